@@ -118,9 +118,10 @@ static const char *gbt_req = "{\"method\": \"getblocktemplate\", \"params\": [{\
 /* Request getblocktemplate from bitcoind already connected with a connsock_t
  * and then summarise the information to the most efficient set of data
  * required to assemble a mining template, storing it in a gbtbase_t structure */
-bool gen_gbtbase(connsock_t *cs, gbtbase_t *gbt)
+/* Decode a getblocktemplate response into gbt, absorbing val */
+bool decode_gbtbase(json_t *val, gbtbase_t *gbt)
 {
-	json_t *rules_array, *coinbase_aux, *res_val, *val;
+	json_t *rules_array, *coinbase_aux, *res_val;
 	const char *previousblockhash;
 	char hash_swap[32], tmp[32];
 	uint64_t coinbasevalue;
@@ -134,11 +135,6 @@ bool gen_gbtbase(connsock_t *cs, gbtbase_t *gbt)
 	int i;
 	bool ret = false;
 
-	val = json_rpc_call(cs, gbt_req);
-	if (!val) {
-		LOGWARNING("%s:%s Failed to get valid json response to getblocktemplate", cs->url, cs->port);
-		return ret;
-	}
 	res_val = json_object_get(val, "result");
 	if (!res_val) {
 		LOGWARNING("Failed to get result in json response to getblocktemplate");
@@ -217,6 +213,38 @@ out:
 	return ret;
 }
 
+bool gen_gbtbase(connsock_t *cs, gbtbase_t *gbt)
+{
+	json_t *val;
+
+	val = json_rpc_call(cs, gbt_req);
+	if (!val) {
+		LOGWARNING("%s:%s Failed to get valid json response to getblocktemplate", cs->url, cs->port);
+		return false;
+	}
+	return decode_gbtbase(val, gbt);
+}
+
+static const char *gbt_lpreq = "{\"method\": \"getblocktemplate\", \"params\": [{\"capabilities\": [\"coinbasetxn\", \"workid\", \"coinbase/append\"], \"rules\" : [\"segwit\", \"signet\"], \"longpollid\": \"%s\"}]}\n";
+
+/* As gen_gbtbase but only returning once bitcoind has a template that differs
+ * from the one longpollid came with. Failures are expected when the call
+ * times out on a quiet network so are only logged at info level. */
+bool gen_gbtbase_longpoll(connsock_t *cs, gbtbase_t *gbt, const char *longpollid)
+{
+	char *rpc_req;
+	json_t *val;
+
+	ASPRINTF(&rpc_req, gbt_lpreq, longpollid);
+	val = json_rpc_response(cs, rpc_req);
+	free(rpc_req);
+	if (!val) {
+		LOGINFO("%s:%s No longpoll response to getblocktemplate", cs->url, cs->port);
+		return false;
+	}
+	return decode_gbtbase(val, gbt);
+}
+
 void clear_gbtbase(gbtbase_t *gbt)
 {
 	free(gbt->flags);
@@ -282,6 +310,40 @@ out:
 	return ret;
 }
 
+/* Request getblockheader from bitcoind for hash, returning its height, bits
+ * and median time past. */
+bool get_blockheader(connsock_t *cs, const char *hash, int *height, char *nbit, uint32_t *mediantime)
+{
+	json_t *val, *res_val;
+	const char *bits;
+	char rpc_req[160];
+	bool ret = false;
+
+	snprintf(rpc_req, sizeof(rpc_req), "{\"method\": \"getblockheader\", \"params\": [\"%.64s\"]}\n", hash);
+	val = json_rpc_call(cs, rpc_req);
+	if (!val) {
+		LOGWARNING("%s:%s Failed to get valid json response to getblockheader", cs->url, cs->port);
+		return ret;
+	}
+	res_val = json_object_get(val, "result");
+	if (!res_val || json_is_null(res_val)) {
+		LOGWARNING("Failed to get result in json response to getblockheader");
+		goto out;
+	}
+	bits = json_string_value(json_object_get(res_val, "bits"));
+	if (unlikely(!bits || strlen(bits) != 8)) {
+		LOGWARNING("Got invalid bits in result to getblockheader");
+		goto out;
+	}
+	strcpy(nbit, bits);
+	*height = json_integer_value(json_object_get(res_val, "height"));
+	*mediantime = json_integer_value(json_object_get(res_val, "mediantime"));
+	ret = true;
+out:
+	json_decref(val);
+	return ret;
+}
+
 static const char *bestblockhash_req = "{\"method\": \"getbestblockhash\"}\n";
 
 /* Request getbestblockhash from bitcoind. bitcoind 0.9+ only */
@@ -313,20 +375,28 @@ out:
 	return ret;
 }
 
-bool submit_block(connsock_t *cs, const char *params)
+/* Submit the block hex made of head followed by taillen bytes of tail, sent
+ * in place without concatenating them into one request string */
+bool submit_blockv(connsock_t *cs, const char *head, const char *tail, const int taillen)
 {
+	static const char *prefix = "{\"method\": \"submitblock\", \"params\": [\"";
+	static const char *suffix = "\"]}\n";
 	json_t *val, *res_val;
-	int len, retries = 0;
+	struct iovec iov[4];
 	const char *res_ret;
+	int retries = 0;
 	bool ret = false;
-	char *rpc_req;
 
-	len = strlen(params) + 64;
+	iov[0].iov_base = (char *)prefix;
+	iov[0].iov_len = strlen(prefix);
+	iov[1].iov_base = (char *)head;
+	iov[1].iov_len = strlen(head);
+	iov[2].iov_base = (char *)tail;
+	iov[2].iov_len = tail ? taillen : 0;
+	iov[3].iov_base = (char *)suffix;
+	iov[3].iov_len = strlen(suffix);
 retry:
-	rpc_req = ckalloc(len);
-	sprintf(rpc_req, "{\"method\": \"submitblock\", \"params\": [\"%s\"]}\n", params);
-	val = json_rpc_call(cs, rpc_req);
-	dealloc(rpc_req);
+	val = json_rpc_callv(cs, iov, 4);
 	if (!val) {
 		LOGWARNING("%s:%s Failed to get valid json response to submitblock", cs->url, cs->port);
 		if (++retries < 5)
@@ -361,6 +431,11 @@ out:
 	return ret;
 }
 
+bool submit_block(connsock_t *cs, const char *params)
+{
+	return submit_blockv(cs, params, NULL, 0);
+}
+
 void precious_block(connsock_t *cs, const char *params)
 {
 	char *rpc_req;
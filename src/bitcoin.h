@@ -14,11 +14,15 @@ typedef struct genwork gbtbase_t;
 
 bool validate_address(connsock_t *cs, const char *address, bool *script, bool *segwit);
 json_t *validate_txn(connsock_t *cs, const char *txn);
+bool decode_gbtbase(json_t *val, gbtbase_t *gbt);
 bool gen_gbtbase(connsock_t *cs, gbtbase_t *gbt);
+bool gen_gbtbase_longpoll(connsock_t *cs, gbtbase_t *gbt, const char *longpollid);
 void clear_gbtbase(gbtbase_t *gbt);
 int get_blockcount(connsock_t *cs);
 bool get_blockhash(connsock_t *cs, int height, char *hash);
+bool get_blockheader(connsock_t *cs, const char *hash, int *height, char *nbit, uint32_t *mediantime);
 bool get_bestblockhash(connsock_t *cs, char *hash);
+bool submit_blockv(connsock_t *cs, const char *head, const char *tail, const int taillen);
 bool submit_block(connsock_t *cs, const char *params);
 void precious_block(connsock_t *cs, const char *params);
 void submit_txn(connsock_t *cs, const char *params);
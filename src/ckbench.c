@@ -0,0 +1,397 @@
+/*
+ * Copyright 2014-2023 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Microbenchmarks of the share and broadcast hot paths, linked against the
+ * same objects as ckpool. Each benchmark prints one json line with its ops
+ * per second and latency percentiles in nanoseconds. */
+
+#include "config.h"
+
+#include <getopt.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ckbench.h"
+#include "ckpool.h"
+#include "libckpool.h"
+#include "sha2.h"
+
+#if defined(USE_AVX2)
+static const char *sha256_impl = "rorx";
+#elif defined(USE_AVX1)
+static const char *sha256_impl = "avx";
+#elif defined(USE_SSE4)
+static const char *sha256_impl = "sse4";
+#else
+static const char *sha256_impl = "generic";
+#endif
+
+/* Comma separated benchmark names to run, all of them if NULL */
+static char *bench_filter;
+
+/* Defined in ckpool.c for logmsg */
+extern ckpool_t *global_ckp;
+
+static ckpool_t ckp;
+
+bool bench_enabled(const char *name)
+{
+	char *filter, *tok, *saveptr = NULL;
+	bool ret = false;
+
+	if (!bench_filter)
+		return true;
+	filter = strdup(bench_filter);
+	for (tok = strtok_r(filter, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+		if (!strcmp(tok, name)) {
+			ret = true;
+			break;
+		}
+	}
+	free(filter);
+	return ret;
+}
+
+void bench_start(bench_t *bench, const char *name, const char *params, const int maxsamples)
+{
+	memset(bench, 0, sizeof(bench_t));
+	snprintf(bench->name, sizeof(bench->name), "%s", name);
+	snprintf(bench->params, sizeof(bench->params), "%s", params);
+	bench->maxsamples = maxsamples;
+	bench->lats = ckalloc(sizeof(int64_t) * maxsamples);
+	bench->start = bench_ns();
+}
+
+/* Record the latency of one timed call of ops operations started at begin.
+ * Safe to call from concurrent threads. */
+void bench_sample(bench_t *bench, const int64_t begin, const int ops)
+{
+	int64_t lat = bench_ns() - begin;
+	int sample;
+
+	sample = __atomic_fetch_add(&bench->samples, 1, __ATOMIC_RELAXED);
+	if (likely(sample < bench->maxsamples))
+		bench->lats[sample] = lat;
+	__atomic_add_fetch(&bench->ops, ops, __ATOMIC_RELAXED);
+}
+
+static int lat_cmp(const void *a, const void *b)
+{
+	const int64_t *x = a, *y = b;
+
+	return (*x > *y) - (*x < *y);
+}
+
+static int64_t percentile(const bench_t *bench, const int samples, const double pc)
+{
+	int idx = samples * pc / 100;
+
+	if (idx >= samples)
+		idx = samples - 1;
+	return bench->lats[idx];
+}
+
+void bench_end(bench_t *bench)
+{
+	double secs = (double)(bench_ns() - bench->start) / 1000000000;
+	int samples = MIN(bench->samples, bench->maxsamples);
+	json_t *val = json_object();
+	char *s;
+
+	qsort(bench->lats, samples, sizeof(int64_t), lat_cmp);
+	json_set_string(val, "bench", bench->name);
+	json_set_string(val, "params", bench->params);
+	json_set_int64(val, "ops", bench->ops);
+	json_set_double(val, "secs", secs);
+	json_set_double(val, "opspersec", secs > 0 ? bench->ops / secs : 0);
+	if (samples) {
+		json_set_int64(val, "p50ns", percentile(bench, samples, 50));
+		json_set_int64(val, "p90ns", percentile(bench, samples, 90));
+		json_set_int64(val, "p99ns", percentile(bench, samples, 99));
+		json_set_int64(val, "p999ns", percentile(bench, samples, 99.9));
+		json_set_int64(val, "maxns", bench->lats[samples - 1]);
+	}
+	s = json_dumps(val, JSON_PRESERVE_ORDER | JSON_COMPACT);
+	printf("%s\n", s);
+	fflush(stdout);
+	free(s);
+	json_decref(val);
+	dealloc(bench->lats);
+}
+
+static void bench_hashes(const int64_t ops)
+{
+	uchar data[80], hash[32];
+	char params[64];
+	bench_t bench;
+	int64_t i;
+
+	memset(data, 0x5a, sizeof(data));
+	snprintf(params, 64, "impl=%s,len=64", sha256_impl);
+	if (bench_enabled("sha256")) {
+		bench_start(&bench, "sha256", params, ops);
+		for (i = 0; i < ops; i++) {
+			int64_t begin = bench_ns();
+
+			sha256(data, 64, hash);
+			bench_sample(&bench, begin, 1);
+		}
+		bench_end(&bench);
+	}
+	if (bench_enabled("gen_hash")) {
+		bench_start(&bench, "gen_hash", params, ops);
+		for (i = 0; i < ops; i++) {
+			int64_t begin = bench_ns();
+
+			gen_hash(data, hash, 64);
+			bench_sample(&bench, begin, 1);
+		}
+		bench_end(&bench);
+	}
+	if (bench_enabled("sha256d_80")) {
+		snprintf(params, 64, "impl=%s", sha256_impl);
+		bench_start(&bench, "sha256d_80", params, ops);
+		for (i = 0; i < ops; i++) {
+			int64_t begin = bench_ns();
+
+			sha256d_80(data, hash);
+			bench_sample(&bench, begin, 1);
+		}
+		bench_end(&bench);
+	}
+}
+
+/* Parse submit lines as the connector receives them from miners */
+static void bench_json(const int64_t ops)
+{
+	char buf[256];
+	bench_t bench;
+	int64_t i;
+
+	bench_start(&bench, "json_loads", "method=mining.submit", ops);
+	for (i = 0; i < ops; i++) {
+		int64_t begin;
+		json_t *val;
+		int len;
+
+		len = snprintf(buf, 256, "{\"params\": [\"bc1qworker.rig%d\", \"%"PRIx64"\", "
+			       "\"%016"PRIx64"\", \"65f2a1b3\", \"%08x\", \"1fffe000\"], "
+			       "\"id\": %"PRId64", \"method\": \"mining.submit\"}\n",
+			       (int)(i % 64), i, i * 7919, (uint32_t)(i * 2654435761U), i);
+		begin = bench_ns();
+		val = json_loadb(buf, len, JSON_DISABLE_EOF_CHECK, NULL);
+		bench_sample(&bench, begin, 1);
+		json_decref(val);
+	}
+	bench_end(&bench);
+}
+
+static int64_t msgq_consumed;
+static char msgq_token;
+
+static void msgq_consume(ckpool_t __maybe_unused *ckp, void __maybe_unused *data)
+{
+	__atomic_add_fetch(&msgq_consumed, 1, __ATOMIC_RELAXED);
+}
+
+struct msgq_producer {
+	bench_t *bench;
+	ckmsgq_t *ckmsgq;
+	int64_t ops;
+};
+
+static void *msgq_produce(void *arg)
+{
+	struct msgq_producer *producer = arg;
+	int64_t i;
+
+	for (i = 0; i < producer->ops; i++) {
+		int64_t begin = bench_ns();
+
+		ckmsgq_add(producer->ckmsgq, &msgq_token);
+		bench_sample(producer->bench, begin, 1);
+	}
+	return NULL;
+}
+
+/* Messages from 1 up to maxthreads producers through to the consumer, timed
+ * until the consumer has processed them all */
+static void bench_ckmsgq(const int64_t ops, const int maxthreads)
+{
+	ckmsgq_t *ckmsgq = create_ckmsgq(&ckp, "benchq", &msgq_consume);
+	int threads, i;
+
+	for (threads = 1; threads <= maxthreads; threads *= 2) {
+		struct msgq_producer *producers;
+		int64_t expected;
+		char params[64];
+		pthread_t *pths;
+		bench_t bench;
+
+		producers = ckalloc(sizeof(struct msgq_producer) * threads);
+		pths = ckalloc(sizeof(pthread_t) * threads);
+		expected = __atomic_load_n(&msgq_consumed, __ATOMIC_RELAXED) + ops / threads * threads;
+		snprintf(params, 64, "threads=%d", threads);
+		bench_start(&bench, "ckmsgq", params, ops);
+		for (i = 0; i < threads; i++) {
+			producers[i].bench = &bench;
+			producers[i].ckmsgq = ckmsgq;
+			producers[i].ops = ops / threads;
+			create_pthread(&pths[i], msgq_produce, &producers[i]);
+		}
+		for (i = 0; i < threads; i++)
+			join_pthread(pths[i]);
+		while (__atomic_load_n(&msgq_consumed, __ATOMIC_RELAXED) < expected)
+			sched_yield();
+		bench_end(&bench);
+		free(pths);
+		free(producers);
+	}
+}
+
+/* A getblocktemplate response resembling a full mempool for when no fixture
+ * is given */
+static json_t *synthetic_gbt(const int txns)
+{
+	json_t *val, *txn_array = json_array();
+	int64_t fees = 0;
+	uchar bin[250];
+	int i, j;
+
+	for (i = 0; i < txns; i++) {
+		char *data, txid[68];
+		uchar hash[32];
+		json_t *txn;
+
+		for (j = 0; j < (int)sizeof(bin); j++)
+			bin[j] = random();
+		data = bin2hex(bin, sizeof(bin));
+		gen_hash(bin, hash, sizeof(bin));
+		__bin2hex(txid, hash, 32);
+		JSON_CPACK(txn, "{ss,ss,ss,sI,si}", "data", data, "txid", txid, "hash", txid,
+			   "fee", (json_int_t)1000 + i, "weight", (int)sizeof(bin) * 4);
+		json_array_append_new(txn_array, txn);
+		fees += 1000 + i;
+		free(data);
+	}
+	JSON_CPACK(val, "{s:{s:[s],s:i,s:s,s:s,s:{s:s},s:I,s:o,s:s,s:i,s:i}}", "result",
+		   "rules", "segwit",
+		   "version", 0x20000000,
+		   "previousblockhash", "00000000000000000002a7c4c1e48d76c5a37902165a270156b7a8d72728a054",
+		   "target", "00000000000000000003a30c0000000000000000000000000000000000000000",
+		   "coinbaseaux", "flags", "",
+		   "coinbasevalue", (json_int_t)312500000 + fees,
+		   "transactions", txn_array,
+		   "bits", "1703a30c",
+		   "curtime", (int)time(NULL),
+		   "height", 850000);
+	return val;
+}
+
+static json_t *load_gbt(const char *fname)
+{
+	json_error_t err_val;
+	json_t *val, *res;
+
+	val = json_load_file(fname, 0, &err_val);
+	if (unlikely(!val))
+		quit(1, "Failed to load gbt fixture %s: %s", fname, err_val.text);
+	/* Accept either the bare template or a whole rpc response */
+	if (json_object_get(val, "result"))
+		return val;
+	res = val;
+	JSON_CPACK(val, "{so}", "result", res);
+	return val;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-b bench,...] [-g gbt.json] [-n ops] [-t threads] [-x txns] [-l loglevel]\n"
+		"\t-b\tOnly run the named benchmarks\n"
+		"\t-g\tgetblocktemplate fixture to build workbases from\n"
+		"\t-n\tOperations per benchmark, default 100000\n"
+		"\t-t\tMost producer threads for ckmsgq, default number of CPUs\n"
+		"\t-x\tTransactions in the synthetic template, default 3000\n"
+		"\t-l\tLog level, default %d\n", prog, LOG_WARNING);
+}
+
+int main(int argc, char **argv)
+{
+	int c, maxthreads, txns = 3000;
+	char *gbtfile = NULL;
+	int64_t ops = 100000;
+	json_t *gbt, *val;
+	char *s;
+
+	global_ckp = &ckp;
+	ckp.name = "ckbench";
+	ckp.loglevel = LOG_WARNING;
+	maxthreads = sysconf(_SC_NPROCESSORS_ONLN) ? : 1;
+
+	while ((c = getopt(argc, argv, "b:g:hl:n:t:x:")) != -1) {
+		switch(c) {
+			case 'b':
+				bench_filter = optarg;
+				break;
+			case 'g':
+				gbtfile = optarg;
+				break;
+			case 'l':
+				ckp.loglevel = atoi(optarg);
+				break;
+			case 'n':
+				ops = strtoll(optarg, NULL, 10);
+				break;
+			case 't':
+				maxthreads = atoi(optarg);
+				break;
+			case 'x':
+				txns = atoi(optarg);
+				break;
+			case 'h':
+			default:
+				usage(argv[0]);
+				exit(c != 'h');
+		}
+	}
+	if (ops < 1 || maxthreads < 1 || txns < 0)
+		quit(1, "Invalid benchmark arguments");
+
+	/* Enough of a server mode config for the stratifier paths */
+	ckp.btcaddress = "1BitcoinEaterAddressDontSendf59kuE";
+	ckp.nonce1length = 4;
+	ckp.nonce2length = 8;
+	ckp.startdiff = 42;
+	ckp.serverurls = 1;
+	ckp.logdir = "logs/";
+	ckp.coinbase_valid = true;
+
+	srandom(42);
+	gbt = gbtfile ? load_gbt(gbtfile) : synthetic_gbt(txns);
+
+	JSON_CPACK(val, "{ss,ss,si,si}", "ckbench", PACKAGE_VERSION, "sha256", sha256_impl,
+		   "maxthreads", maxthreads, "txns",
+		   (int)json_array_size(json_object_get(json_object_get(gbt, "result"), "transactions")));
+	s = json_dumps(val, JSON_PRESERVE_ORDER | JSON_COMPACT);
+	printf("%s\n", s);
+	free(s);
+	json_decref(val);
+
+	bench_hashes(ops);
+	if (bench_enabled("json_loads"))
+		bench_json(ops);
+	if (bench_enabled("ckmsgq"))
+		bench_ckmsgq(ops, maxthreads);
+	stratifier_bench(&ckp, gbt, ops);
+
+	json_decref(gbt);
+	return 0;
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright 2014-2023 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef CKBENCH_H
+#define CKBENCH_H
+
+#include <time.h>
+
+#include "ckpool.h"
+
+/* One benchmark run. Each sample is the latency of one timed call, reported
+ * with the overall ops/sec as a single json line on stdout by bench_end. */
+typedef struct bench {
+	char name[32];
+	char params[64];
+	int64_t ops;
+	int64_t *lats; /* Nanoseconds per sample */
+	int samples;
+	int maxsamples;
+	int64_t start;
+} bench_t;
+
+static inline int64_t bench_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+bool bench_enabled(const char *name);
+void bench_start(bench_t *bench, const char *name, const char *params, const int maxsamples);
+void bench_sample(bench_t *bench, const int64_t begin, const int ops);
+void bench_end(bench_t *bench);
+
+/* Implemented in stratifier.c when built with CKBENCH */
+void stratifier_bench(ckpool_t *ckp, const json_t *gbt, const int64_t ops);
+
+#endif /* CKBENCH_H */
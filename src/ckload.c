@@ -0,0 +1,822 @@
+/*
+ * Copyright 2014-2023 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Simulates a large fleet of stratum miners against a running ckpool. Each
+ * connection subscribes, optionally negotiates version rolling, authorises
+ * and then submits shares at a configured rate and mix of valid, stale,
+ * duplicate and invalid shares. No hashing is done so "valid" shares are
+ * well formed shares on the current job that ckpool checks in full, which
+ * will almost all be rejected as above target. Submit latency, connect to
+ * authorise latency and the spread of block change notifies across clients
+ * are reported as json lines on stdout. */
+
+#include "config.h"
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libckpool.h"
+
+static int msg_loglevel = LOG_WARNING;
+
+void logmsg(int loglevel, const char *fmt, ...)
+{
+	va_list ap;
+	char *buf;
+
+	if (loglevel <= msg_loglevel) {
+		va_start(ap, fmt);
+		VASPRINTF(&buf, fmt, ap);
+		va_end(ap);
+
+		fprintf(stderr, "%s\n", buf);
+		free(buf);
+	}
+}
+
+enum conn_state {
+	CONN_IDLE,
+	CONN_CONNECTING,
+	CONN_SUBSCRIBING,
+	CONN_AUTHORISING,
+	CONN_MINING
+};
+
+enum share_kind {
+	SHARE_VALID,
+	SHARE_STALE,
+	SHARE_DUP,
+	SHARE_INVALID,
+	SHARE_KINDS
+};
+
+static const char *share_kinds[] = {"valid", "stale", "dup", "invalid"};
+
+/* Fixed ids for the setup messages, submits use ids from SUBMIT_ID up */
+#define CONFIGURE_ID	1
+#define SUBSCRIBE_ID	2
+#define AUTHORISE_ID	3
+#define SUBMIT_ID	100
+
+/* Submits outstanding per connection whose send time is remembered */
+#define SUBMIT_SLOTS	8
+
+typedef struct conn {
+	int fd;
+	int state;
+	int index;
+	int nonce2len;
+	uint32_t version_mask;
+	char jobid[32];
+	char oldjobid[32]; /* Job before the last clean notify, for stales */
+	char ntime[12];
+	char sessionid[20]; /* From the last subscribe, to resume with */
+	char enonce1[20];
+	char *lastsubmit; /* Params of the last submit, to duplicate */
+	char *partial; /* Incomplete line left over from the last read */
+	int partlen;
+	uint64_t nonce2;
+	int64_t msgid;
+	int64_t next_submit;
+	int64_t retry; /* When an idle connection may reconnect */
+	int64_t connect_start;
+	bool storm; /* Reconnecting as part of a reconnect storm */
+	int64_t submit_sent[SUBMIT_SLOTS];
+	int submit_kind[SUBMIT_SLOTS];
+} conn_t;
+
+typedef struct worker {
+	pthread_t pth;
+	int epfd;
+	int id;
+	conn_t *conns;
+	int nconns;
+	int started; /* Connections ramped up so far */
+	bool stormed;
+	char buf[65536];
+} worker_t;
+
+/* Report a histogram in the stats line if it has any values */
+static void hist_json(json_t *val, const char *key, const ckhist_t *hist)
+{
+	json_t *subval = ckhist_json(hist);
+
+	if (json_integer_value(json_object_get(subval, "count")))
+		json_object_set_new_nocheck(val, key, subval);
+	else
+		json_decref(subval);
+}
+
+/* Options */
+static char *url = "localhost";
+static char *port = "3333";
+static char *username = "tb1qqh5v9y0cj3272g398sza9prq6jyuwxzw7gygz4";
+static char *agent = PACKAGE "load/" VERSION;
+static int clients = 1000;
+static int threads = 1;
+static int connrate = 1000; /* Connections started per second */
+static double sharerate = 0.1; /* Shares per second per client */
+static int mix[SHARE_KINDS] = {100, 0, 0, 0};
+static bool versionroll;
+static bool workernames;
+static int duration;
+static int interval = 10;
+static int stormat; /* Seconds in to drop and reconnect every client */
+static struct sockaddr_storage binds[16];
+static socklen_t bindlens[16];
+static int nbinds;
+
+static struct addrinfo *pooladdr;
+static int64_t start_ns;
+static volatile bool quitting;
+
+/* Totals since the start */
+static struct {
+	int64_t open;
+	int64_t authorised;
+	int64_t connects;
+	int64_t connfails;
+	int64_t disconnects;
+	int64_t resumed;
+	int64_t notifies;
+	int64_t blocks;
+	int64_t submits[SHARE_KINDS];
+	int64_t accepted[SHARE_KINDS];
+	int64_t rejected[SHARE_KINDS];
+} stats;
+
+/* Latencies in microseconds */
+static ckhist_t submit_hist, auth_hist;
+
+/* Arrival of the most recent block change notify across all clients */
+static mutex_t spread_lock;
+static char spread_job[32];
+static int64_t spread_first;
+static ckhist_t spread_hist;
+
+static int64_t storm_start, storm_end;
+static int64_t storm_pending;
+
+static void close_conn(worker_t *worker, conn_t *conn, const int64_t retry)
+{
+	if (conn->fd < 0)
+		return;
+	epoll_ctl(worker->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+	Close(conn->fd);
+	if (conn->state == CONN_MINING)
+		__atomic_sub_fetch(&stats.authorised, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&stats.open, 1, __ATOMIC_RELAXED);
+	conn->state = CONN_IDLE;
+	conn->retry = retry;
+	conn->jobid[0] = conn->oldjobid[0] = '\0';
+	conn->version_mask = 0;
+	dealloc(conn->partial);
+	conn->partlen = 0;
+	dealloc(conn->lastsubmit);
+}
+
+/* Messages are tiny so a socket buffer too full to take one means the pool
+ * isn't keeping up, which is treated as a failed connection */
+static bool send_line(worker_t *worker, conn_t *conn, const char *buf, const int len)
+{
+	int ret = send(conn->fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+	if (likely(ret == len))
+		return true;
+	LOGINFO("Client %d failed to send, disconnecting", conn->index);
+	__atomic_add_fetch(&stats.disconnects, 1, __ATOMIC_RELAXED);
+	close_conn(worker, conn, time_nanos() + 1000000000);
+	return false;
+}
+
+static void start_conn(worker_t *worker, conn_t *conn, const int64_t now)
+{
+	struct epoll_event event;
+	struct addrinfo *p;
+	int sockd, ret;
+
+	for (p = pooladdr; p; p = p->ai_next) {
+		sockd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK, p->ai_protocol);
+		if (sockd < 0)
+			continue;
+		/* Spread connections over the source addresses to get more
+		 * than one address worth of ephemeral ports */
+		if (nbinds) {
+			int b = conn->index % nbinds;
+
+			if (binds[b].ss_family == p->ai_family &&
+			    bind(sockd, (struct sockaddr *)&binds[b], bindlens[b]) < 0) {
+				close(sockd);
+				continue;
+			}
+		}
+		ret = connect(sockd, p->ai_addr, p->ai_addrlen);
+		if (!ret || errno == EINPROGRESS)
+			break;
+		close(sockd);
+	}
+	__atomic_add_fetch(&stats.connects, 1, __ATOMIC_RELAXED);
+	if (!p) {
+		__atomic_add_fetch(&stats.connfails, 1, __ATOMIC_RELAXED);
+		conn->retry = now + 1000000000;
+		return;
+	}
+	conn->fd = sockd;
+	conn->state = CONN_CONNECTING;
+	conn->connect_start = now;
+	conn->msgid = SUBMIT_ID;
+	__atomic_add_fetch(&stats.open, 1, __ATOMIC_RELAXED);
+	event.events = EPOLLIN | EPOLLOUT;
+	event.data.ptr = conn;
+	epoll_ctl(worker->epfd, EPOLL_CTL_ADD, sockd, &event);
+}
+
+static void connected(worker_t *worker, conn_t *conn)
+{
+	struct epoll_event event;
+	socklen_t len = sizeof(int);
+	char buf[512];
+	int err = 0;
+
+	getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+	if (err) {
+		__atomic_add_fetch(&stats.connfails, 1, __ATOMIC_RELAXED);
+		close_conn(worker, conn, time_nanos() + 1000000000);
+		return;
+	}
+	event.events = EPOLLIN;
+	event.data.ptr = conn;
+	epoll_ctl(worker->epfd, EPOLL_CTL_MOD, conn->fd, &event);
+	conn->state = CONN_SUBSCRIBING;
+
+	if (versionroll) {
+		len = snprintf(buf, 512, "{\"id\": %d, \"method\": \"mining.configure\", \"params\": "
+			       "[[\"version-rolling\"], {\"version-rolling.mask\": \"1fffe000\", "
+			       "\"version-rolling.min-bit-count\": 2}]}\n", CONFIGURE_ID);
+		if (!send_line(worker, conn, buf, len))
+			return;
+	}
+	if (conn->sessionid[0])
+		len = snprintf(buf, 512, "{\"id\": %d, \"method\": \"mining.subscribe\", \"params\": [\"%s\", \"%s\"]}\n",
+			       SUBSCRIBE_ID, agent, conn->sessionid);
+	else
+		len = snprintf(buf, 512, "{\"id\": %d, \"method\": \"mining.subscribe\", \"params\": [\"%s\"]}\n",
+			       SUBSCRIBE_ID, agent);
+	send_line(worker, conn, buf, len);
+}
+
+static void schedule_submit(conn_t *conn, const int64_t now)
+{
+	/* Jitter each interval by +/-50% to not submit in lockstep */
+	conn->next_submit = now + 1000000000 / sharerate * (0.5 + (double)random() / RAND_MAX);
+}
+
+static void send_authorise(worker_t *worker, conn_t *conn)
+{
+	char buf[512];
+	int len;
+
+	if (workernames)
+		len = snprintf(buf, 512, "{\"id\": %d, \"method\": \"mining.authorize\", \"params\": "
+			       "[\"%s.%d\", \"x\"]}\n", AUTHORISE_ID, username, conn->index);
+	else
+		len = snprintf(buf, 512, "{\"id\": %d, \"method\": \"mining.authorize\", \"params\": "
+			       "[\"%s\", \"x\"]}\n", AUTHORISE_ID, username);
+	conn->state = CONN_AUTHORISING;
+	send_line(worker, conn, buf, len);
+}
+
+static int pick_kind(const conn_t *conn)
+{
+	int roll = random() % 100, kind;
+
+	for (kind = 0; kind < SHARE_KINDS; kind++) {
+		if (roll < mix[kind])
+			break;
+		roll -= mix[kind];
+	}
+	if (kind >= SHARE_KINDS)
+		kind = SHARE_VALID;
+	/* Fall back to valid shares until there's something to repeat */
+	if (kind == SHARE_STALE && !conn->oldjobid[0])
+		kind = SHARE_VALID;
+	if (kind == SHARE_DUP && !conn->lastsubmit)
+		kind = SHARE_VALID;
+	return kind;
+}
+
+static void submit(worker_t *worker, conn_t *conn, const int64_t now)
+{
+	char nonce2[36], params[256], buf[512];
+	int kind = pick_kind(conn), len, n2len, slot;
+	uint64_t n2;
+
+	if (kind == SHARE_DUP)
+		strcpy(params, conn->lastsubmit);
+	else {
+		char username_buf[128];
+
+		n2 = htole64(conn->nonce2++);
+		/* Invalid shares have a nonce2 one byte too long */
+		n2len = MIN(conn->nonce2len, 8) + (kind == SHARE_INVALID);
+		__bin2hex(nonce2, &n2, MIN(n2len, 8));
+		if (n2len > 8)
+			strcpy(nonce2 + 16, "00");
+		if (workernames)
+			snprintf(username_buf, 128, "%s.%d", username, conn->index);
+		else
+			snprintf(username_buf, 128, "%s", username);
+		len = snprintf(params, 256, "\"%s\", \"%s\", \"%s\", \"%s\", \"%08lx\"",
+			       username_buf, kind == SHARE_STALE ? conn->oldjobid : conn->jobid,
+			       nonce2, conn->ntime, random() & 0xffffffffUL);
+		if (conn->version_mask)
+			snprintf(params + len, 256 - len, ", \"%08x\"",
+				 (uint32_t)random() & conn->version_mask);
+		if (kind == SHARE_VALID) {
+			free(conn->lastsubmit);
+			conn->lastsubmit = strdup(params);
+		}
+	}
+	slot = conn->msgid % SUBMIT_SLOTS;
+	conn->submit_sent[slot] = now;
+	conn->submit_kind[slot] = kind;
+	len = snprintf(buf, 512, "{\"id\": %"PRId64", \"method\": \"mining.submit\", \"params\": [%s]}\n",
+		       conn->msgid++, params);
+	__atomic_add_fetch(&stats.submits[kind], 1, __ATOMIC_RELAXED);
+	send_line(worker, conn, buf, len);
+}
+
+static void block_notify(const char *jobid, const int64_t now)
+{
+	mutex_lock(&spread_lock);
+	if (strcmp(spread_job, jobid)) {
+		/* First arrival of a new block, start a new spread */
+		snprintf(spread_job, 32, "%s", jobid);
+		spread_first = now;
+		memset(&spread_hist, 0, sizeof(ckhist_t));
+		__atomic_add_fetch(&stats.blocks, 1, __ATOMIC_RELAXED);
+	}
+	ckhist_add(&spread_hist, (now - spread_first) / 1000);
+	mutex_unlock(&spread_lock);
+}
+
+static void parse_method(worker_t *worker, conn_t *conn, json_t *val, const char *method,
+			 const int64_t now)
+{
+	json_t *params = json_object_get(val, "params");
+
+	if (!strcmp(method, "mining.notify")) {
+		const char *jobid = json_string_value(json_array_get(params, 0));
+		const char *ntime = json_string_value(json_array_get(params, 7));
+		bool clean = json_is_true(json_array_get(params, 8));
+
+		if (unlikely(!jobid || !ntime))
+			return;
+		__atomic_add_fetch(&stats.notifies, 1, __ATOMIC_RELAXED);
+		/* The first notify after subscribing is always clean */
+		if (clean && conn->jobid[0]) {
+			strcpy(conn->oldjobid, conn->jobid);
+			block_notify(jobid, now);
+		}
+		snprintf(conn->jobid, 32, "%s", jobid);
+		snprintf(conn->ntime, 12, "%s", ntime);
+	} else if (!strcmp(method, "mining.set_version_mask")) {
+		const char *mask = json_string_value(json_array_get(params, 0));
+
+		if (mask && conn->version_mask)
+			conn->version_mask = strtoul(mask, NULL, 16);
+	} else if (!strcmp(method, "mining.ping")) {
+		char buf[128];
+		int len;
+
+		len = snprintf(buf, 128, "{\"id\": %"JSON_INTEGER_FORMAT", \"result\": \"pong\", \"error\": null}\n",
+			       json_integer_value(json_object_get(val, "id")));
+		send_line(worker, conn, buf, len);
+	}
+}
+
+static void parse_response(worker_t *worker, conn_t *conn, json_t *val, const int64_t now)
+{
+	json_t *result = json_object_get(val, "result");
+	int64_t id = json_integer_value(json_object_get(val, "id"));
+
+	if (id >= SUBMIT_ID) {
+		int slot = id % SUBMIT_SLOTS, kind = conn->submit_kind[slot];
+
+		ckhist_add(&submit_hist, (now - conn->submit_sent[slot]) / 1000);
+		if (json_is_true(result))
+			__atomic_add_fetch(&stats.accepted[kind], 1, __ATOMIC_RELAXED);
+		else
+			__atomic_add_fetch(&stats.rejected[kind], 1, __ATOMIC_RELAXED);
+		return;
+	}
+	switch (id) {
+		case CONFIGURE_ID: {
+			const char *mask;
+
+			if (json_is_true(json_object_get(result, "version-rolling")) &&
+			    (mask = json_string_value(json_object_get(result, "version-rolling.mask"))))
+				conn->version_mask = strtoul(mask, NULL, 16);
+			break;
+		}
+		case SUBSCRIBE_ID: {
+			const char *sessionid, *enonce1;
+
+			if (unlikely(!json_is_array(result))) {
+				LOGINFO("Client %d failed to subscribe", conn->index);
+				close_conn(worker, conn, now + 1000000000);
+				break;
+			}
+			/* Result is [[["mining.notify", sessionid]], enonce1, n2len] */
+			sessionid = json_string_value(json_array_get(json_array_get(json_array_get(result, 0), 0), 1));
+			enonce1 = json_string_value(json_array_get(result, 1));
+			if (enonce1 && conn->sessionid[0] && !safecmp(enonce1, conn->enonce1))
+				__atomic_add_fetch(&stats.resumed, 1, __ATOMIC_RELAXED);
+			snprintf(conn->sessionid, sizeof(conn->sessionid), "%s", sessionid ? sessionid : "");
+			snprintf(conn->enonce1, sizeof(conn->enonce1), "%s", enonce1 ? enonce1 : "");
+			conn->nonce2len = json_integer_value(json_array_get(result, 2));
+			if (conn->nonce2len < 1)
+				conn->nonce2len = 8;
+			send_authorise(worker, conn);
+			break;
+		}
+		case AUTHORISE_ID:
+			if (unlikely(!json_is_true(result))) {
+				LOGINFO("Client %d failed to authorise", conn->index);
+				close_conn(worker, conn, now + 1000000000);
+				break;
+			}
+			conn->state = CONN_MINING;
+			__atomic_add_fetch(&stats.authorised, 1, __ATOMIC_RELAXED);
+			ckhist_add(&auth_hist, (now - conn->connect_start) / 1000);
+			if (conn->storm) {
+				conn->storm = false;
+				if (!__atomic_sub_fetch(&storm_pending, 1, __ATOMIC_RELAXED))
+					storm_end = now;
+			}
+			schedule_submit(conn, now);
+			break;
+	}
+}
+
+static void parse_line(worker_t *worker, conn_t *conn, char *line, const int len,
+		       const int64_t now)
+{
+	const char *method;
+	json_t *val;
+
+	val = json_loadb(line, len, 0, NULL);
+	if (unlikely(!val)) {
+		LOGINFO("Client %d received bad json: %.*s", conn->index, len, line);
+		return;
+	}
+	method = json_string_value(json_object_get(val, "method"));
+	if (method)
+		parse_method(worker, conn, val, method, now);
+	else
+		parse_response(worker, conn, val, now);
+	json_decref(val);
+}
+
+static void read_conn(worker_t *worker, conn_t *conn, const int64_t now)
+{
+	char *buf = worker->buf, *line, *eol;
+	int len, ofs = 0;
+
+	if (conn->partlen) {
+		memcpy(buf, conn->partial, conn->partlen);
+		ofs = conn->partlen;
+		dealloc(conn->partial);
+		conn->partlen = 0;
+	}
+	len = recv(conn->fd, buf + ofs, sizeof(worker->buf) - ofs - 1, 0);
+	if (len <= 0) {
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		LOGINFO("Client %d disconnected", conn->index);
+		__atomic_add_fetch(&stats.disconnects, 1, __ATOMIC_RELAXED);
+		close_conn(worker, conn, now + 1000000000);
+		return;
+	}
+	len += ofs;
+	buf[len] = '\0';
+	for (line = buf; (eol = memchr(line, '\n', buf + len - line)); line = eol + 1) {
+		parse_line(worker, conn, line, eol - line, now);
+		/* Parsing may have dropped the connection */
+		if (conn->fd < 0)
+			return;
+	}
+	if (line < buf + len) {
+		conn->partlen = buf + len - line;
+		conn->partial = ckalloc(conn->partlen);
+		memcpy(conn->partial, line, conn->partlen);
+	}
+}
+
+/* Drop and immediately reconnect every client at once */
+static void storm(worker_t *worker, const int64_t now)
+{
+	int i;
+
+	for (i = 0; i < worker->started; i++) {
+		conn_t *conn = &worker->conns[i];
+
+		if (conn->state == CONN_IDLE)
+			continue;
+		close_conn(worker, conn, now);
+		conn->storm = true;
+		__atomic_add_fetch(&storm_pending, 1, __ATOMIC_RELAXED);
+	}
+	worker->stormed = true;
+}
+
+static void *worker_thread(void *arg)
+{
+	worker_t *worker = (worker_t *)arg;
+	struct epoll_event events[256];
+	char name[16];
+	int i, nfds;
+
+	snprintf(name, 16, "ckload%d", worker->id);
+	rename_proc(name);
+
+	while (!quitting) {
+		int64_t now, due;
+
+		nfds = epoll_wait(worker->epfd, events, 256, 10);
+		now = time_nanos();
+		for (i = 0; i < nfds; i++) {
+			conn_t *conn = events[i].data.ptr;
+
+			if (conn->fd < 0)
+				continue;
+			if (conn->state == CONN_CONNECTING) {
+				if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+					connected(worker, conn);
+				continue;
+			}
+			if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+				read_conn(worker, conn, now);
+		}
+
+		/* Ramp up to this worker's share of the connection rate */
+		due = (now - start_ns) / 1000000 * connrate / 1000 / threads + 1;
+		while (worker->started < worker->nconns && worker->started < due)
+			start_conn(worker, &worker->conns[worker->started++], now);
+
+		if (stormat && !worker->stormed && now - start_ns >= (int64_t)stormat * 1000000000) {
+			if (!__atomic_load_n(&storm_start, __ATOMIC_RELAXED))
+				storm_start = now;
+			storm(worker, now);
+		}
+
+		for (i = 0; i < worker->started; i++) {
+			conn_t *conn = &worker->conns[i];
+
+			if (conn->state == CONN_IDLE) {
+				if (now >= conn->retry)
+					start_conn(worker, conn, now);
+			} else if (conn->state == CONN_MINING && sharerate > 0 &&
+				   conn->jobid[0] && now >= conn->next_submit) {
+				submit(worker, conn, now);
+				if (conn->fd >= 0)
+					schedule_submit(conn, now);
+			}
+		}
+	}
+	return NULL;
+}
+
+static void report(const int64_t now)
+{
+	json_t *val = json_object(), *subval;
+	ckhist_t hist;
+	char *s;
+	int i;
+
+	json_set_double(val, "elapsed", (double)(now - start_ns) / 1000000000);
+	json_set_int64(val, "open", __atomic_load_n(&stats.open, __ATOMIC_RELAXED));
+	json_set_int64(val, "authorised", __atomic_load_n(&stats.authorised, __ATOMIC_RELAXED));
+	json_set_int64(val, "connects", __atomic_load_n(&stats.connects, __ATOMIC_RELAXED));
+	json_set_int64(val, "connfails", __atomic_load_n(&stats.connfails, __ATOMIC_RELAXED));
+	json_set_int64(val, "disconnects", __atomic_load_n(&stats.disconnects, __ATOMIC_RELAXED));
+	json_set_int64(val, "resumed", __atomic_load_n(&stats.resumed, __ATOMIC_RELAXED));
+	json_set_int64(val, "notifies", __atomic_load_n(&stats.notifies, __ATOMIC_RELAXED));
+	json_set_int64(val, "blocks", __atomic_load_n(&stats.blocks, __ATOMIC_RELAXED));
+	for (i = 0; i < SHARE_KINDS; i++) {
+		subval = json_object();
+		json_set_int64(subval, "submitted", __atomic_load_n(&stats.submits[i], __ATOMIC_RELAXED));
+		json_set_int64(subval, "accepted", __atomic_load_n(&stats.accepted[i], __ATOMIC_RELAXED));
+		json_set_int64(subval, "rejected", __atomic_load_n(&stats.rejected[i], __ATOMIC_RELAXED));
+		json_object_set_new_nocheck(val, share_kinds[i], subval);
+	}
+
+	/* Latencies are for this interval only */
+	ckhist_take(&hist, &submit_hist);
+	hist_json(val, "submitus", &hist);
+	ckhist_take(&hist, &auth_hist);
+	hist_json(val, "authus", &hist);
+
+	mutex_lock(&spread_lock);
+	if (spread_job[0]) {
+		subval = json_object();
+		json_set_string(subval, "jobid", spread_job);
+		hist_json(subval, "spreadus", &spread_hist);
+		json_object_set_new_nocheck(val, "lastblock", subval);
+	}
+	mutex_unlock(&spread_lock);
+
+	if (storm_start) {
+		subval = json_object();
+		json_set_int64(subval, "pending", __atomic_load_n(&storm_pending, __ATOMIC_RELAXED));
+		if (storm_end)
+			json_set_double(subval, "secs", (double)(storm_end - storm_start) / 1000000000);
+		json_object_set_new_nocheck(val, "storm", subval);
+	}
+
+	s = json_dumps(val, JSON_PRESERVE_ORDER | JSON_COMPACT);
+	printf("%s\n", s);
+	fflush(stdout);
+	free(s);
+	json_decref(val);
+}
+
+static void add_bind(const char *addr)
+{
+	struct sockaddr_in *sin = (struct sockaddr_in *)&binds[nbinds];
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&binds[nbinds];
+
+	if (nbinds >= 16)
+		quit(1, "Too many bind addresses");
+	if (inet_pton(AF_INET, addr, &sin->sin_addr) == 1) {
+		sin->sin_family = AF_INET;
+		bindlens[nbinds++] = sizeof(struct sockaddr_in);
+	} else if (inet_pton(AF_INET6, addr, &sin6->sin6_addr) == 1) {
+		sin6->sin6_family = AF_INET6;
+		bindlens[nbinds++] = sizeof(struct sockaddr_in6);
+	} else
+		quit(1, "Invalid bind address %s", addr);
+}
+
+static void parse_mix(char *arg)
+{
+	char *tok, *saveptr = NULL;
+	int i = 0, total = 0;
+
+	memset(mix, 0, sizeof(mix));
+	for (tok = strtok_r(arg, ",", &saveptr); tok && i < SHARE_KINDS;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		mix[i] = atoi(tok);
+		total += mix[i++];
+	}
+	if (total != 100)
+		quit(1, "Share mix percentages must add up to 100");
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+		"\t-H host\t\tPool host, default %s\n"
+		"\t-P port\t\tPool port, default %s\n"
+		"\t-u user\t\tUsername to authorise, default %s\n"
+		"\t-w\t\tAppend a worker name per client to the username\n"
+		"\t-c clients\tConnections to open, default %d\n"
+		"\t-t threads\tThreads to spread connections over, default %d\n"
+		"\t-r rate\t\tConnections started per second, default %d\n"
+		"\t-s rate\t\tShares per second per client, default %.2f\n"
+		"\t-m v,s,d,i\tPercentage of valid,stale,duplicate,invalid shares, default 100,0,0,0\n"
+		"\t-V\t\tNegotiate version rolling with mining.configure\n"
+		"\t-S secs\t\tDrop and reconnect every client at once after secs\n"
+		"\t-b addr\t\tSource address to bind, may be repeated\n"
+		"\t-d secs\t\tRun for secs then exit, default forever\n"
+		"\t-i secs\t\tReport interval, default %d\n"
+		"\t-l loglevel\tLog level, default %d\n",
+		prog, url, port, username, clients, threads, connrate, sharerate, interval,
+		LOG_WARNING);
+}
+
+int main(int argc, char **argv)
+{
+	struct addrinfo hints;
+	worker_t *workers;
+	int64_t next;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "b:c:d:H:hi:l:m:P:r:S:s:t:u:Vw")) != -1) {
+		switch(c) {
+			case 'b':
+				add_bind(optarg);
+				break;
+			case 'c':
+				clients = atoi(optarg);
+				break;
+			case 'd':
+				duration = atoi(optarg);
+				break;
+			case 'H':
+				url = optarg;
+				break;
+			case 'i':
+				interval = atoi(optarg);
+				break;
+			case 'l':
+				msg_loglevel = atoi(optarg);
+				break;
+			case 'm':
+				parse_mix(optarg);
+				break;
+			case 'P':
+				port = optarg;
+				break;
+			case 'r':
+				connrate = atoi(optarg);
+				break;
+			case 'S':
+				stormat = atoi(optarg);
+				break;
+			case 's':
+				sharerate = atof(optarg);
+				break;
+			case 't':
+				threads = atoi(optarg);
+				break;
+			case 'u':
+				username = optarg;
+				break;
+			case 'V':
+				versionroll = true;
+				break;
+			case 'w':
+				workernames = true;
+				break;
+			case 'h':
+			default:
+				usage(argv[0]);
+				exit(c != 'h');
+		}
+	}
+	if (clients < 1 || threads < 1 || connrate < 1 || sharerate < 0 || interval < 1)
+		quit(1, "Invalid arguments");
+	if (threads > clients)
+		threads = clients;
+
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(url, port, &hints, &pooladdr))
+		quit(1, "Failed to resolve %s:%s", url, port);
+
+	mutex_init(&spread_lock);
+	srandom(time(NULL) ^ getpid());
+	start_ns = time_nanos();
+
+	workers = ckzalloc(sizeof(worker_t) * threads);
+	for (i = 0; i < threads; i++) {
+		worker_t *worker = &workers[i];
+		int j;
+
+		worker->id = i;
+		worker->nconns = clients / threads + (i < clients % threads);
+		worker->conns = ckzalloc(sizeof(conn_t) * worker->nconns);
+		for (j = 0; j < worker->nconns; j++) {
+			worker->conns[j].fd = -1;
+			worker->conns[j].index = j * threads + i;
+		}
+		worker->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (worker->epfd < 0)
+			quit(1, "Failed to create epoll");
+		create_pthread(&worker->pth, worker_thread, worker);
+	}
+
+	next = start_ns;
+	while (42) {
+		int64_t now;
+
+		next += (int64_t)interval * 1000000000;
+		while ((now = time_nanos()) < next)
+			cksleep_ms(MIN((next - now) / 1000000 + 1, 100));
+		report(now);
+		if (duration && now - start_ns >= (int64_t)duration * 1000000000)
+			break;
+	}
+	quitting = true;
+	for (i = 0; i < threads; i++)
+		join_pthread(workers[i].pth);
+	return 0;
+}
@@ -145,6 +145,88 @@ out:
 	free(buf);
 }
 
+/* Try to claim the next slot in the ring for data, returning false if the
+ * ring is full. Safe against concurrent producers. */
+static bool ckmsgq_push(ckmsgq_t *ckmsgq, void *data, const int64_t stamp)
+{
+	uint64_t pos = __atomic_load_n(&ckmsgq->head, __ATOMIC_RELAXED);
+	struct ckmsgq_slot *slot;
+
+	while (42) {
+		int64_t diff;
+
+		slot = &ckmsgq->slots[pos & (CKMSGQ_SLOTS - 1)];
+		diff = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+		if (!diff) {
+			/* On failure pos is updated to the current head */
+			if (__atomic_compare_exchange_n(&ckmsgq->head, &pos, pos + 1, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0)
+			return false;
+		else
+			pos = __atomic_load_n(&ckmsgq->head, __ATOMIC_RELAXED);
+	}
+	slot->data = data;
+	slot->stamp = stamp;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/* Take the oldest message from the ring. Only called by the consumer. */
+static bool ckmsgq_pop(ckmsgq_t *ckmsgq, void **data)
+{
+	uint64_t pos = ckmsgq->tail;
+	struct ckmsgq_slot *slot = &ckmsgq->slots[pos & (CKMSGQ_SLOTS - 1)];
+
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+		return false;
+	*data = slot->data;
+	if (unlikely(slot->stamp)) {
+		int64_t wait = time_nanos() - slot->stamp;
+
+		if (wait > __atomic_load_n(&ckmsgq->maxwait, __ATOMIC_RELAXED))
+			__atomic_store_n(&ckmsgq->maxwait, wait, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&slot->seq, pos + CKMSGQ_SLOTS, __ATOMIC_RELEASE);
+	__atomic_store_n(&ckmsgq->tail, pos + 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+static bool ckmsgq_pending(ckmsgq_t *ckmsgq)
+{
+	uint64_t pos = __atomic_load_n(&ckmsgq->tail, __ATOMIC_RELAXED);
+	struct ckmsgq_slot *slot = &ckmsgq->slots[pos & (CKMSGQ_SLOTS - 1)];
+
+	return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == pos + 1 ||
+		__atomic_load_n(&ckmsgq->prios, __ATOMIC_RELAXED) ||
+		__atomic_load_n(&ckmsgq->overflows, __ATOMIC_RELAXED);
+}
+
+/* Wake the consumer after adding to the ring, but only if it's asleep. The
+ * fence pairs with the one in ckmsg_queue so that either we see it sleeping
+ * or it sees our message before it sleeps. */
+static void ckmsgq_wake(ckmsgq_t *ckmsgq)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&ckmsgq->sleeping, __ATOMIC_RELAXED))
+		return;
+	mutex_lock(&ckmsgq->lock);
+	pthread_cond_signal(&ckmsgq->cond);
+	mutex_unlock(&ckmsgq->lock);
+}
+
+static void process_ckmsgs(ckmsgq_t *ckmsgq, ckmsg_t *msgs)
+{
+	ckmsg_t *msg, *tmp;
+
+	DL_FOREACH_SAFE(msgs, msg, tmp) {
+		ckmsgq->func(ckmsgq->ckp, msg->data);
+		free(msg);
+		__atomic_store_n(&ckmsgq->processed, ckmsgq->processed + 1, __ATOMIC_RELAXED);
+	}
+}
+
 /* Generic function for creating a message queue receiving and parsing thread */
 static void *ckmsg_queue(void *arg)
 {
@@ -156,73 +238,116 @@ static void *ckmsg_queue(void *arg)
 	ckmsgq->active = true;
 
 	while (42) {
-		ckmsg_t *msg;
+		int batch, maxbatch = ckmsgq->batch ? : 1;
+		ckmsg_t *msgs;
+		void *data;
 		tv_t now;
 		ts_t abs;
 
-		mutex_lock(ckmsgq->lock);
-		tv_time(&now);
-		tv_to_ts(&abs, &now);
-		abs.tv_sec++;
-		if (!ckmsgq->msgs)
-			cond_timedwait(ckmsgq->cond, ckmsgq->lock, &abs);
-		msg = ckmsgq->msgs;
-		if (msg)
-			DL_DELETE(ckmsgq->msgs, msg);
-		mutex_unlock(ckmsgq->lock);
-
-		if (!msg)
+		/* High priority messages jump ahead of everything in the ring */
+		if (unlikely(__atomic_load_n(&ckmsgq->prios, __ATOMIC_RELAXED))) {
+			mutex_lock(&ckmsgq->lock);
+			msgs = ckmsgq->prio;
+			ckmsgq->prio = NULL;
+			ckmsgq->prios = 0;
+			mutex_unlock(&ckmsgq->lock);
+			process_ckmsgs(ckmsgq, msgs);
+		}
+
+		for (batch = maxbatch; batch && ckmsgq_pop(ckmsgq, &data); batch--)
+			ckmsgq->func(ckp, data);
+		if (batch < maxbatch) {
+			__atomic_store_n(&ckmsgq->processed, ckmsgq->processed + maxbatch - batch,
+					 __ATOMIC_RELAXED);
 			continue;
-		ckmsgq->func(ckp, msg->data);
-		free(msg);
+		}
+
+		/* The ring is empty so anything that overflowed is now the
+		 * oldest work queued */
+		if (unlikely(__atomic_load_n(&ckmsgq->overflows, __ATOMIC_RELAXED))) {
+			mutex_lock(&ckmsgq->lock);
+			msgs = ckmsgq->overflow;
+			ckmsgq->overflow = NULL;
+			ckmsgq->overflows = 0;
+			mutex_unlock(&ckmsgq->lock);
+			process_ckmsgs(ckmsgq, msgs);
+			continue;
+		}
+
+		mutex_lock(&ckmsgq->lock);
+		__atomic_store_n(&ckmsgq->sleeping, true, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (!ckmsgq_pending(ckmsgq)) {
+			tv_time(&now);
+			tv_to_ts(&abs, &now);
+			abs.tv_sec++;
+			cond_timedwait(&ckmsgq->cond, &ckmsgq->lock, &abs);
+		}
+		__atomic_store_n(&ckmsgq->sleeping, false, __ATOMIC_RELAXED);
+		mutex_unlock(&ckmsgq->lock);
 	}
 	return NULL;
 }
 
-ckmsgq_t *create_ckmsgq(ckpool_t *ckp, const char *name, const void *func)
+/* Every ckmsgq ever created, only ever added to */
+static ckmsgq_t *ckmsgqs;
+
+static void init_ckmsgq(ckmsgq_t *ckmsgq, ckpool_t *ckp, const void *func)
 {
-	ckmsgq_t *ckmsgq = ckzalloc(sizeof(ckmsgq_t));
+	int i;
 
-	strncpy(ckmsgq->name, name, 15);
 	ckmsgq->func = func;
 	ckmsgq->ckp = ckp;
-	ckmsgq->lock = ckalloc(sizeof(mutex_t));
-	ckmsgq->cond = ckalloc(sizeof(pthread_cond_t));
-	mutex_init(ckmsgq->lock);
-	cond_init(ckmsgq->cond);
+	ckmsgq->slots = ckalloc(sizeof(struct ckmsgq_slot) * CKMSGQ_SLOTS);
+	for (i = 0; i < CKMSGQ_SLOTS; i++)
+		ckmsgq->slots[i].seq = i;
+	mutex_init(&ckmsgq->lock);
+	cond_init(&ckmsgq->cond);
+	ckmsgq->next = __atomic_load_n(&ckmsgqs, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&ckmsgqs, &ckmsgq->next, ckmsgq, true,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
 	create_pthread(&ckmsgq->pth, ckmsg_queue, ckmsgq);
+}
+
+ckmsgq_t *create_ckmsgq(ckpool_t *ckp, const char *name, const void *func)
+{
+	ckmsgq_t *ckmsgq = ckzalloc(sizeof(ckmsgq_t));
+
+	strncpy(ckmsgq->name, name, 15);
+	ckmsgq->count = 1;
+	init_ckmsgq(ckmsgq, ckp, func);
 
 	return ckmsgq;
 }
 
+/* Create an array of count ckmsgqs, each with its own consumer thread */
 ckmsgq_t *create_ckmsgqs(ckpool_t *ckp, const char *name, const void *func, const int count)
 {
 	ckmsgq_t *ckmsgq = ckzalloc(sizeof(ckmsgq_t) * count);
-	mutex_t *lock;
-	pthread_cond_t *cond;
 	int i;
 
-	lock = ckalloc(sizeof(mutex_t));
-	cond = ckalloc(sizeof(pthread_cond_t));
-	mutex_init(lock);
-	cond_init(cond);
-
 	for (i = 0; i < count; i++) {
 		snprintf(ckmsgq[i].name, 15, "%.6s%x", name, i);
-		ckmsgq[i].func = func;
-		ckmsgq[i].ckp = ckp;
-		ckmsgq[i].lock = lock;
-		ckmsgq[i].cond = cond;
-		create_pthread(&ckmsgq[i].pth, ckmsg_queue, &ckmsgq[i]);
+		ckmsgq[i].count = count;
+		init_ckmsgq(&ckmsgq[i], ckp, func);
 	}
 
 	return ckmsgq;
 }
 
-/* Generic function for adding messages to a ckmsgq linked list and signal the
- * ckmsgq parsing thread(s) to wake up and process it. */
+/* Each ckmsgq in an array is only drained by its own thread so messages have
+ * to be spread across them by the producer. Pick the one that always handles
+ * messages for this id, keeping them in order. */
+ckmsgq_t *ckmsgq_by_id(ckmsgq_t *ckmsgqs, const int64_t id)
+{
+	return &ckmsgqs[(uint64_t)id % ckmsgqs->count];
+}
+
+/* Generic function for adding messages to a ckmsgq and waking the ckmsgq
+ * parsing thread if it's asleep. */
 bool _ckmsgq_add(ckmsgq_t *ckmsgq, void *data, const char *file, const char *func, const int line)
 {
+	int64_t stamp = 0;
 	ckmsg_t *msg;
 
 	if (unlikely(!ckmsgq)) {
@@ -235,34 +360,188 @@ bool _ckmsgq_add(ckmsgq_t *ckmsgq, void *data, const char *file, const char *fun
 	while (unlikely(!ckmsgq->active))
 		cksleep_ms(10);
 
+	if (unlikely(!(__atomic_add_fetch(&ckmsgq->messages, 1, __ATOMIC_RELAXED) &
+		       (CKMSGQ_SAMPLE - 1))))
+		stamp = time_nanos();
+	/* Once anything has overflowed keep using the overflow list until
+	 * the consumer has caught up to preserve ordering */
+	if (likely(!__atomic_load_n(&ckmsgq->overflows, __ATOMIC_RELAXED) &&
+		   ckmsgq_push(ckmsgq, data, stamp))) {
+		ckmsgq_wake(ckmsgq);
+		return true;
+	}
+
 	msg = ckalloc(sizeof(ckmsg_t));
 	msg->data = data;
 
-	mutex_lock(ckmsgq->lock);
-	ckmsgq->messages++;
-	DL_APPEND(ckmsgq->msgs, msg);
-	pthread_cond_broadcast(ckmsgq->cond);
-	mutex_unlock(ckmsgq->lock);
+	mutex_lock(&ckmsgq->lock);
+	DL_APPEND(ckmsgq->overflow, msg);
+	ckmsgq->overflows++;
+	if (ckmsgq->sleeping)
+		pthread_cond_signal(&ckmsgq->cond);
+	mutex_unlock(&ckmsgq->lock);
 
 	return true;
 }
 
-/* Return whether there are any messages queued in the ckmsgq linked list. */
-bool ckmsgq_empty(ckmsgq_t *ckmsgq)
+/* Add a prepared list of messages in one go, waking the consumer at most
+ * once. High priority messages are queued ahead of anything already waiting
+ * in the ring, in the order they were added. Takes ownership of the list. */
+void ckmsgq_addbulk(ckmsgq_t *ckmsgq, ckmsg_t *msgs, const bool prio)
 {
-	bool ret = true;
+	ckmsg_t *msg, *tmp;
+	int count, pushed = 0;
 
+	DL_COUNT(msgs, msg, count);
+	if (unlikely(!count))
+		return;
+	__atomic_add_fetch(&ckmsgq->messages, count, __ATOMIC_RELAXED);
+
+	if (!prio) {
+		DL_FOREACH_SAFE(msgs, msg, tmp) {
+			if (__atomic_load_n(&ckmsgq->overflows, __ATOMIC_RELAXED) ||
+			    !ckmsgq_push(ckmsgq, msg->data, 0))
+				break;
+			DL_DELETE(msgs, msg);
+			free(msg);
+			pushed++;
+		}
+		if (likely(!msgs)) {
+			ckmsgq_wake(ckmsgq);
+			return;
+		}
+	}
+
+	mutex_lock(&ckmsgq->lock);
+	if (prio) {
+		DL_CONCAT(ckmsgq->prio, msgs);
+		ckmsgq->prios += count;
+	} else {
+		DL_CONCAT(ckmsgq->overflow, msgs);
+		ckmsgq->overflows += count - pushed;
+	}
+	if (ckmsgq->sleeping)
+		pthread_cond_signal(&ckmsgq->cond);
+	mutex_unlock(&ckmsgq->lock);
+}
+
+/* Return whether there are any messages queued in the ckmsgq. */
+bool ckmsgq_empty(ckmsgq_t *ckmsgq)
+{
 	if (unlikely(!ckmsgq || !ckmsgq->active))
-		goto out;
+		return true;
+	return !ckmsgq_pending(ckmsgq);
+}
 
-	mutex_lock(ckmsgq->lock);
-	if (ckmsgq->msgs)
-		ret = (ckmsgq->msgs->next == ckmsgq->msgs->prev);
-	mutex_unlock(ckmsgq->lock);
-out:
+/* Approximate number of messages waiting, for stats */
+int ckmsgq_queued(ckmsgq_t *ckmsgq)
+{
+	int64_t queued;
+
+	queued = __atomic_load_n(&ckmsgq->head, __ATOMIC_RELAXED) -
+		 __atomic_load_n(&ckmsgq->tail, __ATOMIC_RELAXED);
+	if (queued < 0)
+		queued = 0;
+	queued += __atomic_load_n(&ckmsgq->prios, __ATOMIC_RELAXED);
+	queued += __atomic_load_n(&ckmsgq->overflows, __ATOMIC_RELAXED);
+	return queued;
+}
+
+/* Wrap a heap allocated string in a ckbuf holding one reference, taking
+ * ownership of the string. */
+ckbuf_t *create_ckbuf(char *buf)
+{
+	ckbuf_t *ckbuf = ckalloc(sizeof(ckbuf_t));
+
+	mutex_init(&ckbuf->lock);
+	ckbuf->refs = 1;
+	ckbuf->buf = buf;
+	ckbuf->len = strlen(buf);
+	return ckbuf;
+}
+
+/* Add refs in one go to minimise locking when handing the same buffer out to
+ * many recipients at once. */
+void ckbuf_get(ckbuf_t *ckbuf, const int refs)
+{
+	mutex_lock(&ckbuf->lock);
+	ckbuf->refs += refs;
+	mutex_unlock(&ckbuf->lock);
+}
+
+void ckbuf_put(ckbuf_t *ckbuf)
+{
+	int refs;
+
+	mutex_lock(&ckbuf->lock);
+	refs = --ckbuf->refs;
+	mutex_unlock(&ckbuf->lock);
+
+	if (refs)
+		return;
+	mutex_destroy(&ckbuf->lock);
+	free(ckbuf->buf);
+	free(ckbuf);
+}
+
+#define ARENA_CHUNK 65536
+
+struct arena_chunk {
+	arena_chunk_t *next;
+	size_t size;
+	size_t used;
+	char buf[] __attribute__((aligned(16)));
+};
+
+/* Returns zeroed memory aligned to 16 bytes that lives till arena_free */
+void *arena_alloc(arena_t *arena, size_t len)
+{
+	arena_chunk_t *chunk = arena->chunks;
+	void *ret;
+
+	len = (len + 15) & ~(size_t)15;
+	if (!chunk || chunk->size - chunk->used < len) {
+		size_t size = MAX(len, ARENA_CHUNK);
+
+		chunk = ckzalloc(sizeof(arena_chunk_t) + size);
+		chunk->size = size;
+		arena->size += size;
+		/* Put oversized allocations behind the current chunk so that
+		 * what is left of it can still be used */
+		if (size > ARENA_CHUNK && arena->chunks) {
+			chunk->next = arena->chunks->next;
+			arena->chunks->next = chunk;
+		} else {
+			chunk->next = arena->chunks;
+			arena->chunks = chunk;
+		}
+	}
+	ret = chunk->buf + chunk->used;
+	chunk->used += len;
 	return ret;
 }
 
+char *arena_strdup(arena_t *arena, const char *str)
+{
+	int len = strlen(str);
+	char *ret = arena_alloc(arena, len + 1);
+
+	memcpy(ret, str, len);
+	return ret;
+}
+
+void arena_free(arena_t *arena)
+{
+	arena_chunk_t *chunk, *tmp;
+
+	for (chunk = arena->chunks; chunk; chunk = tmp) {
+		tmp = chunk->next;
+		free(chunk);
+	}
+	arena->chunks = NULL;
+	arena->size = 0;
+}
+
 /* Create a standalone thread that queues received unix messages for a proc
  * instance and adds them to linked list of received messages with their
  * associated receive socket, then signal the associated rmsg_cond for the
@@ -293,7 +572,7 @@ static void *unix_receiver(void *arg)
 			LOGWARNING("Failed to get message on %s socket", qname);
 			continue;
 		}
-		umsg = ckalloc(sizeof(unix_msg_t));
+		umsg = ckzalloc(sizeof(unix_msg_t));
 		umsg->sockd = sockd;
 		umsg->buf = buf;
 
@@ -306,36 +585,106 @@ static void *unix_receiver(void *arg)
 	return NULL;
 }
 
+/* Take the oldest message from the in process ring. The slot stays claimed
+ * until put_unix_msg so producers can't overwrite it while it's handled.
+ * Only called by the consumer. */
+static unix_msg_t *pop_proc_slot(proc_instance_t *pi)
+{
+	uint64_t pos = pi->tail;
+	proc_slot_t *slot = &pi->slots[pos & (PROC_SLOTS - 1)];
+
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+		return NULL;
+	__atomic_store_n(&pi->tail, pos + 1, __ATOMIC_RELAXED);
+	return &slot->umsg;
+}
+
+static bool proc_slot_pending(proc_instance_t *pi)
+{
+	uint64_t pos = pi->tail;
+	proc_slot_t *slot = &pi->slots[pos & (PROC_SLOTS - 1)];
+
+	return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == pos + 1;
+}
+
 /* Get the next message in the receive queue, or wait up to 5 seconds for
- * the next message, returning NULL if no message is received in that time. */
+ * the next message, returning NULL if no message is received in that time.
+ * Messages queued in process are taken first, without locking. */
 unix_msg_t *get_unix_msg(proc_instance_t *pi)
 {
-	unix_msg_t *umsg;
+	unix_msg_t *umsg = pop_proc_slot(pi);
+
+	if (umsg)
+		return umsg;
 
 	mutex_lock(&pi->rmsg_lock);
 	if (!pi->unix_msgs) {
 		tv_t now;
 		ts_t abs;
 
-		tv_time(&now);
-		tv_to_ts(&abs, &now);
-		abs.tv_sec += 5;
-		cond_timedwait(&pi->rmsg_cond, &pi->rmsg_lock, &abs);
+		/* Pairs with the fence in wake_proc */
+		__atomic_store_n(&pi->sleeping, true, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (!proc_slot_pending(pi)) {
+			tv_time(&now);
+			tv_to_ts(&abs, &now);
+			abs.tv_sec += 5;
+			cond_timedwait(&pi->rmsg_cond, &pi->rmsg_lock, &abs);
+		}
+		__atomic_store_n(&pi->sleeping, false, __ATOMIC_RELAXED);
 	}
 	umsg = pi->unix_msgs;
-	if (umsg)
+	if (umsg) {
 		DL_DELETE(pi->unix_msgs, umsg);
+		if (umsg->sockd < 0)
+			pi->overflows--;
+	}
 	mutex_unlock(&pi->rmsg_lock);
 
+	if (!umsg)
+		umsg = pop_proc_slot(pi);
 	return umsg;
 }
 
-static void create_unix_receiver(proc_instance_t *pi)
+/* Release a message returned by get_unix_msg, closing any socket it arrived
+ * on and handing its slot back to producers if it was queued in process. */
+void put_unix_msg(unix_msg_t *umsg)
 {
-	pthread_t pth;
+	proc_slot_t *slot;
+
+	if (!umsg)
+		return;
+	Close(umsg->sockd);
+	slot = umsg->slot;
+	if (!slot) {
+		free(umsg->buf);
+		free(umsg);
+		return;
+	}
+	if (umsg->buf != slot->buf)
+		free(umsg->buf);
+	umsg->buf = NULL;
+	/* seq is pos + 1 while claimed, making it free for pos + PROC_SLOTS */
+	__atomic_store_n(&slot->seq, slot->seq - 1 + PROC_SLOTS, __ATOMIC_RELEASE);
+}
 
+/* Set up the in process channel before anything can send to it */
+static void init_proc_channel(proc_instance_t *pi)
+{
+	int i;
+
+	pi->slots = ckzalloc(sizeof(proc_slot_t) * PROC_SLOTS);
+	for (i = 0; i < PROC_SLOTS; i++) {
+		pi->slots[i].seq = i;
+		pi->slots[i].umsg.slot = &pi->slots[i];
+	}
 	mutex_init(&pi->rmsg_lock);
 	cond_init(&pi->rmsg_cond);
+}
+
+static void create_unix_receiver(proc_instance_t *pi)
+{
+	pthread_t pth;
 
 	create_pthread(&pth, unix_receiver, pi);
 }
@@ -457,6 +806,21 @@ retry:
 		msg = connector_stats(ckp->cdata, 0);
 		send_unix_msg(sockd, msg);
 		dealloc(msg);
+	} else if (cmdmatch(buf, "latencystats")) {
+		json_t *val = json_object();
+
+		LOGDEBUG("Listener received latencystats request");
+		json_set_object(val, "stratifier", stratifier_latency(ckp->sdata, false));
+		json_set_object(val, "connector", connector_latency(ckp->cdata, false));
+		msg = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
+		json_decref(val);
+		send_unix_msg(sockd, msg);
+		dealloc(msg);
+	} else if (cmdmatch(buf, "resetlatency")) {
+		LOGWARNING("Resetting latency stats");
+		json_decref(stratifier_latency(ckp->sdata, true));
+		json_decref(connector_latency(ckp->cdata, true));
+		send_unix_msg(sockd, "resetting");
 	} else if (cmdmatch(buf, "resetshares")) {
 		LOGWARNING("Resetting best shares");
 		send_proc(ckp->stratifier, buf);
@@ -473,6 +837,166 @@ out:
 	return NULL;
 }
 
+/* Append printf style text to a metrics page */
+void metrics_printf(char **buf, const char *fmt, ...)
+{
+	va_list ap;
+	char *line;
+
+	va_start(ap, fmt);
+	VASPRINTF(&line, fmt, ap);
+	va_end(ap);
+	realloc_strcat(buf, line);
+	free(line);
+}
+
+/* Append a histogram of ns as a summary in seconds, with labels being empty
+ * or a list of extra labels */
+void metrics_hist(char **buf, const char *name, const char *labels, const ckhist_t *hist)
+{
+	static const char *keys[] = {"p50", "p90", "p99", "p999"};
+	static const char *quantiles[] = {"0.5", "0.9", "0.99", "0.999"};
+	json_t *val = ckhist_json(hist), *entry;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		entry = json_object_get(val, keys[i]);
+		if (!entry)
+			continue;
+		metrics_printf(buf, "%s{%s%squantile=\"%s\"} %.9f\n", name, labels,
+			       labels[0] ? "," : "", quantiles[i], json_integer_value(entry) / 1e9);
+	}
+	metrics_printf(buf, "%s_count{%s} %"JSON_INTEGER_FORMAT"\n", name, labels,
+		       json_integer_value(json_object_get(val, "count")));
+	json_decref(val);
+}
+
+static void ckmsgq_metrics(char **buf)
+{
+	ckmsgq_t *ckmsgq;
+
+	metrics_printf(buf, "# TYPE ckpool_queue_depth gauge\n");
+	for (ckmsgq = __atomic_load_n(&ckmsgqs, __ATOMIC_ACQUIRE); ckmsgq; ckmsgq = ckmsgq->next)
+		metrics_printf(buf, "ckpool_queue_depth{queue=\"%s\"} %d\n", ckmsgq->name,
+			       ckmsgq_queued(ckmsgq));
+	metrics_printf(buf, "# TYPE ckpool_queue_enqueued_total counter\n");
+	for (ckmsgq = __atomic_load_n(&ckmsgqs, __ATOMIC_ACQUIRE); ckmsgq; ckmsgq = ckmsgq->next)
+		metrics_printf(buf, "ckpool_queue_enqueued_total{queue=\"%s\"} %"PRId64"\n", ckmsgq->name,
+			       __atomic_load_n(&ckmsgq->messages, __ATOMIC_RELAXED));
+	metrics_printf(buf, "# TYPE ckpool_queue_dequeued_total counter\n");
+	for (ckmsgq = __atomic_load_n(&ckmsgqs, __ATOMIC_ACQUIRE); ckmsgq; ckmsgq = ckmsgq->next)
+		metrics_printf(buf, "ckpool_queue_dequeued_total{queue=\"%s\"} %"PRId64"\n", ckmsgq->name,
+			       __atomic_load_n(&ckmsgq->processed, __ATOMIC_RELAXED));
+	/* Worst sampled wait since the last scrape */
+	metrics_printf(buf, "# TYPE ckpool_queue_max_wait_seconds gauge\n");
+	for (ckmsgq = __atomic_load_n(&ckmsgqs, __ATOMIC_ACQUIRE); ckmsgq; ckmsgq = ckmsgq->next)
+		metrics_printf(buf, "ckpool_queue_max_wait_seconds{queue=\"%s\"} %.9f\n", ckmsgq->name,
+			       __atomic_exchange_n(&ckmsgq->maxwait, 0, __ATOMIC_RELAXED) / 1e9);
+}
+
+#define METRICS_THREADS 512
+
+/* Threads sharing a name are summed since they'd otherwise share a label */
+static void thread_metrics(char **buf)
+{
+	thread_cpu_t *cpus = ckalloc(sizeof(thread_cpu_t) * METRICS_THREADS);
+	int i, j, count;
+
+	count = thread_cputimes(cpus, METRICS_THREADS);
+	metrics_printf(buf, "# TYPE ckpool_thread_cpu_seconds_total counter\n");
+	for (i = 0; i < count; i++) {
+		if (!cpus[i].name[0])
+			continue;
+		for (j = i + 1; j < count; j++) {
+			if (!strcmp(cpus[i].name, cpus[j].name)) {
+				cpus[i].secs += cpus[j].secs;
+				cpus[j].name[0] = '\0';
+			}
+		}
+		metrics_printf(buf, "ckpool_thread_cpu_seconds_total{thread=\"%s\"} %.6f\n",
+			       cpus[i].name, cpus[i].secs);
+	}
+	free(cpus);
+}
+
+static char *metrics_page(ckpool_t *ckp)
+{
+	char *buf = NULL;
+
+	ckmsgq_metrics(&buf);
+	thread_metrics(&buf);
+	if (ckp->sdata)
+		stratifier_metrics(ckp, &buf);
+	if (ckp->cdata)
+		connector_metrics(ckp, &buf);
+	return buf;
+}
+
+/* Serve text metrics in the prometheus exposition format over http. Only
+ * counters kept up to date as things happen are read, so it's cheap enough
+ * to scrape every few seconds without taking the locks stats commands do. */
+static void *metrics_server(void *arg)
+{
+	ckpool_t *ckp = (ckpool_t *)arg;
+	char *url = NULL, *port = NULL;
+	int sockd;
+
+	rename_proc("metrics");
+	if (!extract_sockaddr(ckp->metricsurl, &url, &port)) {
+		LOGWARNING("Failed to extract metrics address from %s", ckp->metricsurl);
+		goto out;
+	}
+	sockd = bind_socket(url, port, false);
+	if (sockd < 0 || listen(sockd, 16) < 0) {
+		LOGWARNING("Failed to listen for metrics on %s:%s", url, port);
+		goto out;
+	}
+	LOGNOTICE("Serving metrics on http://%s:%s/metrics", url, port);
+
+	while (42) {
+		struct timeval timeout = {1, 0};
+		char req[1024], *page, *header;
+		int fd, len = 0, ret;
+
+		fd = accept(sockd, NULL, NULL);
+		if (fd < 0) {
+			if (errno != EINTR && errno != ECONNABORTED)
+				cksleep_ms(100);
+			continue;
+		}
+		/* Don't let a slow client hold up the next scrape */
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		while (len < (int)sizeof(req) - 1) {
+			ret = read(fd, req + len, sizeof(req) - 1 - len);
+			if (ret < 1)
+				break;
+			len += ret;
+			req[len] = '\0';
+			if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+				break;
+		}
+		req[len] = '\0';
+		if (!strncmp(req, "GET /metrics ", 13) || !strncmp(req, "GET / ", 6)) {
+			page = metrics_page(ckp);
+			ASPRINTF(&header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+				 "Content-Length: %d\r\nConnection: close\r\n\r\n", (int)strlen(page));
+			if (write_length(fd, header, strlen(header)) > 0)
+				write_length(fd, page, strlen(page));
+			free(header);
+			free(page);
+		} else if (len) {
+			header = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+			write_length(fd, header, strlen(header));
+		}
+		Close(fd);
+	}
+out:
+	free(url);
+	free(port);
+	return NULL;
+}
+
 void empty_buffer(connsock_t *cs)
 {
 	if (cs->buf)
@@ -682,24 +1206,75 @@ out:
 	return ret;
 }
 
+/* Try to claim the next slot in pi's ring and copy msg into it, returning
+ * false if the ring is full. Safe against concurrent producers. */
+static bool push_proc_slot(proc_instance_t *pi, const char *msg, const int len)
+{
+	uint64_t pos = __atomic_load_n(&pi->head, __ATOMIC_RELAXED);
+	proc_slot_t *slot;
+
+	while (42) {
+		int64_t diff;
+
+		slot = &pi->slots[pos & (PROC_SLOTS - 1)];
+		diff = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+		if (!diff) {
+			if (__atomic_compare_exchange_n(&pi->head, &pos, pos + 1, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0)
+			return false;
+		else
+			pos = __atomic_load_n(&pi->head, __ATOMIC_RELAXED);
+	}
+	slot->umsg.sockd = -1;
+	if (likely(len < PROC_SLOTLEN)) {
+		memcpy(slot->buf, msg, len + 1);
+		slot->umsg.buf = slot->buf;
+	} else
+		slot->umsg.buf = strdup(msg);
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/* Only take the lock to wake the consumer if it's asleep */
+static void wake_proc(proc_instance_t *pi)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&pi->sleeping, __ATOMIC_RELAXED))
+		return;
+	mutex_lock(&pi->rmsg_lock);
+	pthread_cond_signal(&pi->rmsg_cond);
+	mutex_unlock(&pi->rmsg_lock);
+}
+
 /* We used to send messages between each proc_instance via unix sockets when
- * ckpool was a multi-process model but that is no longer required so we can
- * place the messages directly on the other proc_instance's queue until we
- * deprecate this mechanism. */
+ * ckpool was a multi-process model but that is no longer required so we
+ * place the messages directly in a preallocated slot of the other
+ * proc_instance's ring, spilling into its locked list only when it's full. */
 void _queue_proc(proc_instance_t *pi, const char *msg, const char *file, const char *func, const int line)
 {
 	unix_msg_t *umsg;
+	int len;
 
-	if (unlikely(!msg || !strlen(msg))) {
+	if (unlikely(!msg || !(len = strlen(msg)))) {
 		LOGWARNING("Null msg passed to queue_proc from %s %s:%d", file, func, line);
 		return;
 	}
-	umsg = ckalloc(sizeof(unix_msg_t));
+	/* Once anything has overflowed keep using the list until the consumer
+	 * has caught up to preserve ordering */
+	if (likely(!__atomic_load_n(&pi->overflows, __ATOMIC_RELAXED) &&
+		   push_proc_slot(pi, msg, len))) {
+		wake_proc(pi);
+		return;
+	}
+	umsg = ckzalloc(sizeof(unix_msg_t));
 	umsg->sockd = -1;
 	umsg->buf = strdup(msg);
 
 	mutex_lock(&pi->rmsg_lock);
 	DL_APPEND(pi->unix_msgs, umsg);
+	pi->overflows++;
 	pthread_cond_signal(&pi->rmsg_cond);
 	mutex_unlock(&pi->rmsg_lock);
 }
@@ -745,21 +1320,30 @@ static const char *rpc_method(const char *rpc_req)
 }
 
 /* All of these calls are made to bitcoind which prefers open/close instead
- * of persistent connections so cs->fd is always invalid. */
-static json_t *_json_rpc_call(connsock_t *cs, const char *rpc_req, const bool info_only)
-{
-	float timeout = RPC_TIMEOUT;
+ * of persistent connections so cs->fd is always invalid. The request is
+ * gathered from iovcnt buffers so large requests need not be concatenated,
+ * the first of which must be a string for logging. */
+static json_t *_json_rpc_callv(connsock_t *cs, const struct iovec *rpc_iov, const int iovcnt,
+			       const bool info_only)
+{
+	const char *rpc_req = iovcnt > 0 ? rpc_iov[0].iov_base : NULL;
+	float timeout = cs->timeout ? cs->timeout : RPC_TIMEOUT;
 	char *http_req = NULL;
 	json_error_t err_val;
+	struct iovec *iov;
 	char *warning = NULL;
 	json_t *val = NULL;
 	tv_t stt_tv, fin_tv;
 	double elapsed;
-	int len, ret;
+	int i, len, ret;
 
 	/* Serialise all calls in case we use cs from multiple threads */
 	cksem_wait(&cs->sem);
-	cs->fd = connect_socket(cs->url, cs->port);
+	if (cs->warmfd > 0) {
+		cs->fd = cs->warmfd;
+		cs->warmfd = -1;
+	} else
+		cs->fd = connect_socket(cs->url, cs->port);
 	if (unlikely(cs->fd < 0)) {
 		ASPRINTF(&warning, "Unable to connect socket to %s:%s in %s", cs->url, cs->port, __func__);
 		goto out;
@@ -780,23 +1364,27 @@ static json_t *_json_rpc_call(connsock_t *cs, const char *rpc_req, const bool in
 		ASPRINTF(&warning, "Null rpc_req passed to %s", __func__);
 		goto out;
 	}
-	len = strlen(rpc_req);
+	for (i = 0, len = 0; i < iovcnt; i++)
+		len += rpc_iov[i].iov_len;
 	if (unlikely(!len)) {
 		ASPRINTF(&warning, "Zero length rpc_req passed to %s", __func__);
 		goto out;
 	}
-	http_req = ckalloc(len + 256); // Leave room for headers
-	sprintf(http_req,
-		 "POST / HTTP/1.1\n"
+	ASPRINTF(&http_req, "POST / HTTP/1.1\n"
 		 "Authorization: Basic %s\n"
 		 "Host: %s:%s\n"
 		 "Content-type: application/json\n"
-		 "Content-Length: %d\n\n%s",
-		 cs->auth, cs->url, cs->port, len, rpc_req);
-
-	len = strlen(http_req);
+		 "Content-Length: %d\n\n",
+		 cs->auth, cs->url, cs->port, len);
+	ret = strlen(http_req);
+	/* Headers followed by the request, copied as writes consume the iov */
+	iov = alloca(sizeof(struct iovec) * (iovcnt + 1));
+	iov[0].iov_base = http_req;
+	iov[0].iov_len = ret;
+	memcpy(iov + 1, rpc_iov, sizeof(struct iovec) * iovcnt);
+	len += ret;
 	tv_time(&stt_tv);
-	ret = write_socket(cs->fd, http_req, len);
+	ret = write_socketv(cs->fd, iov, iovcnt + 1);
 	if (ret != len) {
 		tv_time(&fin_tv);
 		elapsed = tvdiff(&fin_tv, &stt_tv);
@@ -864,18 +1452,32 @@ out:
 			LOGWARNING("%s", warning);
 		free(warning);
 	}
-	Close(cs->fd);
 	free(http_req);
+	Close(cs->fd);
 	dealloc(cs->buf);
 	cksem_post(&cs->sem);
 	return val;
 }
 
+static json_t *_json_rpc_call(connsock_t *cs, const char *rpc_req, const bool info_only)
+{
+	struct iovec iov;
+
+	iov.iov_base = (char *)rpc_req;
+	iov.iov_len = rpc_req ? strlen(rpc_req) : 0;
+	return _json_rpc_callv(cs, &iov, 1, info_only);
+}
+
 json_t *json_rpc_call(connsock_t *cs, const char *rpc_req)
 {
 	return _json_rpc_call(cs, rpc_req, false);
 }
 
+json_t *json_rpc_callv(connsock_t *cs, const struct iovec *iov, const int iovcnt)
+{
+	return _json_rpc_callv(cs, iov, iovcnt, false);
+}
+
 json_t *json_rpc_response(connsock_t *cs, const char *rpc_req)
 {
 	return _json_rpc_call(cs, rpc_req, true);
@@ -1069,6 +1671,7 @@ static void launch_logger(ckpool_t *ckp)
 
 static void clean_up(ckpool_t *ckp)
 {
+	stratifier_flush(ckp);
 	rm_namepid(&ckp->main);
 	dealloc(ckp->socket_dir);
 }
@@ -1091,6 +1694,7 @@ static void sighandler(const int sig)
 		   ckp->name, sig);
 
 	cancel_pthread(&ckp->pth_listener);
+	stratifier_flush(ckp);
 	exit(0);
 }
 
@@ -1439,6 +2043,7 @@ static void parse_config(ckpool_t *ckp)
 	}
 	json_get_string(&ckp->btcaddress, json_conf, "btcaddress");
 	json_get_string(&ckp->btcsig, json_conf, "btcsig");
+	json_get_bool(&ckp->rpcaddrcheck, json_conf, "rpcaddrcheck");
 	if (ckp->btcsig && strlen(ckp->btcsig) > 38) {
 		LOGWARNING("Signature %s too long, truncating to 38 bytes", ckp->btcsig);
 		ckp->btcsig[38] = '\0';
@@ -1447,6 +2052,7 @@ static void parse_config(ckpool_t *ckp)
 	json_get_int(&ckp->nonce1length, json_conf, "nonce1length");
 	json_get_int(&ckp->nonce2length, json_conf, "nonce2length");
 	json_get_int(&ckp->update_interval, json_conf, "update_interval");
+	json_get_double(&ckp->sharebudget, json_conf, "sharebudget");
 	json_get_string(&vmask, json_conf, "version_mask");
 	if (vmask && strlen(vmask) && validhex(vmask))
 		sscanf(vmask, "%x", &ckp->version_mask);
@@ -1471,6 +2077,10 @@ static void parse_config(ckpool_t *ckp)
 	json_get_int64(&ckp->highdiff, json_conf, "highdiff");
 	json_get_int64(&ckp->maxdiff, json_conf, "maxdiff");
 	json_get_string(&ckp->logdir, json_conf, "logdir");
+	json_get_bool(&ckp->binarysharelog, json_conf, "binarysharelog");
+	json_get_int(&ckp->receivers, json_conf, "receivers");
+	json_get_bool(&ckp->reuseport, json_conf, "reuseport");
+	json_get_int(&ckp->acceptrate, json_conf, "acceptrate");
 	json_get_int(&ckp->maxclients, json_conf, "maxclients");
 	json_get_double(&ckp->donation, json_conf, "donation");
 	/* Avoid dust-sized donations */
@@ -1484,10 +2094,16 @@ static void parse_config(ckpool_t *ckp)
 		if (arr_size)
 			parse_proxies(ckp, arr_val, arr_size);
 	}
+	json_get_int(&ckp->proxywindow, json_conf, "proxywindow");
 	arr_val = json_object_get(json_conf, "redirecturl");
 	if (arr_val)
 		parse_redirecturls(ckp, arr_val);
 	json_get_string(&ckp->zmqblock, json_conf, "zmqblock");
+	json_get_bool(&ckp->zmqsequence, json_conf, "zmqsequence");
+	json_get_bool(&ckp->longpoll, json_conf, "longpoll");
+	json_get_int(&ckp->mempool_refresh, json_conf, "mempoolrefresh");
+	json_get_bool(&ckp->emptywork, json_conf, "emptywork");
+	json_get_string(&ckp->metricsurl, json_conf, "metricsurl");
 
 	json_decref(json_conf);
 }
@@ -1570,7 +2186,12 @@ static bool send_recv_path(const char *path, const char *msg)
 	return ret;
 }
 
+#ifdef CKBENCH
+/* ckbench links everything here but provides its own main */
+int ckpool_main(int argc, char **argv)
+#else
 int main(int argc, char **argv)
+#endif
 {
 	struct sigaction handler;
 	int c, ret, i = 0, j;
@@ -1787,6 +2408,8 @@ int main(int argc, char **argv)
 		quit(0, "No redirect entries found in config file %s", ckp.config);
 	if (!ckp.zmqblock)
 		ckp.zmqblock = "tcp://127.0.0.1:28332";
+	if (!ckp.mempool_refresh)
+		ckp.mempool_refresh = 5;
 
 	/* Create the log directory */
 	trail_slash(&ckp.logdir);
@@ -1888,6 +2511,11 @@ int main(int argc, char **argv)
 
 	// ckp.ckpapi = create_ckmsgq(&ckp, "api", &ckpool_api);
 	create_pthread(&ckp.pth_listener, listener, &ckp.main);
+	if (ckp.metricsurl) {
+		pthread_t pth_metrics;
+
+		create_pthread(&pth_metrics, metrics_server, &ckp);
+	}
 
 	handler.sa_handler = &sighandler;
 	handler.sa_flags = 0;
@@ -1895,7 +2523,11 @@ int main(int argc, char **argv)
 	sigaction(SIGTERM, &handler, NULL);
 	sigaction(SIGINT, &handler, NULL);
 
-	/* Launch separate processes from here */
+	/* Launch separate processes from here, able to message each other
+	 * as soon as they start */
+	init_proc_channel(&ckp.generator);
+	init_proc_channel(&ckp.stratifier);
+	init_proc_channel(&ckp.connector);
 	prepare_child(&ckp, &ckp.generator, generator, "generator");
 	prepare_child(&ckp, &ckp.stratifier, stratifier, "stratifier");
 	prepare_child(&ckp, &ckp.connector, connector, "connector");
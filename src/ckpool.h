@@ -33,27 +33,99 @@ struct ckmsg {
 typedef struct ckmsg ckmsg_t;
 
 typedef struct unix_msg unix_msg_t;
+typedef struct proc_slot proc_slot_t;
 
 struct unix_msg {
 	unix_msg_t *next;
 	unix_msg_t *prev;
 	int sockd;
 	char *buf;
+	proc_slot_t *slot; /* Set if queued in process in a proc_instance slot */
 };
 
+/* Number of preallocated message slots in each proc_instance's in process
+ * channel, a power of 2, and the longest message carried in a slot without
+ * being duplicated. */
+#define PROC_SLOTS 1024
+#define PROC_SLOTLEN 256
+
+struct proc_slot {
+	uint64_t seq;
+	unix_msg_t umsg;
+	char buf[PROC_SLOTLEN];
+};
+
+/* Number of slots in each ckmsgq ring, a power of 2. Messages beyond this
+ * spill into a locked overflow list rather than blocking producers. */
+#define CKMSGQ_SLOTS 4096
+
+/* One in this many messages added to a ckmsgq is timestamped to sample how
+ * long messages wait, a power of 2 */
+#define CKMSGQ_SAMPLE 64
+
+struct ckmsgq_slot {
+	uint64_t seq;
+	void *data;
+	int64_t stamp; /* time_nanos() when queued if sampled, else 0 */
+};
+
+typedef struct ckmsgq ckmsgq_t;
+
+/* A bounded multi-producer single-consumer ring buffer of messages serviced
+ * by one thread. Producer and consumer indices live on separate cache lines
+ * and the consumer is only woken when it's actually sleeping. */
 struct ckmsgq {
 	ckpool_t *ckp;
+	ckmsgq_t *next; /* List of every ckmsgq created, for metrics */
 	char name[16];
 	pthread_t pth;
-	mutex_t *lock;
-	pthread_cond_t *cond;
-	ckmsg_t *msgs;
 	void (*func)(ckpool_t *, void *);
-	int64_t messages;
+	struct ckmsgq_slot *slots;
+	int batch; /* Max messages to dequeue per wakeup, 0 means 1 */
+	int count; /* Number of ckmsgqs in the array this one belongs to */
 	bool active;
+
+	/* Written by producers */
+	uint64_t head __attribute__((aligned(64)));
+	int64_t messages;
+
+	/* Written only by the consumer, apart from maxwait being reset */
+	uint64_t tail __attribute__((aligned(64)));
+	int64_t processed;
+	int64_t maxwait; /* Longest sampled wait in ns since last reset */
+
+	/* Slow path for sleeping, high priority and overflow messages */
+	mutex_t lock __attribute__((aligned(64)));
+	pthread_cond_t cond;
+	ckmsg_t *prio;
+	ckmsg_t *overflow;
+	int prios;
+	int overflows;
+	bool sleeping;
 };
 
-typedef struct ckmsgq ckmsgq_t;
+/* An immutable serialised message that can be shared by many recipients,
+ * freed when the last reference to it is released. */
+struct ckbuf {
+	mutex_t lock;
+	int refs;
+	int len;
+	char *buf;
+};
+
+typedef struct ckbuf ckbuf_t;
+
+/* Bump allocator for data that all dies at once, released in one go with
+ * arena_free. A zeroed arena is empty and callers serialise their own access
+ * to it. */
+typedef struct arena_chunk arena_chunk_t;
+
+struct arena {
+	arena_chunk_t *chunks;
+	int64_t size; /* Total bytes allocated for chunks */
+};
+
+typedef struct arena arena_t;
 
 typedef struct proc_instance proc_instance_t;
 
@@ -66,14 +138,25 @@ struct proc_instance {
 	int oldpid;
 	pthread_t pth_process;
 
-	/* Linked list of received messages, locking and conditional */
-	unix_msg_t *unix_msgs;
+	/* Ring of preallocated slots for messages from other threads in
+	 * process, released by put_unix_msg once they've been handled */
+	proc_slot_t *slots;
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t tail __attribute__((aligned(64)));
+
+	/* Linked list of messages received on the unix socket or overflowing
+	 * the ring, locking and conditional */
+	unix_msg_t *unix_msgs __attribute__((aligned(64)));
 	mutex_t rmsg_lock;
 	pthread_cond_t rmsg_cond;
+	int overflows;
+	bool sleeping;
 };
 
 struct connsock {
 	int fd;
+	int warmfd; /* Connected ahead of the next rpc call if > 0 */
+	float timeout; /* Rpc read timeout if set instead of RPC_TIMEOUT */
 	char *url;
 	char *port;
 	char *auth;
@@ -122,6 +205,24 @@ struct server_instance {
 	bool notify;
 	bool alive;
 	connsock_t cs;
+
+	/* Used only for submitblock, kept with a connected socket ready */
+	connsock_t submit_cs;
+	time_t submit_warmed;
+
+	/* Used only for longpoll getblocktemplate calls */
+	connsock_t lp_cs;
+
+	/* Submitblock results and latencies in seconds, under submit_lock */
+	int submits;
+	int submits_accepted;
+	double submit_last;
+	double submit_max;
+	double submit_total;
+
+	/* From the share solving the block to this server's response */
+	double solve_last;
+	double solve_max;
 };
 
 typedef struct server_instance server_instance_t;
@@ -141,6 +242,8 @@ struct ckpool_instance {
 	bool killold;
 	/* Whether to log shares or not */
 	bool logshares;
+	/* Write sharelogs in the compact binary format of sharelog.h */
+	bool binarysharelog;
 	/* Logging level */
 	int loglevel;
 	/* Main process name */
@@ -184,6 +287,12 @@ struct ckpool_instance {
 
 	/* Name of protocol used for ZMQ block notifications */
 	char *zmqblock;
+	bool zmqsequence; // Subscribe to the ZMQ sequence topic instead of hashblock
+	bool longpoll; // Hold a longpoll getblocktemplate for pushed templates
+	int mempool_refresh; // Minimum seconds between mempool driven template updates
+	bool emptywork; // Broadcast coinbase only work on a new block before the full template
+
+	char *metricsurl; // host:port to serve text metrics over http on, if set
 
 	/* Threads of main process */
 	pthread_t pth_listener;
@@ -240,6 +349,8 @@ struct ckpool_instance {
 	char *btcaddress; // Address to mine to
 	bool script; // Address is a script address
 	bool segwit; // Address is a segwit address
+	int addrnets; // ADDR_ networks of btcaddress, to check user addresses against locally
+	bool rpcaddrcheck; // Ask bitcoind about usernames that don't decode as addresses
 	char *btcsig; // Optional signature to add to coinbase
 	bool coinbase_valid; // Coinbase transaction confirmed valid
 
@@ -261,8 +372,14 @@ struct ckpool_instance {
 	int nodeservers; // If this server has remote node servers
 	bool *trusted; // If this server URL accepts trusted remote nodes
 	char *upstream; // Upstream pool in trusted remote mode
+	bool upstream_sharebatch; // Upstream takes shares batched per worker
 
 	int update_interval; // Seconds between stratum updates
+	double sharebudget; // Pool shares per second to aim vardiff for, 0 for per client only
+
+	int receivers; // Connector receiver threads handling events inline, 0 for one receiver feeding cevents
+	bool reuseport; // Give each receiver thread its own SO_REUSEPORT listening sockets
+	int acceptrate; // New connections accepted per second, 0 for unlimited
 
 	uint32_t version_mask; // Bits which set to true means allow miner to modify those bits
 
@@ -271,6 +388,7 @@ struct ckpool_instance {
 	char **proxyurl;
 	char **proxyauth;
 	char **proxypass;
+	int proxywindow; // Max unanswered shares per upstream connection, 0 for unlimited
 
 	/* Passthrough redirect options */
 	int redirecturls;
@@ -283,6 +401,15 @@ struct ckpool_instance {
 	void *cdata;
 };
 
+/* Version of the compact txndelta/workdelta protocol offered by nodes, and
+ * whether they can take deflated payloads */
+#define NODE_PROTOCOL 1
+#ifdef USE_ZLIB
+#define NODE_ZLIB true
+#else
+#define NODE_ZLIB false
+#endif
+
 enum stratum_msgtype {
 	SM_RECONNECT = 0,
 	SM_DIFF,
@@ -307,6 +434,9 @@ enum stratum_msgtype {
 	SM_WORKERSTATS,
 	SM_REQTXNS,
 	SM_CONFIGURE,
+	SM_TXNDELTA,
+	SM_WORKDELTA,
+	SM_SHAREBATCH,
 	SM_NONE
 };
 
@@ -334,6 +464,9 @@ static const char __maybe_unused *stratum_msgs[] = {
 	"workerstats",
 	"reqtxns",
 	"mining.configure",
+	"txndelta",
+	"workdelta",
+	"sharebatch",
 	""
 };
 
@@ -343,10 +476,22 @@ void get_timestamp(char *stamp);
 
 ckmsgq_t *create_ckmsgq(ckpool_t *ckp, const char *name, const void *func);
 ckmsgq_t *create_ckmsgqs(ckpool_t *ckp, const char *name, const void *func, const int count);
+ckmsgq_t *ckmsgq_by_id(ckmsgq_t *ckmsgqs, const int64_t id);
 bool _ckmsgq_add(ckmsgq_t *ckmsgq, void *data, const char *file, const char *func, const int line);
 #define ckmsgq_add(ckmsgq, data) _ckmsgq_add(ckmsgq, data, __FILE__, __func__, __LINE__)
+void ckmsgq_addbulk(ckmsgq_t *ckmsgq, ckmsg_t *msgs, const bool prio);
 bool ckmsgq_empty(ckmsgq_t *ckmsgq);
+int ckmsgq_queued(ckmsgq_t *ckmsgq);
+void metrics_printf(char **buf, const char *fmt, ...);
+void metrics_hist(char **buf, const char *name, const char *labels, const ckhist_t *hist);
+ckbuf_t *create_ckbuf(char *buf);
+void ckbuf_get(ckbuf_t *ckbuf, const int refs);
+void ckbuf_put(ckbuf_t *ckbuf);
+void *arena_alloc(arena_t *arena, size_t len);
+char *arena_strdup(arena_t *arena, const char *str);
+void arena_free(arena_t *arena);
 unix_msg_t *get_unix_msg(proc_instance_t *pi);
+void put_unix_msg(unix_msg_t *umsg);
 
 bool ping_main(ckpool_t *ckp);
 void empty_buffer(connsock_t *cs);
@@ -365,6 +510,7 @@ char *_ckdb_msg_call(const ckpool_t *ckp, const char *msg,  const char *file, co
 #define ckdb_msg_call(ckp, msg) _ckdb_msg_call(ckp, msg, __FILE__, __func__, __LINE__)
 
 json_t *json_rpc_call(connsock_t *cs, const char *rpc_req);
+json_t *json_rpc_callv(connsock_t *cs, const struct iovec *iov, const int iovcnt);
 json_t *json_rpc_response(connsock_t *cs, const char *rpc_req);
 void json_rpc_msg(connsock_t *cs, const char *rpc_req);
 bool _send_json_msg(connsock_t *cs, const json_t *json_msg, const char *file, const char *func, const int line);
@@ -0,0 +1,276 @@
+/*
+ * Copyright 2014-2023 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Streams binary sharelogs written with binarysharelog set back out as the
+ * json lines ckpool writes by default, or as CSV. */
+
+#include "config.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libckpool.h"
+#include "sharelog.h"
+
+static int msg_loglevel = LOG_WARNING;
+
+void logmsg(int loglevel, const char *fmt, ...)
+{
+	va_list ap;
+	char *buf;
+
+	if (loglevel <= msg_loglevel) {
+		va_start(ap, fmt);
+		VASPRINTF(&buf, fmt, ap);
+		va_end(ap);
+
+		fprintf(stderr, "%s\n", buf);
+		free(buf);
+	}
+}
+
+/* Strings defined so far in the file being read, indexed by id */
+typedef struct strtable {
+	char **strs;
+	uint32_t size;
+} strtable_t;
+
+static const char *csv_header = "workinfoid,clientid,enonce1,nonce2,nonce,ntime,diff,sdiff,"
+	"hash,result,reject-reason,errn,createdate,createby,createcode,createinet,"
+	"workername,username,address,agent";
+
+static void add_string(strtable_t *st, const uint32_t id, char *str)
+{
+	if (id >= st->size) {
+		uint32_t size = MAX(id + 1, st->size * 2);
+
+		st->strs = realloc(st->strs, sizeof(char *) * size);
+		if (unlikely(!st->strs))
+			quit(1, "Failed to realloc string table of size %u", size);
+		memset(st->strs + st->size, 0, sizeof(char *) * (size - st->size));
+		st->size = size;
+	}
+	/* A later definition of the same id replaces the old one */
+	free(st->strs[id]);
+	st->strs[id] = str;
+}
+
+static const char *get_string(const strtable_t *st, const uint32_t id)
+{
+	if (unlikely(id >= st->size || !st->strs[id]))
+		return "";
+	return st->strs[id];
+}
+
+static void clear_strings(strtable_t *st)
+{
+	uint32_t i;
+
+	for (i = 0; i < st->size; i++)
+		free(st->strs[i]);
+	dealloc(st->strs);
+	st->size = 0;
+}
+
+static bool zero_hash(const uint8_t *hash)
+{
+	int i;
+
+	for (i = 0; i < 32; i++) {
+		if (hash[i])
+			return false;
+	}
+	return true;
+}
+
+static void print_csv_string(const char *str)
+{
+	if (!strpbrk(str, ",\"\n")) {
+		fputs(str, stdout);
+		return;
+	}
+	putchar('"');
+	for (; *str; str++) {
+		if (*str == '"')
+			putchar('"');
+		putchar(*str);
+	}
+	putchar('"');
+}
+
+static void print_share(const sharelog_share_t *share, const strtable_t *st, const bool csv)
+{
+	char enonce1[36], nonce2[36], nonce[12], ntime[12], hash[68] = {}, cdfield[64];
+	const char *reject = NULL;
+	int errn = share->errn;
+
+	__bin2hex(enonce1, share->enonce1, MIN(share->enonce1len, sizeof(share->enonce1)));
+	__bin2hex(nonce2, share->nonce2, MIN(share->nonce2len, sizeof(share->nonce2)));
+	__bin2hex(nonce, share->nonce, sizeof(share->nonce));
+	__bin2hex(ntime, share->ntime, sizeof(share->ntime));
+	if (!zero_hash(share->hash))
+		__bin2hex(hash, share->hash, sizeof(share->hash));
+	sprintf(cdfield, "%"PRId64",%"PRId64, share->createsec, share->creatensec);
+	if (errn && errn >= SE_INVALID_NONCE2 && errn <= SE_INVALID_VERSION_MASK)
+		reject = SHARE_ERR(errn);
+
+	if (csv) {
+		printf("%"PRId64",%"PRId64",%s,%s,%s,%s,%.16g,%.16g,%s,%s,", share->workinfoid,
+		       share->clientid, enonce1, nonce2, nonce, ntime, share->diff,
+		       share->sdiff, hash, share->result ? "true" : "false");
+		print_csv_string(reject ? reject : "");
+		printf(",%d,\"%s\",code,parse_submit,", errn, cdfield);
+		print_csv_string(get_string(st, share->strings[SLS_CREATEINET]));
+		putchar(',');
+		print_csv_string(get_string(st, share->strings[SLS_WORKERNAME]));
+		putchar(',');
+		print_csv_string(get_string(st, share->strings[SLS_USERNAME]));
+		putchar(',');
+		print_csv_string(get_string(st, share->strings[SLS_ADDRESS]));
+		putchar(',');
+		print_csv_string(get_string(st, share->strings[SLS_AGENT]));
+		putchar('\n');
+	} else {
+		json_t *val = json_object();
+		char *s;
+
+		/* Same keys in the same order as the json sharelog */
+		json_set_int(val, "workinfoid", share->workinfoid);
+		json_set_int64(val, "clientid", share->clientid);
+		json_set_string(val, "enonce1", enonce1);
+		json_set_string(val, "nonce2", nonce2);
+		json_set_string(val, "nonce", nonce);
+		json_set_string(val, "ntime", ntime);
+		json_set_double(val, "diff", share->diff);
+		json_set_double(val, "sdiff", share->sdiff);
+		json_set_string(val, "hash", hash);
+		json_set_bool(val, "result", share->result);
+		if (reject)
+			json_set_string(val, "reject-reason", reject);
+		json_set_int(val, "errn", errn);
+		json_set_string(val, "createdate", cdfield);
+		json_set_string(val, "createby", "code");
+		json_set_string(val, "createcode", "parse_submit");
+		json_set_string(val, "createinet", get_string(st, share->strings[SLS_CREATEINET]));
+		json_set_string(val, "workername", get_string(st, share->strings[SLS_WORKERNAME]));
+		json_set_string(val, "username", get_string(st, share->strings[SLS_USERNAME]));
+		json_set_string(val, "address", get_string(st, share->strings[SLS_ADDRESS]));
+		json_set_string(val, "agent", get_string(st, share->strings[SLS_AGENT]));
+		s = json_dumps(val, JSON_EOL);
+		fputs(s, stdout);
+		free(s);
+		json_decref(val);
+	}
+}
+
+/* Stream one binary sharelog, returning false if it was invalid */
+static bool read_sharelog(FILE *fp, const char *fname, const bool csv)
+{
+	strtable_t st = {};
+	sharelog_hdr_t hdr;
+	bool ret = false;
+	int type;
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    memcmp(hdr.magic, SHARELOG_MAGIC, sizeof(hdr.magic))) {
+		LOGERR("%s is not a binary sharelog", fname);
+		goto out;
+	}
+	if (hdr.version != SHARELOG_VERSION) {
+		LOGERR("%s has unsupported sharelog version %u", fname, hdr.version);
+		goto out;
+	}
+
+	while ((type = fgetc(fp)) != EOF) {
+		if (type == SHARELOG_STRING) {
+			sharelog_str_t def;
+			char *str;
+
+			def.type = type;
+			if (fread((char *)&def + 1, sizeof(def) - 1, 1, fp) != 1)
+				goto out_truncated;
+			str = ckalloc(def.len + 1);
+			if (def.len && fread(str, def.len, 1, fp) != 1) {
+				free(str);
+				goto out_truncated;
+			}
+			str[def.len] = '\0';
+			add_string(&st, def.id, str);
+		} else if (type == SHARELOG_SHARE) {
+			sharelog_share_t share;
+
+			share.type = type;
+			if (fread((char *)&share + 1, sizeof(share) - 1, 1, fp) != 1)
+				goto out_truncated;
+			print_share(&share, &st, csv);
+		} else {
+			LOGERR("Unknown record type %d in %s at offset %ld", type, fname,
+			       ftell(fp) - 1);
+			goto out;
+		}
+	}
+	ret = true;
+	goto out;
+
+out_truncated:
+	/* The last record may still be being written so this is not an error */
+	LOGWARNING("Truncated record at end of %s", fname);
+	ret = true;
+out:
+	clear_strings(&st);
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-c] [-H] [file.sharebin...]\n"
+		"\t-c\tOutput CSV instead of json\n"
+		"\t-H\tOmit the CSV header line\n"
+		"Reads standard input when no files are given\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	bool csv = false, header = true, ret = true;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "cHh")) != -1) {
+		switch(c) {
+			case 'c':
+				csv = true;
+				break;
+			case 'H':
+				header = false;
+				break;
+			case 'h':
+			default:
+				usage(argv[0]);
+				exit(c != 'h');
+		}
+	}
+	if (csv && header)
+		printf("%s\n", csv_header);
+	if (optind >= argc)
+		ret = read_sharelog(stdin, "stdin", csv);
+	for (i = optind; i < argc; i++) {
+		FILE *fp = fopen(argv[i], "re");
+
+		if (unlikely(!fp)) {
+			LOGERR("Failed to open %s", argv[i]);
+			ret = false;
+			continue;
+		}
+		if (!read_sharelog(fp, argv[i], csv))
+			ret = false;
+		fclose(fp);
+	}
+	exit(!ret);
+}
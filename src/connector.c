@@ -12,9 +12,17 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <string.h>
 #include <unistd.h>
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
 
 #include "ckpool.h"
 #include "libckpool.h"
@@ -29,6 +37,9 @@ typedef struct client_instance client_instance_t;
 typedef struct sender_send sender_send_t;
 typedef struct share share_t;
 typedef struct redirect redirect_t;
+#ifdef USE_IO_URING
+typedef struct sender_write sender_write_t;
+#endif
 
 struct client_instance {
 	/* For clients hashtable */
@@ -37,6 +48,8 @@ struct client_instance {
 
 	/* fd cannot be changed while a ref is held */
 	int fd;
+	/* The epoll set of the receiver this client was accepted by */
+	int epfd;
 
 	/* Reference count for when this instance is used outside of the
 	 * connector_data lock */
@@ -60,11 +73,28 @@ struct client_instance {
 	/* Which serverurl is this instance connected to */
 	int server;
 
+	/* Read buffer of bufsize bytes with bufofs bytes of unparsed data */
 	char *buf;
 	unsigned long bufofs;
-
-	/* Are we currently sending a blocked message from this client */
-	sender_send_t *sending;
+	unsigned long bufsize;
+
+	/* Sends queued to this client, only accessed by the sender thread */
+	sender_send_t *sends;
+	/* Bytes still to be written from sends */
+	int64_t backlog;
+	/* For the sender's list of clients with new sends to flush */
+	client_instance_t *flush_next;
+	client_instance_t *flush_prev;
+	bool flushing;
+	/* For the sender's list of clients blocked waiting on EPOLLOUT */
+	client_instance_t *blocked_next;
+	client_instance_t *blocked_prev;
+	/* Has the fd been added to the sender's epoll set */
+	bool sender_polled;
+#ifdef USE_IO_URING
+	/* The write in flight on the sender's ring, if any */
+	sender_write_t *write;
+#endif
 
 	/* Is this a trusted remote server */
 	bool remote;
@@ -72,6 +102,9 @@ struct client_instance {
 	/* Is this the parent passthrough client */
 	bool passthrough;
 
+	/* Has this client sent mining.subscribe */
+	bool subscribed;
+
 	/* Linked list of shares in redirector mode.*/
 	share_t *shares;
 
@@ -95,6 +128,13 @@ struct sender_send {
 	char *buf;
 	int len;
 	int ofs;
+
+	/* Set when buf belongs to a buffer shared with other sends */
+	ckbuf_t *ckbuf;
+
+	/* For share results, when the share was read and this was queued */
+	int64_t stamp;
+	int64_t queued;
 };
 
 struct share {
@@ -112,6 +152,53 @@ struct redirect {
 	int redirect_no;
 };
 
+/* Maximum sends to one client coalesced into one writev */
+#define SENDER_IOVS 64
+
+#ifdef USE_IO_URING
+/* A minimal io_uring, only ever used by the thread that created it */
+typedef struct uring {
+	int fd;
+
+	/* Submission queue, with sqpending being our tail of prepared sqes not
+	 * yet published to the kernel */
+	unsigned *sqhead;
+	unsigned *sqtail;
+	unsigned sqmask;
+	unsigned sqentries;
+	unsigned sqpending;
+	struct io_uring_sqe *sqes;
+
+	/* Completion queue */
+	unsigned *cqhead;
+	unsigned *cqtail;
+	unsigned cqmask;
+	struct io_uring_cqe *cqes;
+
+	void *rings;
+	size_t ringsize;
+	size_t sqesize;
+
+	/* Registered ring of receive buffers the kernel picks from */
+	struct io_uring_buf_ring *br;
+	uint16_t brtail;
+	char *bufs;
+	unsigned nbufs;
+	unsigned bufsize;
+} uring_t;
+
+/* The message of a sendmsg in flight on the sender's ring, which has to stay
+ * put till it completes */
+struct sender_write {
+	sender_write_t *next;
+
+	struct msghdr msg;
+	struct iovec iov[SENDER_IOVS];
+};
+#endif
+
+typedef struct receiver_instance receiver_t;
+
 /* Private data for the connector */
 struct connector_data {
 	ckpool_t *ckp;
@@ -124,12 +211,13 @@ struct connector_data {
 	int *serverfd;
 	/* All time count of clients connected */
 	int nfds;
-	/* The epoll fd */
-	int epfd;
+
+	/* Receiver threads, each with their own epoll set */
+	receiver_t *receivers;
+	int nreceivers;
 
 	bool accept;
 	pthread_t pth_sender;
-	pthread_t pth_receiver;
 
 	/* For the hashtable of all clients */
 	client_instance_t *clients;
@@ -143,12 +231,13 @@ struct connector_data {
 
 	int64_t client_ids;
 
-	/* client message process queue */
-	ckmsgq_t *cmpq;
-
 	/* client message event process queue */
 	ckmsgq_t *cevents;
 
+	/* Messages from the stratifier for clients, one queue per shard of
+	 * client ids keeping each client's messages in order */
+	ckmsgq_t *cmpq;
+
 	/* For the linked list of pending sends */
 	sender_send_t *sender_sends;
 
@@ -159,7 +248,19 @@ struct connector_data {
 
 	/* For protecting the pending sends list */
 	mutex_t sender_lock;
-	pthread_cond_t sender_cond;
+	/* Eventfd polled by the sender, signalled when sends are pending */
+	int sender_wakefd;
+	/* Largest per client backlog of bytes seen in the last stats pass */
+	int64_t sends_maxbacklog;
+	int64_t sends_maxbacklog_id;
+
+	/* Times a receiver stopped accepting to pace incoming connections */
+	int64_t accepts_paused;
+
+	/* Nanoseconds from a share result reaching the connector till it was
+	 * written, and from the share being read till its result was written */
+	ckhist_t send_latency;
+	ckhist_t share_latency;
 
 	/* Hash list of all redirected IP address in redirector mode */
 	redirect_t *redirects;
@@ -172,10 +273,234 @@ struct connector_data {
 
 	/* Have we given the warning about inability to raise sendbuf size */
 	bool wmem_warn;
+
+	/* Are receivers and the sender driving client I/O with io_uring */
+	bool uring;
+#ifdef USE_IO_URING
+	uring_t *sender_ring;
+	/* Unused sender_write structures for reuse */
+	sender_write_t *sender_writes;
+#endif
 };
 
 typedef struct connector_data cdata_t;
 
+/* Maximum events harvested per epoll_wait */
+#define RECEIVER_EVENTS 128
+
+struct receiver_instance {
+	cdata_t *cdata;
+	pthread_t pth;
+	int id;
+	int epfd;
+
+	/* Listening sockets polled by this receiver, one per serverurl. These
+	 * are its own SO_REUSEPORT sockets or the shared cdata serverfds */
+	int *serverfd;
+	bool own_serverfds;
+
+	/* Handle events in this thread instead of queueing them to cevents */
+	bool inline_events;
+	int64_t events;
+
+	/* Accept pacing with a token bucket refilled at this receiver's share
+	 * of acceptrate. Listening sockets are removed from the epoll set while
+	 * it is empty, leaving new connections waiting in the listen backlog. */
+	double accept_rate;
+	double accept_tokens;
+	int64_t accept_refilled;
+	int64_t accept_resume;
+	bool accepts_paused;
+#ifdef USE_IO_URING
+	uring_t *ring;
+	/* Which listening sockets have an accept armed on the ring */
+	bool *accept_armed;
+#endif
+};
+
+#ifdef USE_IO_URING
+/* Set up a ring with sqentries submission slots where the kernel is recent
+ * enough for everything the connector asks of it, which is implied by it
+ * accepting IORING_SETUP_SINGLE_ISSUER. Returns false with errno set
+ * otherwise. */
+static bool uring_init(uring_t *ring, const unsigned sqentries)
+{
+	struct io_uring_params params;
+	size_t sqsize, cqsize;
+	unsigned *sqarray, i;
+	char *base;
+
+	memset(ring, 0, sizeof(uring_t));
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN |
+		IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_CQSIZE;
+	params.cq_entries = sqentries * 4;
+	ring->fd = syscall(__NR_io_uring_setup, sqentries, &params);
+	if (ring->fd < 0)
+		return false;
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP) ||
+	    !(params.features & IORING_FEAT_EXT_ARG)) {
+		errno = EOPNOTSUPP;
+		goto out_close;
+	}
+	sqsize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cqsize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->ringsize = MAX(sqsize, cqsize);
+	ring->rings = mmap(NULL, ring->ringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			   ring->fd, IORING_OFF_SQ_RING);
+	if (ring->rings == MAP_FAILED)
+		goto out_close;
+	ring->sqesize = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqesize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		munmap(ring->rings, ring->ringsize);
+		goto out_close;
+	}
+
+	base = ring->rings;
+	ring->sqhead = (unsigned *)(base + params.sq_off.head);
+	ring->sqtail = (unsigned *)(base + params.sq_off.tail);
+	ring->sqmask = *(unsigned *)(base + params.sq_off.ring_mask);
+	ring->sqentries = params.sq_entries;
+	ring->sqpending = *ring->sqtail;
+	/* Slots map straight onto sqes so the array never changes */
+	sqarray = (unsigned *)(base + params.sq_off.array);
+	for (i = 0; i < params.sq_entries; i++)
+		sqarray[i] = i;
+	ring->cqhead = (unsigned *)(base + params.cq_off.head);
+	ring->cqtail = (unsigned *)(base + params.cq_off.tail);
+	ring->cqmask = *(unsigned *)(base + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+	return true;
+
+out_close:
+	i = errno;
+	Close(ring->fd);
+	errno = i;
+	return false;
+}
+
+static void uring_free(uring_t *ring)
+{
+	munmap(ring->sqes, ring->sqesize);
+	munmap(ring->rings, ring->ringsize);
+	Close(ring->fd);
+}
+
+/* Submit all prepared sqes, waiting up to timeout ms for a completion if
+ * wait is set. Returns the number submitted or -errno, with -ETIME if the
+ * wait timed out and -EBUSY if completions need reaping first. */
+static int uring_enter(uring_t *ring, const bool wait, const int timeout)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned flags = IORING_ENTER_EXT_ARG, submit;
+	int ret;
+
+	/* The kernel doesn't wait unless it submits exactly this many */
+	submit = ring->sqpending - *ring->sqtail;
+	__atomic_store_n(ring->sqtail, ring->sqpending, __ATOMIC_RELEASE);
+	memset(&arg, 0, sizeof(arg));
+	if (wait) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+		flags |= IORING_ENTER_GETEVENTS;
+	}
+	do {
+		ret = syscall(__NR_io_uring_enter, ring->fd, submit, wait ? 1 : 0, flags, &arg,
+			      sizeof(arg));
+		/* Nothing is submitted if we were interrupted */
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		ret = -errno;
+	return ret;
+}
+
+/* Get a zeroed sqe to prepare, submitting what's already prepared first if
+ * the submission queue is full. Returns NULL if no slot could be freed. */
+static struct io_uring_sqe *uring_sqe(uring_t *ring)
+{
+	struct io_uring_sqe *sqe;
+
+	if (unlikely(ring->sqpending - __atomic_load_n(ring->sqhead, __ATOMIC_ACQUIRE) >= ring->sqentries)) {
+		uring_enter(ring, false, 0);
+		if (ring->sqpending - __atomic_load_n(ring->sqhead, __ATOMIC_ACQUIRE) >= ring->sqentries)
+			return NULL;
+	}
+	sqe = &ring->sqes[ring->sqpending++ & ring->sqmask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	return sqe;
+}
+
+/* Pop the oldest completion off the ring into cqe, returning false if there
+ * are none */
+static bool uring_cqe(uring_t *ring, struct io_uring_cqe *cqe)
+{
+	unsigned head = *ring->cqhead;
+
+	if (head == __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE))
+		return false;
+	memcpy(cqe, &ring->cqes[head & ring->cqmask], sizeof(struct io_uring_cqe));
+	__atomic_store_n(ring->cqhead, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/* Hand receive buffer bid back to the kernel */
+static void uring_put_buf(uring_t *ring, const unsigned bid)
+{
+	struct io_uring_buf *buf = &ring->br->bufs[ring->brtail & (ring->nbufs - 1)];
+
+	buf->addr = (uint64_t)(uintptr_t)(ring->bufs + (size_t)bid * ring->bufsize);
+	buf->len = ring->bufsize;
+	buf->bid = bid;
+	__atomic_store_n(&ring->br->tail, ++ring->brtail, __ATOMIC_RELEASE);
+}
+
+/* Register nbufs receive buffers of bufsize bytes as buffer group bgid for
+ * the kernel to fill multishot receives from. nbufs must be a power of 2. */
+static bool uring_setup_bufs(uring_t *ring, const unsigned nbufs, const unsigned bufsize,
+			     const int bgid)
+{
+	struct io_uring_buf_reg reg;
+	unsigned i;
+
+	ring->br = mmap(NULL, nbufs * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->br == MAP_FAILED)
+		return false;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)ring->br;
+	reg.ring_entries = nbufs;
+	reg.bgid = bgid;
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		munmap(ring->br, nbufs * sizeof(struct io_uring_buf));
+		return false;
+	}
+	ring->bufs = ckalloc((size_t)nbufs * bufsize);
+	ring->nbufs = nbufs;
+	ring->bufsize = bufsize;
+	for (i = 0; i < nbufs; i++)
+		uring_put_buf(ring, i);
+	return true;
+}
+
+/* See if the kernel supports the io_uring backend, falling back to epoll if
+ * it doesn't */
+static bool uring_supported(void)
+{
+	uring_t ring;
+
+	if (!uring_init(&ring, 8)) {
+		LOGWARNING("Connector io_uring unavailable: %s, using epoll", strerror(errno));
+		return false;
+	}
+	uring_free(&ring);
+	return true;
+}
+#endif
+
 void connector_upstream_msg(ckpool_t *ckp, char *msg)
 {
 	cdata_t *cdata = ckp->cdata;
@@ -231,6 +556,7 @@ static client_instance_t *recruit_client(cdata_t *cdata)
 		LOGDEBUG("Connector recycled client instance");
 
 	client->buf = ckzalloc(PAGESIZE);
+	client->bufsize = PAGESIZE;
 
 	return client;
 }
@@ -264,43 +590,36 @@ int64_t connector_newclientid(ckpool_t *ckp)
 	return ret;
 }
 
-/* Accepts incoming connections on the server socket and generates client
- * instances */
-static int accept_client(cdata_t *cdata, const int epfd, const uint64_t server)
-{
-	int fd, port, no_clients, sockd;
-	ckpool_t *ckp = cdata->ckp;
-	client_instance_t *client;
-	struct epoll_event event;
-	socklen_t address_len;
-	socklen_t optlen;
+#ifdef USE_IO_URING
+/* Buffer group of a receiver's ring of receive buffers */
+#define RECEIVER_BGID 0
 
-	ck_rlock(&cdata->lock);
-	no_clients = HASH_COUNT(cdata->clients);
-	ck_runlock(&cdata->lock);
+/* Arm a multishot receive on a client into its receiver's ring of buffers */
+static bool uring_recv_client(uring_t *ring, const client_instance_t *client)
+{
+	struct io_uring_sqe *sqe = uring_sqe(ring);
 
-	if (unlikely(ckp->maxclients && no_clients >= ckp->maxclients)) {
-		LOGWARNING("Server full with %d clients", no_clients);
-		return 0;
-	}
+	if (unlikely(!sqe))
+		return false;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = client->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = RECEIVER_BGID;
+	sqe->user_data = client->id;
+	return true;
+}
+#endif
 
-	sockd = cdata->serverfd[server];
-	client = recruit_client(cdata);
-	client->server = server;
-	client->address = (struct sockaddr *)&client->address_storage;
-	address_len = sizeof(client->address_storage);
-	fd = accept(sockd, client->address, &address_len);
-	if (unlikely(fd < 0)) {
-		/* Handle these errors gracefully should we ever share this
-		 * socket */
-		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED) {
-			LOGERR("Recoverable error on accept in accept_client");
-			return 0;
-		}
-		LOGERR("Failed to accept on socket %d in acceptor", sockd);
-		recycle_client(cdata, client);
-		return -1;
-	}
+/* Add a newly accepted fd from the address in client->address to the clients
+ * and start receiving from it */
+static int add_client(receiver_t *receiver, client_instance_t *client, int fd,
+		      const int no_clients)
+{
+	cdata_t *cdata = receiver->cdata;
+	struct epoll_event event;
+	socklen_t optlen;
+	int port;
 
 	switch (client->address->sa_family) {
 		const struct sockaddr_in *inet4_in;
@@ -325,7 +644,9 @@ static int accept_client(cdata_t *cdata, const int epfd, const uint64_t server)
 	}
 
 	keep_sockalive(fd);
-	noblock_socket(fd);
+	/* Sockets driven by io_uring are left blocking for the kernel to poll */
+	if (!cdata->uring)
+		noblock_socket(fd);
 
 	LOGINFO("Connected new client %d on socket %d to %d active clients from %s:%d",
 		cdata->nfds, fd, no_clients, client->address_name, port);
@@ -341,14 +662,25 @@ static int accept_client(cdata_t *cdata, const int epfd, const uint64_t server)
 	 * removes it automatically from the epoll list. */
 	__inc_instance_ref(client);
 	client->fd = fd;
+	client->epfd = receiver->epfd;
 	optlen = sizeof(client->sendbufsize);
 	getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &client->sendbufsize, &optlen);
 	LOGDEBUG("Client sendbufsize detected as %d", client->sendbufsize);
 
+#ifdef USE_IO_URING
+	if (cdata->uring) {
+		if (unlikely(!uring_recv_client(receiver->ring, client))) {
+			LOGERR("Failed to queue receive in add_client");
+			dec_instance_ref(cdata, client);
+			return 0;
+		}
+		return 1;
+	}
+#endif
 	event.data.u64 = client->id;
 	event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
-	if (unlikely(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) < 0)) {
-		LOGERR("Failed to epoll_ctl add in accept_client");
+	if (unlikely(epoll_ctl(receiver->epfd, EPOLL_CTL_ADD, fd, &event) < 0)) {
+		LOGERR("Failed to epoll_ctl add in add_client");
 		dec_instance_ref(cdata, client);
 		return 0;
 	}
@@ -356,6 +688,83 @@ static int accept_client(cdata_t *cdata, const int epfd, const uint64_t server)
 	return 1;
 }
 
+/* Accepts incoming connections on the server socket and generates client
+ * instances */
+static int accept_client(receiver_t *receiver, const uint64_t server)
+{
+	cdata_t *cdata = receiver->cdata;
+	ckpool_t *ckp = cdata->ckp;
+	client_instance_t *client;
+	socklen_t address_len;
+	int fd, no_clients, sockd;
+
+	ck_rlock(&cdata->lock);
+	no_clients = HASH_COUNT(cdata->clients);
+	ck_runlock(&cdata->lock);
+
+	if (unlikely(ckp->maxclients && no_clients >= ckp->maxclients)) {
+		LOGWARNING("Server full with %d clients", no_clients);
+		return 0;
+	}
+
+	sockd = receiver->serverfd[server];
+	client = recruit_client(cdata);
+	client->server = server;
+	client->address = (struct sockaddr *)&client->address_storage;
+	address_len = sizeof(client->address_storage);
+	fd = accept(sockd, client->address, &address_len);
+	if (unlikely(fd < 0)) {
+		/* Handle these errors gracefully should we ever share this
+		 * socket */
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED) {
+			/* Expected when receivers share a listening socket */
+			if (cdata->nreceivers < 2 || errno == ECONNABORTED)
+				LOGERR("Recoverable error on accept in accept_client");
+			recycle_client(cdata, client);
+			return 0;
+		}
+		LOGERR("Failed to accept on socket %d in acceptor", sockd);
+		recycle_client(cdata, client);
+		return -1;
+	}
+	return add_client(receiver, client, fd, no_clients);
+}
+
+#ifdef USE_IO_URING
+/* Add a client accepted by a multishot accept on the receiver's ring. The
+ * connection is already established so a full server closes it. */
+static int uring_accept_client(receiver_t *receiver, const uint64_t server, int fd)
+{
+	cdata_t *cdata = receiver->cdata;
+	ckpool_t *ckp = cdata->ckp;
+	client_instance_t *client;
+	socklen_t address_len;
+	int no_clients;
+
+	ck_rlock(&cdata->lock);
+	no_clients = HASH_COUNT(cdata->clients);
+	ck_runlock(&cdata->lock);
+
+	if (unlikely(ckp->maxclients && no_clients >= ckp->maxclients)) {
+		LOGWARNING("Server full with %d clients", no_clients);
+		Close(fd);
+		return 0;
+	}
+
+	client = recruit_client(cdata);
+	client->server = server;
+	client->address = (struct sockaddr *)&client->address_storage;
+	address_len = sizeof(client->address_storage);
+	if (unlikely(getpeername(fd, client->address, &address_len) < 0)) {
+		LOGINFO("Failed to getpeername of accepted socket %d", fd);
+		Close(fd);
+		recycle_client(cdata, client);
+		return 0;
+	}
+	return add_client(receiver, client, fd, no_clients);
+}
+#endif
+
 static int __drop_client(cdata_t *cdata, client_instance_t *client)
 {
 	int ret = -1;
@@ -364,6 +773,10 @@ static int __drop_client(cdata_t *cdata, client_instance_t *client)
 		goto out;
 	client->invalid = true;
 	ret = client->fd;
+	/* Receives and writes in flight on an io_uring hold their own
+	 * reference to the socket, so shut it down to complete them */
+	if (cdata->uring)
+		shutdown(client->fd, SHUT_RDWR);
 	/* Closing the fd will automatically remove it from the epoll list */
 	Close(client->fd);
 	HASH_DEL(cdata->clients, client);
@@ -474,7 +887,15 @@ static void drop_all_clients(cdata_t *cdata)
 	ck_wunlock(&cdata->lock);
 }
 
-static void send_client(ckpool_t *ckp, cdata_t *cdata, int64_t id, char *buf);
+static void send_client_stamp(ckpool_t *ckp, cdata_t *cdata, const int64_t id, char *buf,
+			      const int64_t stamp);
+
+/* Send a client by id a heap allocated buffer, allowing this function to
+ * free the ram. */
+static void send_client(ckpool_t *ckp, cdata_t *cdata, const int64_t id, char *buf)
+{
+	send_client_stamp(ckp, cdata, id, buf, 0);
+}
 
 /* Look for shares being submitted via a redirector and add them to a linked
  * list for looking up the responses. */
@@ -510,52 +931,247 @@ static void parse_redirector_share(cdata_t *cdata, client_instance_t *client, co
 	ck_wunlock(&cdata->lock);
 }
 
-/* Client is holding a reference count from being on the epoll list. Returns
- * true if we will still be receiving messages from this client. */
-static bool parse_client_msg(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client)
+/* The fields of a mining.submit message found in place in a read buffer */
+typedef struct submit_scan {
+	const char *param[SUBMIT_PARAMS];
+	int paramlen[SUBMIT_PARAMS];
+	int params;
+	const char *id;
+	int idlen;
+	char idtype; /* 's'tring, 'i'nteger or 'n'ull */
+	bool submit;
+} submit_scan_t;
+
+static const char *scan_ws(const char *p, const char *end)
 {
-	int buflen, ret;
-	json_t *val;
-	char *eol;
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+		p++;
+	return p;
+}
 
-retry:
+/* Scan a json string without escapes at p, returning the position after the
+ * closing quote or NULL if there's anything we'd need jansson for. */
+static const char *scan_string(const char *p, const char *end, const char **str, int *len)
+{
+	const char *start;
+
+	if (p >= end || *p != '"')
+		return NULL;
+	start = ++p;
+	while (p < end && *p != '"') {
+		/* Leave escapes, control chars and utf8 to jansson */
+		if (unlikely(*p == '\\' || *p < 0x20 || *p > 0x7e))
+			return NULL;
+		p++;
+	}
+	if (p >= end)
+		return NULL;
+	*str = start;
+	*len = p - start;
+	return p + 1;
+}
+
+/* Recognise the overwhelmingly common plain mining.submit message in the
+ * msglen bytes at msg and find its fields without building a json tree. Any
+ * message with other keys, escapes or unexpected types returns false to be
+ * parsed by jansson instead. */
+static bool scan_submit(const char *msg, const int msglen, submit_scan_t *scan)
+{
+	const char *p = msg, *end = msg + msglen, *key;
+	bool have_id = false, have_params = false;
+	int keylen;
+
+	memset(scan, 0, sizeof(submit_scan_t));
+	p = scan_ws(p, end);
+	if (p >= end || *p++ != '{')
+		return false;
+	while (42) {
+		p = scan_ws(p, end);
+		if (!(p = scan_string(p, end, &key, &keylen)))
+			return false;
+		p = scan_ws(p, end);
+		if (p >= end || *p++ != ':')
+			return false;
+		p = scan_ws(p, end);
+		if (keylen == 6 && !memcmp(key, "method", 6)) {
+			const char *method;
+			int len;
+
+			if (!(p = scan_string(p, end, &method, &len)))
+				return false;
+			if (len != 13 || memcmp(method, "mining.submit", 13))
+				return false;
+			scan->submit = true;
+		} else if (keylen == 6 && !memcmp(key, "params", 6)) {
+			if (p >= end || *p++ != '[')
+				return false;
+			p = scan_ws(p, end);
+			if (p < end && *p == ']')
+				p++;
+			else {
+				while (42) {
+					if (scan->params >= SUBMIT_PARAMS)
+						return false;
+					if (!(p = scan_string(p, end, &scan->param[scan->params],
+							      &scan->paramlen[scan->params])))
+						return false;
+					scan->params++;
+					p = scan_ws(p, end);
+					if (p >= end)
+						return false;
+					if (*p == ']') {
+						p++;
+						break;
+					}
+					if (*p++ != ',')
+						return false;
+					p = scan_ws(p, end);
+				}
+			}
+			have_params = true;
+		} else if (keylen == 2 && !memcmp(key, "id", 2)) {
+			if (p < end && *p == '"') {
+				if (!(p = scan_string(p, end, &scan->id, &scan->idlen)))
+					return false;
+				scan->idtype = 's';
+			} else if (end - p >= 4 && !memcmp(p, "null", 4)) {
+				scan->idtype = 'n';
+				p += 4;
+			} else {
+				scan->id = p;
+				if (p < end && *p == '-')
+					p++;
+				while (p < end && *p >= '0' && *p <= '9')
+					p++;
+				scan->idlen = p - scan->id;
+				/* Bounded to fit an int64 */
+				if (!scan->idlen || scan->idlen > 18 || (scan->idlen == 1 && *scan->id == '-'))
+					return false;
+				scan->idtype = 'i';
+			}
+			have_id = true;
+		} else
+			return false;
+		p = scan_ws(p, end);
+		if (p >= end)
+			return false;
+		if (*p == '}')
+			break;
+		if (*p++ != ',')
+			return false;
+	}
+	return scan->submit && have_id && have_params;
+}
+
+/* Create the typed submit handed to the stratifier from a scanned one */
+static stratum_submit_t *scan_stratum_submit(const client_instance_t *client,
+					     const submit_scan_t *scan)
+{
+	const char *id = "null";
+	char idbuf[24];
+	int idlen = 4;
+
+	/* Keep the raw json of string ids with their quotes, and normalise
+	 * integer ids as jansson would */
+	if (scan->idtype == 's') {
+		id = scan->id - 1;
+		idlen = scan->idlen + 2;
+	} else if (scan->idtype == 'i') {
+		idlen = sprintf(idbuf, "%lld", strtoll(scan->id, NULL, 10));
+		id = idbuf;
+	}
+	return create_submit(client->id, client->address_name, client->server, id, idlen,
+			     scan->param, scan->paramlen, scan->params);
+}
+
+/* Until a client subscribes, its messages from each read are gathered and
+ * queued together, ahead of everything waiting if they include a subscribe
+ * with a session id. Clients resuming a session are thus served first in a
+ * reconnect storm, without reordering any configure sent before subscribe. */
+static void gather_greeting(client_instance_t *client, ckmsg_t **greeting, bool *resume,
+			    json_t *val)
+{
+	ckmsg_t *msg = ckalloc(sizeof(ckmsg_t));
+
+	msg->data = val;
+	DL_APPEND(*greeting, msg);
+	if (safecmp(json_string_value(json_object_get(val, "method")), "mining.subscribe"))
+		return;
+	client->subscribed = true;
+	*resume = json_is_string(json_array_get(json_object_get(val, "params"), 1));
+}
+
+/* Make room for len more bytes in a client's read buffer, returning false if
+ * the client has filled it without an EOL. */
+static bool client_buf_room(client_instance_t *client, const unsigned long len)
+{
 	if (unlikely(client->bufofs > MAX_MSGSIZE)) {
 		if (!client->remote) {
 			LOGNOTICE("Client id %"PRId64" fd %d overloaded buffer without EOL, disconnecting",
 				client->id, client->fd);
 			return false;
 		}
-		client->buf = realloc(client->buf, round_up_page(client->bufofs + MAX_MSGSIZE + 1));
 	}
-	/* This read call is non-blocking since the socket is set to O_NOBLOCK */
-	ret = read(client->fd, client->buf + client->bufofs, MAX_MSGSIZE);
-	if (ret < 1) {
-		if (likely(errno == EAGAIN || errno == EWOULDBLOCK || !ret))
-			return true;
-		LOGINFO("Client id %"PRId64" fd %d disconnected - recv fail with bufofs %lu ret %d errno %d %s",
-			client->id, client->fd, client->bufofs, ret, errno, ret && errno ? strerror(errno) : "");
-		return false;
-	}
-	client->bufofs += ret;
-reparse:
-	eol = memchr(client->buf, '\n', client->bufofs);
-	if (!eol)
-		goto retry;
-
-	/* Do something useful with this message now */
-	buflen = eol - client->buf + 1;
-	if (unlikely(buflen > MAX_MSGSIZE && !client->remote)) {
-		LOGNOTICE("Client id %"PRId64" fd %d message oversize, disconnecting", client->id, client->fd);
-		return false;
+	if (unlikely(client->bufsize - client->bufofs < len + 1)) {
+		client->bufsize = round_up_page(client->bufofs + len + 1);
+		client->buf = realloc(client->buf, client->bufsize);
 	}
+	return true;
+}
 
-	if (!(val = json_loads(client->buf, JSON_DISABLE_EOF_CHECK, NULL))) {
-		char *buf = strdup("Invalid JSON, disconnecting\n");
+/* Parse every complete message in a client's read buffer by offset, only
+ * moving what's left of the buffer down once they're all done. Returns false
+ * if the client is to be dropped. */
+static bool parse_client_buf(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client,
+			     const int64_t stamp)
+{
+	ckmsg_t *greeting = NULL;
+	bool resume = false;
+	unsigned long start;
+	json_t *val;
+	int buflen;
+	char *eol;
+
+	for (start = 0; (eol = memchr(client->buf + start, '\n', client->bufofs - start)); start += buflen) {
+		char *msg = client->buf + start;
+		submit_scan_t scan;
+		bool submit;
+
+		/* Do something useful with this message now */
+		buflen = eol - msg + 1;
+		if (unlikely(buflen > MAX_MSGSIZE && !client->remote)) {
+			LOGNOTICE("Client id %"PRId64" fd %d message oversize, disconnecting", client->id, client->fd);
+			stratifier_add_recvs(ckp, greeting, resume);
+			return false;
+		}
+
+		if (!client->passthrough && (submit = scan_submit(msg, buflen, &scan))) {
+			stratum_submit_t *ssubmit = scan_stratum_submit(client, &scan);
+
+			ssubmit->stamp = stamp;
+
+			/* Plain shares go to the stratifier without any json
+			 * unless another mode needs to inspect them */
+			if (likely(!ckp->passthrough && !ckp->node && !ckp->redirector &&
+				   !greeting)) {
+				if (likely(!client->invalid))
+					stratifier_add_submit(ckp, ssubmit);
+				else
+					free(ssubmit);
+				continue;
+			}
+			val = submit_json(ssubmit);
+			free(ssubmit);
+		} else if (!(val = json_loadb(msg, buflen, JSON_DISABLE_EOF_CHECK, NULL))) {
+			char *buf = strdup("Invalid JSON, disconnecting\n");
+
+			LOGINFO("Client id %"PRId64" sent invalid json message %.*s", client->id, buflen, msg);
+			send_client(ckp, cdata, client->id, buf);
+			stratifier_add_recvs(ckp, greeting, resume);
+			return false;
+		} else
+			submit = !!memmem(msg, buflen, "mining.submit", 13);
 
-		LOGINFO("Client id %"PRId64" sent invalid json message %s", client->id, client->buf);
-		send_client(ckp, cdata, client->id, buf);
-		return false;
-	} else {
 		if (client->passthrough) {
 			int64_t passthrough_id;
 
@@ -563,7 +1179,7 @@ reparse:
 			passthrough_id = (client->id << 32) | passthrough_id;
 			json_object_set_new_nocheck(val, "client_id", json_integer(passthrough_id));
 		} else {
-			if (ckp->redirector && !client->redirected && strstr(client->buf, "mining.submit"))
+			if (ckp->redirector && !client->redirected && submit)
 				parse_redirector_share(cdata, client, val);
 			json_object_set_new_nocheck(val, "client_id", json_integer(client->id));
 			json_object_set_new_nocheck(val, "address", json_string(client->address_name));
@@ -574,7 +1190,12 @@ reparse:
 		 * do this unlocked as the occasional false negative can be
 		 * filtered by the stratifier. */
 		if (likely(!client->invalid)) {
-			if (!ckp->passthrough)
+			/* Anything following a subscribe in the same read
+			 * stays behind it on the greeting list */
+			if (!ckp->passthrough && (!client->subscribed || greeting) &&
+			    !client->passthrough)
+				gather_greeting(client, &greeting, &resume, val);
+			else if (!ckp->passthrough)
 				stratifier_add_recv(ckp, val);
 			if (ckp->node)
 				stratifier_add_recv(ckp, json_deep_copy(val));
@@ -583,18 +1204,45 @@ reparse:
 		} else
 			json_decref(val);
 	}
-	client->bufofs -= buflen;
-	if (client->bufofs)
-		memmove(client->buf, client->buf + buflen, client->bufofs);
+	stratifier_add_recvs(ckp, greeting, resume);
+	if (start) {
+		client->bufofs -= start;
+		if (client->bufofs)
+			memmove(client->buf, client->buf + start, client->bufofs);
+	}
 	client->buf[client->bufofs] = '\0';
-
-	if (client->bufofs)
-		goto reparse;
-	goto retry;
+	return true;
 }
 
-static client_instance_t *ref_client_by_id(cdata_t *cdata, int64_t id)
-{
+/* Client is holding a reference count from being on the epoll list. Returns
+ * true if we will still be receiving messages from this client. */
+static bool parse_client_msg(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client)
+{
+	int ret;
+
+retry:
+	/* Always leave room for at least one maximum sized message */
+	if (unlikely(!client_buf_room(client, MAX_MSGSIZE)))
+		return false;
+	/* This read call is non-blocking since the socket is set to O_NOBLOCK.
+	 * Fill as much of the buffer as we can to pick up pipelined messages
+	 * in one call. */
+	ret = read(client->fd, client->buf + client->bufofs, client->bufsize - client->bufofs - 1);
+	if (ret < 1) {
+		if (likely(errno == EAGAIN || errno == EWOULDBLOCK || !ret))
+			return true;
+		LOGINFO("Client id %"PRId64" fd %d disconnected - recv fail with bufofs %lu ret %d errno %d %s",
+			client->id, client->fd, client->bufofs, ret, errno, ret && errno ? strerror(errno) : "");
+		return false;
+	}
+	client->bufofs += ret;
+	if (unlikely(!parse_client_buf(ckp, cdata, client, time_nanos())))
+		return false;
+	goto retry;
+}
+
+static client_instance_t *ref_client_by_id(cdata_t *cdata, int64_t id)
+{
 	client_instance_t *client;
 
 	ck_wlock(&cdata->lock);
@@ -607,250 +1255,937 @@ static client_instance_t *ref_client_by_id(cdata_t *cdata, int64_t id)
 	}
 	ck_wunlock(&cdata->lock);
 
-	return client;
+	return client;
+}
+
+static void redirect_client(ckpool_t *ckp, client_instance_t *client);
+
+static bool redirect_matches(cdata_t *cdata, client_instance_t *client)
+{
+	redirect_t *redirect;
+
+	ck_rlock(&cdata->lock);
+	HASH_FIND_STR(cdata->redirects, client->address_name, redirect);
+	ck_runlock(&cdata->lock);
+
+	return redirect;
+}
+
+static void process_client_event(ckpool_t *ckp, struct epoll_event *event)
+{
+	const uint32_t events = event->events;
+	const uint64_t id = event->data.u64;
+	cdata_t *cdata = ckp->cdata;
+	client_instance_t *client;
+
+	client = ref_client_by_id(cdata, id);
+	if (unlikely(!client)) {
+		LOGNOTICE("Failed to find client by id %"PRId64" in receiver!", id);
+		goto outnoclient;
+	}
+	/* We can have both messages and read hang ups so process the
+	 * message first. */
+	if (likely(events & EPOLLIN)) {
+		/* Rearm the client for epoll events if we have successfully
+		 * parsed a message from it */
+		if (unlikely(!parse_client_msg(ckp, cdata, client))) {
+			invalidate_client(ckp, cdata, client);
+			goto out;
+		}
+	}
+	if (unlikely(events & EPOLLERR)) {
+		socklen_t errlen = sizeof(int);
+		int error = 0;
+
+		/* See what type of error this is and raise the log
+			* level of the message if it's unexpected. */
+		getsockopt(client->fd, SOL_SOCKET, SO_ERROR, (void *)&error, &errlen);
+		if (error != 104) {
+			LOGNOTICE("Client id %"PRId64" fd %d epollerr HUP in epoll with errno %d: %s",
+					client->id, client->fd, error, strerror(error));
+		} else {
+			LOGINFO("Client id %"PRId64" fd %d epollerr HUP in epoll with errno %d: %s",
+				client->id, client->fd, error, strerror(error));
+		}
+		invalidate_client(cdata->pi->ckp, cdata, client);
+	} else if (unlikely(events & EPOLLHUP)) {
+		/* Client connection reset by peer */
+		LOGINFO("Client id %"PRId64" fd %d HUP in epoll", client->id, client->fd);
+		invalidate_client(cdata->pi->ckp, cdata, client);
+	} else if (unlikely(events & EPOLLRDHUP)) {
+		/* Client disconnected by peer */
+		LOGINFO("Client id %"PRId64" fd %d RDHUP in epoll", client->id, client->fd);
+		invalidate_client(cdata->pi->ckp, cdata, client);
+	}
+out:
+	if (likely(!client->invalid)) {
+		/* Rearm the fd in the epoll list if it's still active */
+		event->data.u64 = id;
+		event->events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+		epoll_ctl(client->epfd, EPOLL_CTL_MOD, client->fd, event);
+	}
+	dec_instance_ref(cdata, client);
+outnoclient:
+	return;
+}
+
+/* Process an event queued to cevents by the receiver, freeing it */
+static void client_event_processor(ckpool_t *ckp, struct epoll_event *event)
+{
+	process_client_event(ckp, event);
+	free(event);
+}
+
+/* Add or remove all of a receiver's listening sockets in its epoll set */
+static bool watch_servers(receiver_t *receiver, const bool add)
+{
+	cdata_t *cdata = receiver->cdata;
+	uint64_t i;
+
+	for (i = 0; i < (uint64_t)cdata->ckp->serverurls; i++) {
+		struct epoll_event event;
+
+		/* The small values will be less than the first client ids */
+		event.data.u64 = i;
+		/* Only wake one receiver for a listening socket shared by
+		 * several of them */
+		if (cdata->nreceivers > 1 && !receiver->own_serverfds)
+			event.events = EPOLLIN | EPOLLEXCLUSIVE;
+		else
+			event.events = EPOLLIN | EPOLLRDHUP;
+		if (unlikely(epoll_ctl(receiver->epfd, add ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+				       receiver->serverfd[i], &event) < 0)) {
+			LOGEMERG("FATAL: Failed to %s server fd in epoll_ctl", add ? "add" : "remove");
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Take a token to accept one connection with acceptrate set, setting when the
+ * next token is due if there are none left. */
+static bool accept_token(receiver_t *receiver)
+{
+	int64_t now;
+
+	if (!receiver->accept_rate)
+		return true;
+	now = time_nanos();
+	receiver->accept_tokens += (double)(now - receiver->accept_refilled) *
+		receiver->accept_rate / 1000000000;
+	receiver->accept_refilled = now;
+	/* Allow bursts of up to a second's worth */
+	if (receiver->accept_tokens > receiver->accept_rate)
+		receiver->accept_tokens = receiver->accept_rate;
+	if (receiver->accept_tokens >= 1) {
+		receiver->accept_tokens -= 1;
+		return true;
+	}
+	receiver->accept_resume = now + (1 - receiver->accept_tokens) * 1000000000 /
+		receiver->accept_rate;
+	return false;
+}
+
+#ifdef USE_IO_URING
+/* Submission slots and receive buffers of each receiver's ring. Buffers are
+ * handed straight back once their data is copied so few are in use at once */
+#define RECEIVER_RING 1024
+#define RECEIVER_BUFS 1024
+#define RECEIVER_BUFSIZE 2048
+
+/* Arm an accept on one of a receiver's listening sockets. A multishot accept
+ * takes everything in the backlog at once so paced receivers accept one
+ * connection at a time instead, each paid for with a token up front. */
+static bool uring_watch_server(receiver_t *receiver, const uint64_t server)
+{
+	struct io_uring_sqe *sqe = uring_sqe(receiver->ring);
+
+	if (unlikely(!sqe)) {
+		LOGEMERG("FATAL: Failed to get sqe to add server fd");
+		return false;
+	}
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = receiver->serverfd[server];
+	if (!receiver->accept_rate)
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = server;
+	receiver->accept_armed[server] = true;
+	return true;
+}
+
+/* Arm accepts on all of a receiver's listening sockets without one, pausing
+ * with the rest left in the listen backlog once out of tokens */
+static bool uring_watch_servers(receiver_t *receiver)
+{
+	uint64_t i;
+
+	for (i = 0; i < (uint64_t)receiver->cdata->ckp->serverurls; i++) {
+		if (receiver->accept_armed[i])
+			continue;
+		if (unlikely(!accept_token(receiver))) {
+			if (!receiver->accepts_paused) {
+				receiver->accepts_paused = true;
+				__atomic_add_fetch(&receiver->cdata->accepts_paused, 1, __ATOMIC_RELAXED);
+			}
+			return true;
+		}
+		if (unlikely(!uring_watch_server(receiver, i)))
+			return false;
+	}
+	receiver->accepts_paused = false;
+	return true;
+}
+
+/* Handle an accept completing on a receiver's ring, rearming it when it's
+ * done. Returns false on a fatal error. */
+static bool uring_accepted(receiver_t *receiver, const struct io_uring_cqe *cqe)
+{
+	const uint64_t server = cqe->user_data;
+	const int res = cqe->res;
+
+	if (likely(res >= 0)) {
+		if (unlikely(uring_accept_client(receiver, server, res) < 0))
+			return false;
+	} else if (res != -EAGAIN && res != -ECONNABORTED && res != -EINTR) {
+		LOGEMERG("FATAL: Failed to accept on socket %d in receiver: %s",
+			 receiver->serverfd[server], strerror(-res));
+		return false;
+	} else
+		LOGERR("Recoverable error on accept in receiver: %s", strerror(-res));
+	if (cqe->flags & IORING_CQE_F_MORE)
+		return true;
+	receiver->accept_armed[server] = false;
+	return uring_watch_servers(receiver);
+}
+
+/* Handle a multishot receive completing on a receiver's ring, copying the data
+ * out of the ring's buffer into the client's to be parsed. */
+static void uring_client_recv(ckpool_t *ckp, receiver_t *receiver, const struct io_uring_cqe *cqe)
+{
+	cdata_t *cdata = receiver->cdata;
+	uring_t *ring = receiver->ring;
+	client_instance_t *client;
+	const int res = cqe->res;
+	int bid = -1;
+
+	if (cqe->flags & IORING_CQE_F_BUFFER)
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	/* Dropped clients' receives complete once they're shut down */
+	client = ref_client_by_id(cdata, cqe->user_data);
+	if (unlikely(!client))
+		goto out_buf;
+	if (likely(res > 0)) {
+		if (unlikely(!client_buf_room(client, res))) {
+			invalidate_client(ckp, cdata, client);
+			goto out;
+		}
+		memcpy(client->buf + client->bufofs, ring->bufs + (size_t)bid * ring->bufsize, res);
+		client->bufofs += res;
+		uring_put_buf(ring, bid);
+		bid = -1;
+		if (unlikely(!parse_client_buf(ckp, cdata, client, time_nanos()))) {
+			invalidate_client(ckp, cdata, client);
+			goto out;
+		}
+	} else if (res != -ENOBUFS) {
+		/* Out of buffers just needs rearming, anything else is the
+		 * client disconnecting */
+		LOGINFO("Client id %"PRId64" fd %d disconnected - recv fail with bufofs %lu ret %d %s",
+			client->id, client->fd, client->bufofs, res, res ? strerror(-res) : "");
+		invalidate_client(ckp, cdata, client);
+		goto out;
+	}
+	if (!(cqe->flags & IORING_CQE_F_MORE) && likely(!client->invalid)) {
+		if (unlikely(!uring_recv_client(ring, client))) {
+			LOGWARNING("Failed to rearm receive for client id %"PRId64" fd %d",
+				   client->id, client->fd);
+			invalidate_client(ckp, cdata, client);
+		}
+	}
+out:
+	dec_instance_ref(cdata, client);
+out_buf:
+	if (bid > -1)
+		uring_put_buf(ring, bid);
+}
+
+/* Receiver loop driving its listening sockets and clients from an io_uring
+ * with multishot accepts and receives, handling every event in this thread
+ * to keep each client's data in order. */
+static void uring_receiver(receiver_t *receiver)
+{
+	cdata_t *cdata = receiver->cdata;
+	ckpool_t *ckp = cdata->ckp;
+	uint64_t serverfds;
+	uring_t *ring;
+
+	ring = receiver->ring = ckalloc(sizeof(uring_t));
+	if (unlikely(!uring_init(ring, RECEIVER_RING) ||
+		     !uring_setup_bufs(ring, RECEIVER_BUFS, RECEIVER_BUFSIZE, RECEIVER_BGID)))
+		quit(1, "FATAL: Failed to set up io_uring in receiver: %s", strerror(errno));
+	serverfds = ckp->serverurls;
+	receiver->accept_armed = ckzalloc(sizeof(bool) * serverfds);
+	if (unlikely(!uring_watch_servers(receiver)))
+		return;
+
+	/* Wait for the stratifier to be ready for us */
+	while (!ckp->stratifier_ready)
+		cksleep_ms(10);
+
+	while (42) {
+		struct io_uring_cqe cqe;
+		int ret, timeout = 1000;
+
+		while (unlikely(!cdata->accept))
+			cksleep_ms(10);
+		if (unlikely(receiver->accepts_paused)) {
+			int64_t wait = receiver->accept_resume - time_nanos();
+
+			if (wait <= 0) {
+				if (unlikely(!uring_watch_servers(receiver)))
+					return;
+				wait = receiver->accept_resume - time_nanos();
+			}
+			/* Still waiting on tokens for some listening sockets */
+			if (receiver->accepts_paused && wait > 0)
+				timeout = wait / 1000000 + 1;
+		}
+		ret = uring_enter(ring, true, timeout);
+		if (unlikely(ret < 0 && ret != -ETIME && ret != -EBUSY)) {
+			LOGEMERG("FATAL: Failed to wait on io_uring in receiver: %s", strerror(-ret));
+			return;
+		}
+		while (uring_cqe(ring, &cqe)) {
+			const uint64_t id = cqe.user_data;
+
+			receiver->events++;
+			if (id < serverfds) {
+				if (unlikely(!uring_accepted(receiver, &cqe)))
+					return;
+				continue;
+			}
+			uring_client_recv(ckp, receiver, &cqe);
+		}
+	}
+}
+#endif
+
+/* Waits on fds ready to read on from the list stored in conn_instance and
+ * handles the incoming messages */
+static void *receiver(void *arg)
+{
+	receiver_t *receiver = (receiver_t *)arg;
+	struct epoll_event events[RECEIVER_EVENTS];
+	cdata_t *cdata = receiver->cdata;
+	ckpool_t *ckp = cdata->ckp;
+	uint64_t serverfds;
+	char name[16];
+	int ret, epfd;
+
+	if (cdata->nreceivers > 1)
+		snprintf(name, 15, "creceiver%d", receiver->id);
+	else
+		strcpy(name, "creceiver");
+	rename_proc(name);
+
+#ifdef USE_IO_URING
+	if (cdata->uring) {
+		uring_receiver(receiver);
+		goto out;
+	}
+#endif
+	epfd = receiver->epfd;
+	serverfds = ckp->serverurls;
+	if (unlikely(!watch_servers(receiver, true)))
+		goto out;
+
+	/* Wait for the stratifier to be ready for us */
+	while (!ckp->stratifier_ready)
+		cksleep_ms(10);
+
+	while (42) {
+		int nevents, j, timeout = 1000;
+
+		while (unlikely(!cdata->accept))
+			cksleep_ms(10);
+		if (unlikely(receiver->accepts_paused)) {
+			int64_t wait = receiver->accept_resume - time_nanos();
+
+			if (wait > 0)
+				timeout = wait / 1000000 + 1;
+			else if (likely(watch_servers(receiver, true)))
+				receiver->accepts_paused = false;
+			else
+				goto out;
+		}
+		nevents = epoll_wait(epfd, events, RECEIVER_EVENTS, timeout);
+		if (unlikely(nevents < 1)) {
+			if (unlikely(nevents == -1)) {
+				if (errno == EINTR)
+					continue;
+				LOGEMERG("FATAL: Failed to epoll_wait in receiver");
+				break;
+			}
+			/* Nothing to service, still very unlikely */
+			continue;
+		}
+		receiver->events += nevents;
+		for (j = 0; j < nevents; j++) {
+			struct epoll_event *event = &events[j];
+			uint64_t edu64 = event->data.u64;
+
+			if (edu64 < serverfds) {
+				if (receiver->accepts_paused)
+					continue;
+				if (unlikely(!accept_token(receiver))) {
+					if (unlikely(!watch_servers(receiver, false)))
+						goto out;
+					receiver->accepts_paused = true;
+					__atomic_add_fetch(&cdata->accepts_paused, 1, __ATOMIC_RELAXED);
+					continue;
+				}
+				ret = accept_client(receiver, edu64);
+				if (unlikely(ret < 0)) {
+					LOGEMERG("FATAL: Failed to accept_client in receiver");
+					goto out;
+				}
+				continue;
+			}
+			if (receiver->inline_events) {
+				process_client_event(ckp, event);
+				continue;
+			}
+			/* Event structure is handed off to client_event_processor
+			 * here to be freed so we need a copy of it */
+			event = ckalloc(sizeof(struct epoll_event));
+			memcpy(event, &events[j], sizeof(struct epoll_event));
+			ckmsgq_add(ckmsgq_by_id(cdata->cevents, edu64), event);
+		}
+	}
+out:
+	/* We shouldn't get here unless there's an error */
+	return NULL;
+}
+
+/* Create the SO_REUSEPORT listening sockets for an extra receiver, bound to
+ * the same addresses as the main server sockets. Returns false if the
+ * receiver has to share the main sockets instead. */
+static bool receiver_serverfds(cdata_t *cdata, receiver_t *receiver)
+{
+	ckpool_t *ckp = cdata->ckp;
+	int i;
+
+	receiver->serverfd = ckalloc(sizeof(int) * ckp->serverurls);
+	for (i = 0; i < ckp->serverurls; i++) {
+		char url[INET6_ADDRSTRLEN], port[8];
+		int sockd = -1;
+
+		if (url_from_socket(cdata->serverfd[i], url, port))
+			sockd = bind_socket(url, port, true);
+		if (sockd < 0 || listen(sockd, 8192) < 0) {
+			LOGWARNING("Failed to create reuseport socket for receiver %d on %s, sharing listening sockets",
+				   receiver->id, ckp->serverurl[i]);
+			if (sockd >= 0)
+				Close(sockd);
+			while (i-- > 0)
+				Close(receiver->serverfd[i]);
+			dealloc(receiver->serverfd);
+			return false;
+		}
+		receiver->serverfd[i] = sockd;
+	}
+	return true;
+}
+
+static void create_receivers(ckpool_t *ckp, cdata_t *cdata)
+{
+	int i;
+
+	cdata->nreceivers = ckp->receivers > 0 ? ckp->receivers : 1;
+	cdata->receivers = ckzalloc(sizeof(receiver_t) * cdata->nreceivers);
+	for (i = 0; i < cdata->nreceivers; i++) {
+		receiver_t *rcv = &cdata->receivers[i];
+
+		rcv->cdata = cdata;
+		rcv->id = i;
+		rcv->inline_events = ckp->receivers > 0;
+		if (ckp->acceptrate > 0) {
+			rcv->accept_rate = MAX((double)ckp->acceptrate / cdata->nreceivers, 1);
+			rcv->accept_tokens = rcv->accept_rate;
+			rcv->accept_refilled = time_nanos();
+		}
+		rcv->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (rcv->epfd < 0)
+			quit(1, "FATAL: Failed to create epoll in receiver");
+		/* The first receiver always uses the main server sockets */
+		if (i && ckp->reuseport && receiver_serverfds(cdata, rcv))
+			rcv->own_serverfds = true;
+		else
+			rcv->serverfd = cdata->serverfd;
+		/* Shared sockets are accepted from by several receivers */
+		if (cdata->nreceivers > 1 && !rcv->own_serverfds) {
+			int j;
+
+			for (j = 0; j < ckp->serverurls; j++)
+				noblock_socket(cdata->serverfd[j]);
+		}
+		create_pthread(&rcv->pth, receiver, rcv);
+	}
+}
+
+static void clear_sender_send(sender_send_t *sender_send, cdata_t *cdata)
+{
+	dec_instance_ref(cdata, sender_send->client);
+	if (sender_send->ckbuf)
+		ckbuf_put(sender_send->ckbuf);
+	else
+		free(sender_send->buf);
+	free(sender_send);
+}
+
+/* Hand a list of sends to the sender thread, waking it if it had nothing
+ * pending. */
+static void queue_sender_sends(cdata_t *cdata, sender_send_t *sends, const int count)
+{
+	const uint64_t wake = 1;
+
+	mutex_lock(&cdata->sender_lock);
+	cdata->sends_generated += count;
+	if (!cdata->sender_sends && write(cdata->sender_wakefd, &wake, sizeof(wake)) != sizeof(wake))
+		LOGERR("Failed to write to sender wakefd");
+	DL_CONCAT(cdata->sender_sends, sends);
+	mutex_unlock(&cdata->sender_lock);
+}
+
+/* Maximum events harvested by the sender per epoll_wait */
+#define SENDER_EVENTS 128
+/* Marker for the sender's wakefd in its epoll set, never a client id */
+#define SENDER_WAKEID UINT64_MAX
+
+static void clear_client_sends(cdata_t *cdata, client_instance_t *client)
+{
+	sender_send_t *send, *tmp;
+
+	DL_FOREACH_SAFE(client->sends, send, tmp) {
+		DL_DELETE(client->sends, send);
+		clear_sender_send(send, cdata);
+	}
+	client->backlog = 0;
+}
+
+static void unblock_client(client_instance_t **blocked, client_instance_t *client)
+{
+	if (!client->blocked_time)
+		return;
+	DL_DELETE2(*blocked, client, blocked_prev, blocked_next);
+	client->blocked_time = 0;
+}
+
+/* Wait for EPOLLOUT on a client whose socket buffer is full */
+static void block_client(cdata_t *cdata, client_instance_t **blocked, const int epfd,
+			 client_instance_t *client)
+{
+	struct epoll_event event;
+	int op;
+
+	if (!client->blocked_time) {
+		sender_send_t *send;
+		int count;
+
+		client->blocked_time = time(NULL);
+		DL_APPEND2(*blocked, client, blocked_prev, blocked_next);
+		DL_COUNT(client->sends, send, count);
+		cdata->sends_delayed += count;
+	}
+	event.data.u64 = client->id;
+	event.events = EPOLLOUT | EPOLLONESHOT;
+	op = client->sender_polled ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	if (unlikely(epoll_ctl(epfd, op, client->fd, &event) < 0)) {
+		LOGINFO("Failed to epoll_ctl sender for client id %"PRId64" fd %d",
+			client->id, client->fd);
+		return;
+	}
+	client->sender_polled = true;
+}
+
+/* Account for ret bytes of a client's sends having been written, clearing
+ * those that are done */
+static void client_sent(cdata_t *cdata, client_instance_t *client, ssize_t ret)
+{
+	sender_send_t *send, *tmp;
+
+	client->backlog -= ret;
+	DL_FOREACH_SAFE(client->sends, send, tmp) {
+		if (ret < send->len) {
+			send->ofs += ret;
+			send->len -= ret;
+			break;
+		}
+		ret -= send->len;
+		if (send->stamp) {
+			int64_t now = time_nanos();
+
+			ckhist_add(&cdata->send_latency, now - send->queued);
+			ckhist_add(&cdata->share_latency, now - send->stamp);
+		}
+		DL_DELETE(client->sends, send);
+		clear_sender_send(send, cdata);
+	}
+}
+
+#ifdef USE_IO_URING
+/* Submission slots of the sender's ring */
+#define SENDER_RING 1024
+
+/* Queue a sendmsg of as many of a client's sends as fit in one on the sender's
+ * ring unless one is already in flight, holding a reference to the client
+ * till it completes. Clients stay on the blocked list while they have a write
+ * in flight so those that stop reading are still timed out. */
+static void uring_flush_client(ckpool_t *ckp, cdata_t *cdata, client_instance_t **blocked,
+			       client_instance_t *client)
+{
+	struct io_uring_sqe *sqe;
+	sender_write_t *write;
+	sender_send_t *send;
+	int iovcnt = 0;
+
+	if (client->write || !client->sends)
+		return;
+	if (unlikely(client->invalid)) {
+		unblock_client(blocked, client);
+		clear_client_sends(cdata, client);
+		return;
+	}
+	if (!client->blocked_time) {
+		client->blocked_time = time(NULL);
+		DL_APPEND2(*blocked, client, blocked_prev, blocked_next);
+	}
+	/* Retried by check_blocked_clients if the ring is full */
+	sqe = uring_sqe(cdata->sender_ring);
+	if (unlikely(!sqe))
+		return;
+
+	write = cdata->sender_writes;
+	if (write)
+		LL_DELETE(cdata->sender_writes, write);
+	else
+		write = ckzalloc(sizeof(sender_write_t));
+	DL_FOREACH(client->sends, send) {
+		if (iovcnt >= SENDER_IOVS)
+			break;
+		if (unlikely(!ckp->wmem_warn && send->len > client->sendbufsize))
+			client->sendbufsize = set_sendbufsize(ckp, client->fd, send->len);
+		write->iov[iovcnt].iov_base = send->buf + send->ofs;
+		write->iov[iovcnt++].iov_len = send->len;
+	}
+	write->msg.msg_iov = write->iov;
+	write->msg.msg_iovlen = iovcnt;
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = client->fd;
+	sqe->addr = (uint64_t)(uintptr_t)&write->msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = (uint64_t)(uintptr_t)client;
+	client->write = write;
+	inc_instance_ref(cdata, client);
 }
 
-static void redirect_client(ckpool_t *ckp, client_instance_t *client);
-
-static bool redirect_matches(cdata_t *cdata, client_instance_t *client)
+/* Handle a client's sendmsg completing on the sender's ring, queueing the
+ * next one if it has more sends waiting */
+static void uring_client_sent(ckpool_t *ckp, cdata_t *cdata, client_instance_t **blocked,
+			      client_instance_t *client, const int res)
 {
-	redirect_t *redirect;
+	LL_PREPEND(cdata->sender_writes, client->write);
+	client->write = NULL;
 
-	ck_rlock(&cdata->lock);
-	HASH_FIND_STR(cdata->redirects, client->address_name, redirect);
-	ck_runlock(&cdata->lock);
+	if (unlikely(client->invalid))
+		goto out_clear;
+	if (unlikely(res < 0 && res != -EAGAIN && res != -EINTR)) {
+		LOGINFO("Client id %"PRId64" fd %d disconnected with write errno %d:%s",
+			client->id, client->fd, -res, strerror(-res));
+		invalidate_client(ckp, cdata, client);
+		goto out_clear;
+	}
+	if (res > 0) {
+		client_sent(cdata, client, res);
+		/* A short write means the socket buffer filled */
+		if (client->sends)
+			cdata->sends_delayed++;
+	}
+	if (client->sends)
+		uring_flush_client(ckp, cdata, blocked, client);
+	else
+		unblock_client(blocked, client);
+	goto out;
 
-	return redirect;
+out_clear:
+	unblock_client(blocked, client);
+	clear_client_sends(cdata, client);
+out:
+	dec_instance_ref(cdata, client);
 }
+#endif
 
-static void client_event_processor(ckpool_t *ckp, struct epoll_event *event)
+/* Write out all the sends queued to a client, coalescing them into as few
+ * writev calls as possible, until they're done or the socket would block.
+ * The caller must hold a reference to the client. */
+static void flush_client(ckpool_t *ckp, cdata_t *cdata, client_instance_t **blocked,
+			 const int epfd, client_instance_t *client)
 {
-	const uint32_t events = event->events;
-	const uint64_t id = event->data.u64;
-	cdata_t *cdata = ckp->cdata;
-	client_instance_t *client;
-
-	client = ref_client_by_id(cdata, id);
-	if (unlikely(!client)) {
-		LOGNOTICE("Failed to find client by id %"PRId64" in receiver!", id);
-		goto outnoclient;
+#ifdef USE_IO_URING
+	if (cdata->uring) {
+		uring_flush_client(ckp, cdata, blocked, client);
+		return;
 	}
-	/* We can have both messages and read hang ups so process the
-	 * message first. */
-	if (likely(events & EPOLLIN)) {
-		/* Rearm the client for epoll events if we have successfully
-		 * parsed a message from it */
-		if (unlikely(!parse_client_msg(ckp, cdata, client))) {
+#endif
+	while (client->sends) {
+		struct iovec iov[SENDER_IOVS];
+		sender_send_t *send;
+		int iovcnt = 0;
+		ssize_t ret;
+
+		if (unlikely(client->invalid))
+			goto out_clear;
+		DL_FOREACH(client->sends, send) {
+			if (iovcnt >= SENDER_IOVS)
+				break;
+			/* Increase sendbufsize to match large messages sent to
+			 * clients - this usually only applies to clients as
+			 * mining nodes. */
+			if (unlikely(!ckp->wmem_warn && send->len > client->sendbufsize))
+				client->sendbufsize = set_sendbufsize(ckp, client->fd, send->len);
+			iov[iovcnt].iov_base = send->buf + send->ofs;
+			iov[iovcnt++].iov_len = send->len;
+		}
+		ret = writev(client->fd, iov, iovcnt);
+		if (ret < 1) {
+			if (!ret || errno == EAGAIN || errno == EWOULDBLOCK) {
+				block_client(cdata, blocked, epfd, client);
+				return;
+			}
+			if (errno == EINTR)
+				continue;
+			LOGINFO("Client id %"PRId64" fd %d disconnected with write errno %d:%s",
+				client->id, client->fd, errno, strerror(errno));
 			invalidate_client(ckp, cdata, client);
-			goto out;
+			goto out_clear;
 		}
+		client_sent(cdata, client, ret);
 	}
-	if (unlikely(events & EPOLLERR)) {
-		socklen_t errlen = sizeof(int);
-		int error = 0;
+	unblock_client(blocked, client);
+	return;
 
-		/* See what type of error this is and raise the log
-			* level of the message if it's unexpected. */
-		getsockopt(client->fd, SOL_SOCKET, SO_ERROR, (void *)&error, &errlen);
-		if (error != 104) {
-			LOGNOTICE("Client id %"PRId64" fd %d epollerr HUP in epoll with errno %d: %s",
-					client->id, client->fd, error, strerror(error));
-		} else {
-			LOGINFO("Client id %"PRId64" fd %d epollerr HUP in epoll with errno %d: %s",
-				client->id, client->fd, error, strerror(error));
-		}
-		invalidate_client(cdata->pi->ckp, cdata, client);
-	} else if (unlikely(events & EPOLLHUP)) {
-		/* Client connection reset by peer */
-		LOGINFO("Client id %"PRId64" fd %d HUP in epoll", client->id, client->fd);
-		invalidate_client(cdata->pi->ckp, cdata, client);
-	} else if (unlikely(events & EPOLLRDHUP)) {
-		/* Client disconnected by peer */
-		LOGINFO("Client id %"PRId64" fd %d RDHUP in epoll", client->id, client->fd);
-		invalidate_client(cdata->pi->ckp, cdata, client);
-	}
-out:
-	if (likely(!client->invalid)) {
-		/* Rearm the fd in the epoll list if it's still active */
-		event->data.u64 = id;
-		event->events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
-		epoll_ctl(cdata->epfd, EPOLL_CTL_MOD, client->fd, event);
-	}
-	dec_instance_ref(cdata, client);
-outnoclient:
-	free(event);
+out_clear:
+	unblock_client(blocked, client);
+	clear_client_sends(cdata, client);
 }
 
-/* Waits on fds ready to read on from the list stored in conn_instance and
- * handles the incoming messages */
-static void *receiver(void *arg)
+/* Move newly queued sends onto their clients' queues and try to write out
+ * those that aren't already waiting on EPOLLOUT. */
+static void sender_new_sends(ckpool_t *ckp, cdata_t *cdata, client_instance_t **blocked,
+			     const int epfd)
 {
-	cdata_t *cdata = (cdata_t *)arg;
-	struct epoll_event *event = ckzalloc(sizeof(struct epoll_event));
-	ckpool_t *ckp = cdata->ckp;
-	uint64_t serverfds, i;
-	int ret, epfd;
+	client_instance_t *flush = NULL, *client, *tmpclient;
+	sender_send_t *sends, *send, *tmp;
+	uint64_t wake;
 
-	rename_proc("creceiver");
+	mutex_lock(&cdata->sender_lock);
+	/* Drain the wakefd under lock so no wakeup can be lost */
+	if (read(cdata->sender_wakefd, &wake, sizeof(wake)) < 0 && errno != EAGAIN)
+		LOGERR("Failed to read sender wakefd");
+	sends = cdata->sender_sends;
+	cdata->sender_sends = NULL;
+	mutex_unlock(&cdata->sender_lock);
 
-	epfd = cdata->epfd = epoll_create1(EPOLL_CLOEXEC);
-	if (epfd < 0) {
-		LOGEMERG("FATAL: Failed to create epoll in receiver");
-		goto out;
-	}
-	serverfds = ckp->serverurls;
-	/* Add all the serverfds to the epoll */
-	for (i = 0; i < serverfds; i++) {
-		/* The small values will be less than the first client ids */
-		event->data.u64 = i;
-		event->events = EPOLLIN | EPOLLRDHUP;
-		ret = epoll_ctl(epfd, EPOLL_CTL_ADD, cdata->serverfd[i], event);
-		if (ret < 0) {
-			LOGEMERG("FATAL: Failed to add epfd %d to epoll_ctl", epfd);
-			goto out;
+	DL_FOREACH_SAFE(sends, send, tmp) {
+		client = send->client;
+		DL_DELETE(sends, send);
+		DL_APPEND(client->sends, send);
+		client->backlog += send->len;
+		if (!client->flushing && !client->blocked_time) {
+			/* Hold a reference while it's on the flush list */
+			inc_instance_ref(cdata, client);
+			client->flushing = true;
+			DL_APPEND2(flush, client, flush_prev, flush_next);
 		}
 	}
+	DL_FOREACH_SAFE2(flush, client, tmpclient, flush_next) {
+		DL_DELETE2(flush, client, flush_prev, flush_next);
+		client->flushing = false;
+		flush_client(ckp, cdata, blocked, epfd, client);
+		dec_instance_ref(cdata, client);
+	}
+}
 
-	/* Wait for the stratifier to be ready for us */
-	while (!ckp->stratifier_ready)
-		cksleep_ms(10);
+/* Disconnect clients that have been blocked for too long and update the
+ * backlog stats. */
+static void check_blocked_clients(ckpool_t *ckp, cdata_t *cdata, client_instance_t **blocked)
+{
+	int64_t sends_queued = 0, sends_size = 0, maxbacklog = 0, maxbacklog_id = 0;
+	client_instance_t *client, *tmp;
+	time_t now_t = time(NULL);
 
-	while (42) {
-		uint64_t edu64;
+	DL_FOREACH_SAFE2(*blocked, client, tmp, blocked_next) {
+		sender_send_t *send;
+		int count;
 
-		while (unlikely(!cdata->accept))
-			cksleep_ms(10);
-		ret = epoll_wait(epfd, event, 1, 1000);
-		if (unlikely(ret < 1)) {
-			if (unlikely(ret == -1)) {
-				LOGEMERG("FATAL: Failed to epoll_wait in receiver");
-				break;
+		/* Invalidate clients that block for more than 60 seconds */
+		if (unlikely(client->invalid || now_t - client->blocked_time >= 60)) {
+			if (!client->invalid) {
+				LOGNOTICE("Client id %"PRId64" fd %d blocked for >60 seconds, disconnecting",
+					  client->id, client->fd);
+				invalidate_client(ckp, cdata, client);
 			}
-			/* Nothing to service, still very unlikely */
+#ifdef USE_IO_URING
+			/* Sends in flight are cleared once they complete */
+			if (client->write)
+				continue;
+#endif
+			unblock_client(blocked, client);
+			clear_client_sends(cdata, client);
 			continue;
 		}
-		edu64 = event->data.u64;
-		if (edu64 < serverfds) {
-			ret = accept_client(cdata, epfd, edu64);
-			if (unlikely(ret < 0)) {
-				LOGEMERG("FATAL: Failed to accept_client in receiver");
-				break;
-			}
-			continue;
+#ifdef USE_IO_URING
+		/* Retry clients whose write didn't fit on the ring */
+		if (cdata->uring && !client->write)
+			uring_flush_client(ckp, cdata, blocked, client);
+#endif
+		DL_COUNT(client->sends, send, count);
+		sends_queued += count;
+		sends_size += client->backlog + count * sizeof(sender_send_t);
+		if (client->backlog > maxbacklog) {
+			maxbacklog = client->backlog;
+			maxbacklog_id = client->id;
 		}
-		/* Event structure is handed off to client_event_processor
-		 * here to be freed so we need to allocate a new one */
-		ckmsgq_add(cdata->cevents, event);
-		event = ckzalloc(sizeof(struct epoll_event));
 	}
-out:
-	/* We shouldn't get here unless there's an error */
-	return NULL;
+
+	mutex_lock(&cdata->sender_lock);
+	cdata->sends_queued = sends_queued;
+	cdata->sends_size = sends_size;
+	cdata->sends_maxbacklog = maxbacklog;
+	cdata->sends_maxbacklog_id = maxbacklog_id;
+	mutex_unlock(&cdata->sender_lock);
 }
 
-/* Send a sender_send message and return true if we've finished sending it or
- * are unable to send any more. */
-static bool send_sender_send(ckpool_t *ckp, cdata_t *cdata, sender_send_t *sender_send)
+#ifdef USE_IO_URING
+/* Poll the sender's wakefd on its ring */
+static void uring_poll_wakefd(cdata_t *cdata)
 {
-	client_instance_t *client = sender_send->client;
-	time_t now_t;
-
-	if (unlikely(client->invalid))
-		goto out_true;
-
-	/* Make sure we only send one message at a time to each client */
-	if (unlikely(client->sending && client->sending != sender_send))
-		return false;
+	struct io_uring_sqe *sqe = uring_sqe(cdata->sender_ring);
+
+	if (unlikely(!sqe))
+		quit(1, "FATAL: Failed to get sqe to poll sender wakefd");
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = cdata->sender_wakefd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = SENDER_WAKEID;
+}
 
-	client->sending = sender_send;
-	now_t = time(NULL);
+/* Sender loop writing each client's queue out with a sendmsg on an io_uring,
+ * sending to every client with new sends in one submission and leaving the
+ * kernel to wait on those whose sockets are full. */
+static void uring_sender(cdata_t *cdata)
+{
+	client_instance_t *blocked = NULL;
+	ckpool_t *ckp = cdata->ckp;
+	time_t last_check = 0;
 
-	/* Increase sendbufsize to match large messages sent to clients - this
-	 * usually only applies to clients as mining nodes. */
-	if (unlikely(!ckp->wmem_warn && sender_send->len > client->sendbufsize))
-		client->sendbufsize = set_sendbufsize(ckp, client->fd, sender_send->len);
+	cdata->sender_ring = ckalloc(sizeof(uring_t));
+	if (unlikely(!uring_init(cdata->sender_ring, SENDER_RING)))
+		quit(1, "FATAL: Failed to set up io_uring in sender: %s", strerror(errno));
+	uring_poll_wakefd(cdata);
 
-	while (sender_send->len) {
-		int ret = write(client->fd, sender_send->buf + sender_send->ofs, sender_send->len);
+	while (42) {
+		struct io_uring_cqe cqe;
+		time_t now_t;
+		int ret;
 
-		if (ret < 1) {
-			/* Invalidate clients that block for more than 60 seconds */
-			if (unlikely(client->blocked_time && now_t - client->blocked_time >= 60)) {
-				LOGNOTICE("Client id %"PRId64" fd %d blocked for >60 seconds, disconnecting",
-					  client->id, client->fd);
-				invalidate_client(ckp, cdata, client);
-				goto out_true;
-			}
-			if (errno == EAGAIN || errno == EWOULDBLOCK || !ret) {
-				if (!client->blocked_time)
-					client->blocked_time = now_t;
-				return false;
+		ret = uring_enter(cdata->sender_ring, true, 1000);
+		if (unlikely(ret < 0 && ret != -ETIME && ret != -EBUSY)) {
+			LOGEMERG("FATAL: Failed to wait on io_uring in sender: %s", strerror(-ret));
+			break;
+		}
+		while (uring_cqe(cdata->sender_ring, &cqe)) {
+			if (cqe.user_data == SENDER_WAKEID) {
+				if (!(cqe.flags & IORING_CQE_F_MORE))
+					uring_poll_wakefd(cdata);
+				sender_new_sends(ckp, cdata, &blocked, -1);
+				continue;
 			}
-			LOGINFO("Client id %"PRId64" fd %d disconnected with write errno %d:%s",
-				client->id, client->fd, errno, strerror(errno));
-			invalidate_client(ckp, cdata, client);
-			goto out_true;
+			uring_client_sent(ckp, cdata, &blocked,
+					  (client_instance_t *)(uintptr_t)cqe.user_data, cqe.res);
+		}
+		now_t = time(NULL);
+		if (now_t != last_check) {
+			last_check = now_t;
+			check_blocked_clients(ckp, cdata, &blocked);
 		}
-		sender_send->ofs += ret;
-		sender_send->len -= ret;
-		client->blocked_time = 0;
 	}
-out_true:
-	client->sending = NULL;
-	return true;
-}
-
-static void clear_sender_send(sender_send_t *sender_send, cdata_t *cdata)
-{
-	dec_instance_ref(cdata, sender_send->client);
-	free(sender_send->buf);
-	free(sender_send);
 }
+#endif
 
-/* Use a thread to send queued messages, appending them to the sends list and
- * iterating over all of them, attempting to send them all non-blocking to
- * only send to those clients ready to receive data. */
+/* Use a thread to send queued messages, writing each client's queue out as
+ * soon as it arrives and only retrying clients whose sockets were full once
+ * epoll tells us they're writable again. */
 static void *sender(void *arg)
 {
+	struct epoll_event events[SENDER_EVENTS], event;
 	cdata_t *cdata = (cdata_t *)arg;
-	sender_send_t *sends = NULL;
+	client_instance_t *blocked = NULL;
 	ckpool_t *ckp = cdata->ckp;
+	time_t last_check = 0;
+	int epfd;
 
 	rename_proc("csender");
 
+#ifdef USE_IO_URING
+	if (cdata->uring) {
+		uring_sender(cdata);
+		return NULL;
+	}
+#endif
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0)
+		quit(1, "FATAL: Failed to create epoll in sender");
+	event.data.u64 = SENDER_WAKEID;
+	event.events = EPOLLIN;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, cdata->sender_wakefd, &event) < 0)
+		quit(1, "FATAL: Failed to add sender wakefd to epoll");
+
 	while (42) {
-		int64_t sends_queued = 0, sends_size = 0;
-		sender_send_t *sending, *tmp;
-
-		/* Check all sends to see if they can be written out */
-		DL_FOREACH_SAFE(sends, sending, tmp) {
-			if (send_sender_send(ckp, cdata, sending)) {
-				DL_DELETE(sends, sending);
-				clear_sender_send(sending, cdata);
-			} else {
-				sends_queued++;
-				sends_size += sizeof(sender_send_t) + sending->len + 1;
-			}
+		int nevents, i;
+		time_t now_t;
+
+		nevents = epoll_wait(epfd, events, SENDER_EVENTS, 1000);
+		if (unlikely(nevents < 0)) {
+			if (errno == EINTR)
+				continue;
+			LOGEMERG("FATAL: Failed to epoll_wait in sender");
+			break;
 		}
+		for (i = 0; i < nevents; i++) {
+			const uint64_t id = events[i].data.u64;
+			client_instance_t *client;
 
-		mutex_lock(&cdata->sender_lock);
-		cdata->sends_delayed += sends_queued;
-		cdata->sends_queued = sends_queued;
-		cdata->sends_size = sends_size;
-		/* Poll every 10ms if there are no new sends. */
-		if (!cdata->sender_sends) {
-			const ts_t polltime = {0, 10000000};
-			ts_t timeout_ts;
-
-			ts_realtime(&timeout_ts);
-			timeraddspec(&timeout_ts, &polltime);
-			cond_timedwait(&cdata->sender_cond, &cdata->sender_lock, &timeout_ts);
+			if (id == SENDER_WAKEID) {
+				sender_new_sends(ckp, cdata, &blocked, epfd);
+				continue;
+			}
+			/* Writable again, dropped clients won't be found */
+			client = ref_client_by_id(cdata, id);
+			if (unlikely(!client))
+				continue;
+			flush_client(ckp, cdata, &blocked, epfd, client);
+			dec_instance_ref(cdata, client);
 		}
-		if (cdata->sender_sends) {
-			DL_CONCAT(sends, cdata->sender_sends);
-			cdata->sender_sends = NULL;
+		now_t = time(NULL);
+		if (now_t != last_check) {
+			last_check = now_t;
+			check_blocked_clients(ckp, cdata, &blocked);
 		}
-		mutex_unlock(&cdata->sender_lock);
 	}
 	/* We shouldn't get here unless there's an error */
 	return NULL;
@@ -901,13 +2236,11 @@ static void redirect_client(ckpool_t *ckp, client_instance_t *client)
 	sender_send->client = client;
 	sender_send->buf = buf;
 	sender_send->len = strlen(buf);
+	/* queue_sender_sends expects a list */
+	sender_send->prev = sender_send;
 	inc_instance_ref(cdata, client);
 
-	mutex_lock(&cdata->sender_lock);
-	cdata->sends_generated++;
-	DL_APPEND(cdata->sender_sends, sender_send);
-	pthread_cond_signal(&cdata->sender_cond);
-	mutex_unlock(&cdata->sender_lock);
+	queue_sender_sends(cdata, sender_send, 1);
 }
 
 /* Look for accepted shares in redirector mode to know we can redirect this
@@ -972,9 +2305,10 @@ out:
 	return ret;
 }
 
-/* Send a client by id a heap allocated buffer, allowing this function to
- * free the ram. */
-static void send_client(ckpool_t *ckp, cdata_t *cdata, const int64_t id, char *buf)
+/* As send_client for a share result, timing it from when the share was read
+ * at stamp until it's written */
+static void send_client_stamp(ckpool_t *ckp, cdata_t *cdata, const int64_t id, char *buf,
+			      const int64_t stamp)
 {
 	sender_send_t *sender_send;
 	client_instance_t *client;
@@ -1043,18 +2377,86 @@ static void send_client(ckpool_t *ckp, cdata_t *cdata, const int64_t id, char *b
 	sender_send->client = client;
 	sender_send->buf = buf;
 	sender_send->len = len;
+	if (stamp) {
+		sender_send->stamp = stamp;
+		sender_send->queued = time_nanos();
+	}
+	/* queue_sender_sends expects a list */
+	sender_send->prev = sender_send;
 
-	mutex_lock(&cdata->sender_lock);
-	cdata->sends_generated++;
-	DL_APPEND(cdata->sender_sends, sender_send);
-	pthread_cond_signal(&cdata->sender_cond);
-	mutex_unlock(&cdata->sender_lock);
+	queue_sender_sends(cdata, sender_send, 1);
 
 	/* Redirect after sending response to shares and authorise */
 	if (unlikely(redirect))
 		redirect_client(ckp, client);
 }
 
+/* Queue one shared serialised message to a list of local (non subclient)
+ * client ids, taking a reference to the ckbuf for each send created. As with
+ * send_client, authorised clients matching a whitelisted redirector IP are
+ * redirected after the message is queued. */
+static void broadcast_clients(ckpool_t *ckp, ckbuf_t *ckbuf, const int64_t *client_ids, const int clients)
+{
+	int i, sends = 0, missing = 0, redirects = 0;
+	client_instance_t *client, **redirect = NULL;
+	sender_send_t *sender_send, *bulk_send = NULL;
+	cdata_t *cdata = ckp->cdata;
+	int64_t *missing_ids = NULL;
+
+	ck_wlock(&cdata->lock);
+	for (i = 0; i < clients; i++) {
+		int64_t id = client_ids[i];
+
+		HASH_FIND_I64(cdata->clients, &id, client);
+		if (unlikely(!client)) {
+			if (!missing_ids)
+				missing_ids = ckalloc(sizeof(int64_t) * clients);
+			missing_ids[missing++] = id;
+			continue;
+		}
+		if (unlikely(client->invalid))
+			continue;
+		__inc_instance_ref(client);
+		if (ckp->redirector && !client->redirected && client->authorised) {
+			redirect_t *found;
+
+			HASH_FIND_STR(cdata->redirects, client->address_name, found);
+			if (found) {
+				if (!redirect)
+					redirect = ckalloc(sizeof(client_instance_t *) * clients);
+				/* Hold a reference till it's been redirected */
+				__inc_instance_ref(client);
+				redirect[redirects++] = client;
+			}
+		}
+		sender_send = ckzalloc(sizeof(sender_send_t));
+		sender_send->client = client;
+		sender_send->ckbuf = ckbuf;
+		sender_send->buf = ckbuf->buf;
+		sender_send->len = ckbuf->len;
+		DL_APPEND(bulk_send, sender_send);
+		sends++;
+	}
+	ck_wunlock(&cdata->lock);
+
+	if (likely(sends)) {
+		ckbuf_get(ckbuf, sends);
+		queue_sender_sends(cdata, bulk_send, sends);
+	}
+
+	for (i = 0; i < redirects; i++) {
+		redirect_client(ckp, redirect[i]);
+		dec_instance_ref(cdata, redirect[i]);
+	}
+	free(redirect);
+
+	for (i = 0; i < missing; i++) {
+		LOGINFO("Connector failed to find client id %"PRId64" to broadcast to", missing_ids[i]);
+		stratifier_drop_id(ckp, missing_ids[i]);
+	}
+	free(missing_ids);
+}
+
 static void send_client_json(ckpool_t *ckp, cdata_t *cdata, int64_t client_id, json_t *json_msg)
 {
 	client_instance_t *client;
@@ -1108,6 +2510,40 @@ static void passthrough_client(ckpool_t *ckp, cdata_t *cdata, client_instance_t
 		client->sendbufsize = set_sendbufsize(ckp, client->fd, 1048576);
 }
 
+/* Accept a trusted remote server, telling it we take its shares batched */
+static void remote_server(ckpool_t *ckp, cdata_t *cdata, client_instance_t *client)
+{
+	json_t *val;
+
+	LOGINFO("Connector adding remote trusted server client %"PRId64, client->id);
+	client->remote = true;
+	JSON_CPACK(val, "{sb,sb}", "result", true, "sharebatch", true);
+	send_client_json(ckp, cdata, client->id, val);
+	if (!ckp->rmem_warn)
+		set_recvbufsize(ckp, client->fd, 2097152);
+	if (!ckp->wmem_warn)
+		client->sendbufsize = set_sendbufsize(ckp, client->fd, 2097152);
+}
+
+/* Enter holding the upstream cs semaphore */
+static void parse_upstream_method(ckpool_t *ckp, const char *method, json_t *val)
+{
+	if (!safecmp(method, stratum_msgs[SM_TRANSACTIONS]))
+		parse_upstream_txns(ckp, val);
+	else if (!safecmp(method, stratum_msgs[SM_AUTHRESULT]))
+		parse_upstream_auth(ckp, val);
+	else if (!safecmp(method, stratum_msgs[SM_WORKINFO]))
+		parse_upstream_workinfo(ckp, val);
+	else if (!safecmp(method, stratum_msgs[SM_BLOCK]))
+		parse_upstream_block(ckp, val);
+	else if (!safecmp(method, stratum_msgs[SM_REQTXNS]))
+		parse_upstream_reqtxns(ckp, val);
+	else if (!safecmp(method, "pong"))
+		LOGDEBUG("Received upstream pong");
+	else
+		LOGWARNING("Unrecognised upstream method %s", method);
+}
+
 static bool connect_upstream(ckpool_t *ckp, connsock_t *cs)
 {
 	json_t *req, *val = NULL, *res_val, *err_val;
@@ -1137,11 +2573,25 @@ static bool connect_upstream(ckpool_t *ckp, connsock_t *cs)
 		LOGWARNING("Failed to send message in connect_upstream");
 		goto out;
 	}
-	if (read_socket_line(cs, &timeout) < 1) {
-		LOGWARNING("Failed to receive line in connect_upstream");
-		goto out;
+	while (42) {
+		const char *method;
+
+		if (read_socket_line(cs, &timeout) < 1) {
+			LOGWARNING("Failed to receive line in connect_upstream");
+			goto out;
+		}
+		val = json_msg_result(cs->buf, &res_val, &err_val);
+		if (!val || res_val)
+			break;
+		/* The upstream stratifier may queue its transactions ahead of
+		 * the connector accepting us so parse them as they arrive */
+		method = json_string_value(json_object_get(val, "method"));
+		if (!method)
+			break;
+		parse_upstream_method(ckp, method, val);
+		json_decref(val);
+		val = NULL;
 	}
-	val = json_msg_result(cs->buf, &res_val, &err_val);
 	if (!val || !res_val) {
 		LOGWARNING("Failed to get a json result in connect_upstream, got: %s",
 			 cs->buf);
@@ -1152,10 +2602,13 @@ static bool connect_upstream(ckpool_t *ckp, connsock_t *cs)
 		LOGWARNING("Denied upstream trusted connection");
 		goto out;
 	}
-	LOGWARNING("Connected to upstream server %s:%s as trusted remote",
-		   cs->url, cs->port);
+	/* Older servers only take shares one message each */
+	ckp->upstream_sharebatch = json_is_true(json_object_get(val, "sharebatch"));
+	LOGWARNING("Connected to upstream server %s:%s as trusted remote%s",
+		   cs->url, cs->port, ckp->upstream_sharebatch ? " batching shares" : "");
 	ret = true;
 out:
+	json_decref(val);
 	cksem_post(&cs->sem);
 
 	return ret;
@@ -1237,24 +2690,8 @@ static void *urecv_process(void *arg)
 		if (unlikely(!method)) {
 			LOGWARNING("Failed to find method from upstream pool json %s",
 				   cs->buf);
-			json_decref(val);
-			goto decref;
-		}
-		if (!safecmp(method, stratum_msgs[SM_TRANSACTIONS]))
-			parse_upstream_txns(ckp, val);
-		else if (!safecmp(method, stratum_msgs[SM_AUTHRESULT]))
-			parse_upstream_auth(ckp, val);
-		else if (!safecmp(method, stratum_msgs[SM_WORKINFO]))
-			parse_upstream_workinfo(ckp, val);
-		else if (!safecmp(method, stratum_msgs[SM_BLOCK]))
-			parse_upstream_block(ckp, val);
-		else if (!safecmp(method, stratum_msgs[SM_REQTXNS]))
-			parse_upstream_reqtxns(ckp, val);
-		else if (!safecmp(method, "pong"))
-			LOGDEBUG("Received upstream pong");
-		else
-			LOGWARNING("Unrecognised upstream method %s", method);
-decref:
+		} else
+			parse_upstream_method(ckp, method, val);
 		json_decref(val);
 nomsg:
 		cksem_post(&cs->sem);
@@ -1322,11 +2759,88 @@ static void client_message_processor(ckpool_t *ckp, json_t *json_msg)
 	send_client_json(ckp, cdata, client_id, json_msg);
 }
 
+/* A message from the stratifier queued to cmpq, holding one of a json
+ * message, a serialised buffer for client_id or a shared buffer for a list of
+ * client_ids */
+struct connector_msg {
+	int64_t client_id;
+	json_t *json_msg;
+	char *buf;
+	int64_t stamp;
+	ckbuf_t *ckbuf;
+	int64_t *client_ids;
+	int clients;
+};
+
+typedef struct connector_msg cmsg_t;
+
+static void cmsg_process(ckpool_t *ckp, cmsg_t *cmsg)
+{
+	if (cmsg->ckbuf) {
+		broadcast_clients(ckp, cmsg->ckbuf, cmsg->client_ids, cmsg->clients);
+		ckbuf_put(cmsg->ckbuf);
+		free(cmsg->client_ids);
+	} else if (cmsg->buf)
+		send_client_stamp(ckp, ckp->cdata, cmsg->client_id, cmsg->buf, cmsg->stamp);
+	else
+		client_message_processor(ckp, cmsg->json_msg);
+	free(cmsg);
+}
+
+/* Queue a json message from the stratifier to the connector thread for its
+ * client. Takes ownership of val. */
 void connector_add_message(ckpool_t *ckp, json_t *val)
 {
+	cmsg_t *cmsg = ckzalloc(sizeof(cmsg_t));
 	cdata_t *cdata = ckp->cdata;
 
-	ckmsgq_add(cdata->cmpq, val);
+	cmsg->client_id = json_integer_value(json_object_get(val, "client_id"));
+	cmsg->json_msg = val;
+	ckmsgq_add(ckmsgq_by_id(cdata->cmpq, cmsg->client_id), cmsg);
+}
+
+/* As connector_add_message for a message the stratifier has already
+ * serialised, without any json. Takes ownership of buf. */
+void connector_send(ckpool_t *ckp, const int64_t client_id, char *buf, const int64_t stamp)
+{
+	cmsg_t *cmsg = ckzalloc(sizeof(cmsg_t));
+	cdata_t *cdata = ckp->cdata;
+
+	cmsg->client_id = client_id;
+	cmsg->buf = buf;
+	cmsg->stamp = stamp;
+	ckmsgq_add(ckmsgq_by_id(cdata->cmpq, client_id), cmsg);
+}
+
+/* Queue a shared serialised message to each of the cmpq queues holding any
+ * of client_ids, so it stays in order with the other messages to each
+ * client. Takes a reference to ckbuf for each queue used. */
+void connector_broadcast(ckpool_t *ckp, ckbuf_t *ckbuf, const int64_t *client_ids, const int clients)
+{
+	cdata_t *cdata = ckp->cdata;
+	int queues = cdata->cmpq->count;
+	cmsg_t **cmsgs;
+	int i;
+
+	cmsgs = ckzalloc(sizeof(cmsg_t *) * queues);
+	for (i = 0; i < clients; i++) {
+		int q = (uint64_t)client_ids[i] % queues;
+		cmsg_t *cmsg = cmsgs[q];
+
+		if (!cmsg) {
+			cmsg = cmsgs[q] = ckzalloc(sizeof(cmsg_t));
+			cmsg->ckbuf = ckbuf;
+			cmsg->client_ids = ckalloc(sizeof(int64_t) * clients);
+		}
+		cmsg->client_ids[cmsg->clients++] = client_ids[i];
+	}
+	for (i = 0; i < queues; i++) {
+		if (!cmsgs[i])
+			continue;
+		ckbuf_get(ckbuf, 1);
+		ckmsgq_add(&cdata->cmpq[i], cmsgs[i]);
+	}
+	free(cmsgs);
 }
 
 /* Send the passthrough the terminate node.method */
@@ -1343,6 +2857,45 @@ static void drop_passthrough_client(ckpool_t *ckp, cdata_t *cdata, const int64_t
 	send_client(ckp, cdata, id, msg);
 }
 
+/* Share result write latencies in ns, emptied if reset is set */
+json_t *connector_latency(void *data, const bool reset)
+{
+	json_t *val = json_object();
+	cdata_t *cdata = data;
+
+	ckhist_set_json(val, "send", &cdata->send_latency, reset);
+	ckhist_set_json(val, "share", &cdata->share_latency, reset);
+	return val;
+}
+
+/* Append the connector's metrics, reading its counters without locking */
+void connector_metrics(ckpool_t *ckp, char **buf)
+{
+	cdata_t *cdata = ckp->cdata;
+
+	metrics_printf(buf, "# TYPE ckpool_clients_connected gauge\n"
+		       "ckpool_clients_connected %d\n", cdata->nfds);
+	metrics_printf(buf, "# TYPE ckpool_sends_total counter\nckpool_sends_total %"PRId64"\n",
+		       __atomic_load_n(&cdata->sends_generated, __ATOMIC_RELAXED));
+	metrics_printf(buf, "# TYPE ckpool_sends_delayed_total counter\n"
+		       "ckpool_sends_delayed_total %"PRId64"\n",
+		       __atomic_load_n(&cdata->sends_delayed, __ATOMIC_RELAXED));
+	/* Backlog of clients whose sockets are full, as of the last check */
+	metrics_printf(buf, "# TYPE ckpool_sends_queued gauge\nckpool_sends_queued %"PRId64"\n"
+		       "# TYPE ckpool_sends_queued_bytes gauge\nckpool_sends_queued_bytes %"PRId64"\n"
+		       "# TYPE ckpool_sends_max_backlog_bytes gauge\n"
+		       "ckpool_sends_max_backlog_bytes %"PRId64"\n",
+		       __atomic_load_n(&cdata->sends_queued, __ATOMIC_RELAXED),
+		       __atomic_load_n(&cdata->sends_size, __ATOMIC_RELAXED),
+		       __atomic_load_n(&cdata->sends_maxbacklog, __ATOMIC_RELAXED));
+	metrics_printf(buf, "# TYPE ckpool_accepts_paused_total counter\n"
+		       "ckpool_accepts_paused_total %"PRId64"\n",
+		       __atomic_load_n(&cdata->accepts_paused, __ATOMIC_RELAXED));
+	metrics_printf(buf, "# TYPE ckpool_connector_stage_seconds summary\n");
+	metrics_hist(buf, "ckpool_connector_stage_seconds", "stage=\"send\"", &cdata->send_latency);
+	metrics_hist(buf, "ckpool_connector_stage_seconds", "stage=\"share\"", &cdata->share_latency);
+}
+
 char *connector_stats(void *data, const int runtime)
 {
 	json_t *val = json_object(), *subval;
@@ -1386,11 +2939,19 @@ char *connector_stats(void *data, const int runtime)
 	JSON_CPACK(subval, "{si,si,si}", "count", objects, "memory", memsize, "generated", cdata->sends_generated);
 	json_set_object(val, "sends", subval);
 
-	JSON_CPACK(subval, "{si,si,si}", "count", cdata->sends_queued, "memory", cdata->sends_size, "generated", cdata->sends_delayed);
+	JSON_CPACK(subval, "{si,si,si,sI,sI}", "count", cdata->sends_queued, "memory", cdata->sends_size,
+		   "generated", cdata->sends_delayed, "maxbacklog", cdata->sends_maxbacklog,
+		   "maxbacklogid", cdata->sends_maxbacklog_id);
 	mutex_unlock(&cdata->sender_lock);
 
 	json_set_object(val, "delays", subval);
 
+	subval = json_array();
+	for (objects = 0; objects < cdata->nreceivers; objects++)
+		json_array_append_new(subval, json_integer(cdata->receivers[objects].events));
+	json_set_object(val, "receiverevents", subval);
+	json_set_object(val, "latency", connector_latency(cdata, false));
+
 	buf = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
 	json_decref(val);
 	if (runtime)
@@ -1433,11 +2994,8 @@ retry:
 		}
 	}
 
-	if (umsg) {
-		Close(umsg->sockd);
-		free(umsg->buf);
-		dealloc(umsg);
-	}
+	put_unix_msg(umsg);
+	umsg = NULL;
 
 	do {
 		umsg = get_unix_msg(pi);
@@ -1450,7 +3008,11 @@ retry:
 	if (likely(buf[0] == '{')) {
 		json_t *val = json_loads(buf, JSON_DISABLE_EOF_CHECK, NULL);
 
-		ckmsgq_add(cdata->cmpq, val);
+		if (unlikely(!val)) {
+			LOGWARNING("Connector failed to parse json message: %s", buf);
+			goto retry;
+		}
+		client_message_processor(ckp, val);
 	} else if (cmdmatch(buf, "dropclient")) {
 		client_instance_t *client;
 
@@ -1517,6 +3079,21 @@ retry:
 		}
 		passthrough_client(ckp, cdata, client);
 		dec_instance_ref(cdata, client);
+	} else if (cmdmatch(buf, "remote")) {
+		client_instance_t *client;
+
+		ret = sscanf(buf, "remote=%"PRId64, &client_id);
+		if (ret < 0) {
+			LOGDEBUG("Connector failed to parse remote command: %s", buf);
+			goto retry;
+		}
+		client = ref_client_by_id(cdata, client_id);
+		if (unlikely(!client)) {
+			LOGINFO("Connector failed to find client id %"PRId64" to add as remote", client_id);
+			goto retry;
+		}
+		remote_server(ckp, cdata, client);
+		dec_instance_ref(cdata, client);
 	} else if (cmdmatch(buf, "getxfd")) {
 		int fdno = -1;
 
@@ -1555,6 +3132,8 @@ void *connector(void *arg)
 			goto out;
 		}
 		setsockopt(sockd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (ckp->reuseport)
+			setsockopt(sockd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
 		memset(&serv_addr, 0, sizeof(serv_addr));
 		serv_addr.sin_family = AF_INET;
 		serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -1613,7 +3192,7 @@ void *connector(void *arg)
 			do {
 				if (sockd > 0)
 					break;
-				sockd = bind_socket(newurl, newport);
+				sockd = bind_socket(newurl, newport, ckp->reuseport);
 				if (sockd > 0)
 					break;
 				LOGWARNING("Connector failed to bind to socket, retrying in 5s");
@@ -1636,7 +3215,8 @@ void *connector(void *arg)
 	if (tries)
 		LOGWARNING("Connector successfully bound to socket");
 
-	cdata->cmpq = create_ckmsgq(ckp, "cmpq", &client_message_processor);
+	threads = sysconf(_SC_NPROCESSORS_ONLN) / 2 ? : 1;
+	cdata->cmpq = create_ckmsgqs(ckp, "cmpq", &cmsg_process, threads);
 
 	if (ckp->remote && !setup_upstream(ckp, cdata))
 		goto out;
@@ -1648,11 +3228,19 @@ void *connector(void *arg)
 	 * them from the server fds in epoll. */
 	cdata->client_ids = ckp->serverurls;
 	mutex_init(&cdata->sender_lock);
-	cond_init(&cdata->sender_cond);
+	cdata->sender_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (cdata->sender_wakefd < 0)
+		quit(1, "FATAL: Failed to create sender eventfd");
+#ifdef USE_IO_URING
+	cdata->uring = uring_supported();
+	if (cdata->uring)
+		LOGNOTICE("Connector using io_uring for client I/O");
+#endif
 	create_pthread(&cdata->pth_sender, sender, cdata);
-	threads = sysconf(_SC_NPROCESSORS_ONLN) / 2 ? : 1;
-	cdata->cevents = create_ckmsgqs(ckp, "cevent", &client_event_processor, threads);
-	create_pthread(&cdata->pth_receiver, receiver, cdata);
+	/* Receivers handling events inline don't need the cevents queue */
+	if (ckp->receivers < 1 && !cdata->uring)
+		cdata->cevents = create_ckmsgqs(ckp, "cevent", &client_event_processor, threads);
+	create_receivers(ckp, cdata);
 	cdata->start_time = time(NULL);
 
 	ckp->connector_ready = true;
@@ -13,7 +13,11 @@
 int64_t connector_newclientid(ckpool_t *ckp);
 void connector_upstream_msg(ckpool_t *ckp, char *msg);
 void connector_add_message(ckpool_t *ckp, json_t *val);
+void connector_send(ckpool_t *ckp, const int64_t client_id, char *buf, const int64_t stamp);
+void connector_broadcast(ckpool_t *ckp, ckbuf_t *ckbuf, const int64_t *client_ids, const int clients);
 char *connector_stats(void *data, const int runtime);
+json_t *connector_latency(void *data, const bool reset);
+void connector_metrics(ckpool_t *ckp, char **buf);
 void connector_send_fd(ckpool_t *ckp, const int fdno, const int sockd);
 void *connector(void *arg);
 
@@ -49,10 +49,14 @@ typedef struct proxy_instance proxy_instance_t;
 
 struct share_msg {
 	UT_hash_handle hh;
+	struct share_msg *next; // For lists of shares taken off the hashlist
 	int64_t id64; // Our own id for submitting upstream
 
+	int proxyid; // Ids of the subproxy it was submitted to
+	int subid;
 	int64_t client_id;
 	time_t submit_time;
+	tv_t submit_tv;
 	double diff;
 };
 
@@ -64,6 +68,10 @@ struct stratum_msg {
 
 	json_t *json_msg;
 	int64_t client_id;
+	int proxyid; // Ids of the subproxy a held submit is waiting on
+	int subid;
+	double diff;
+	time_t submit_time;
 };
 
 typedef struct stratum_msg stratum_msg_t;
@@ -116,6 +124,8 @@ struct proxy_instance {
 	int nonce2len;
 
 	tv_t last_message;
+	bool up; /* Seen with a live connection by the receive loop */
+	bool failed; /* Has gone down since it was first up */
 
 	double diff;
 	double diff_accepted;
@@ -160,6 +170,14 @@ struct proxy_instance {
 
 	 /* Are we in the middle of a blocked write of this message? */
 	cs_msg_t *sending;
+	cs_msg_t *queued; /* Unsent message further submits are appended to */
+
+	/* Share pipelining stats, under the gdata share_lock */
+	int inflight; /* Shares submitted without a response yet */
+	int64_t submitted;
+	int64_t acked;
+	int64_t timeouts; /* Shares aged out without a response */
+	double latency; /* Decaying average ms to share responses */
 
 	pthread_t pth_precv;
 
@@ -167,7 +185,7 @@ struct proxy_instance {
 
 	char_entry_t *recvd_lines; /* Linked list of unprocessed messages */
 
-	int epfd; /* Epoll fd used by the parent proxy */
+	int epfd; /* Epoll fd of the shared receive loop */
 
 	mutex_t proxy_lock; /* Lock protecting hashlist of proxies */
 	proxy_instance_t *parent; /* Parent proxy of subproxies */
@@ -186,7 +204,8 @@ struct generator_data {
 	int subproxies_generated;
 
 	int64_t proxy_notify_id;	// Globally increasing notify id
-	pthread_t pth_uprecv;	// User proxy receive thread
+	int epfd;		// Epoll fd for all upstream proxy connections
+	pthread_t pth_precv;	// Combined proxy receive thread
 	pthread_t pth_psend;	// Combined proxy send thread
 
 	mutex_t psend_lock;	// Lock associated with conditional below
@@ -194,6 +213,7 @@ struct generator_data {
 
 	stratum_msg_t *psends;
 	int psends_generated;
+	int psends_held;	// Submits waiting on a full proxywindow
 
 	mutex_t notify_lock;
 	notify_instance_t *notify_instances;
@@ -203,27 +223,29 @@ struct generator_data {
 	int64_t share_id;
 
 	server_instance_t *current_si; // Current server instance
+	mutex_t submit_lock; // Protects server submitblock stats
+
+	/* Template pushed by longpoll ready for the next getbase and the
+	 * longpollid of the newest template fetched, under lp_lock */
+	mutex_t lp_lock;
+	gbtbase_t *lp_gbt;
+	char *longpollid;
+	char lp_prevhash[68];
+	int64_t longpolls;
 
 	proxy_instance_t *current_proxy;
 };
 
 typedef struct generator_data gdata_t;
 
-/* Use a temporary fd when testing server_alive to avoid races on cs->fd */
-static bool server_alive(ckpool_t *ckp, server_instance_t *si, bool pinging)
+/* Set up the address and auth of a connsock for this server */
+static bool server_connsock(server_instance_t *si, connsock_t *cs)
 {
 	char *userpass = NULL;
-	bool ret = false;
-	connsock_t *cs;
-	gbtbase_t gbt;
-	int fd;
 
-	if (si->alive)
-		return true;
-	cs = &si->cs;
 	if (!extract_sockaddr(si->url, &cs->url, &cs->port)) {
 		LOGWARNING("Failed to extract address from %s", si->url);
-		return ret;
+		return false;
 	}
 	userpass = strdup(si->auth);
 	realloc_strcat(&userpass, ":");
@@ -233,9 +255,25 @@ static bool server_alive(ckpool_t *ckp, server_instance_t *si, bool pinging)
 	if (!cs->auth) {
 		LOGWARNING("Failed to create base64 auth from %s", userpass);
 		dealloc(userpass);
-		return ret;
+		return false;
 	}
 	dealloc(userpass);
+	return true;
+}
+
+/* Use a temporary fd when testing server_alive to avoid races on cs->fd */
+static bool server_alive(ckpool_t *ckp, server_instance_t *si, bool pinging)
+{
+	bool ret = false;
+	connsock_t *cs;
+	gbtbase_t gbt;
+	int fd;
+
+	if (si->alive)
+		return true;
+	cs = &si->cs;
+	if (!server_connsock(si, cs))
+		return ret;
 
 	fd = connect_socket(cs->url, cs->port);
 	if (fd < 0) {
@@ -337,30 +375,220 @@ static void kill_server(server_instance_t *si)
 
 static void clear_unix_msg(unix_msg_t **umsg)
 {
-	if (*umsg) {
-		Close((*umsg)->sockd);
-		free((*umsg)->buf);
-		free(*umsg);
-		*umsg = NULL;
+	put_unix_msg(*umsg);
+	*umsg = NULL;
+}
+
+/* One block submission raced to every server, freed by whichever of the
+ * submitting threads or the waiter drops the last reference */
+typedef struct submit_race {
+	mutex_t lock;
+	pthread_cond_t cond;
+	int refs;
+	int pending; /* Servers yet to respond */
+	bool accepted;
+	tv_t solve_tv; /* When the share solving the block arrived */
+	char *head; /* Header and coinbase hex */
+	ckbuf_t *tail; /* Transactions hex shared with the workbase */
+} submit_race_t;
+
+typedef struct submit_arg {
+	ckpool_t *ckp;
+	server_instance_t *si;
+	submit_race_t *race;
+} submit_arg_t;
+
+static void put_submit_race(submit_race_t *race)
+{
+	int refs;
+
+	mutex_lock(&race->lock);
+	refs = --race->refs;
+	mutex_unlock(&race->lock);
+
+	if (refs)
+		return;
+	pthread_cond_destroy(&race->cond);
+	mutex_destroy(&race->lock);
+	free(race->head);
+	if (race->tail)
+		ckbuf_put(race->tail);
+	free(race);
+}
+
+/* Keep retrying a failed block submission, backing off from
+ * SUBMIT_BACKOFF_MS to SUBMIT_BACKOFF_MAXMS between attempts, until any server
+ * accepts it or SUBMIT_RETRY_SECS have passed */
+#define SUBMIT_RETRY_SECS 30
+#define SUBMIT_BACKOFF_MS 100
+#define SUBMIT_BACKOFF_MAXMS 2000
+
+static void *submit_thread(void *arg)
+{
+	submit_arg_t *sarg = (submit_arg_t *)arg;
+	submit_race_t *race = sarg->race;
+	server_instance_t *si = sarg->si;
+	gdata_t *gdata = sarg->ckp->gdata;
+	connsock_t *cs = &si->submit_cs;
+	int backoff = SUBMIT_BACKOFF_MS;
+	double elapsed, solved;
+	tv_t start_tv, end_tv;
+	bool ret, accepted;
+
+	pthread_detach(pthread_self());
+	free(sarg);
+
+	tv_time(&start_tv);
+	while (42) {
+		ret = cs->url && submit_blockv(cs, race->head, race->tail ? race->tail->buf : NULL,
+					       race->tail ? race->tail->len : 0);
+		if (ret)
+			break;
+		mutex_lock(&race->lock);
+		accepted = race->accepted;
+		mutex_unlock(&race->lock);
+		tv_time(&end_tv);
+		if (accepted || tvdiff(&end_tv, &start_tv) >= SUBMIT_RETRY_SECS)
+			break;
+		LOGWARNING("Block submission to %s:%s failed, retrying in %dms", cs->url,
+			   cs->port, backoff);
+		cksleep_ms(backoff);
+		backoff = MIN(backoff * 2, SUBMIT_BACKOFF_MAXMS);
+	}
+	tv_time(&end_tv);
+	elapsed = tvdiff(&end_tv, &start_tv);
+	solved = tvdiff(&end_tv, &race->solve_tv);
+	LOGWARNING("Block submission to %s:%s %s in %.1fms, %.1fms after solve", cs->url,
+		   cs->port, ret ? "accepted" : "failed", elapsed * 1000, solved * 1000);
+
+	mutex_lock(&gdata->submit_lock);
+	si->submits++;
+	if (ret)
+		si->submits_accepted++;
+	si->submit_last = elapsed;
+	if (elapsed > si->submit_max)
+		si->submit_max = elapsed;
+	si->submit_total += elapsed;
+	si->solve_last = solved;
+	if (solved > si->solve_max)
+		si->solve_max = solved;
+	mutex_unlock(&gdata->submit_lock);
+
+	mutex_lock(&race->lock);
+	race->pending--;
+	if (ret)
+		race->accepted = true;
+	pthread_cond_signal(&race->cond);
+	mutex_unlock(&race->lock);
+
+	put_submit_race(race);
+	return NULL;
+}
+
+/* Submit the block made of head followed by the optional tail to every
+ * server at once on their dedicated submit connections, returning as soon as
+ * any accepts it or all have given up retrying. Takes its own reference to
+ * tail. */
+bool generator_submitblock(ckpool_t *ckp, const char *head, ckbuf_t *tail, const tv_t *solve_tv)
+{
+	submit_race_t *race;
+	pthread_t pth;
+	bool ret;
+	int i;
+
+	if (unlikely(!ckp->servers)) {
+		LOGWARNING("No servers to submit block to in generator_submitblock");
+		return false;
+	}
+	race = ckzalloc(sizeof(submit_race_t));
+	mutex_init(&race->lock);
+	cond_init(&race->cond);
+	race->head = strdup(head);
+	if (tail) {
+		ckbuf_get(tail, 1);
+		race->tail = tail;
 	}
+	if (solve_tv)
+		memcpy(&race->solve_tv, solve_tv, sizeof(tv_t));
+	else
+		tv_time(&race->solve_tv);
+	race->pending = ckp->btcds;
+	race->refs = ckp->btcds + 1;
+
+	LOGNOTICE("Submitting block data to %d bitcoind%s!", ckp->btcds, ckp->btcds > 1 ? "s" : "");
+	for (i = 0; i < ckp->btcds; i++) {
+		submit_arg_t *sarg = ckalloc(sizeof(submit_arg_t));
+
+		sarg->ckp = ckp;
+		sarg->si = ckp->servers[i];
+		sarg->race = race;
+		create_pthread(&pth, submit_thread, sarg);
+	}
+
+	mutex_lock(&race->lock);
+	while (!race->accepted && race->pending)
+		cond_wait(&race->cond, &race->lock);
+	ret = race->accepted;
+	mutex_unlock(&race->lock);
+
+	put_submit_race(race);
+	return ret;
 }
 
-bool generator_submitblock(ckpool_t *ckp, const char *buf)
+/* Submitblock results and latencies in milliseconds of each server */
+static void send_server_stats(ckpool_t *ckp, const int sockd)
 {
+	json_t *val = json_object(), *arr_val = json_array(), *subval;
 	gdata_t *gdata = ckp->gdata;
-	server_instance_t *si;
-	bool warn = false;
-	connsock_t *cs;
+	int i;
+
+	mutex_lock(&gdata->submit_lock);
+	for (i = 0; i < ckp->btcds; i++) {
+		server_instance_t *si = ckp->servers[i];
 
-	while (unlikely(!(si = gdata->current_si))) {
-		if (!warn)
-			LOGWARNING("No live current server in generator_blocksubmit! Resubmitting indefinitely!");
-		warn = true;
-		cksleep_ms(10);
+		JSON_CPACK(subval, "{si,ss,sb,si,si,sf,sf,sf,sf,sf}", "id", si->id, "url", si->url,
+			   "alive", si->alive, "submits", si->submits,
+			   "accepted", si->submits_accepted, "lastms", si->submit_last * 1000,
+			   "maxms", si->submit_max * 1000,
+			   "avgms", si->submits ? si->submit_total * 1000 / si->submits : 0.0,
+			   "solvelastms", si->solve_last * 1000, "solvemaxms", si->solve_max * 1000);
+		json_array_append_new(arr_val, subval);
 	}
-	cs = &si->cs;
-	LOGNOTICE("Submitting block data!");
-	return submit_block(cs, buf);
+	mutex_unlock(&gdata->submit_lock);
+
+	json_set_object(val, "servers", arr_val);
+	mutex_lock(&gdata->lp_lock);
+	json_set_int64(val, "longpolls", gdata->longpolls);
+	mutex_unlock(&gdata->lp_lock);
+	send_api_response(val, sockd);
+}
+
+/* Replace the ready socket on a server's submit connsock before bitcoind
+ * would drop it as idle, so a block submission never waits on connecting */
+#define SUBMIT_WARM_SECS 15
+
+static void warm_submit_cs(server_instance_t *si)
+{
+	connsock_t *cs = &si->submit_cs;
+	time_t now = time(NULL);
+	int fd, oldfd;
+
+	if (unlikely(!cs->url))
+		return;
+	if (cs->warmfd > 0 && now - si->submit_warmed < SUBMIT_WARM_SECS)
+		return;
+	/* Connect before taking the semaphore so a submission never waits on
+	 * it, and leave the old socket in place while one is in progress */
+	fd = connect_socket(cs->url, cs->port);
+	if (cksem_trywait(&cs->sem)) {
+		Close(fd);
+		return;
+	}
+	oldfd = cs->warmfd;
+	cs->warmfd = fd;
+	si->submit_warmed = now;
+	cksem_post(&cs->sem);
+	Close(oldfd);
 }
 
 void generator_preciousblock(ckpool_t *ckp, const char *hash)
@@ -391,6 +619,21 @@ bool generator_get_blockhash(ckpool_t *ckp, int height, char *hash)
 	return get_blockhash(cs, height, hash);
 }
 
+bool generator_get_blockheader(ckpool_t *ckp, const char *hash, int *height, char *nbit,
+			       uint32_t *mediantime)
+{
+	gdata_t *gdata = ckp->gdata;
+	server_instance_t *si;
+	connsock_t *cs;
+
+	if (unlikely(!(si = gdata->current_si))) {
+		LOGWARNING("No live current server in generator_get_blockheader");
+		return false;
+	}
+	cs = &si->cs;
+	return get_blockheader(cs, hash, height, nbit, mediantime);
+}
+
 static void gen_loop(proc_instance_t *pi)
 {
 	server_instance_t *si = NULL, *old_si;
@@ -486,6 +729,8 @@ retry:
 		memset(buf + 12 + 64, 0, 1);
 		sprintf(blockmsg, "%sblock:%s", ret ? "" : "no", buf + 12);
 		send_proc(ckp->stratifier, blockmsg);
+	} else if (cmdmatch(buf, "stats")) {
+		send_server_stats(ckp, umsg->sockd);
 	} else if (cmdmatch(buf, "reconnect")) {
 		goto reconnect;
 	} else if (cmdmatch(buf, "loglevel")) {
@@ -513,18 +758,7 @@ static bool connect_proxy(ckpool_t *ckp, connsock_t *cs, proxy_instance_t *proxy
 		return false;
 	}
 	keep_sockalive(cs->fd);
-	if (!ckp->passthrough) {
-		struct epoll_event event;
-
-		event.events = EPOLLIN | EPOLLRDHUP;
-		event.data.ptr = proxy;
-		/* Add this connsock_t to the epoll list */
-		if (unlikely(epoll_ctl(proxy->epfd, EPOLL_CTL_ADD, cs->fd, &event) == -1)) {
-			LOGERR("Failed to add fd %d to epfd %d to epoll_ctl in proxy_alive",
-				cs->fd, proxy->epfd);
-			return false;
-		}
-	} else {
+	if (ckp->passthrough) {
 		/* We want large send/recv buffers on passthroughs */
 		if (!ckp->rmem_warn)
 			cs->rcvbufsiz = set_recvbufsize(ckp, cs->fd, 1048576);
@@ -534,6 +768,23 @@ static bool connect_proxy(ckpool_t *ckp, connsock_t *cs, proxy_instance_t *proxy
 	return true;
 }
 
+/* Add this connsock_t to the receive loop's epoll list once it has finished
+ * subscribe and auth so the loop never waits on a connection being set up */
+static bool epoll_proxy(proxy_instance_t *proxy)
+{
+	connsock_t *cs = &proxy->cs;
+	struct epoll_event event;
+
+	event.events = EPOLLIN | EPOLLRDHUP;
+	event.data.ptr = proxy;
+	if (unlikely(epoll_ctl(proxy->epfd, EPOLL_CTL_ADD, cs->fd, &event) == -1)) {
+		LOGERR("Failed to add fd %d to epfd %d to epoll_ctl in proxy_alive",
+			cs->fd, proxy->epfd);
+		return false;
+	}
+	return true;
+}
+
 /* For some reason notify is buried at various different array depths so use
  * a reentrant function to try and find it. */
 static json_t *find_notify(json_t *val)
@@ -818,9 +1069,11 @@ static bool node_stratum(connsock_t *cs, proxy_instance_t *proxi)
 	bool res, ret = false;
 	float timeout = 10;
 
-	JSON_CPACK(req, "{ss,s[s]}",
+	/* Older pools only look at the version and keep sending json */
+	JSON_CPACK(req, "{ss,s[s{si,sb}]}",
 			"method", "mining.node",
-			"params", PACKAGE"/"VERSION);
+			"params", PACKAGE"/"VERSION,
+			"compact", NODE_PROTOCOL, "zlib", NODE_ZLIB);
 
 	res = send_json_msg(cs, req);
 	json_decref(req);
@@ -861,13 +1114,45 @@ static void reconnect_generator(ckpool_t *ckp)
 	send_proc(ckp->generator, "reconnect");
 }
 
+static void free_gbtbase(gbtbase_t *gbt)
+{
+	if (!gbt)
+		return;
+	clear_gbtbase(gbt);
+	free(gbt);
+}
+
+/* Must hold lp_lock */
+static void __set_longpollid(gdata_t *gdata, const gbtbase_t *gbt)
+{
+	const char *longpollid = json_string_value(json_object_get(gbt->json, "longpollid"));
+
+	if (!longpollid)
+		return;
+	free(gdata->longpollid);
+	gdata->longpollid = strdup(longpollid);
+	strcpy(gdata->lp_prevhash, gbt->prevhash);
+}
+
 struct genwork *generator_getbase(ckpool_t *ckp)
 {
 	gdata_t *gdata = ckp->gdata;
-	gbtbase_t *gbt = NULL;
+	gbtbase_t *gbt = NULL, *old;
 	server_instance_t *si;
 	connsock_t *cs;
 
+	/* Use any template longpoll has already fetched */
+	if (ckp->longpoll) {
+		mutex_lock(&gdata->lp_lock);
+		gbt = gdata->lp_gbt;
+		gdata->lp_gbt = NULL;
+		mutex_unlock(&gdata->lp_lock);
+		if (gbt) {
+			LOGDEBUG("Using longpoll block template");
+			goto out;
+		}
+	}
+
 	/* Use temporary variables to prevent deref while accessing */
 	si = gdata->current_si;
 	if (unlikely(!si)) {
@@ -881,11 +1166,81 @@ struct genwork *generator_getbase(ckpool_t *ckp)
 		si->alive = cs->alive = false;
 		reconnect_generator(ckp);
 		dealloc(gbt);
+		goto out;
+	}
+	if (ckp->longpoll) {
+		/* This is newer than any template longpoll returned meanwhile */
+		mutex_lock(&gdata->lp_lock);
+		old = gdata->lp_gbt;
+		gdata->lp_gbt = NULL;
+		__set_longpollid(gdata, gbt);
+		mutex_unlock(&gdata->lp_lock);
+		free_gbtbase(old);
 	}
 out:
 	return gbt;
 }
 
+#define LONGPOLL_TIMEOUT 900
+
+/* Hold a longpoll getblocktemplate open on the current server, handing the
+ * stratifier each changed template as soon as bitcoind has it instead of
+ * waiting for the next update_interval, block poll or notification. */
+static void *longpoll_thread(void *arg)
+{
+	ckpool_t *ckp = (ckpool_t *)arg;
+	gdata_t *gdata = ckp->gdata;
+
+	pthread_detach(pthread_self());
+	rename_proc("longpoll");
+
+	while (42) {
+		char prevhash[68], *longpollid = NULL;
+		gbtbase_t *gbt, *old;
+		server_instance_t *si;
+		bool new_block;
+
+		si = gdata->current_si;
+		if (si && si->alive) {
+			mutex_lock(&gdata->lp_lock);
+			if (gdata->longpollid)
+				longpollid = strdup(gdata->longpollid);
+			strcpy(prevhash, gdata->lp_prevhash);
+			mutex_unlock(&gdata->lp_lock);
+		}
+		/* Wait till the first template tells us its longpollid */
+		if (!longpollid) {
+			cksleep_ms(1000);
+			continue;
+		}
+		gbt = ckzalloc(sizeof(gbtbase_t));
+		if (!gen_gbtbase_longpoll(&si->lp_cs, gbt, longpollid)) {
+			free(longpollid);
+			dealloc(gbt);
+			cksleep_ms(1000);
+			continue;
+		}
+		free(longpollid);
+		if (unlikely(si != gdata->current_si)) {
+			free_gbtbase(gbt);
+			continue;
+		}
+		new_block = strcmp(gbt->prevhash, prevhash);
+
+		mutex_lock(&gdata->lp_lock);
+		old = gdata->lp_gbt;
+		gdata->lp_gbt = gbt;
+		__set_longpollid(gdata, gbt);
+		gdata->longpolls++;
+		mutex_unlock(&gdata->lp_lock);
+		free_gbtbase(old);
+
+		LOGINFO("Longpoll returned %s block template", new_block ? "new block" : "updated");
+		send_proc(ckp->stratifier, new_block ? "update" : "mempool");
+	}
+	return NULL;
+}
+
 int generator_getbest(ckpool_t *ckp, char *hash)
 {
 	gdata_t *gdata = ckp->gdata;
@@ -1194,6 +1549,24 @@ static void close_proxy_socket(proxy_instance_t *proxy, proxy_instance_t *subpro
 	}
 }
 
+/* Forget the shares outstanding on a subproxy whose connection has gone,
+ * counting them as timed out since they'll never get a response */
+static void purge_proxy_shares(gdata_t *gdata, proxy_instance_t *proxy)
+{
+	share_msg_t *share, *tmp;
+
+	mutex_lock(&gdata->share_lock);
+	HASH_ITER(hh, gdata->shares, share, tmp) {
+		if (share->proxyid != proxy->id || share->subid != proxy->subid)
+			continue;
+		HASH_DEL(gdata->shares, share);
+		free(share);
+		proxy->timeouts++;
+	}
+	proxy->inflight = 0;
+	mutex_unlock(&gdata->share_lock);
+}
+
 /* Remove the subproxy from the proxi list and put it on the dead list.
  * Further use of the subproxy pointer may point to a new proxy but will not
  * dereference. This will only disable subproxies so parent proxies need to
@@ -1203,6 +1576,7 @@ static void disable_subproxy(gdata_t *gdata, proxy_instance_t *proxi, proxy_inst
 	subproxy->alive = false;
 	send_stratifier_deadproxy(gdata->ckp, subproxy->id, subproxy->subid);
 	close_proxy_socket(proxi, subproxy);
+	purge_proxy_shares(gdata, subproxy);
 	if (parent_proxy(subproxy))
 		return;
 
@@ -1576,6 +1950,16 @@ static proxy_instance_t *subproxy_by_id(proxy_instance_t *proxy, const int subid
 	return subproxy;
 }
 
+/* Find a subproxy from both its ids, NULL if it no longer exists */
+static proxy_instance_t *subproxy_by_ids(gdata_t *gdata, const int id, const int subid)
+{
+	proxy_instance_t *proxy = proxy_by_id(gdata, id);
+
+	if (unlikely(!proxy))
+		return NULL;
+	return subproxy_by_id(proxy, subid);
+}
+
 static void drop_proxy(gdata_t *gdata, const char *buf)
 {
 	proxy_instance_t *proxy, *subproxy;
@@ -1608,27 +1992,35 @@ static void stratifier_reconnect_client(ckpool_t *ckp, const int64_t id)
 	send_proc(ckp->stratifier, buf);
 }
 
-/* Add a share to the gdata share hashlist. Returns the share id */
-static int add_share(gdata_t *gdata, const int64_t client_id, const double diff)
+/* Add a share being submitted to proxy to the gdata share hashlist, counting
+ * it in flight till it gets a response, ages out in the receive loop or the
+ * proxy is disabled. Returns the share id or -1 if the proxy is dead or
+ * already has a full window of shares outstanding. */
+static int64_t add_share(gdata_t *gdata, proxy_instance_t *proxy, const int64_t client_id,
+			 const double diff)
 {
-	share_msg_t *share = ckzalloc(sizeof(share_msg_t)), *tmpshare;
-	time_t now;
-	int ret;
+	ckpool_t *ckp = gdata->ckp;
+	share_msg_t *share;
+	int64_t ret = -1;
 
-	share->submit_time = now = time(NULL);
+	mutex_lock(&gdata->share_lock);
+	/* Checked under share_lock so purge_proxy_shares can't miss it */
+	if (unlikely(!proxy->alive))
+		goto out_unlock;
+	if (ckp->proxywindow && proxy->inflight >= ckp->proxywindow)
+		goto out_unlock;
+	share = ckzalloc(sizeof(share_msg_t));
+	share->proxyid = proxy->id;
+	share->subid = proxy->subid;
 	share->client_id = client_id;
 	share->diff = diff;
-
-	/* Add new share entry to the share hashtable. Age old shares */
-	mutex_lock(&gdata->share_lock);
+	share->submit_time = time(NULL);
+	tv_time(&share->submit_tv);
 	ret = share->id64 = gdata->share_id++;
 	HASH_ADD_I64(gdata->shares, id64, share);
-	HASH_ITER(hh, gdata->shares, share, tmpshare) {
-		if (share->submit_time < now - 120) {
-			HASH_DEL(gdata->shares, share);
-			free(share);
-		}
-	}
+	proxy->inflight++;
+	proxy->submitted++;
+out_unlock:
 	mutex_unlock(&gdata->share_lock);
 
 	return ret;
@@ -1638,8 +2030,8 @@ static void submit_share(gdata_t *gdata, json_t *val)
 {
 	proxy_instance_t *proxy, *proxi;
 	ckpool_t *ckp = gdata->ckp;
-	int id, subid, share_id;
 	bool success = false;
+	int id, subid;
 	stratum_msg_t *msg;
 	int64_t client_id;
 
@@ -1681,8 +2073,6 @@ static void submit_share(gdata_t *gdata, json_t *val)
 	success = true;
 	msg = ckzalloc(sizeof(stratum_msg_t));
 	msg->json_msg = val;
-	share_id = add_share(gdata, client_id, proxi->diff);
-	json_set_int(val, "id", share_id);
 
 	/* Add the new message to the psend list */
 	mutex_lock(&gdata->psend_lock);
@@ -1772,12 +2162,32 @@ static int parse_share(gdata_t *gdata, proxy_instance_t *proxi, const char *buf)
 
 	mutex_lock(&gdata->share_lock);
 	HASH_FIND_I64(gdata->shares, &id, share);
+	/* Only accept the result from the subproxy it was submitted to */
+	if (share && (share->proxyid != proxi->id || share->subid != proxi->subid))
+		share = NULL;
 	if (share) {
+		double latency;
+		tv_t now_t;
+
 		HASH_DEL(gdata->shares, share);
-		free(share);
+		tv_time(&now_t);
+		latency = tvdiff(&now_t, &share->submit_tv) * 1000;
+		if (!proxi->acked++)
+			proxi->latency = latency;
+		else
+			proxi->latency += (latency - proxi->latency) / 10;
+		if (proxi->inflight > 0)
+			proxi->inflight--;
 	}
 	mutex_unlock(&gdata->share_lock);
 
+	/* Wake proxy_send to release any submits held on a full window */
+	if (share && gdata->psends_held) {
+		mutex_lock(&gdata->psend_lock);
+		pthread_cond_signal(&gdata->psend_cond);
+		mutex_unlock(&gdata->psend_lock);
+	}
+
 	if (!share) {
 		LOGINFO("Proxy %d:%d failed to find matching share to result: %s",
 			proxi->id, proxi->subid, buf);
@@ -1849,6 +2259,8 @@ static void send_json_msgq(gdata_t *gdata, cs_msg_t **csmsgq)
 		}
 		if (csmsg->len < 1) {
 			proxy->sending = NULL;
+			if (proxy->queued == csmsg)
+				proxy->queued = NULL;
 			DL_DELETE(*csmsgq, csmsg);
 			free(csmsg->buf);
 			free(csmsg);
@@ -1856,28 +2268,149 @@ static void send_json_msgq(gdata_t *gdata, cs_msg_t **csmsgq)
 	}
 }
 
+/* Messages to a proxy are appended to its queued message till that starts
+ * being sent so each proxy gets as many submits per send as are ready */
 static void add_json_msgq(cs_msg_t **csmsgq, proxy_instance_t *proxy, json_t **val)
 {
-	cs_msg_t *csmsg = ckzalloc(sizeof(cs_msg_t));
+	cs_msg_t *csmsg;
+	char *buf;
+	int len;
 
-	csmsg->buf = json_dumps(*val, JSON_ESCAPE_SLASH | JSON_EOL);
+	buf = json_dumps(*val, JSON_ESCAPE_SLASH | JSON_EOL);
 	json_decref(*val);
 	*val = NULL;
-	if (unlikely(!csmsg->buf)) {
+	if (unlikely(!buf)) {
 		LOGWARNING("Failed to create json dump in add_json_msgq");
 		return;
 	}
-	csmsg->len = strlen(csmsg->buf);
+	len = strlen(buf);
+	csmsg = proxy->queued;
+	if (csmsg && csmsg != proxy->sending) {
+		csmsg->buf = realloc(csmsg->buf, csmsg->len + len + 1);
+		if (unlikely(!csmsg->buf))
+			quit(1, "Failed to realloc in add_json_msgq");
+		memcpy(csmsg->buf + csmsg->len, buf, len + 1);
+		csmsg->len += len;
+		free(buf);
+		return;
+	}
+	csmsg = ckzalloc(sizeof(cs_msg_t));
+	csmsg->buf = buf;
+	csmsg->len = len;
 	csmsg->proxy = proxy;
+	proxy->queued = csmsg;
 	DL_APPEND(*csmsgq, csmsg);
 }
 
-/* For processing and sending shares. proxy refers to parent proxy here */
+/* Turn a share from the stratifier into a mining.submit for its subproxy,
+ * returning false if it can't be sent. */
+static bool prepare_submit(gdata_t *gdata, stratum_msg_t *msg)
+{
+	proxy_instance_t *proxy, *subproxy;
+	ckpool_t *ckp = gdata->ckp;
+	int proxyid = 0, subid = 0;
+	int64_t client_id = 0, id;
+	notify_instance_t *ni;
+	json_t *jobid = NULL;
+	json_t *val;
+
+	if (unlikely(!json_get_int(&subid, msg->json_msg, "subproxy"))) {
+		LOGWARNING("Failed to find subproxy in proxy_send msg");
+		return false;
+	}
+	if (unlikely(!json_get_int64(&id, msg->json_msg, "jobid"))) {
+		LOGWARNING("Failed to find jobid in proxy_send msg");
+		return false;
+	}
+	if (unlikely(!json_get_int(&proxyid, msg->json_msg, "proxy"))) {
+		LOGWARNING("Failed to find proxy in proxy_send msg");
+		return false;
+	}
+	if (unlikely(!json_get_int64(&client_id, msg->json_msg, "client_id"))) {
+		LOGWARNING("Failed to find client_id in proxy_send msg");
+		return false;
+	}
+	proxy = proxy_by_id(gdata, proxyid);
+	if (unlikely(!proxy)) {
+		LOGWARNING("Proxysend for got message for non-existent proxy %d",
+			   proxyid);
+		return false;
+	}
+	subproxy = subproxy_by_id(proxy, subid);
+	if (unlikely(!subproxy)) {
+		LOGWARNING("Proxysend for got message for non-existent subproxy %d:%d",
+			   proxyid, subid);
+		return false;
+	}
+
+	mutex_lock(&gdata->notify_lock);
+	HASH_FIND_I64(gdata->notify_instances, &id, ni);
+	if (ni)
+		jobid = json_copy(ni->jobid);
+	mutex_unlock(&gdata->notify_lock);
+
+	if (unlikely(!jobid)) {
+		stratifier_reconnect_client(ckp, client_id);
+		LOGNOTICE("Proxy %d:%s failed to find matching jobid in proxysend",
+			  subproxy->id, subproxy->url);
+		return false;
+	}
+
+	JSON_CPACK(val, "{s[soooo]ss}", "params", subproxy->auth, jobid,
+			json_object_dup(msg->json_msg, "nonce2"),
+			json_object_dup(msg->json_msg, "ntime"),
+			json_object_dup(msg->json_msg, "nonce"),
+			"method", "mining.submit");
+	json_decref(msg->json_msg);
+	msg->json_msg = val;
+	msg->client_id = client_id;
+	msg->proxyid = proxyid;
+	msg->subid = subid;
+	msg->diff = subproxy->diff;
+	msg->submit_time = time(NULL);
+	return true;
+}
+
+/* Queue a prepared submit to its subproxy unless it already has a full
+ * window of shares outstanding. Returns false if the submit is to be held.
+ * The subproxy is looked up again each time as it may have been recycled
+ * while the submit was held. */
+static bool queue_submit(gdata_t *gdata, cs_msg_t **csmsgq, stratum_msg_t *msg)
+{
+	proxy_instance_t *subproxy = subproxy_by_ids(gdata, msg->proxyid, msg->subid);
+	ckpool_t *ckp = gdata->ckp;
+	int64_t share_id;
+
+	if (unlikely(!subproxy || !subproxy->alive)) {
+		LOGDEBUG("Dropping submit to dead proxy %d:%d", msg->proxyid, msg->subid);
+		return true;
+	}
+	/* Unlocked check to skip a full window cheaply, add_share rechecks */
+	if (ckp->proxywindow && subproxy->inflight >= ckp->proxywindow)
+		return false;
+	share_id = add_share(gdata, subproxy, msg->client_id, msg->diff);
+	if (share_id < 0)
+		return false;
+	json_set_int64(msg->json_msg, "id", share_id);
+	add_json_msgq(csmsgq, subproxy, &msg->json_msg);
+	return true;
+}
+
+static void free_stratum_msg(stratum_msg_t *msg)
+{
+	if (msg->json_msg)
+		json_decref(msg->json_msg);
+	free(msg);
+}
+
+/* For processing and sending shares. Everything queued by the stratifier is
+ * taken at once, and submits held waiting on a full proxywindow are retried
+ * ahead of new ones to keep them in order. */
 static void *proxy_send(void *arg)
 {
 	ckpool_t *ckp = (ckpool_t *)arg;
 	gdata_t *gdata = ckp->gdata;
-	stratum_msg_t *msg = NULL;
+	stratum_msg_t *held = NULL;
 	cs_msg_t *csmsgq = NULL;
 
 	rename_proc("proxysend");
@@ -1885,17 +2418,9 @@ static void *proxy_send(void *arg)
 	pthread_detach(pthread_self());
 
 	while (42) {
-		proxy_instance_t *proxy, *subproxy;
-		int proxyid = 0, subid = 0;
-		int64_t client_id = 0, id;
-		notify_instance_t *ni;
-		json_t *jobid = NULL;
-		json_t *val;
-
-		if (unlikely(msg)) {
-			json_decref(msg->json_msg);
-			free(msg);
-		}
+		stratum_msg_t *msgs, *msg, *tmp;
+		int nheld = 0;
+		time_t now;
 
 		mutex_lock(&gdata->psend_lock);
 		if (!gdata->psends) {
@@ -1907,65 +2432,28 @@ static void *proxy_send(void *arg)
 			timeraddspec(&timeout_ts, &polltime);
 			cond_timedwait(&gdata->psend_cond, &gdata->psend_lock, &timeout_ts);
 		}
-		msg = gdata->psends;
-		if (likely(msg))
-			DL_DELETE(gdata->psends, msg);
+		msgs = gdata->psends;
+		gdata->psends = NULL;
 		mutex_unlock(&gdata->psend_lock);
 
-		if (!msg) {
-			send_json_msgq(gdata, &csmsgq);
-			continue;
-		}
-
-		if (unlikely(!json_get_int(&subid, msg->json_msg, "subproxy"))) {
-			LOGWARNING("Failed to find subproxy in proxy_send msg");
-			continue;
-		}
-		if (unlikely(!json_get_int64(&id, msg->json_msg, "jobid"))) {
-			LOGWARNING("Failed to find jobid in proxy_send msg");
-			continue;
-		}
-		if (unlikely(!json_get_int(&proxyid, msg->json_msg, "proxy"))) {
-			LOGWARNING("Failed to find proxy in proxy_send msg");
-			continue;
-		}
-		if (unlikely(!json_get_int64(&client_id, msg->json_msg, "client_id"))) {
-			LOGWARNING("Failed to find client_id in proxy_send msg");
-			continue;
-		}
-		proxy = proxy_by_id(gdata, proxyid);
-		if (unlikely(!proxy)) {
-			LOGWARNING("Proxysend for got message for non-existent proxy %d",
-				   proxyid);
-			continue;
-		}
-		subproxy = subproxy_by_id(proxy, subid);
-		if (unlikely(!subproxy)) {
-			LOGWARNING("Proxysend for got message for non-existent subproxy %d:%d",
-				   proxyid, subid);
-			continue;
+		now = time(NULL);
+		DL_FOREACH_SAFE(msgs, msg, tmp) {
+			DL_DELETE(msgs, msg);
+			if (prepare_submit(gdata, msg))
+				DL_APPEND(held, msg);
+			else
+				free_stratum_msg(msg);
 		}
-
-		mutex_lock(&gdata->notify_lock);
-		HASH_FIND_INT(gdata->notify_instances, &id, ni);
-		if (ni)
-			jobid = json_copy(ni->jobid);
-		mutex_unlock(&gdata->notify_lock);
-
-		if (unlikely(!jobid)) {
-			stratifier_reconnect_client(ckp, client_id);
-			LOGNOTICE("Proxy %d:%s failed to find matching jobid in proxysend",
-				  subproxy->id, subproxy->url);
-			continue;
+		DL_FOREACH_SAFE(held, msg, tmp) {
+			/* Drop held submits as old as unanswered shares get */
+			if (!queue_submit(gdata, &csmsgq, msg) && msg->submit_time > now - 120) {
+				nheld++;
+				continue;
+			}
+			DL_DELETE(held, msg);
+			free_stratum_msg(msg);
 		}
-
-		JSON_CPACK(val, "{s[soooo]soss}", "params", subproxy->auth, jobid,
-				json_object_dup(msg->json_msg, "nonce2"),
-				json_object_dup(msg->json_msg, "ntime"),
-				json_object_dup(msg->json_msg, "nonce"),
-				"id", json_object_dup(msg->json_msg, "id"),
-				"method", "mining.submit");
-		add_json_msgq(&csmsgq, subproxy, &val);
+		gdata->psends_held = nheld;
 		send_json_msgq(gdata, &csmsgq);
 	}
 	return NULL;
@@ -2142,11 +2630,15 @@ static bool proxy_alive(ckpool_t *ckp, proxy_instance_t *proxi, connsock_t *cs,
 	if (ckp->mindiff > 1)
 		suggest_diff(ckp, cs, proxi);
 out:
+	if (ret && !ckp->passthrough && !epoll_proxy(proxi))
+		ret = false;
 	if (!ret) {
 		send_stratifier_deadproxy(ckp, proxi->id, proxi->subid);
 		/* Close and invalidate the file handle */
 		Close(cs->fd);
 	}
+	if (ret)
+		tv_time(&proxi->last_message);
 	proxi->alive = ret;
 	cksem_post(&cs->sem);
 
@@ -2329,278 +2821,179 @@ static bool subproxies_alive(proxy_instance_t *proxy)
 	return ret;
 }
 
-/* For receiving messages from the upstream proxy, also responsible for setting
- * up the connection and testing it's alive. */
-static void *proxy_recv(void *arg)
+/* Age notifications older than 10 mins and shares older than 2 mins without
+ * a response */
+static void age_proxy_data(gdata_t *gdata, const time_t now)
 {
-	proxy_instance_t *proxi = (proxy_instance_t *)arg;
-	connsock_t *cs = &proxi->cs;
-	proxy_instance_t *subproxy;
-	ckpool_t *ckp = proxi->ckp;
-	gdata_t *gdata = ckp->gdata;
-	struct epoll_event event;
-	bool alive;
-	int epfd;
-
-	rename_proc("proxyrecv");
-	pthread_detach(pthread_self());
+	share_msg_t *share, *tmpshare, *expired = NULL;
+	notify_instance_t *ni, *tmp;
 
-	proxi->epfd = epfd = epoll_create1(EPOLL_CLOEXEC);
-	if (epfd < 0){
-		LOGEMERG("FATAL: Failed to create epoll in proxyrecv");
-		return NULL;
+	mutex_lock(&gdata->notify_lock);
+	HASH_ITER(hh, gdata->notify_instances, ni, tmp) {
+		if (HASH_COUNT(gdata->notify_instances) < 3)
+			break;
+		if (ni->notify_time < now - 600) {
+			HASH_DEL(gdata->notify_instances, ni);
+			clear_notify(ni);
+		}
 	}
+	mutex_unlock(&gdata->notify_lock);
 
-	if (proxy_alive(ckp, proxi, cs, false))
-		LOGWARNING("Proxy %d:%s connection established", proxi->id, proxi->url);
-
-	alive = proxi->alive;
-
-	while (42) {
-		bool message = false, hup = false;
-		share_msg_t *share, *tmpshare;
-		notify_instance_t *ni, *tmp;
-		float timeout;
-		time_t now;
-		int ret;
-
-		subproxy = proxi;
-		if (!proxi->alive) {
-			reconnect_proxy(proxi);
-			while (!subproxies_alive(proxi)) {
-				reconnect_proxy(proxi);
-				if (alive) {
-					reconnect_generator(ckp);
-					LOGWARNING("Proxy %d:%s failed, attempting reconnect",
-						   proxi->id, proxi->url);
-					alive = false;
-				}
-				sleep(5);
-			}
+	mutex_lock(&gdata->share_lock);
+	HASH_ITER(hh, gdata->shares, share, tmpshare) {
+		if (share->submit_time < now - 120) {
+			HASH_DEL(gdata->shares, share);
+			LL_PREPEND(expired, share);
 		}
-		if (!alive) {
-			reconnect_generator(ckp);
-			LOGWARNING("Proxy %d:%s recovered", proxi->id, proxi->url);
-			alive = true;
+	}
+	mutex_unlock(&gdata->share_lock);
+
+	/* Proxies are looked up without share_lock held as check_proxies
+	 * disables them, taking share_lock, with gdata->lock held */
+	LL_FOREACH_SAFE(expired, share, tmpshare) {
+		proxy_instance_t *proxy = subproxy_by_ids(gdata, share->proxyid, share->subid);
+
+		LL_DELETE(expired, share);
+		if (proxy) {
+			mutex_lock(&gdata->share_lock);
+			proxy->timeouts++;
+			if (proxy->inflight > 0)
+				proxy->inflight--;
+			mutex_unlock(&gdata->share_lock);
 		}
+		free(share);
+	}
+}
 
-		now = time(NULL);
+/* Reconnect any dead proxies and tell the generator when a global proxy
+ * fails or recovers. */
+static void check_proxies(ckpool_t *ckp, gdata_t *gdata, const time_t now)
+{
+	proxy_instance_t *proxy, *tmp;
 
-		/* Age old notifications older than 10 mins old */
-		mutex_lock(&gdata->notify_lock);
-		HASH_ITER(hh, gdata->notify_instances, ni, tmp) {
-			if (HASH_COUNT(gdata->notify_instances) < 3)
-				break;
-			if (ni->notify_time < now - 600) {
-				HASH_DEL(gdata->notify_instances, ni);
-				clear_notify(ni);
-			}
-		}
-		mutex_unlock(&gdata->notify_lock);
-
-		/* Similary with shares older than 2 mins without response */
-		mutex_lock(&gdata->share_lock);
-		HASH_ITER(hh, gdata->shares, share, tmpshare) {
-			if (share->submit_time < now - 120) {
-				HASH_DEL(gdata->shares, share);
-				free(share);
-			}
+	mutex_lock(&gdata->lock);
+	HASH_ITER(hh, gdata->proxies, proxy, tmp) {
+		bool up;
+
+		if (proxy->disabled)
+			continue;
+		/* If we don't get an update within 10 minutes the upstream
+		 * pool has likely stopped responding. */
+		if (proxy->global && proxy->alive && proxy->last_message.tv_sec < now - 600) {
+			LOGNOTICE("Proxy %d:%s no messages for 10 minutes in proxy_recv",
+				  proxy->id, proxy->url);
+			disable_subproxy(gdata, proxy, proxy);
 		}
-		mutex_unlock(&gdata->share_lock);
+		if (!proxy->alive)
+			reconnect_proxy(proxy);
+		if (!proxy->global)
+			continue;
+		up = proxy->alive || subproxies_alive(proxy);
+		if (up == proxy->up)
+			continue;
+		proxy->up = up;
+		if (!up) {
+			LOGWARNING("Proxy %d:%s failed, attempting reconnect",
+				   proxy->id, proxy->url);
+			proxy->failed = true;
+		} else if (proxy->failed)
+			LOGWARNING("Proxy %d:%s recovered", proxy->id, proxy->url);
+		else
+			LOGWARNING("Proxy %d:%s connection established", proxy->id, proxy->url);
+		reconnect_generator(ckp);
+	}
+	mutex_unlock(&gdata->lock);
+}
 
-		cs = NULL;
-		/* If we don't get an update within 10 minutes the upstream pool
-		 * has likely stopped responding. */
-		ret = epoll_wait(epfd, &event, 1, 600000);
-		if (likely(ret > 0)) {
-			subproxy = event.data.ptr;
-			cs = &subproxy->cs;
-			if (!subproxy->alive) {
-				cs = NULL;
-				continue;
-			}
+/* Parse all complete messages waiting on one proxy connection */
+static void proxy_event(ckpool_t *ckp, gdata_t *gdata, proxy_instance_t *proxy,
+			const uint32_t events)
+{
+	bool message = false, hup = false, readerr = false;
+	connsock_t *cs = &proxy->cs;
+	float timeout = 0;
+	int ret;
 
-			/* Serialise messages from here once we have a cs by
-			 * holding the semaphore. */
-			cksem_wait(&cs->sem);
-			/* Process any messages before checking for errors in
-			 * case a message is sent and then the socket
-			 * immediately closed.
-			 */
-			if (event.events & EPOLLIN) {
-				timeout = 30;
-				ret = read_socket_line(cs, &timeout);
-				/* If we are unable to read anything within 30
-				 * seconds at this point after EPOLLIN is set
-				 * then the socket is dead. */
-				if (ret < 1) {
-					LOGNOTICE("Proxy %d:%d %s failed to read_socket_line in proxy_recv",
-						  proxi->id, subproxy->subid, subproxy->url);
-					hup = true;
-				} else {
-					message = true;
-					timeout = 0;
-				}
-			}
-			if (event.events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP)) {
-				LOGNOTICE("Proxy %d:%d %s epoll hangup in proxy_recv",
-					  proxi->id, subproxy->subid, subproxy->url);
-				hup = true;
-			}
-		} else {
-			LOGNOTICE("Proxy %d:%d %s failed to epoll in proxy_recv",
-				  proxi->id, subproxy->subid, subproxy->url);
-			hup = true;
-		}
+	/* May have been disabled handling an earlier event */
+	if (unlikely(!proxy->alive))
+		return;
 
-		/* Parse any other messages already fully buffered with a zero
-		 * timeout. */
-		while (message || read_socket_line(cs, &timeout) > 0) {
-			message = false;
-			timeout = 0;
-			/* subproxy may have been recycled here if it is not a
-			 * parent and reconnect was issued */
-			if (parse_method(ckp, subproxy, cs->buf))
-				continue;
-			/* If it's not a method it should be a share result */
-			if (!parse_share(gdata, subproxy, cs->buf)) {
-				LOGNOTICE("Proxy %d:%d unhandled stratum message: %s",
-					  subproxy->id, subproxy->subid, cs->buf);
-			}
+	/* Serialise messages from here once we have a cs by holding the
+	 * semaphore. Process any messages before checking for errors in case
+	 * a message is sent and then the socket immediately closed. Never
+	 * wait on a partial line here as every other proxy is waiting on us. */
+	cksem_wait(&cs->sem);
+	if (events & EPOLLIN) {
+		ret = read_socket_line(cs, &timeout);
+		if (ret < 0) {
+			LOGNOTICE("Proxy %d:%d %s failed to read_socket_line in proxy_recv",
+				  proxy->id, proxy->subid, proxy->url);
+			hup = readerr = true;
+		} else if (ret > 0)
+			message = true;
+	}
+	if (events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP)) {
+		LOGNOTICE("Proxy %d:%d %s epoll hangup in proxy_recv",
+			  proxy->id, proxy->subid, proxy->url);
+		hup = true;
+	}
+	if (message)
+		tv_time(&proxy->last_message);
+
+	/* Parse any other messages already fully buffered */
+	while (message || (!readerr && read_socket_line(cs, &timeout) > 0)) {
+		message = false;
+		timeout = 0;
+		/* proxy may have been recycled here if it is not a parent
+		 * and reconnect was issued */
+		if (parse_method(ckp, proxy, cs->buf))
+			continue;
+		/* If it's not a method it should be a share result */
+		if (!parse_share(gdata, proxy, cs->buf)) {
+			LOGNOTICE("Proxy %d:%d unhandled stratum message: %s",
+				  proxy->id, proxy->subid, cs->buf);
 		}
-
-		/* Process hangup only after parsing messages */
-		if (hup)
-			disable_subproxy(gdata, proxi, subproxy);
-		if (cs)
-			cksem_post(&cs->sem);
 	}
 
-	return NULL;
+	/* Process hangup only after parsing messages */
+	if (hup)
+		disable_subproxy(gdata, proxy->parent, proxy);
+	cksem_post(&cs->sem);
 }
 
-/* Thread that handles all received messages from user proxies */
-static void *userproxy_recv(void *arg)
+#define PROXY_EVENTS 64
+
+/* Single event loop receiving from every upstream proxy and subproxy, global
+ * or user. Connections are set up by the recruit and reconnect threads and
+ * only join the epoll list once they're authorised. */
+static void *proxy_recv(void *arg)
 {
+	struct epoll_event events[PROXY_EVENTS];
 	ckpool_t *ckp = (ckpool_t *)arg;
 	gdata_t *gdata = ckp->gdata;
-	struct epoll_event event;
-	int epfd;
+	time_t last_check = 0;
 
-	rename_proc("uproxyrecv");
+	rename_proc("proxyrecv");
 	pthread_detach(pthread_self());
 
-	epfd = epoll_create1(EPOLL_CLOEXEC);
-	if (epfd < 0){
-		LOGEMERG("FATAL: Failed to create epoll in userproxy_recv");
-		return NULL;
-	}
-
 	while (42) {
-		proxy_instance_t *proxy, *tmpproxy;
-		bool message = false, hup = false;
-		share_msg_t *share, *tmpshare;
-		notify_instance_t *ni, *tmp;
-		connsock_t *cs;
-		float timeout;
-		time_t now;
-		int ret;
+		time_t now = time(NULL);
+		int i, ret;
 
-		mutex_lock(&gdata->lock);
-		HASH_ITER(hh, gdata->proxies, proxy, tmpproxy) {
-			if (!proxy->global && !proxy->alive) {
-				proxy->epfd = epfd;
-				reconnect_proxy(proxy);
-			}
+		if (now != last_check) {
+			last_check = now;
+			check_proxies(ckp, gdata, now);
+			age_proxy_data(gdata, now);
 		}
-		mutex_unlock(&gdata->lock);
-
-		ret = epoll_wait(epfd, &event, 1, 1000);
-		if (ret < 1) {
-			if (likely(!ret))
+		ret = epoll_wait(gdata->epfd, events, PROXY_EVENTS, 1000);
+		if (ret < 0) {
+			if (errno == EINTR)
 				continue;
-			LOGEMERG("Failed to epoll_wait in userproxy_recv");
+			LOGEMERG("Failed to epoll_wait in proxy_recv");
 			break;
 		}
-		proxy = event.data.ptr;
-		/* Make sure we haven't popped this off before we've finished
-		 * subscribe/auth */
-		if (unlikely(!proxy->authorised))
-			continue;
-
-		now = time(NULL);
-
-		mutex_lock(&gdata->notify_lock);
-		HASH_ITER(hh, gdata->notify_instances, ni, tmp) {
-			if (HASH_COUNT(gdata->notify_instances) < 3)
-				break;
-			if (ni->notify_time < now - 600) {
-				HASH_DEL(gdata->notify_instances, ni);
-				clear_notify(ni);
-			}
-		}
-		mutex_unlock(&gdata->notify_lock);
-
-		/* Similary with shares older than 2 mins without response */
-		mutex_lock(&gdata->share_lock);
-		HASH_ITER(hh, gdata->shares, share, tmpshare) {
-			if (share->submit_time < now - 120) {
-				HASH_DEL(gdata->shares, share);
-				free(share);
-			}
-		}
-		mutex_unlock(&gdata->share_lock);
-
-		cs = &proxy->cs;
-
-#if 0
-		/* Is this needed at all? */
-		if (!proxy->alive)
-			continue;
-#endif
-
-		if ((event.events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP))) {
-			LOGNOTICE("Proxy %d:%d %s hangup in userproxy_recv", proxy->id,
-				  proxy->subid, proxy->url);
-			hup = true;
-		}
-
-		if (likely(event.events & EPOLLIN)) {
-			timeout = 30;
-
-			cksem_wait(&cs->sem);
-			ret = read_socket_line(cs, &timeout);
-			/* If we are unable to read anything within 30
-			 * seconds at this point after EPOLLIN is set
-			 * then the socket is dead. */
-			if (ret < 1) {
-				LOGNOTICE("Proxy %d:%d %s failed to read_socket_line in userproxy_recv",
-					  proxy->id, proxy->subid, proxy->url);
-				hup = true;
-			} else {
-				message = true;
-				timeout = 0;
-			}
-			while (message || (ret = read_socket_line(cs, &timeout)) > 0) {
-				message = false;
-				timeout = 0;
-				/* proxy may have been recycled here if it is not a
-				 * parent and reconnect was issued */
-				if (parse_method(ckp, proxy, cs->buf))
-					continue;
-				/* If it's not a method it should be a share result */
-				if (!parse_share(gdata, proxy, cs->buf)) {
-					LOGNOTICE("Proxy %d:%d unhandled stratum message: %s",
-						  proxy->id, proxy->subid, cs->buf);
-				}
-			}
-			cksem_post(&cs->sem);
-		}
-
-		if (hup) {
-			disable_subproxy(gdata, proxy->parent, proxy);
-			continue;
-		}
+		for (i = 0; i < ret; i++)
+			proxy_event(ckp, gdata, events[i].data.ptr, events[i].events);
 	}
 	return NULL;
 }
@@ -2610,8 +3003,6 @@ static void prepare_proxy(proxy_instance_t *proxi)
 	proxi->parent = proxi;
 	mutex_init(&proxi->proxy_lock);
 	add_subproxy(proxi, proxi);
-	if (proxi->global)
-		create_pthread(&proxi->pth_precv, proxy_recv, proxi);
 }
 
 static proxy_instance_t *wait_best_proxy(ckpool_t *ckp, gdata_t *gdata)
@@ -2734,6 +3125,7 @@ static proxy_instance_t *__add_userproxy(ckpool_t *ckp, gdata_t *gdata, const in
 	proxy->auth = auth;
 	proxy->pass = pass;
 	proxy->ckp = proxy->cs.ckp = ckp;
+	proxy->epfd = gdata->epfd;
 	cksem_init(&proxy->cs.sem);
 	cksem_post(&proxy->cs.sem);
 	HASH_ADD_INT(gdata->proxies, id, proxy);
@@ -2825,7 +3217,8 @@ static void delete_proxy(ckpool_t *ckp, gdata_t *gdata, proxy_instance_t *proxy)
 	mutex_lock(&gdata->lock);
 	HASH_DEL(gdata->proxies, proxy);
 	/* Disable all its threads */
-	pthread_cancel(proxy->pth_precv);
+	if (proxy->pth_precv)
+		pthread_cancel(proxy->pth_precv);
 	close_proxy_socket(proxy, proxy);
 	mutex_unlock(&gdata->lock);
 
@@ -2917,7 +3310,7 @@ out:
 static void send_stats(gdata_t *gdata, const int sockd)
 {
 	json_t *val = json_object(), *subval;
-	int total_objects, objects;
+	int total_objects, objects, held;
 	int64_t generated, memsize;
 	proxy_instance_t *proxy;
 	stratum_msg_t *msg;
@@ -2970,8 +3363,10 @@ static void send_stats(gdata_t *gdata, const int sockd)
 	generated = gdata->psends_generated;
 	mutex_unlock(&gdata->psend_lock);
 
-	memsize = sizeof(stratum_msg_t) * objects;
-	JSON_CPACK(subval, "{si,sI,sI}", "count", objects, "memory", memsize, "generated", generated);
+	held = gdata->psends_held;
+	memsize = sizeof(stratum_msg_t) * (objects + held);
+	JSON_CPACK(subval, "{si,si,sI,sI}", "count", objects, "held", held, "memory", memsize,
+		   "generated", generated);
 	json_set_object(val, "psends", subval);
 
 	send_api_response(val, sockd);
@@ -3012,6 +3407,13 @@ static json_t *__proxystats(proxy_instance_t *proxy, proxy_instance_t *parent, b
 		json_set_double(val, "dsps1440", proxy->dsps1440);
 		json_set_double(val, "accepted", proxy->diff_accepted);
 		json_set_double(val, "rejected", proxy->diff_rejected);
+		json_set_int(val, "inflight", proxy->inflight);
+		json_set_int64(val, "submitted", proxy->submitted);
+		json_set_int64(val, "acked", proxy->acked);
+		json_set_int64(val, "timeouts", proxy->timeouts);
+		json_set_double(val, "ackrate", proxy->submitted ?
+				(double)proxy->acked / proxy->submitted : 0);
+		json_set_double(val, "latency", proxy->latency);
 	}
 	json_set_string(val, "connect", proxy_status[parent->connect_status]);
 	json_set_string(val, "subscribe", proxy_status[parent->subscribe_status]);
@@ -3291,6 +3693,7 @@ static void *server_watchdog(void *arg)
 			/* Have we reached the current server? */
 			if (server_alive(ckp, si, true) && !best)
 				best = si;
+			warm_submit_cs(si);
 		}
 		if (best && best != gdata->current_si)
 			send_proc(ckp->generator, "reconnect");
@@ -3301,6 +3704,7 @@ static void *server_watchdog(void *arg)
 
 static void setup_servers(ckpool_t *ckp)
 {
+	gdata_t *gdata = ckp->gdata;
 	pthread_t pth_watchdog;
 	int i;
 
@@ -3320,16 +3724,36 @@ static void setup_servers(ckpool_t *ckp)
 		cs->ckp = ckp;
 		cksem_init(&cs->sem);
 		cksem_post(&cs->sem);
+
+		cs = &si->submit_cs;
+		cs->ckp = ckp;
+		cs->warmfd = -1;
+		cksem_init(&cs->sem);
+		cksem_post(&cs->sem);
+		server_connsock(si, cs);
+
+		cs = &si->lp_cs;
+		cs->ckp = ckp;
+		cs->warmfd = -1;
+		cs->timeout = LONGPOLL_TIMEOUT;
+		cksem_init(&cs->sem);
+		cksem_post(&cs->sem);
+		server_connsock(si, cs);
 	}
+	mutex_init(&gdata->submit_lock);
+	mutex_init(&gdata->lp_lock);
 
 	create_pthread(&pth_watchdog, server_watchdog, ckp);
 }
 
 static void server_mode(ckpool_t *ckp, proc_instance_t *pi)
 {
+	pthread_t pth_longpoll;
 	int i;
 
 	setup_servers(ckp);
+	if (ckp->longpoll)
+		create_pthread(&pth_longpoll, longpoll_thread, ckp);
 
 	gen_loop(pi);
 
@@ -3357,6 +3781,7 @@ static proxy_instance_t *__add_proxy(ckpool_t *ckp, gdata_t *gdata, const int id
 	else
 		proxy->pass = strdup("");
 	proxy->ckp = proxy->cs.ckp = ckp;
+	proxy->epfd = gdata->epfd;
 	HASH_ADD_INT(gdata->proxies, id, proxy);
 	proxy->global = true;
 	cksem_init(&proxy->cs.sem);
@@ -3377,19 +3802,29 @@ static void proxy_mode(ckpool_t *ckp, proc_instance_t *pi)
 	if (ckp->node)
 		setup_servers(ckp);
 
+	if (!ckp->passthrough) {
+		gdata->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (gdata->epfd < 0)
+			quit(1, "FATAL: Failed to create epoll in proxy_mode");
+		mutex_init(&gdata->psend_lock);
+		cond_init(&gdata->psend_cond);
+	}
+
 	/* Create all our proxy structures and pointers */
 	for (i = 0; i < ckp->proxies; i++) {
 		proxy = __add_proxy(ckp, gdata, i);
 		if (ckp->passthrough) {
+			/* Its own parent for the connect status in proxy_alive */
+			proxy->parent = proxy;
 			create_pthread(&proxy->pth_precv, passthrough_recv, proxy);
 			proxy->passsends = create_ckmsgq(ckp, "passsend", &passthrough_send);
-		} else {
-			mutex_init(&gdata->psend_lock);
-			cond_init(&gdata->psend_cond);
+		} else
 			prepare_proxy(proxy);
-			create_pthread(&gdata->pth_uprecv, userproxy_recv, ckp);
-			create_pthread(&gdata->pth_psend, proxy_send, ckp);
-		}
+	}
+
+	if (!ckp->passthrough) {
+		create_pthread(&gdata->pth_precv, proxy_recv, ckp);
+		create_pthread(&gdata->pth_psend, proxy_send, ckp);
 	}
 
 	proxy_loop(pi);
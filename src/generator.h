@@ -22,9 +22,11 @@ int generator_getbest(ckpool_t *ckp, char *hash);
 bool generator_checkaddr(ckpool_t *ckp, const char *addr, bool *script, bool *segwit);
 bool generator_checktxn(const ckpool_t *ckp, const char *txn, json_t **val);
 char *generator_get_txn(ckpool_t *ckp, const char *hash);
-bool generator_submitblock(ckpool_t *ckp, const char *buf);
+bool generator_submitblock(ckpool_t *ckp, const char *head, ckbuf_t *tail, const tv_t *solve_tv);
 void generator_preciousblock(ckpool_t *ckp, const char *hash);
 bool generator_get_blockhash(ckpool_t *ckp, int height, char *hash);
+bool generator_get_blockheader(ckpool_t *ckp, const char *hash, int *height, char *nbit,
+			       uint32_t *mediantime);
 void *generator(void *arg);
 
 #endif /* GENERATOR_H */
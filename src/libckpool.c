@@ -56,13 +56,60 @@ void __attribute__((weak)) logmsg(int __maybe_unused loglevel, const char *fmt,
 	free(buf);
 }
 
+/* Threads named by rename_proc and their cpu clocks, for reporting cpu time
+ * per thread. Entries are claimed once and never removed. */
+#define NAMED_THREADS 512
+
+static struct named_thread {
+	char name[16];
+	clockid_t clock;
+	bool ready;
+} named_threads[NAMED_THREADS];
+
+static int named_thread_count;
+
 void rename_proc(const char *name)
 {
+	struct named_thread *thread;
+	clockid_t clock;
 	char buf[16];
+	int i;
 
 	snprintf(buf, 15, "ckp@%s", name);
 	buf[15] = '\0';
 	prctl(PR_SET_NAME, buf, 0, 0, 0);
+
+	if (pthread_getcpuclockid(pthread_self(), &clock))
+		return;
+	i = __atomic_fetch_add(&named_thread_count, 1, __ATOMIC_RELAXED);
+	if (unlikely(i >= NAMED_THREADS))
+		return;
+	thread = &named_threads[i];
+	snprintf(thread->name, 16, "%s", name);
+	thread->clock = clock;
+	__atomic_store_n(&thread->ready, true, __ATOMIC_RELEASE);
+}
+
+/* Fill in up to max names and cpu seconds of threads named by rename_proc
+ * that are still running, returning how many were found */
+int thread_cputimes(thread_cpu_t *cpus, const int max)
+{
+	int i, count, found = 0;
+
+	count = MIN(__atomic_load_n(&named_thread_count, __ATOMIC_RELAXED), NAMED_THREADS);
+	for (i = 0; i < count && found < max; i++) {
+		struct named_thread *thread = &named_threads[i];
+		ts_t ts;
+
+		if (!__atomic_load_n(&thread->ready, __ATOMIC_ACQUIRE))
+			continue;
+		/* Fails once the thread has exited */
+		if (clock_gettime(thread->clock, &ts))
+			continue;
+		strcpy(cpus[found].name, thread->name);
+		cpus[found++].secs = ts.tv_sec + ts.tv_nsec / 1e9;
+	}
+	return found;
 }
 
 void create_pthread(pthread_t *thread, void *(*start_routine)(void *), void *arg)
@@ -163,7 +210,11 @@ int _mutex_timedlock(mutex_t *lock, int timeout, const char *file, const char *f
 void _mutex_lock(mutex_t *lock, const char *file, const char *func, const int line)
 {
 	int ret, retries = 0;
+	int64_t start = 0;
 
+	/* Only locks being measured pay for reading the clock */
+	if (unlikely(lock->wait))
+		start = time_nanos();
 retry:
 	ret = _mutex_timedlock(lock, 10, file, func, line);
 	if (unlikely(ret)) {
@@ -176,6 +227,8 @@ retry:
 		}
 		quitfrom(1, file, func, line, "WTF MUTEX ERROR ON LOCK!");
 	}
+	if (unlikely(start))
+		ckhist_add(lock->wait, time_nanos() - start);
 }
 
 /* Does not unset lock->file/func/line since they're only relevant when the lock is held */
@@ -308,6 +361,7 @@ void _mutex_init(mutex_t *lock, const char *file, const char *func, const int li
 {
 	if (unlikely(pthread_mutex_init(&lock->mutex, NULL)))
 		quitfrom(1, file, func, line, "Failed to pthread_mutex_init");
+	lock->wait = NULL;
 }
 
 void _rwlock_init(rwlock_t *lock, const char *file, const char *func, const int line)
@@ -327,22 +381,35 @@ void _cklock_init(cklock_t *lock, const char *file, const char *func, const int
 {
 	_mutex_init(&lock->mutex, file, func, line);
 	_rwlock_init(&lock->rwlock, file, func, line);
+	lock->wait = NULL;
 }
 
 
 /* Read lock variant of cklock. Cannot be promoted. */
 void _ck_rlock(cklock_t *lock, const char *file, const char *func, const int line)
 {
+	int64_t start = 0;
+
+	if (unlikely(lock->wait))
+		start = time_nanos();
 	_mutex_lock(&lock->mutex, file, func, line);
 	_rd_lock(&lock->rwlock, file, func, line);
 	_mutex_unlock(&lock->mutex, file, func, line);
+	if (unlikely(start))
+		ckhist_add(lock->wait, time_nanos() - start);
 }
 
 /* Write lock variant of cklock */
 void _ck_wlock(cklock_t *lock, const char *file, const char *func, const int line)
 {
+	int64_t start = 0;
+
+	if (unlikely(lock->wait))
+		start = time_nanos();
 	_mutex_lock(&lock->mutex, file, func, line);
 	_wr_lock(&lock->rwlock, file, func, line);
+	if (unlikely(start))
+		ckhist_add(lock->wait, time_nanos() - start);
 }
 
 /* Downgrade write variant to a read lock */
@@ -675,7 +742,7 @@ void _close(int *fd, const char *file, const char *func, const int line)
 	}
 }
 
-int bind_socket(char *url, char *port)
+int bind_socket(char *url, char *port, const bool reuseport)
 {
 	struct addrinfo servinfobase, *servinfo, hints, *p;
 	int ret, sockd = -1;
@@ -700,6 +767,9 @@ int bind_socket(char *url, char *port)
 		goto out;
 	}
 	setsockopt(sockd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	/* Allow more sockets to bind the same address for load balancing */
+	if (reuseport)
+		setsockopt(sockd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
 	ret = bind(sockd, p->ai_addr, p->ai_addrlen);
 	if (ret < 0) {
 		LOGWARNING("Failed to bind socket for %s:%s", url, port);
@@ -851,6 +921,42 @@ out:
 	return ret;
 }
 
+/* As write_socket but gathering from iovcnt buffers, which are consumed by
+ * partial writes so iov can not be reused afterwards. */
+int write_socketv(int fd, struct iovec *iov, int iovcnt)
+{
+	int ret, ofs = 0;
+
+	ret = wait_write_select(fd, 5);
+	if (ret < 1) {
+		if (!ret)
+			LOGNOTICE("Select timed out in write_socketv");
+		else
+			LOGNOTICE("Select failed in write_socketv");
+		goto out;
+	}
+	while (iovcnt) {
+		ret = writev(fd, iov, iovcnt);
+		if (unlikely(ret < 0)) {
+			LOGNOTICE("Failed to write in write_socketv (%d)", errno);
+			goto out;
+		}
+		ofs += ret;
+		while (iovcnt && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	ret = ofs;
+out:
+	return ret;
+}
+
 void empty_socket(int fd)
 {
 	char buf[PAGESIZE];
@@ -1682,18 +1788,16 @@ bool cmdmatch(const char *buf, const char *cmd)
 
 static const char base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-/* Return a malloced string of *src encoded into mime base 64 */
-char *http_base64(const char *src)
+/* Return a malloced string of len bytes of src encoded into mime base 64 */
+char *base64_encode(const uchar *src, size_t len)
 {
+	size_t l = len, hlen;
 	char *str, *dst;
-	size_t l, hlen;
-	int t, r;
+	int t;
 
-	l = strlen((const char *)src);
 	hlen = ((l + 2) / 3) * 4 + 1;
 	str = ckalloc(hlen);
 	dst = str;
-	r = 0;
 
 	while (l >= 3) {
 		t = (src[0] << 16) | (src[1] << 8) | src[2];
@@ -1702,7 +1806,7 @@ char *http_base64(const char *src)
 		dst[2] = base64[(t >> 6) & 0x3f];
 		dst[3] = base64[(t >> 0) & 0x3f];
 		src += 3; l -= 3;
-		dst += 4; r += 4;
+		dst += 4;
 	}
 
 	switch (l) {
@@ -1713,7 +1817,6 @@ char *http_base64(const char *src)
 			dst[2] = base64[(t >> 6) & 0x3f];
 			dst[3] = '=';
 			dst += 4;
-			r += 4;
 			break;
 		case 1:
 			t = src[0] << 16;
@@ -1721,7 +1824,6 @@ char *http_base64(const char *src)
 			dst[1] = base64[(t >> 12) & 0x3f];
 			dst[2] = dst[3] = '=';
 			dst += 4;
-			r += 4;
 			break;
 		case 0:
 			break;
@@ -1730,6 +1832,57 @@ char *http_base64(const char *src)
 	return (str);
 }
 
+/* Return a malloced string of *src encoded into mime base 64 */
+char *http_base64(const char *src)
+{
+	return base64_encode((const uchar *)src, strlen(src));
+}
+
+static inline int base64_value(const char c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A';
+	if (c >= 'a' && c <= 'z')
+		return c - 'a' + 26;
+	if (c >= '0' && c <= '9')
+		return c - '0' + 52;
+	if (c == '+')
+		return 62;
+	if (c == '/')
+		return 63;
+	return -1;
+}
+
+/* Decode a mime base 64 string into a malloced buffer, storing its length in
+ * *len. Returns NULL on any invalid input. */
+uchar *base64_decode(const char *src, size_t *len)
+{
+	size_t slen = strlen(src), i;
+	uint32_t t = 0;
+	uchar *ret;
+	int bits = 0;
+
+	*len = 0;
+	if (unlikely(slen % 4))
+		return NULL;
+	ret = ckalloc(slen / 4 * 3 + 1);
+	for (i = 0; i < slen && src[i] != '='; i++) {
+		int val = base64_value(src[i]);
+
+		if (unlikely(val < 0)) {
+			free(ret);
+			return NULL;
+		}
+		t = (t << 6) | val;
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			ret[(*len)++] = t >> bits;
+		}
+	}
+	return ret;
+}
+
 static const int8_t charset_rev[128] = {
 	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
 	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
@@ -1829,6 +1982,169 @@ int address_to_txn(char *p2h, const char *addr, const bool script, const bool se
 	return address_to_pubkeytxn(p2h, addr);
 }
 
+/* Decode a base58check address into its 25 bytes, checking its checksum */
+static bool b58check_decode(uchar *bin, const char *addr)
+{
+	int len = strlen(addr), zeroes = 0, i, j;
+	uchar hash[32];
+
+	if (len < 26 || len > 35)
+		return false;
+	memset(bin, 0, 25);
+	for (i = 0; i < len; i++) {
+		int c = addr[i] & 0x80 || addr[i] > 'z' ? -1 : b58tobin_tbl[(int)addr[i]];
+		uint32_t carry;
+
+		if (c < 0)
+			return false;
+		carry = c;
+		for (j = 24; j >= 0; j--) {
+			carry += (uint32_t)bin[j] * 58;
+			bin[j] = carry & 0xff;
+			carry >>= 8;
+		}
+		if (carry)
+			return false;
+	}
+	/* Each leading 1 encodes a leading zero byte */
+	while (addr[zeroes] == '1')
+		zeroes++;
+	for (i = 0; i < zeroes; i++) {
+		if (bin[i])
+			return false;
+	}
+	if (zeroes < 25 && !bin[zeroes])
+		return false;
+	gen_hash(bin, hash, 21);
+	return !memcmp(hash, bin + 21, 4);
+}
+
+static uint32_t bech32_polymod_step(const uint32_t pre)
+{
+	uint8_t b = pre >> 25;
+
+	return ((pre & 0x1FFFFFF) << 5) ^
+		(-((b >> 0) & 1) & 0x3b6a57b2UL) ^
+		(-((b >> 1) & 1) & 0x26508e6dUL) ^
+		(-((b >> 2) & 1) & 0x1ea119faUL) ^
+		(-((b >> 3) & 1) & 0x3d4233ddUL) ^
+		(-((b >> 4) & 1) & 0x2a1462b3UL);
+}
+
+#define BECH32_CONST	1
+#define BECH32M_CONST	0x2bc830a3
+
+/* Check a segwit address per BIP173 and BIP350, returning its hrp's
+ * networks or 0 if invalid */
+static int segaddress_check(const char *addr, bool *script)
+{
+	int len = strlen(addr), hrp_len, data_len, i, bits = 0, proglen = 0;
+	bool lower = false, upper = false;
+	uint32_t chk = 1, val = 0;
+	uint8_t data[90];
+	char hrp[8];
+	int nets;
+
+	if (len < 8 || len > 90)
+		return 0;
+	for (i = 0; i < len; i++) {
+		if (addr[i] < 33 || addr[i] > 126)
+			return 0;
+		if (addr[i] >= 'a' && addr[i] <= 'z')
+			lower = true;
+		else if (addr[i] >= 'A' && addr[i] <= 'Z')
+			upper = true;
+	}
+	if (lower && upper)
+		return 0;
+	for (hrp_len = len - 1; hrp_len > 0 && addr[hrp_len] != '1'; hrp_len--);
+	data_len = len - hrp_len - 1;
+	if (hrp_len < 1 || hrp_len > 4 || data_len < 6 + 1)
+		return 0;
+	for (i = 0; i < hrp_len; i++)
+		hrp[i] = addr[i] >= 'A' && addr[i] <= 'Z' ? addr[i] + 32 : addr[i];
+	hrp[hrp_len] = '\0';
+	if (!strcmp(hrp, "bc"))
+		nets = ADDR_MAINNET;
+	else if (!strcmp(hrp, "tb"))
+		nets = ADDR_TESTNET;
+	else if (!strcmp(hrp, "bcrt"))
+		nets = ADDR_REGTEST;
+	else
+		return 0;
+
+	for (i = 0; i < hrp_len; i++)
+		chk = bech32_polymod_step(chk) ^ (hrp[i] >> 5);
+	chk = bech32_polymod_step(chk);
+	for (i = 0; i < hrp_len; i++)
+		chk = bech32_polymod_step(chk) ^ (hrp[i] & 0x1f);
+	for (i = 0; i < data_len; i++) {
+		int v = charset_rev[(int)addr[hrp_len + 1 + i]];
+
+		if (v < 0)
+			return 0;
+		chk = bech32_polymod_step(chk) ^ v;
+		data[i] = v;
+	}
+	data_len -= 6;
+
+	/* Witness version 0 uses bech32, later versions bech32m */
+	if (data[0] > 16 || chk != (data[0] ? BECH32M_CONST : BECH32_CONST))
+		return 0;
+	for (i = 1; i < data_len; i++) {
+		val = (val << 5) | data[i];
+		bits += 5;
+		if (bits >= 8) {
+			bits -= 8;
+			proglen++;
+		}
+	}
+	/* No more than 4 bits of zero padding */
+	if (bits > 4 || (val & ((1 << bits) - 1)))
+		return 0;
+	if (proglen < 2 || proglen > 40)
+		return 0;
+	if (!data[0] && proglen != 20 && proglen != 32)
+		return 0;
+	/* bitcoind reports all but v0 keyhash witness addresses as scripts */
+	*script = data[0] || proglen == 32;
+	return nets;
+}
+
+/* Fully decode and check a base58 or segwit address without bitcoind,
+ * returning a mask of the ADDR_ networks it is valid on, or 0 if it is not a
+ * valid address, and setting script and segwit as validateaddress would. */
+int decode_address(const char *addr, bool *script, bool *segwit)
+{
+	uchar bin[25];
+	int nets;
+
+	if (unlikely(!addr))
+		return 0;
+	if ((nets = segaddress_check(addr, script))) {
+		*segwit = true;
+		return nets;
+	}
+	if (!b58check_decode(bin, addr))
+		return 0;
+	*segwit = false;
+	switch (bin[0]) {
+		case 0x00:
+			*script = false;
+			return ADDR_MAINNET;
+		case 0x05:
+			*script = true;
+			return ADDR_MAINNET;
+		case 0x6f:
+			*script = false;
+			return ADDR_TESTNET | ADDR_REGTEST;
+		case 0xc4:
+			*script = true;
+			return ADDR_TESTNET | ADDR_REGTEST;
+	}
+	return 0;
+}
+
 /*  For encoding nHeight into coinbase, return how many bytes were used */
 int ser_number(uchar *s, int32_t val)
 {
@@ -1943,6 +2259,15 @@ void ts_realtime(ts_t *ts)
 	clock_gettime(CLOCK_REALTIME, ts);
 }
 
+/* Monotonic time in nanoseconds for measuring latencies */
+int64_t time_nanos(void)
+{
+	ts_t ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 void cksleep_prepare_r(ts_t *ts)
 {
 	clock_gettime(CLOCK_MONOTONIC, ts);
@@ -2056,6 +2381,87 @@ double sane_tdiff(tv_t *end, tv_t *start)
 	return tdiff;
 }
 
+static int ckhist_bucket(const uint64_t val)
+{
+	int bits;
+
+	if (val < 16)
+		return val;
+	bits = 63 - __builtin_clzll(val);
+	return 16 + (bits - 4) * 8 + (int)(val >> (bits - 3)) - 8;
+}
+
+/* The largest value that lands in a bucket */
+static int64_t ckhist_value(const int bucket)
+{
+	int bits, top;
+
+	if (bucket < 16)
+		return bucket;
+	bits = (bucket - 16) / 8 + 4;
+	top = (bucket - 16) % 8 + 8;
+	return ((int64_t)(top + 1) << (bits - 3)) - 1;
+}
+
+void ckhist_add(ckhist_t *hist, int64_t val)
+{
+	if (unlikely(val < 0))
+		val = 0;
+	__atomic_add_fetch(&hist->counts[ckhist_bucket(val)], 1, __ATOMIC_RELAXED);
+}
+
+/* Move the counts from src to dst, leaving src empty */
+void ckhist_take(ckhist_t *dst, ckhist_t *src)
+{
+	int i;
+
+	for (i = 0; i < CKHIST_BUCKETS; i++)
+		dst->counts[i] = __atomic_exchange_n(&src->counts[i], 0, __ATOMIC_RELAXED);
+}
+
+/* Summarise a histogram as its count, percentiles and maximum. Values are
+ * read without locking so a histogram being added to may be slightly off. */
+json_t *ckhist_json(const ckhist_t *hist)
+{
+	static const double pcs[] = {50, 90, 99, 99.9};
+	static const char *names[] = {"p50", "p90", "p99", "p999"};
+	int64_t counts[CKHIST_BUCKETS], total = 0, count = 0;
+	int i, j = 0, max = 0;
+	json_t *val;
+
+	for (i = 0; i < CKHIST_BUCKETS; i++) {
+		counts[i] = __atomic_load_n(&hist->counts[i], __ATOMIC_RELAXED);
+		total += counts[i];
+		if (counts[i])
+			max = i;
+	}
+	val = json_object();
+	json_set_int64(val, "count", total);
+	if (!total)
+		return val;
+	for (i = 0; i < CKHIST_BUCKETS && j < 4; i++) {
+		count += counts[i];
+		while (j < 4 && count >= total * pcs[j] / 100) {
+			json_set_int64(val, names[j], ckhist_value(i));
+			j++;
+		}
+	}
+	json_set_int64(val, "max", ckhist_value(max));
+	return val;
+}
+
+/* Set key in val to the summary of hist, emptying hist if reset is set */
+void ckhist_set_json(json_t *val, const char *key, ckhist_t *hist, const bool reset)
+{
+	ckhist_t taken;
+
+	if (reset) {
+		ckhist_take(&taken, hist);
+		hist = &taken;
+	}
+	json_set_object(val, key, ckhist_json(hist));
+}
+
 /* Convert a double value into a truncated string for displaying with its
  * associated suitable for Mega, Giga etc. Buf array needs to be long enough */
 void suffix_string(double val, char *buf, size_t bufsiz, int sigdigits)
@@ -37,6 +37,7 @@
 
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include "utlist.h"
 
@@ -303,6 +304,17 @@ static const char __maybe_unused *share_errs[] = {
 
 #define SHARE_ERR(x) share_errs[((x) + 9)]
 
+/* Lock free histogram of non-negative values such as latencies in ns. Values
+ * under 16 get a bucket each, then each power of 2 is split in 8 buckets for
+ * about 12% accuracy. */
+#define CKHIST_BUCKETS 512
+
+typedef struct ckhist ckhist_t;
+
+struct ckhist {
+	int64_t counts[CKHIST_BUCKETS];
+};
+
 typedef struct ckmutex mutex_t;
 
 struct ckmutex {
@@ -310,6 +322,7 @@ struct ckmutex {
 	const char *file;
 	const char *func;
 	int line;
+	ckhist_t *wait; /* If set, records how long each lock waited */
 };
 
 typedef struct ckrwlock rwlock_t;
@@ -328,6 +341,7 @@ struct cklock {
 	const char *file;
 	const char *func;
 	int line;
+	ckhist_t *wait; /* If set, records how long each rlock and wlock waited */
 };
 
 typedef struct cklock cklock_t;
@@ -431,7 +445,13 @@ static inline void _json_set_object(json_t *val, const char *key, json_t *object
 }
 #define json_set_object(val, key, object) _json_set_object(val, key, object, __FILE__, __func__, __LINE__)
 
+typedef struct thread_cpu {
+	char name[16];
+	double secs;
+} thread_cpu_t;
+
 void rename_proc(const char *name);
+int thread_cputimes(thread_cpu_t *cpus, const int max);
 void create_pthread(pthread_t *thread, void *(*start_routine)(void *), void *arg);
 void join_pthread(pthread_t thread);
 bool ck_completion_timeout(void *fn, void *fnarg, int timeout);
@@ -512,10 +532,11 @@ void block_socket(int fd);
 void _close(int *fd, const char *file, const char *func, const int line);
 #define _Close(FD) _close(FD, __FILE__, __func__, __LINE__)
 #define Close(FD) _close(&FD, __FILE__, __func__, __LINE__)
-int bind_socket(char *url, char *port);
+int bind_socket(char *url, char *port, const bool reuseport);
 int connect_socket(char *url, char *port);
 int round_trip(char *url);
 int write_socket(int fd, const void *buf, size_t nbyte);
+int write_socketv(int fd, struct iovec *iov, int iovcnt);
 void empty_socket(int fd);
 void _close_unix_socket(int *sockd, const char *server_path);
 #define close_unix_socket(sockd, server_path) _close_unix_socket(&sockd, server_path)
@@ -568,12 +589,19 @@ bool _validhex(const char *buf, const char *file, const char *func, const int li
 #define validhex(buf) _validhex(buf, __FILE__, __func__, __LINE__)
 bool _hex2bin(void *p, const void *vhexstr, size_t len, const char *file, const char *func, const int line);
 #define hex2bin(p, vhexstr, len) _hex2bin(p, vhexstr, len, __FILE__, __func__, __LINE__)
+char *base64_encode(const uchar *src, size_t len);
 char *http_base64(const char *src);
+uchar *base64_decode(const char *src, size_t *len);
 void b58tobin(char *b58bin, const char *b58);
 int safecmp(const char *a, const char *b);
 bool cmdmatch(const char *buf, const char *cmd);
 
 int address_to_txn(char *p2h, const char *addr, const bool script, const bool segwit);
+/* Networks an address is valid on, from its base58 version or segwit hrp */
+#define ADDR_MAINNET	(1 << 0)
+#define ADDR_TESTNET	(1 << 1) /* Includes signet */
+#define ADDR_REGTEST	(1 << 2)
+int decode_address(const char *addr, bool *script, bool *segwit);
 int ser_number(uchar *s, int32_t val);
 int get_sernumber(uchar *s);
 bool fulltest(const uchar *hash, const uchar *target);
@@ -587,6 +615,7 @@ void ms_to_ts(ts_t *spec, int64_t ms);
 void ms_to_tv(tv_t *val, int64_t ms);
 void tv_time(tv_t *tv);
 void ts_realtime(ts_t *ts);
+int64_t time_nanos(void);
 
 void cksleep_prepare_r(ts_t *ts);
 void nanosleep_abstime(ts_t *ts_end);
@@ -602,6 +631,11 @@ double tvdiff(tv_t *end, tv_t *start);
 
 void decay_time(double *f, double fadd, double fsecs, double interval);
 double sane_tdiff(tv_t *end, tv_t *start);
+
+void ckhist_add(ckhist_t *hist, int64_t val);
+void ckhist_take(ckhist_t *dst, ckhist_t *src);
+json_t *ckhist_json(const ckhist_t *hist);
+void ckhist_set_json(json_t *val, const char *key, ckhist_t *hist, const bool reset);
 void suffix_string(double val, char *buf, size_t bufsiz, int sigdigits);
 
 double le256todouble(const uchar *target);
@@ -165,6 +165,37 @@ void sha256(const unsigned char *message, unsigned int len, unsigned char *diges
     sha256_final(&ctx, digest);
 }
 
+/* Double sha256 an 80 byte block header into a 32 byte digest. The final
+ * padding of both rounds is fixed for this length so the blocks are built
+ * directly and handed to the transform, skipping the generic update/final
+ * bookkeeping for each share hashed. */
+void sha256d_80(const unsigned char *header, unsigned char *digest)
+{
+    unsigned char block[2 * SHA256_BLOCK_SIZE];
+    unsigned char block2[SHA256_BLOCK_SIZE];
+    sha256_ctx ctx;
+    int j;
+
+    memcpy(block, header, 80);
+    memset(block + 80, 0, sizeof(block) - 80);
+    block[80] = 0x80;
+    UNPACK32(80 << 3, block + sizeof(block) - 4);
+    memset(block2, 0, sizeof(block2));
+    block2[32] = 0x80;
+    UNPACK32(32 << 3, block2 + sizeof(block2) - 4);
+
+    memcpy(ctx.h, sha256_h0, sizeof(ctx.h));
+    sha256_transf(&ctx, block, 2);
+    for (j = 0; j < 8; j++) {
+        UNPACK32(ctx.h[j], &block2[j << 2]);
+    }
+    memcpy(ctx.h, sha256_h0, sizeof(ctx.h));
+    sha256_transf(&ctx, block2, 1);
+    for (j = 0; j < 8; j++) {
+        UNPACK32(ctx.h[j], &digest[j << 2]);
+    }
+}
+
 void sha256_init(sha256_ctx *ctx)
 {
     int i;
@@ -65,5 +65,6 @@ void sha256_update(sha256_ctx *ctx, const unsigned char *message,
 void sha256_final(sha256_ctx *ctx, unsigned char *digest);
 void sha256(const unsigned char *message, unsigned int len,
             unsigned char *digest);
+void sha256d_80(const unsigned char *header, unsigned char *digest);
 
 #endif /* !SHA2_H */
@@ -0,0 +1,76 @@
+/*
+ * Copyright 2014-2023 Con Kolivas
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef SHARELOG_H
+#define SHARELOG_H
+
+#include <stdint.h>
+
+/* Compact binary sharelog format, written instead of json sharelogs when
+ * binarysharelog is set. A file starts with a sharelog_hdr_t followed by a
+ * stream of items, each starting with a one byte type. Strings are interned
+ * per file: each is written once as a SHARELOG_STRING item before the first
+ * share using it, and share records refer to it by id. Ids restart whenever
+ * ckpool reopens the file so a later definition of an id replaces any earlier
+ * one. All values are in host byte order. */
+
+#define SHARELOG_MAGIC "CKSL"
+#define SHARELOG_VERSION 1
+#define SHARELOG_SUFFIX "sharebin"
+
+enum sharelog_type {
+	SHARELOG_STRING = 1,
+	SHARELOG_SHARE
+};
+
+/* Indices of the interned strings in a share record */
+enum sharelog_strings {
+	SLS_WORKERNAME,
+	SLS_USERNAME,
+	SLS_ADDRESS,
+	SLS_AGENT,
+	SLS_CREATEINET,
+	SHARELOG_STRINGS
+};
+
+typedef struct sharelog_hdr {
+	char magic[4];
+	uint32_t version;
+} __attribute__((packed)) sharelog_hdr_t;
+
+/* Followed by len bytes of the string without a terminating NUL */
+typedef struct sharelog_str {
+	uint8_t type;
+	uint8_t pad;
+	uint16_t len;
+	uint32_t id;
+} __attribute__((packed)) sharelog_str_t;
+
+typedef struct sharelog_share {
+	uint8_t type;
+	uint8_t result;
+	int8_t errn;
+	uint8_t enonce1len;
+	uint8_t nonce2len;
+	uint8_t pad[3];
+	uint32_t strings[SHARELOG_STRINGS];
+	int64_t workinfoid;
+	int64_t clientid;
+	int64_t createsec;
+	int64_t creatensec;
+	double diff;
+	double sdiff;
+	uint8_t nonce[4];
+	uint8_t ntime[4];
+	uint8_t hash[32]; /* All zero when the share had no valid workbase */
+	uint8_t enonce1[16];
+	uint8_t nonce2[16];
+} __attribute__((packed)) sharelog_share_t;
+
+#endif /* SHARELOG_H */
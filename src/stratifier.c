@@ -10,10 +10,12 @@
 #include "config.h"
 
 #include <arpa/inet.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include <math.h>
@@ -23,6 +25,9 @@
 #ifdef HAVE_ZMQ_H
 #include <zmq.h>
 #endif
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
 
 #include "ckpool.h"
 #include "libckpool.h"
@@ -33,6 +38,10 @@
 #include "utlist.h"
 #include "connector.h"
 #include "generator.h"
+#include "sharelog.h"
+#ifdef CKBENCH
+#include "ckbench.h"
+#endif
 
 /* Consistent across all pool instances */
 static const char *workpadding = "000000800000000000000000000000000000000000000000000000000000000000000000000000000000000080020000";
@@ -40,6 +49,24 @@ static const char *scriptsig_header = "01000000010000000000000000000000000000000
 static uchar scriptsig_header_bin[41];
 static const double nonces = 4294967296;
 
+/* Share counters of one thread processing shares, only ever written by that
+ * thread and summed by statsupdate with each update of rolling stats. Aligned
+ * to a cache line so no two threads write to the same one. */
+typedef struct uastats uastats_t;
+
+struct uastats {
+	uastats_t *next;
+
+	int64_t shares;
+	int64_t diff_shares;
+	int64_t rejects;
+
+	/* How much of the above statsupdate has accounted for so far */
+	int64_t accounted_shares;
+	int64_t accounted_diff_shares;
+	int64_t accounted_rejects;
+} __attribute__((aligned(64)));
+
 /* Add unaccounted shares when they arrive, remove them with each update of
  * rolling stats. */
 struct pool_stats {
@@ -54,7 +81,6 @@ struct pool_stats {
 	int remote_users;
 
 	/* Absolute shares stats */
-	int64_t unaccounted_shares;
 	int64_t accounted_shares;
 
 	/* Cycle of 32 to determine which users to dump stats on */
@@ -67,9 +93,7 @@ struct pool_stats {
 	double sps60;
 
 	/* Diff shares stats */
-	int64_t unaccounted_diff_shares;
 	int64_t accounted_diff_shares;
-	int64_t unaccounted_rejects;
 	int64_t accounted_rejects;
 
 	/* Diff shares per second for 1/5/15... minute rolling averages */
@@ -102,17 +126,77 @@ typedef struct json_params json_params_t;
 struct smsg {
 	json_t *json_msg;
 	int64_t client_id;
+
+	/* A message already serialised for the one client instead of json_msg */
+	char *buf;
+
+	/* For broadcasts, one pre-serialised message shared by a list of
+	 * clients instead of a json_msg per client */
+	ckbuf_t *ckbuf;
+	int64_t *client_ids;
+	int clients;
+
+	/* For share results, when the share was read and this was queued */
+	int64_t stamp;
+	int64_t queued;
+
+	/* A submit from the connector queued on srecvs without any json */
+	stratum_submit_t *submit;
 };
 
 typedef struct smsg smsg_t;
 
+/* Sharelog entries queued for the sharelog writer thread */
+typedef struct sharelog sharelog_t;
+
+struct sharelog {
+	sharelog_t *next;
+	sharelog_t *prev;
+	char *fname;
+	char *buf;
+	int len;
+
+	/* Binary records hold a sharelog_share_t in buf with the strings to
+	 * be interned by the writer */
+	bool binary;
+	char *strings[SHARELOG_STRINGS];
+};
+
+/* Strings already written to a binary sharelog file and their ids */
+typedef struct sharelog_strid sharelog_strid_t;
+
+struct sharelog_strid {
+	UT_hash_handle hh;
+	char *str;
+	uint32_t id;
+};
+
+/* Open append descriptors held by the sharelog writer, one per logfile */
+typedef struct sharelog_fd sharelog_fd_t;
+
+struct sharelog_fd {
+	UT_hash_handle hh;
+	char *fname;
+	int fd;
+	time_t last_write;
+
+	/* String dictionary for binary sharelogs */
+	sharelog_strid_t *strids;
+	uint32_t strid;
+};
+
 struct userwb {
 	UT_hash_handle hh;
 	int64_t id;
 
+	struct user_instance *user;
+	struct userwb *next; // Next userwb of the same workbase
+
 	uchar *coinb2bin; // Coinb2 cointaining this user's address for generation
 	char *coinb2;
 	int coinb2len; // Length of user coinb2
+
+	ckbuf_t *notify[2]; // Serialised notify for this user, indexed by clean
 };
 
 struct user_instance;
@@ -121,6 +205,21 @@ struct stratum_instance;
 
 typedef struct user_instance user_instance_t;
 typedef struct worker_instance worker_instance_t;
+typedef struct slab slab_t;
+
+/* Rolling diff shares per second averages. Shares only add to uadiff and the
+ * averages are decayed at most once every METER_INTERVAL on the share path,
+ * leaving readers to see them as of no older than that with meter_snapshot */
+typedef struct hashmeter {
+	double uadiff; /* Shares not yet accounted for in the averages */
+	tv_t last_decay;
+
+	double dsps1; /* Diff shares per second, 1 minute rolling average */
+	double dsps5; /* ... 5 minute ... */
+	double dsps60;/* etc */
+	double dsps1440;
+	double dsps10080;
+} hashmeter_t;
 typedef struct stratum_instance stratum_instance_t;
 
 struct user_instance {
@@ -149,15 +248,13 @@ struct user_instance {
 
 	int64_t shares;
 
-	int64_t uadiff; /* Shares not yet accounted for in hashmeter */
-
-	double dsps1; /* Diff shares per second, 1 minute rolling average */
-	double dsps5; /* ... 5 minute ... */
-	double dsps60;/* etc */
-	double dsps1440;
-	double dsps10080;
+	hashmeter_t meter;
 	tv_t last_share;
-	tv_t last_decay;
+
+	/* Set whenever anything in this user's or its workers' stored stats
+	 * changes, cleared once statsupdate has stored them */
+	bool dirty;
+	time_t last_stored;
 
 	bool authorised; /* Has this username ever been authorised? */
 	time_t auth_time;
@@ -168,144 +265,151 @@ struct user_instance {
 
 /* Combined data from workers with the same workername */
 struct worker_instance {
+	/* Used for every share, kept together at the start */
 	user_instance_t *user_instance;
-	char *workername;
-
-	/* Number of stratum instances attached as this one worker */
-	int instance_count;
-
-	worker_instance_t *next;
-	worker_instance_t *prev;
-
 	int64_t shares;
+	hashmeter_t meter;
+	tv_t last_share;
+	double best_diff; /* Best share found by this worker */
+	bool idle;
 
-	int64_t uadiff; /* Shares not yet accounted for in hashmeter */
+	bool notified_idle;
+	int mindiff; /* User chosen mindiff */
+	int64_t best_ever; /* Best share ever found by this worker */
 
-	double dsps1;
-	double dsps5;
-	double dsps60;
-	double dsps1440;
-	double dsps10080;
-	tv_t last_share;
-	tv_t last_decay;
+	/* Number of stratum instances attached as this one worker */
+	int instance_count;
 	time_t start_time;
 
-	double best_diff; /* Best share found by this worker */
-	int64_t best_ever; /* Best share ever found by this worker */
-	int mindiff; /* User chosen mindiff */
+	char *workername;
 
-	bool idle;
-	bool notified_idle;
+	worker_instance_t *next;
+	worker_instance_t *prev;
 };
 
 typedef struct stratifier_data sdata_t;
 
 typedef struct proxy_base proxy_t;
 
-/* Per client stratum instance == workers */
+/* Per client stratum instance == workers. The fields used by every share
+ * come first, packed into as few cache lines as possible, followed by the
+ * rarely used ones. Allocated from the cache line aligned instance slab. */
 struct stratum_instance {
 	UT_hash_handle hh;
 	int64_t id;
 
-	/* Virtualid used as unique local id for passthrough clients */
-	int64_t virtualid;
-
-	stratum_instance_t *recycled_next;
-	stratum_instance_t *recycled_prev;
-
-	stratum_instance_t *user_next;
-	stratum_instance_t *user_prev;
-
-	stratum_instance_t *node_next;
-	stratum_instance_t *node_prev;
-
-	stratum_instance_t *remote_next;
-	stratum_instance_t *remote_prev;
-
-	/* Descriptive of ID number and passthrough if any */
-	char identity[128];
-
 	/* Reference count for when this instance is used outside of the
-	 * instance_lock */
+	 * instance_lock, changed atomically */
 	int ref;
+	int ssdc; /* Shares since diff change */
 
-	char enonce1[36]; /* Fit up to 16 byte binary enonce1 */
-	uchar enonce1bin[16];
-	char enonce1var[20]; /* Fit up to 8 byte binary enonce1var */
-	uint64_t enonce1_64;
-	int session_id;
+	sdata_t *sdata; /* Which sdata this client is bound to */
+	ckpool_t *ckp;
+	user_instance_t *user_instance;
+	worker_instance_t *worker_instance;
+	char *workername;
 
 	int64_t diff; /* Current diff */
 	int64_t old_diff; /* Previous diff */
 	int64_t diff_change_job_id; /* Last job_id we changed diff */
+	int64_t suggest_diff; /* Stratum client suggested diff */
+	double best_diff; /* Best share found by this instance */
 
-	int64_t uadiff; /* Shares not yet accounted for in hashmeter */
-
-	double dsps1; /* Diff shares per second, 1 minute rolling average */
-	double dsps5; /* ... 5 minute ... */
-	double dsps60;/* etc */
-	double dsps1440;
-	double dsps10080;
+	hashmeter_t meter;
 	tv_t ldc; /* Last diff change */
-	int ssdc; /* Shares since diff change */
 	tv_t first_share;
 	tv_t last_share;
-	tv_t last_decay;
 	time_t first_invalid; /* Time of first invalid in run of non stale rejects */
-	time_t upstream_invalid; /* As first_invalid but for upstream responses */
-	time_t start_time;
 
-	char address[INET6_ADDRSTRLEN];
-	bool node; /* Is this a mining node */
+	uchar enonce1bin[16];
+	uint64_t enonce1_64;
+
 	bool subscribed;
-	bool authorising; /* In progress, protected by instance_lock */
 	bool authorised;
 	bool dropped;
 	bool idle;
+	bool node; /* Is this a mining node */
+	bool compact; /* Node sent txndelta/workdelta, protected by instance_lock */
+	bool zlib; /* Node takes deflated compact payloads */
+	int node_protocol; /* Compact protocol version the node offered */
+	bool passthrough; /* Is this a passthrough */
+	bool trusted; /* Is this a trusted remote server */
+	bool remote; /* Is this a remote client on a trusted remote server */
+	bool diff_pending; /* New diff to be sent with the next notify */
 	int reject;	/* Indicator that this client is having a run of rejects
 			 * or other problem and should be dropped lazily if
 			 * this is set to 2 */
+	int server; /* Which server is this instance bound to */
+
+	/* Everything below is only used on connection, auth and the like */
+
+	/* Virtualid used as unique local id for passthrough clients */
+	int64_t virtualid;
+
+	/* Descriptive of ID number and passthrough if any, the longest being
+	 * passthrough:<int64> subclient:<int64> */
+	char identity[64];
+
+	char enonce1[36]; /* Fit up to 16 byte binary enonce1 */
+	char enonce1var[20]; /* Fit up to 8 byte binary enonce1var */
+	int session_id;
+
+	time_t upstream_invalid; /* As first_invalid but for upstream responses */
+	time_t start_time;
+
+	char *address; /* Interned */
+	bool authorising; /* In progress, protected by instance_lock */
 
 	int latency; /* Latency when on a mining node */
 
 	bool reconnect; /* This client really needs to reconnect */
 	time_t reconnect_request; /* The time we sent a reconnect message */
 
-	user_instance_t *user_instance;
-	worker_instance_t *worker_instance;
-
+	/* Interned, shared by every client sending the same string */
 	char *useragent;
-	char *workername;
 	char *password;
 	bool messages; /* Is this a client that understands stratum messages */
 	int user_id;
-	int server; /* Which server is this instance bound to */
-
-	ckpool_t *ckp;
 
 	time_t last_txns; /* Last time this worker requested txn hashes */
 	time_t disconnected_time; /* Time this instance disconnected */
 
-	int64_t suggest_diff; /* Stratum client suggested diff */
-	double best_diff; /* Best share found by this instance */
-
-	sdata_t *sdata; /* Which sdata this client is bound to */
 	proxy_t *proxy; /* Proxy this is bound to in proxy mode */
 	int proxyid; /* Which proxy id  */
 	int subproxyid; /* Which subproxy */
 
-	bool passthrough; /* Is this a passthrough */
-	bool trusted; /* Is this a trusted remote server */
-	bool remote; /* Is this a remote client on a trusted remote server */
+	slab_t *slab; /* Which instance slab this was carved from */
+
+	stratum_instance_t *user_next;
+	stratum_instance_t *user_prev;
+
+	stratum_instance_t *node_next;
+	stratum_instance_t *node_prev;
+
+	stratum_instance_t *remote_next;
+	stratum_instance_t *remote_prev;
 };
 
-struct share {
-	UT_hash_handle hh;
-	uchar hash[32];
-	int64_t workbase_id;
+/* Duplicate share detection table hung off each workbase. Share hashes are
+ * stored open addressed in a power of 2 sized array per stripe, with the
+ * stripe chosen from the hash itself so concurrent share processors rarely
+ * contend on the one lock. An all zero hash marks an empty slot. */
+#define SHARE_STRIPES 16
+#define SHARE_STRIPE_MINSIZE 64
+
+struct share_stripe {
+	mutex_t lock;
+	uchar (*hashes)[32];
+	int64_t size;
+	int64_t count;
+	int64_t generated;
+} __attribute__((aligned(64)));
+
+struct sharetable {
+	struct share_stripe stripes[SHARE_STRIPES];
 };
 
-typedef struct share share_t;
+typedef struct sharetable sharetable_t;
 
 struct proxy_base {
 	UT_hash_handle hh;
@@ -355,25 +459,97 @@ struct proxy_base {
 
 typedef struct session session_t;
 
+/* Disconnected clients' sessions are kept to resume for SESSION_EXPIRE
+ * seconds, on a wheel of one slot per second so expiry only ever visits the
+ * sessions due. */
+#define SESSION_EXPIRE	600
+#define SESSION_WHEEL	1024 /* Power of 2 larger than SESSION_EXPIRE */
+
 struct session {
 	UT_hash_handle hh;
+	UT_hash_handle hh_addr;
+	session_t *next; /* On its expiry wheel slot */
+	session_t *prev;
 	int session_id;
 	uint64_t enonce1_64;
 	int64_t client_id;
 	int userid;
 	time_t added;
-	char address[INET6_ADDRSTRLEN];
+	char *address; /* Interned */
+};
+
+typedef struct addrcache addrcache_t;
+
+/* Results of checking usernames as addresses with bitcoind */
+struct addrcache {
+	UT_hash_handle hh;
+	char address[128];
+	time_t added;
+	bool valid;
+	bool script;
+	bool segwit;
+};
+
+/* Most addresses cached, dropping the oldest beyond this, and how long in
+ * seconds before an address that didn't validate, which may have been a
+ * failure to reach bitcoind, is asked about again. */
+#define ADDRCACHE_MAX 65536
+#define ADDRCACHE_INVALID 60
+
+/* A share accepted in remote mode waiting to go upstream in the next
+ * sharebatch */
+typedef struct remote_share remote_share_t;
+
+struct remote_share {
+	remote_share_t *next;
+	remote_share_t *prev;
+	char *workername;
+	double diff;
+	double sdiff;
 };
 
+/* Milliseconds of shares gathered into each sharebatch */
+#define SHAREBATCH_MS 100
+
 typedef struct txntable txntable_t;
 
+/* Transactions expire a number of generations after the last workbase
+ * referencing them, never more than REFCOUNT_REMOTE + 2 ahead, so this many
+ * slots of the txn wheel never hold two different generations */
+#define TXN_WHEEL 23
+
+/* Every level of the merkle tree of the last local workbase, index 0 of each
+ * being the coinbase placeholder, so the next workbase only rehashes the
+ * subtrees whose transactions changed. Only used by the serialised
+ * block_update. */
+#define MERKLE_LEVELS 17
+
+typedef struct merkle_cache {
+	uchar *level[MERKLE_LEVELS];
+	int size[MERKLE_LEVELS]; /* Hashes held at each level */
+	int alloced[MERKLE_LEVELS];
+} merkle_cache_t;
+
 struct txntable {
 	UT_hash_handle hh;
 	int id;
 	char hash[68];
 	char *data;
-	int refcount;
-	bool seen;
+	int refcount; /* Generations to keep a txn that is being added for */
+
+	/* Short id compact nodes know this txn by, 0 if its txid is unknown */
+	uint32_t sid;
+	uchar txid[32];
+
+	/* As a node, the short id upstream sent this txn with and its entry in
+	 * txn_usids */
+	uint32_t usid;
+	UT_hash_handle uh;
+
+	/* Generation this txn expires at and its place in the txn wheel */
+	int64_t expiry;
+	txntable_t *next;
+	txntable_t *prev;
 };
 
 #define ID_AUTH 0
@@ -387,6 +563,57 @@ struct txntable {
 #define ID_ADDRAUTH 8
 #define ID_HEARTBEAT 9
 
+/* Client instances are spread over shards by id so that looking them up and
+ * reference counting them only takes the one shard lock and never waits on
+ * instance_lock. Adding or removing an instance takes instance_lock and then
+ * the shard lock, so holding instance_lock still allows walking or looking
+ * up any instance. */
+#define INSTANCE_SHARDS 64
+
+typedef struct instance_shard {
+	cklock_t lock;
+	stratum_instance_t *instances;
+} instance_shard_t;
+
+/* Fixed size objects carved from cache line aligned slabs, recycling objects
+ * in place. New objects are always taken from the oldest slab with room so
+ * that after a fall in clients the newer slabs empty and can be freed,
+ * keeping one spare slab's worth of objects. Protected by instance_lock */
+#define SLAB_OBJECTS 256
+
+typedef struct objslab objslab_t;
+
+struct slab {
+	slab_t *next; /* On the objslab's partial list while it has room */
+	slab_t *prev;
+	objslab_t *objslab;
+	int64_t id; /* Order the slab was created in, for the partial list */
+	char *objects;
+	void *recycled; /* Free objects, each storing the next in its first word */
+	int carved; /* Objects handed out from this slab for the first time */
+	int used; /* Objects currently in use */
+};
+
+struct objslab {
+	size_t size; /* Object size rounded up to a whole cache line */
+	slab_t *partial; /* Slabs with objects free, oldest first */
+	int64_t ids; /* Slabs ever created */
+	int64_t count; /* Number of slabs */
+	int64_t used; /* Objects currently in use */
+	int64_t generated; /* Objects ever carved fresh rather than recycled */
+	int64_t freed; /* Slabs freed once empty */
+};
+
+typedef struct strintern strintern_t;
+
+/* Strings repeated across many clients, such as user agents, worker names
+ * and addresses, stored once in a hashtable and reference counted. */
+struct strintern {
+	UT_hash_handle hh;
+	int refs;
+	char str[];
+};
+
 struct stratifier_data {
 	ckpool_t *ckp;
 
@@ -398,9 +625,14 @@ struct stratifier_data {
 	pool_stats_t stats;
 	/* Protects changes to pool stats */
 	mutex_t stats_lock;
-	/* Protects changes to unaccounted pool stats */
+	/* Per thread unaccounted pool stats and the lock protecting the list */
+	uastats_t *uastats;
 	mutex_t uastats_lock;
 
+	/* Shares waiting to be upstreamed in remote mode and their lock */
+	remote_share_t *remote_shares;
+	mutex_t remote_share_lock;
+
 	bool verbose;
 
 	uint64_t enonce1_64;
@@ -417,6 +649,23 @@ struct stratifier_data {
 	int workbases_generated;
 	txntable_t *txns;
 	int64_t txns_generated;
+	merkle_cache_t merkle_cache;
+
+	/* Transactions in lists by the generation they expire at, protected
+	 * by txn_lock. Every update_txns is a new generation */
+	int64_t txn_generation;
+	txntable_t *txn_wheel[TXN_WHEEL];
+
+	/* Last short id given to a txn, protected by txn_lock, and the epoch
+	 * short ids are valid for */
+	uint32_t txn_sid;
+	uint32_t txn_epoch;
+	/* Nodes sent compact messages, protected by instance_lock */
+	int compact_nodes;
+	/* As a node, txns by their upstream short id and the upstream epoch
+	 * those are from, protected by txn_lock */
+	txntable_t *txn_usids;
+	uint32_t upstream_epoch;
 
 	/* Workbases from remote trusted servers */
 	workbase_t *remote_workbases;
@@ -429,6 +678,36 @@ struct stratifier_data {
 	/* Time we last sent out a stratum update */
 	time_t update_time;
 
+	/* Vardiff share rate divisor keeping the pool near its sharebudget */
+	double diff_scale;
+
+	/* Seconds from a new block signal to clean empty and full work, only
+	 * written by block_update */
+	int64_t empty_jobs;
+	double empty_last;
+	double empty_max;
+	int64_t full_jobs;
+	double full_last;
+	double full_max;
+
+	/* Nanosecond latencies of each stage of the share pipeline and waits
+	 * on the busiest locks */
+	ckhist_t submit_queue; /* Connector read till a share processor took it */
+	ckhist_t submit_parse; /* Time taken by parse_submit */
+	ckhist_t send_queue; /* Share result queued till ssend_process took it */
+	ckhist_t recv_process; /* Time taken by srecv_process */
+	ckhist_t instance_wait;
+	ckhist_t workbase_wait;
+	ckhist_t share_wait;
+
+	/* Nanoseconds block_update took to build each template from the
+	 * generator's and then to broadcast it */
+	ckhist_t template_time;
+	ckhist_t broadcast_time;
+
+	/* Results of every share processed indexed by share_err + 9 */
+	int64_t share_results[SE_INVALID_VERSION_MASK + 10];
+
 	int64_t workbase_id;
 	int64_t blockchange_id;
 	int session_id;
@@ -436,30 +715,60 @@ struct stratifier_data {
 	char lastswaphash[68];
 
 	ckmsgq_t *updateq;	// Generator base work updates
+	int sthreads;		// Threads in each of the queue arrays below
 	ckmsgq_t *ssends;	// Stratum sends
 	ckmsgq_t *srecvs;	// Stratum receives
 	ckmsgq_t *sshareq;	// Stratum share sends
-	ckmsgq_t *sauthq;	// Stratum authorisations
+	ckmsgq_t *sauthq;	// Stratum authorisations, one queue per thread
 	ckmsgq_t *stxnq;	// Transaction requests
 
+	/* Bounded queue of sharelog entries for the sharelog writer */
+	mutex_t sharelog_lock;
+	pthread_cond_t sharelog_cond;
+	pthread_cond_t sharelog_space; /* Signalled each time the writer drains */
+	sharelog_t *sharelogs;
+	int sharelogs_queued;
+	int64_t sharelog_bytes;
+	int64_t sharelogs_generated;
+	int64_t sharelogs_stalled;
+	bool sharelog_writing;
+	bool sharelog_flush;
+
 	int user_instance_id;
 
-	stratum_instance_t *stratum_instances;
-	stratum_instance_t *recycled_instances;
+	instance_shard_t instance_shards[INSTANCE_SHARDS];
+	objslab_t instance_slab;
+	objslab_t worker_slab;
 	stratum_instance_t *node_instances;
 	stratum_instance_t *remote_instances;
 
-	int64_t stratum_generated;
 	int64_t disconnected_generated;
 	int64_t userwbs_generated;
+
+	/* Sessions of disconnected clients hashed by session id and address
+	 * under their own lock so subscribes never need the instance lock */
+	cklock_t session_lock;
 	session_t *disconnected_sessions;
+	session_t *session_addrs;
+	session_t *session_wheel[SESSION_WHEEL];
+	time_t sessions_aged; /* Last second expired from the wheel */
 
 	user_instance_t *user_instances;
 
+	/* Interned strings, under their own lock which nests inside any other */
+	mutex_t intern_lock;
+	strintern_t *interned;
+	int64_t interned_refs;
+	int64_t interned_bytes; /* Bytes of unique strings stored */
+	int64_t interned_saved; /* Bytes of duplicates not stored */
+
+	addrcache_t *addrcache;
+	cklock_t addrcache_lock;
+
 	/* Protects both stratum and user instances */
 	cklock_t instance_lock;
 
-	share_t *shares;
+	/* Protects shares_generated from retired share tables */
 	mutex_t share_lock;
 
 	int64_t shares_generated;
@@ -533,8 +842,8 @@ static void generate_coinbase(ckpool_t *ckp, workbase_t *wb)
 	ts_t now;
 
 	/* Set fixed length coinb1 arrays to be more than enough */
-	wb->coinb1 = ckzalloc(256);
-	wb->coinb1bin = ckzalloc(128);
+	wb->coinb1 = arena_alloc(&wb->arena, 256);
+	wb->coinb1bin = arena_alloc(&wb->arena, 128);
 
 	/* Strings in wb should have been zero memset prior. Generate binary
 	 * templates first, then convert to hex */
@@ -573,7 +882,7 @@ static void generate_coinbase(ckpool_t *ckp, workbase_t *wb)
 	len += wb->enonce1varlen;
 	len += wb->enonce2varlen;
 
-	wb->coinb2bin = ckzalloc(512);
+	wb->coinb2bin = arena_alloc(&wb->arena, 512);
 //	memcpy(wb->coinb2bin, "\x0a\x63\x6b\x70\x6f\x6f\x6c", 7);
 	wb->coinb2len = 7;
 	if (ckp->btcsig) {
@@ -614,7 +923,7 @@ static void generate_coinbase(ckpool_t *ckp, workbase_t *wb)
 	/* Coinb2 address goes here, takes up 23~25 bytes + 1 byte for length */
 
 	wb->coinb3len = 0;
-	wb->coinb3bin = ckzalloc(256 + wb->insert_witness * (8 + witnessdata_size + 2));
+	wb->coinb3bin = arena_alloc(&wb->arena, 256 + wb->insert_witness * (8 + witnessdata_size + 2));
 
 	if (ckp->donvalid && ckp->donation > 0) {
 		u64 = (uint64_t *)wb->coinb3bin;
@@ -653,7 +962,7 @@ static void generate_coinbase(ckpool_t *ckp, workbase_t *wb)
 		memcpy(wb->coinb2bin + wb->coinb2len, wb->coinb3bin, wb->coinb3len);
 		wb->coinb2len += wb->coinb3len;
 		wb->coinb3len = 0;
-		dealloc(wb->coinb3bin);
+		wb->coinb3bin = NULL;
 
 		/* Set this only once */
 		if (unlikely(!ckp->coinbase_valid)) {
@@ -730,7 +1039,8 @@ static void generate_coinbase(ckpool_t *ckp, workbase_t *wb)
 	}
 
 	/* Set this just for node compatibility, though it's unused */
-	wb->coinb2 = bin2hex(wb->coinb2bin, wb->coinb2len);
+	wb->coinb2 = arena_alloc(&wb->arena, wb->coinb2len * 2 + 1);
+	__bin2hex(wb->coinb2, wb->coinb2bin, wb->coinb2len);
 	LOGDEBUG("Coinb2: %s", wb->coinb2);
 	/* Coinbases 2 +/- 3 templates complete */
 
@@ -748,127 +1058,414 @@ static void generate_coinbase(ckpool_t *ckp, workbase_t *wb)
 static void stratum_broadcast_update(sdata_t *sdata, const workbase_t *wb, bool clean);
 static void stratum_broadcast_updates(sdata_t *sdata, bool clean);
 
-static void clear_userwb(sdata_t *sdata, int64_t id)
+/* Remove only the userwbs that were generated for this workbase from their
+ * users rather than searching every user */
+static void clear_userwb(sdata_t *sdata, workbase_t *wb)
 {
-	user_instance_t *instance, *tmp;
+	struct userwb *userwb;
 
 	ck_wlock(&sdata->instance_lock);
-	HASH_ITER(hh, sdata->user_instances, instance, tmp) {
-		struct userwb *userwb;
+	for (userwb = wb->userwbs; userwb; userwb = userwb->next) {
+		HASH_DEL(userwb->user->userwbs, userwb);
+		if (userwb->notify[0])
+			ckbuf_put(userwb->notify[0]);
+		if (userwb->notify[1])
+			ckbuf_put(userwb->notify[1]);
+		/* The userwb itself lives in the workbase arena */
+	}
+	wb->userwbs = NULL;
+	ck_wunlock(&sdata->instance_lock);
+}
 
-		HASH_FIND_I64(instance->userwbs, &id, userwb);
-		if (!userwb)
-			continue;
-		HASH_DEL(instance->userwbs, userwb);
-		free(userwb->coinb2bin);
-		free(userwb->coinb2);
-		free(userwb);
+static void free_sharetable(sharetable_t *sharetable)
+{
+	int i;
+
+	for (i = 0; i < SHARE_STRIPES; i++) {
+		mutex_destroy(&sharetable->stripes[i].lock);
+		free(sharetable->stripes[i].hashes);
 	}
-	ck_wunlock(&sdata->instance_lock);
+	free(sharetable);
 }
 
 static void clear_workbase(ckpool_t *ckp, workbase_t *wb)
 {
 	if (ckp->btcsolo)
-		clear_userwb(ckp->sdata, wb->id);
+		clear_userwb(ckp->sdata, wb);
+	if (wb->sharetable)
+		free_sharetable(wb->sharetable);
 	free(wb->flags);
-	free(wb->txn_data);
-	free(wb->txn_hashes);
-	free(wb->logdir);
-	free(wb->coinb1bin);
-	free(wb->coinb1);
-	free(wb->coinb2bin);
-	free(wb->coinb2);
-	free(wb->coinb3bin);
+	if (wb->txnbuf)
+		ckbuf_put(wb->txnbuf);
+	arena_free(&wb->arena);
 	json_decref(wb->merkle_array);
 	if (wb->json)
 		json_decref(wb->json);
 	free(wb);
 }
 
-/* Remove all shares with a workbase id less than wb_id for block changes */
-static void purge_share_hashtable(sdata_t *sdata, const int64_t wb_id)
+/* Size each stripe of a new share table to comfortably hold as many shares
+ * as the previous workbase received, to avoid growing it in the share path. */
+static sharetable_t *create_sharetable(const int64_t expected)
 {
-	share_t *share, *tmp;
-	int purged = 0;
+	sharetable_t *sharetable = ckalloc(sizeof(sharetable_t));
+	int64_t size = SHARE_STRIPE_MINSIZE;
+	int i;
 
-	mutex_lock(&sdata->share_lock);
-	HASH_ITER(hh, sdata->shares, share, tmp) {
-		if (share->workbase_id < wb_id) {
-			HASH_DEL(sdata->shares, share);
-			dealloc(share);
-			purged++;
-		}
+	while (size < expected * 2 / SHARE_STRIPES)
+		size <<= 1;
+	for (i = 0; i < SHARE_STRIPES; i++) {
+		struct share_stripe *stripe = &sharetable->stripes[i];
+
+		mutex_init(&stripe->lock);
+		stripe->hashes = ckzalloc(size * 32);
+		stripe->size = size;
+		stripe->count = stripe->generated = 0;
 	}
+	return sharetable;
+}
+
+/* Approximate count of shares in a table, read unlocked */
+static int64_t sharetable_count(const sharetable_t *sharetable)
+{
+	int64_t count = 0;
+	int i;
+
+	if (sharetable) {
+		for (i = 0; i < SHARE_STRIPES; i++)
+			count += sharetable->stripes[i].count;
+	}
+	return count;
+}
+
+/* Free a workbase's share table once no more shares can be accepted against
+ * it, keeping the count of shares it checked. Must be entered with the
+ * workbase_lock held and no readcount on the workbase. Returns the number of
+ * shares that were in the table. */
+static int64_t __retire_sharetable(sdata_t *sdata, workbase_t *wb)
+{
+	sharetable_t *sharetable = wb->sharetable;
+	int64_t count = 0, generated = 0;
+	int i;
+
+	if (!sharetable)
+		return 0;
+	wb->sharetable = NULL;
+	for (i = 0; i < SHARE_STRIPES; i++) {
+		count += sharetable->stripes[i].count;
+		generated += sharetable->stripes[i].generated;
+	}
+	free_sharetable(sharetable);
+
+	mutex_lock(&sdata->share_lock);
+	sdata->shares_generated += generated;
 	mutex_unlock(&sdata->share_lock);
 
+	return count;
+}
+
+/* Free the share tables of all workbases prior to wb_id on block changes.
+ * Those still in use are freed when they're aged instead. */
+static void purge_share_hashtable(sdata_t *sdata, const int64_t wb_id)
+{
+	workbase_t *wb, *tmp;
+	int64_t purged = 0;
+
+	ck_wlock(&sdata->workbase_lock);
+	HASH_ITER(hh, sdata->workbases, wb, tmp) {
+		if (wb->id < wb_id && !wb->readcount)
+			purged += __retire_sharetable(sdata, wb);
+	}
+	ck_wunlock(&sdata->workbase_lock);
+
 	if (purged)
-		LOGINFO("Cleared %d shares from share hashtable", purged);
+		LOGINFO("Cleared %"PRId64" shares from share hashtable", purged);
+}
+
+/* Authorisations are spread over the authoriser threads by client, so each
+ * client's are still handled in order */
+static void add_sauth(ckpool_t *ckp, json_params_t *jp)
+{
+	sdata_t *sdata = ckp->sdata;
+
+	ckmsgq_add(ckmsgq_by_id(sdata->sauthq, jp->client_id), jp);
+}
+
+static void free_smsg(smsg_t *msg)
+{
+	if (msg->json_msg)
+		json_decref(msg->json_msg);
+	if (msg->ckbuf)
+		ckbuf_put(msg->ckbuf);
+	free(msg->buf);
+	free(msg->client_ids);
+	free(msg->submit);
+	free(msg);
+}
+
+/* Split a broadcast into one message per ssends queue, each for the clients
+ * that queue sends to and sharing the one serialised buffer, appending them
+ * to the per queue lists in sends. Frees the original message. */
+static void split_broadcast(sdata_t *sdata, smsg_t *bmsg, ckmsg_t **sends)
+{
+	const int threads = sdata->ssends->count;
+	smsg_t **msgs = ckzalloc(sizeof(smsg_t *) * threads);
+	int *clients = ckzalloc(sizeof(int) * threads);
+	int i, j;
+
+	for (j = 0; j < bmsg->clients; j++)
+		clients[(uint64_t)bmsg->client_ids[j] % threads]++;
+	for (j = 0; j < bmsg->clients; j++) {
+		int64_t client_id = bmsg->client_ids[j];
+		smsg_t *msg;
+
+		i = (uint64_t)client_id % threads;
+		msg = msgs[i];
+		if (!msg) {
+			msg = msgs[i] = ckzalloc(sizeof(smsg_t));
+			msg->ckbuf = bmsg->ckbuf;
+			ckbuf_get(msg->ckbuf, 1);
+			msg->client_ids = ckalloc(sizeof(int64_t) * clients[i]);
+		}
+		msg->client_ids[msg->clients++] = client_id;
+	}
+	for (i = 0; i < threads; i++) {
+		ckmsg_t *client_msg;
+
+		if (!msgs[i])
+			continue;
+		client_msg = ckalloc(sizeof(ckmsg_t));
+		client_msg->data = msgs[i];
+		DL_APPEND(sends[i], client_msg);
+	}
+	free(clients);
+	free(msgs);
+	free_smsg(bmsg);
+}
+
+/* Spread a bulk list of sends over the ssends queues by client id so that
+ * each client's messages are always sent, in order, by the same thread. */
+static void ssend_bulk_add(sdata_t *sdata, ckmsg_t *bulk_send, const bool prio)
+{
+	const int threads = sdata->ssends->count;
+	ckmsg_t **sends, *client_msg, *tmp;
+	int i;
+
+	if (threads < 2) {
+		ckmsgq_addbulk(sdata->ssends, bulk_send, prio);
+		return;
+	}
+	sends = ckzalloc(sizeof(ckmsg_t *) * threads);
+	DL_FOREACH_SAFE(bulk_send, client_msg, tmp) {
+		smsg_t *msg = client_msg->data;
+
+		DL_DELETE(bulk_send, client_msg);
+		if (msg->ckbuf) {
+			split_broadcast(sdata, msg, sends);
+			free(client_msg);
+			continue;
+		}
+		DL_APPEND(sends[(uint64_t)msg->client_id % threads], client_msg);
+	}
+	for (i = 0; i < threads; i++) {
+		if (sends[i])
+			ckmsgq_addbulk(&sdata->ssends[i], sends[i], prio);
+	}
+	free(sends);
+}
+
+/* Append a bulk list already created to the ssends list */
+static void ssend_bulk_append(sdata_t *sdata, ckmsg_t *bulk_send)
+{
+	ssend_bulk_add(sdata, bulk_send, false);
+}
+
+/* As ssend_bulk_append but for high priority messages to be put at the front
+ * of the list. */
+static void ssend_bulk_prepend(sdata_t *sdata, ckmsg_t *bulk_send)
+{
+	ssend_bulk_add(sdata, bulk_send, true);
+}
+
+/* Queue a single message on the ssends queue for its client, splitting
+ * broadcasts across the queues. */
+static bool ssend_add(sdata_t *sdata, smsg_t *msg)
+{
+	ckmsg_t *client_msg, *bulk_send = NULL;
+
+	if (!msg->ckbuf)
+		return ckmsgq_add(ckmsgq_by_id(sdata->ssends, msg->client_id), msg);
+	client_msg = ckalloc(sizeof(ckmsg_t));
+	client_msg->data = msg;
+	DL_APPEND(bulk_send, client_msg);
+	ssend_bulk_add(sdata, bulk_send, false);
+	return true;
+}
+
+/* Send a json msg to an upstream trusted remote server */
+static void upstream_json(ckpool_t *ckp, json_t *val)
+{
+	char *msg;
+
+	msg = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER | JSON_COMPACT | JSON_EOL);
+	/* Connector absorbs and frees msg */
+	connector_upstream_msg(ckp, msg);
+}
+
+/* Upstream a json msgtype */
+static void upstream_json_msgtype(ckpool_t *ckp, json_t *val, const int msg_type)
+{
+	json_set_string(val, "method", stratum_msgs[msg_type]);
+	upstream_json(ckp, val);
+}
+
+/* Largest inflated compact payload a node will accept */
+#define COMPACT_MAXSIZE 0x10000000
+
+/* Set the data of a compact message to the base64 of payload, deflated with
+ * its inflated size if asked for and that makes it any smaller. */
+static void compact_payload(json_t *val, const uchar *payload, const size_t len, const bool zlib)
+{
+	char *data = NULL;
+
+	json_object_del(val, "size");
+#ifdef USE_ZLIB
+	if (zlib && len) {
+		uLongf zlen = compressBound(len);
+		uchar *zbuf = ckalloc(zlen);
+
+		if (compress(zbuf, &zlen, payload, len) == Z_OK && zlen < len) {
+			data = base64_encode(zbuf, zlen);
+			json_set_int64(val, "size", len);
+		}
+		free(zbuf);
+	}
+#endif
+	if (!data)
+		data = base64_encode(payload, len);
+	json_set_string(val, "data", data);
+	free(data);
 }
 
-/* Remove all shares with a workbase id == wb_id being discarded */
-static void age_share_hashtable(sdata_t *sdata, const int64_t wb_id)
+/* Returns the decoded payload of a compact message and its length */
+static uchar *compact_data(const json_t *val, size_t *len)
 {
-	share_t *share, *tmp;
-	int aged = 0;
+	const char *data = json_string_value(json_object_get(val, "data"));
+	json_t *size_val = json_object_get(val, "size");
+	uchar *payload, *ret = NULL;
+	size_t plen;
+#ifdef USE_ZLIB
+	uLongf size;
+#endif
 
-	mutex_lock(&sdata->share_lock);
-	HASH_ITER(hh, sdata->shares, share, tmp) {
-		if (share->workbase_id == wb_id) {
-			HASH_DEL(sdata->shares, share);
-			dealloc(share);
-			aged++;
-		}
+	if (unlikely(!data))
+		goto out;
+	payload = base64_decode(data, &plen);
+	if (unlikely(!payload))
+		goto out;
+	if (!size_val) {
+		*len = plen;
+		ret = payload;
+		goto out;
 	}
-	mutex_unlock(&sdata->share_lock);
-
-	if (aged)
-		LOGINFO("Aged %d shares from share hashtable", aged);
+#ifdef USE_ZLIB
+	size = json_integer_value(size_val);
+	if (likely(size <= COMPACT_MAXSIZE)) {
+		ret = ckalloc(size + 1);
+		if (likely(uncompress(ret, &size, payload, plen) == Z_OK))
+			*len = size;
+		else
+			dealloc(ret);
+	}
+#endif
+	free(payload);
+out:
+	return ret;
 }
 
-/* Append a bulk list already created to the ssends list */
-static void ssend_bulk_append(sdata_t *sdata, ckmsg_t *bulk_send, const int messages)
-{
-	ckmsgq_t *ssends = sdata->ssends;
+/* A txndelta payload being built, each txn being its little endian short id,
+ * txid, little endian length and raw data */
+typedef struct txndelta {
+	uchar *buf;
+	size_t len;
+	size_t alloced;
+} txndelta_t;
 
-	mutex_lock(ssends->lock);
-	ssends->messages += messages;
-	DL_CONCAT(ssends->msgs, bulk_send);
-	pthread_cond_signal(ssends->cond);
-	mutex_unlock(ssends->lock);
-}
+#define TXNDELTA_HEADER 40
 
-/* As ssend_bulk_append but for high priority messages to be put at the front
- * of the list. */
-static void ssend_bulk_prepend(sdata_t *sdata, ckmsg_t *bulk_send, const int messages)
+static void txndelta_add(txndelta_t *delta, const txntable_t *txn)
 {
-	ckmsgq_t *ssends = sdata->ssends;
-	ckmsg_t *tmp;
+	size_t len = strlen(txn->data) / 2;
+	uint32_t u32;
+	uchar *p;
 
-	mutex_lock(ssends->lock);
-	tmp = ssends->msgs;
-	ssends->msgs = bulk_send;
-	ssends->messages += messages;
-	DL_CONCAT(ssends->msgs, tmp);
-	pthread_cond_signal(ssends->cond);
-	mutex_unlock(ssends->lock);
+	if (delta->len + TXNDELTA_HEADER + len > delta->alloced) {
+		delta->alloced = (delta->len + TXNDELTA_HEADER + len) * 2;
+		delta->buf = realloc(delta->buf, delta->alloced);
+		if (unlikely(!delta->buf))
+			quit(1, "Failed to realloc txndelta of size %lu", delta->alloced);
+	}
+	p = delta->buf + delta->len;
+	u32 = htole32(txn->sid);
+	memcpy(p, &u32, 4);
+	memcpy(p + 4, txn->txid, 32);
+	u32 = htole32(len);
+	memcpy(p + 36, &u32, 4);
+	hex2bin(p + TXNDELTA_HEADER, txn->data, len);
+	delta->len += TXNDELTA_HEADER + len;
 }
 
-/* Send a json msg to an upstream trusted remote server */
-static void upstream_json(ckpool_t *ckp, json_t *val)
+/* Returns the next txn in a txndelta payload after filling in the fields of
+ * the one at p, or NULL if it's truncated */
+static const uchar *txndelta_next(const uchar *p, const uchar *end, uint32_t *sid,
+				  const uchar **txid, const uchar **data, uint32_t *len)
 {
-	char *msg;
-
-	msg = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER | JSON_COMPACT | JSON_EOL);
-	/* Connector absorbs and frees msg */
-	connector_upstream_msg(ckp, msg);
+	if (unlikely(end - p < TXNDELTA_HEADER))
+		return NULL;
+	memcpy(sid, p, 4);
+	*sid = le32toh(*sid);
+	*txid = p + 4;
+	memcpy(len, p + 36, 4);
+	*len = le32toh(*len);
+	*data = p + TXNDELTA_HEADER;
+	if (unlikely(end - *data < *len))
+		return NULL;
+	return *data + *len;
 }
 
-/* Upstream a json msgtype */
-static void upstream_json_msgtype(ckpool_t *ckp, json_t *val, const int msg_type)
+/* Send val with the payload to every compact node, serialised once for those
+ * taking deflated payloads and once for the rest. Takes ownership of val. */
+static void compact_broadcast(sdata_t *sdata, json_t *val, const uchar *payload, const size_t len)
 {
-	json_set_string(val, "method", stratum_msgs[msg_type]);
-	upstream_json(ckp, val);
+	int64_t *client_ids[2] = {NULL, NULL};
+	int clients[2] = {0, 0};
+	stratum_instance_t *client;
+	int i;
+
+	ck_rlock(&sdata->instance_lock);
+	DL_FOREACH2(sdata->node_instances, client, node_next) {
+		if (!client->compact)
+			continue;
+		i = client->zlib;
+		if (!client_ids[i])
+			client_ids[i] = ckalloc(sizeof(int64_t) * sdata->compact_nodes);
+		client_ids[i][clients[i]++] = client->id;
+	}
+	ck_runlock(&sdata->instance_lock);
+
+	for (i = 0; i < 2; i++) {
+		smsg_t *msg;
+
+		if (!clients[i])
+			continue;
+		compact_payload(val, payload, len, i);
+		msg = ckzalloc(sizeof(smsg_t));
+		msg->ckbuf = create_ckbuf(json_dumps(val, JSON_EOL | JSON_COMPACT));
+		msg->client_ids = client_ids[i];
+		msg->clients = clients[i];
+		ssend_add(sdata, msg);
+	}
+	json_decref(val);
 }
 
 /* Upstream a json msgtype, duplicating the json */
@@ -885,8 +1482,12 @@ static void send_node_workinfo(ckpool_t *ckp, sdata_t *sdata, const workbase_t *
 {
 	stratum_instance_t *client;
 	ckmsg_t *bulk_send = NULL;
-	int messages = 0;
 	json_t *wb_val;
+	bool compact;
+
+	/* Compact nodes get the short ids of the txns instead of their hashes
+	 * if this workbase has them */
+	compact = sdata->compact_nodes && (wb->sids || !wb->txns);
 
 	wb_val = json_object();
 
@@ -917,8 +1518,11 @@ static void send_node_workinfo(ckpool_t *ckp, sdata_t *sdata, const workbase_t *
 	DL_FOREACH2(sdata->node_instances, client, node_next) {
 		ckmsg_t *client_msg;
 		smsg_t *msg;
-		json_t *json_msg = json_deep_copy(wb_val);
+		json_t *json_msg;
 
+		if (compact && client->compact)
+			continue;
+		json_msg = json_deep_copy(wb_val);
 		json_set_string(json_msg, "node.method", stratum_msgs[SM_WORKINFO]);
 		client_msg = ckalloc(sizeof(ckmsg_t));
 		msg = ckzalloc(sizeof(smsg_t));
@@ -926,7 +1530,6 @@ static void send_node_workinfo(ckpool_t *ckp, sdata_t *sdata, const workbase_t *
 		msg->client_id = client->id;
 		client_msg->data = msg;
 		DL_APPEND(bulk_send, client_msg);
-		messages++;
 	}
 	DL_FOREACH2(sdata->remote_instances, client, remote_next) {
 		ckmsg_t *client_msg;
@@ -940,18 +1543,26 @@ static void send_node_workinfo(ckpool_t *ckp, sdata_t *sdata, const workbase_t *
 		msg->client_id = client->id;
 		client_msg->data = msg;
 		DL_APPEND(bulk_send, client_msg);
-		messages++;
 	}
 	ck_runlock(&sdata->instance_lock);
 
 	if (ckp->remote)
 		upstream_msgtype(ckp, wb_val, SM_WORKINFO);
 
+	if (compact) {
+		json_t *delta_val = json_deep_copy(wb_val);
+
+		json_object_del(delta_val, "txn_hashes");
+		json_set_string(delta_val, "node.method", stratum_msgs[SM_WORKDELTA]);
+		json_set_uint32(delta_val, "epoch", sdata->txn_epoch);
+		compact_broadcast(sdata, delta_val, (const uchar *)wb->sids,
+				  wb->txns * sizeof(uint32_t));
+	}
 	json_decref(wb_val);
 
 	if (bulk_send) {
 		LOGINFO("Sending workinfo to mining nodes");
-		ssend_bulk_append(sdata, bulk_send, messages);
+		ssend_bulk_append(sdata, bulk_send);
 	}
 }
 
@@ -987,21 +1598,24 @@ static void send_workinfo(ckpool_t *ckp, sdata_t *sdata, const workbase_t *wb)
 		send_node_workinfo(ckp, sdata, wb);
 }
 
-/* Entered with instance_lock held, make sure wb can't be pulled from us */
-static void __generate_userwb(sdata_t *sdata, workbase_t *wb, user_instance_t *user)
+/* Return this user's coinbase for wb, generating it the first time a client
+ * of the user needs a notify or submits a share on it so that only active
+ * users ever have one. NULL if the user has no valid address. Entered with
+ * instance_lock write held, make sure wb can't be pulled from us. */
+static struct userwb *__get_userwb(sdata_t *sdata, workbase_t *wb, user_instance_t *user)
 {
 	struct userwb *userwb;
 	int64_t id = wb->id;
 
-	/* Make sure this user doesn't have this userwb already */
 	HASH_FIND_I64(user->userwbs, &id, userwb);
-	if (unlikely(userwb))
-		return;
+	if (likely(userwb) || !user->btcaddress)
+		return userwb;
 
 	sdata->userwbs_generated++;
-	userwb = ckzalloc(sizeof(struct userwb));
+	userwb = arena_alloc(&wb->arena, sizeof(struct userwb));
 	userwb->id = id;
-	userwb->coinb2bin = ckalloc(wb->coinb2len + 1 + user->txnlen + wb->coinb3len);
+	userwb->user = user;
+	userwb->coinb2bin = arena_alloc(&wb->arena, wb->coinb2len + 1 + user->txnlen + wb->coinb3len);
 	memcpy(userwb->coinb2bin, wb->coinb2bin, wb->coinb2len);
 	userwb->coinb2len = wb->coinb2len;
 	userwb->coinb2bin[userwb->coinb2len++] = user->txnlen;
@@ -1009,21 +1623,12 @@ static void __generate_userwb(sdata_t *sdata, workbase_t *wb, user_instance_t *u
 	userwb->coinb2len += user->txnlen;
 	memcpy(userwb->coinb2bin + userwb->coinb2len, wb->coinb3bin, wb->coinb3len);
 	userwb->coinb2len += wb->coinb3len;
-	userwb->coinb2 = bin2hex(userwb->coinb2bin, userwb->coinb2len);
+	userwb->coinb2 = arena_alloc(&wb->arena, userwb->coinb2len * 2 + 1);
+	__bin2hex(userwb->coinb2, userwb->coinb2bin, userwb->coinb2len);
 	HASH_ADD_I64(user->userwbs, id, userwb);
-}
-
-static void generate_userwbs(sdata_t *sdata, workbase_t *wb)
-{
-	user_instance_t *instance, *tmp;
-
-	ck_wlock(&sdata->instance_lock);
-	HASH_ITER(hh, sdata->user_instances, instance, tmp) {
-		if (!instance->btcaddress)
-			continue;
-		__generate_userwb(sdata, wb, instance);
-	}
-	ck_wunlock(&sdata->instance_lock);
+	userwb->next = wb->userwbs;
+	wb->userwbs = userwb;
+	return userwb;
 }
 
 /* Add a new workbase to the table of workbases. Sdata is the global data in
@@ -1037,6 +1642,9 @@ static void add_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, bool *new_bl
 	int len, ret;
 
 	ts_realtime(&wb->gentime);
+	/* Every share's coinbase starts with coinb1 so hash it only once */
+	sha256_init(&wb->coinb1ctx);
+	sha256_update(&wb->coinb1ctx, wb->coinb1bin, wb->coinb1len);
 	/* Stats network_diff is not protected by lock but is not a critical
 	 * value */
 	wb->network_diff = diff_from_nbits(wb->headerbin + 72);
@@ -1046,7 +1654,7 @@ static void add_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, bool *new_bl
 	if (stats->network_diff != old_diff)
 		LOGWARNING("Network diff set to %.1f", stats->network_diff);
 	len = strlen(ckp->logdir) + 8 + 1 + 16 + 1;
-	wb->logdir = ckzalloc(len);
+	wb->logdir = arena_alloc(&wb->arena, len);
 
 	/* In proxy mode, the wb->id is received in the notify update and
 	 * we set workbase_id from it. In server mode the stratifier is
@@ -1077,6 +1685,8 @@ static void add_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, bool *new_bl
 	if (ckp->logshares)
 		sprintf(wb->logdir, "%s%08x/%s", ckp->logdir, wb->height, wb->idstring);
 
+	wb->sharetable = create_sharetable(sdata->current_workbase ?
+		sharetable_count(sdata->current_workbase->sharetable) : 0);
 	HASH_ADD_I64(sdata->workbases, id, wb);
 	if (sdata->current_workbase)
 		tv_time(&sdata->current_workbase->retired);
@@ -1095,10 +1705,10 @@ static void add_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, bool *new_bl
 		/*  Age old workbases older than 10 minutes old */
 		if (tmp->gentime.tv_sec < wb->gentime.tv_sec - 600) {
 			HASH_DEL(sdata->workbases, tmp);
+			__retire_sharetable(sdata, tmp);
 			ck_wunlock(&sdata->workbase_lock);
 
 			/* Drop lock to avoid recursive locks */
-			age_share_hashtable(sdata, tmp->id);
 			clear_workbase(ckp, tmp);
 
 			ck_wlock(&sdata->workbase_lock);
@@ -1106,11 +1716,6 @@ static void add_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb, bool *new_bl
 	}
 	ck_wunlock(&sdata->workbase_lock);
 
-	/* This wb can't be pulled out from under us so no workbase lock is
-	 * required to generate_userwbs */
-	if (ckp->btcsolo)
-		generate_userwbs(sdata, wb);
-
 	if (*new_block)
 		purge_share_hashtable(sdata, wb->id);
 
@@ -1124,6 +1729,26 @@ static void broadcast_ping(sdata_t *sdata);
 #define REFCOUNT_LOCAL		10
 #define REFCOUNT_RETURNED	5
 
+/* Enter with txn_lock held. Keep txn for at least refs more generations of
+ * update_txns, moving it to its new slot in the txn wheel. */
+static void __ref_txn(sdata_t *sdata, txntable_t *txn, const int refs)
+{
+	int64_t expiry = sdata->txn_generation + refs + 2;
+
+	if (expiry <= txn->expiry)
+		return;
+	if (txn->expiry)
+		DL_DELETE(sdata->txn_wheel[txn->expiry % TXN_WHEEL], txn);
+	txn->expiry = expiry;
+	DL_APPEND(sdata->txn_wheel[expiry % TXN_WHEEL], txn);
+}
+
+/* Enter with txn_lock held */
+static int __txn_refs(const sdata_t *sdata, const txntable_t *txn)
+{
+	return txn->expiry - sdata->txn_generation - 2;
+}
+
 /* Submit the transactions in node/remote mode so the local btcd has all the
  * transactions that will go into the next blocksolve. */
 static void submit_transaction(ckpool_t *ckp, const char *hash)
@@ -1140,8 +1765,9 @@ static void submit_transaction(ckpool_t *ckp, const char *hash)
 /* Build a hashlist of all transactions, allowing us to compare with the list of
  * existing transactions to determine which need to be propagated */
 static bool add_txn(ckpool_t *ckp, sdata_t *sdata, txntable_t **txns, const char *hash,
-		    const char *data, bool local)
+		    const char *txid, const char *data, bool local, uint32_t *sid)
 {
+	uint32_t newsid = 0;
 	bool found = false;
 	txntable_t *txn;
 
@@ -1152,14 +1778,20 @@ static bool add_txn(ckpool_t *ckp, sdata_t *sdata, txntable_t **txns, const char
 	if (txn) {
 		/* If we already have this in our transaction table but haven't
 		 * seen it in a while, it is reappearing in work and we should
-		 * propagate it again in update_txns. */
-		if (txn->refcount > REFCOUNT_RETURNED)
+		 * propagate it again in update_txns. A txn added without its
+		 * txid is propagated again to give it a short id. */
+		if (__txn_refs(sdata, txn) > REFCOUNT_RETURNED && (txn->sid || !txid)) {
 			found = true;
-		if (!local)
-			txn->refcount = REFCOUNT_REMOTE;
-		else if (txn->refcount < REFCOUNT_LOCAL)
-			txn->refcount = REFCOUNT_LOCAL;
-		txn->seen = true;
+			if (sid)
+				*sid = txn->sid;
+		}
+		__ref_txn(sdata, txn, local ? REFCOUNT_LOCAL : REFCOUNT_REMOTE);
+	}
+	/* Propagated txns get a new short id, skipping 0 on wrapping */
+	if (!found && txid) {
+		if (unlikely(!++sdata->txn_sid))
+			++sdata->txn_sid;
+		newsid = sdata->txn_sid;
 	}
 	ck_wunlock(&sdata->txn_lock);
 
@@ -1168,6 +1800,10 @@ static bool add_txn(ckpool_t *ckp, sdata_t *sdata, txntable_t **txns, const char
 
 	txn = ckzalloc(sizeof(txntable_t));
 	memcpy(txn->hash, hash, 65);
+	if (newsid && hex2bin(txn->txid, txid, 32))
+		txn->sid = newsid;
+	if (sid)
+		*sid = txn->sid;
 	if (local)
 		txn->data = strdup(data);
 	else {
@@ -1182,7 +1818,6 @@ static bool add_txn(ckpool_t *ckp, sdata_t *sdata, txntable_t **txns, const char
 		}
 	}
 
-	txn->seen = true;
 	if (!local || ckp->node)
 		txn->refcount = REFCOUNT_REMOTE;
 	else
@@ -1197,12 +1832,14 @@ static void send_node_transactions(ckpool_t *ckp, sdata_t *sdata, const json_t *
 	stratum_instance_t *client;
 	ckmsg_t *bulk_send = NULL;
 	ckmsg_t *client_msg;
-	int messages = 0;
 	json_t *json_msg;
 	smsg_t *msg;
 
 	ck_rlock(&sdata->instance_lock);
 	DL_FOREACH2(sdata->node_instances, client, node_next) {
+		/* Compact nodes have these in a txndelta from update_txns */
+		if (client->compact)
+			continue;
 		json_msg = json_deep_copy(txn_val);
 		json_set_string(json_msg, "node.method", stratum_msgs[SM_TRANSACTIONS]);
 		client_msg = ckalloc(sizeof(ckmsg_t));
@@ -1211,7 +1848,6 @@ static void send_node_transactions(ckpool_t *ckp, sdata_t *sdata, const json_t *
 		msg->client_id = client->id;
 		client_msg->data = msg;
 		DL_APPEND(bulk_send, client_msg);
-		messages++;
 	}
 	DL_FOREACH2(sdata->remote_instances, client, remote_next) {
 		json_msg = json_deep_copy(txn_val);
@@ -1222,7 +1858,6 @@ static void send_node_transactions(ckpool_t *ckp, sdata_t *sdata, const json_t *
 		msg->client_id = client->id;
 		client_msg->data = msg;
 		DL_APPEND(bulk_send, client_msg);
-		messages++;
 	}
 	ck_runlock(&sdata->instance_lock);
 
@@ -1231,7 +1866,7 @@ static void send_node_transactions(ckpool_t *ckp, sdata_t *sdata, const json_t *
 
 	if (bulk_send) {
 		LOGINFO("Sending transactions to mining nodes");
-		ssend_bulk_append(sdata, bulk_send, messages);
+		ssend_bulk_append(sdata, bulk_send);
 	}
 }
 
@@ -1253,25 +1888,34 @@ static void clear_txn(txntable_t *txn)
 
 static void update_txns(ckpool_t *ckp, sdata_t *sdata, txntable_t *txns, bool local)
 {
-	json_t *val, *txn_array = json_array(), *purged_txns = json_array();
+	json_t *val, *txn_array = NULL, *purged_txns = NULL;
+	txndelta_t delta = {NULL, 0, 0};
 	int added = 0, purged = 0;
 	txntable_t *tmp, *tmpa;
-
-	/* Find which transactions have their refcount decremented to zero
-	 * and remove them. */
+	txntable_t **expired;
+	bool compact;
+
+	/* Only build the json for propagation if anything will use it. The
+	 * node lists are checked unlocked but transiently wrong is harmless
+	 * as newly connected nodes are sent every transaction. */
+	if (ckp->remote || sdata->node_instances || sdata->remote_instances)
+		txn_array = json_array();
+	if (ckp->nodeservers)
+		purged_txns = json_array();
+
+	/* Remove the transactions expiring this generation */
 	ck_wlock(&sdata->txn_lock);
-	HASH_ITER(hh, sdata->txns, tmp, tmpa) {
-		json_t *txn_val;
-
-		if (tmp->seen) {
-			tmp->seen = false;
-			continue;
-		}
-		if (tmp->refcount-- > 0)
-			continue;
+	/* Nodes only become compact under txn_lock so every one either has
+	 * these txns in its initial txndelta or gets them here */
+	compact = sdata->compact_nodes;
+	expired = &sdata->txn_wheel[++sdata->txn_generation % TXN_WHEEL];
+	DL_FOREACH_SAFE(*expired, tmp, tmpa) {
+		DL_DELETE(*expired, tmp);
 		HASH_DEL(sdata->txns, tmp);
-		txn_val = json_string(tmp->data);
-		json_array_append_new(purged_txns, txn_val);
+		if (tmp->usid)
+			HASH_DELETE(uh, sdata->txn_usids, tmp);
+		if (purged_txns)
+			json_array_append_new(purged_txns, json_string(tmp->data));
 		clear_txn(tmp);
 		purged++;
 	}
@@ -1282,39 +1926,62 @@ static void update_txns(ckpool_t *ckp, sdata_t *sdata, txntable_t *txns, bool lo
 
 		HASH_DEL(txns, tmp);
 		/* Propagate transaction here */
-		JSON_CPACK(txn_val, "{ss,ss}", "hash", tmp->hash, "data", tmp->data);
-		json_array_append_new(txn_array, txn_val);
+		if (txn_array) {
+			JSON_CPACK(txn_val, "{ss,ss}", "hash", tmp->hash, "data", tmp->data);
+			json_array_append_new(txn_array, txn_val);
+		}
 
 		/* Check one last time this txn hasn't already been added in the
 		 * interim. This can happen in add_txn intentionally for a
 		 * transaction that has reappeared. */
 		HASH_FIND_STR(sdata->txns, tmp->hash, found);
 		if (found) {
+			/* Keep the short id it's being propagated with */
+			if (tmp->sid) {
+				found->sid = tmp->sid;
+				memcpy(found->txid, tmp->txid, 32);
+				if (compact)
+					txndelta_add(&delta, found);
+			}
 			clear_txn(tmp);
 			continue;
 		}
+		if (compact && tmp->sid)
+			txndelta_add(&delta, tmp);
 
 		/* Move to the sdata transaction table */
 		HASH_ADD_STR(sdata->txns, hash, tmp);
+		__ref_txn(sdata, tmp, tmp->refcount);
 		sdata->txns_generated++;
 		added++;
 	}
 	ck_wunlock(&sdata->txn_lock);
 
-	if (added) {
-		JSON_CPACK(val, "{so}", "transaction", txn_array);
-		send_node_transactions(ckp, sdata, val);
-		json_decref(val);
-	} else
-		json_decref(txn_array);
+	if (delta.len) {
+		JSON_CPACK(val, "{ss}", "node.method", stratum_msgs[SM_TXNDELTA]);
+		json_set_uint32(val, "epoch", sdata->txn_epoch);
+		compact_broadcast(sdata, val, delta.buf, delta.len);
+		free(delta.buf);
+	}
+
+	if (txn_array) {
+		if (added) {
+			JSON_CPACK(val, "{so}", "transaction", txn_array);
+			send_node_transactions(ckp, sdata, val);
+			json_decref(val);
+		} else
+			json_decref(txn_array);
+	}
 
 	/* Submit transactions to bitcoind again when we're purging them in
 	 * case they've been removed from its mempool as well and we need them
 	 * again in the future for a remote workinfo that hasn't forgotten
 	 * about them. */
-	if (purged && ckp->nodeservers)
-		submit_transaction_array(ckp, purged_txns);
-	json_decref(purged_txns);
+	if (purged_txns) {
+		if (purged)
+			submit_transaction_array(ckp, purged_txns);
+		json_decref(purged_txns);
+	}
 
 	if (added || purged) {
 		LOGINFO("Stratifier added %d %stransactions and purged %d", added,
@@ -1322,12 +1989,42 @@ static void update_txns(ckpool_t *ckp, sdata_t *sdata, txntable_t *txns, bool lo
 	}
 }
 
+/* Count the leading hashes of a new tree's leaves matching the cached tree */
+static int merkle_prefix(const merkle_cache_t *mc, const uchar *hashbin, const int leaves)
+{
+	int i, max = MIN(leaves, mc->size[0]);
+
+	for (i = 0; i < max; i++) {
+		if (memcmp(mc->level[0] + i * 32, hashbin + i * 32, 32))
+			break;
+	}
+	return i;
+}
+
+static void cache_merkle_level(merkle_cache_t *mc, const int level, const uchar *hashbin,
+			       const int hashes)
+{
+	if (unlikely(level >= MERKLE_LEVELS))
+		return;
+	if (hashes > mc->alloced[level]) {
+		mc->level[level] = realloc(mc->level[level], hashes * 32);
+		if (unlikely(!mc->level[level]))
+			quit(1, "Failed to realloc merkle cache level %d of %d hashes", level, hashes);
+		mc->alloced[level] = hashes;
+	}
+	memcpy(mc->level[level], hashbin, hashes * 32);
+	mc->size[level] = hashes;
+}
+
 /* Distill down a set of transactions into an efficient tree arrangement for
- * stratum messages and fast work assembly. */
+ * stratum messages and fast work assembly. Local workbases reuse any merkle
+ * subtree whose transactions all match a prefix of the last local one. */
 static txntable_t *wb_merkle_bin_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb,
 				      json_t *txn_array, bool local)
 {
-	int i, j, binleft, binlen;
+	merkle_cache_t *mc = &sdata->merkle_cache;
+	int i, j, k, binleft, binlen;
+	int level = 0, prefix = 0, reused = 0;
 	txntable_t *txns = NULL;
 	json_t *arr_val;
 	uchar *hashbin;
@@ -1352,13 +2049,18 @@ static txntable_t *wb_merkle_bin_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t
 			len += strlen(txn);
 		}
 
-		wb->txn_data = ckzalloc(len + 1);
-		wb->txn_hashes = ckzalloc(wb->txns * 65 + 1);
+		/* Kept out of the arena so block submissions can outlive the
+		 * workbase */
+		wb->txnbuf = create_ckbuf(ckzalloc(len + 1));
+		wb->txn_hashes = arena_alloc(&wb->arena, wb->txns * 65 + 1);
 		memset(wb->txn_hashes, 0x20, wb->txns * 65); // Spaces
+		if (local)
+			wb->sids = arena_alloc(&wb->arena, wb->txns * sizeof(uint32_t));
 
 		for (i = 0; i < wb->txns; i++) {
 			const char *txid, *hash;
 			char binswap[32];
+			uint32_t sid;
 
 			arr_val = json_array_get(txn_array, i);
 
@@ -1372,10 +2074,13 @@ static txntable_t *wb_merkle_bin_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t
 				goto out;
 			}
 			txn = json_string_value(json_object_get(arr_val, "data"));
-			add_txn(ckp, sdata, &txns, hash, txn, local);
+			add_txn(ckp, sdata, &txns, hash, txid, txn, local, &sid);
+			if (wb->sids)
+				wb->sids[i] = htole32(sid);
 			len = strlen(txn);
-			memcpy(wb->txn_data + ofs, txn, len);
+			memcpy(wb->txnbuf->buf + ofs, txn, len);
 			ofs += len;
+			wb->txnbuf->len = ofs;
 			if (!hex2bin(binswap, txid, 32)) {
 				LOGERR("Failed to hex2bin hash in gbt_merkle_bins");
 				goto out;
@@ -1384,10 +2089,14 @@ static txntable_t *wb_merkle_bin_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t
 			bswap_256(hashbin + 32 + 32 * i, binswap);
 		}
 	} else
-		wb->txn_hashes = ckzalloc(1);
+		wb->txn_hashes = arena_alloc(&wb->arena, 1);
 	wb->merkle_array = json_array();
+	if (local)
+		prefix = merkle_prefix(mc, hashbin, binleft);
 	if (binleft > 1) {
 		while (42) {
+			if (local)
+				cache_merkle_level(mc, level, hashbin, binleft);
 			if (binleft == 1)
 				break;
 			memcpy(&wb->merklebin[wb->merkles][0], hashbin + 32, 32);
@@ -1400,12 +2109,23 @@ static txntable_t *wb_merkle_bin_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t
 				binlen += 32;
 				binleft++;
 			}
-			for (i = 32, j = 64; j < binlen; i += 32, j += 64)
-				gen_hash(hashbin + j, hashbin + i, 64);
+			/* A parent is unchanged if every leaf under it is in
+			 * the matching prefix */
+			for (i = 32, j = 64, k = 1; j < binlen; i += 32, j += 64, k++) {
+				if (((int64_t)(k + 1) << (level + 1)) <= prefix &&
+				    level + 1 < MERKLE_LEVELS && k < mc->size[level + 1]) {
+					memcpy(hashbin + i, mc->level[level + 1] + i, 32);
+					reused++;
+				} else
+					gen_hash(hashbin + j, hashbin + i, 64);
+			}
 			binleft /= 2;
 			binlen = binleft * 32;
+			level++;
 		}
 	}
+	if (reused)
+		LOGDEBUG("Reused %d merkle hashes from the last workbase", reused);
 	LOGNOTICE("Stored %s workbase with %d transactions", local ? "local" : "remote",
 		  wb->txns);
 out:
@@ -1464,24 +2184,133 @@ static void gbt_witness_data(workbase_t *wb, json_t *txn_array)
 	wb->insert_witness = true;
 }
 
+/* A queued generator base update with the hash of the new block if that is
+ * what triggered it */
+typedef struct base_update {
+	int prio;
+	tv_t queued;
+	char blockhash[68];
+} base_update_t;
+
+/* Sum the fees of the transactions in a getblocktemplate */
+static int64_t gbt_fees(const json_t *gbt)
+{
+	json_t *txn_array = json_object_get(gbt, "transactions");
+	int i, txns = json_array_size(txn_array);
+	int64_t fees = 0;
+
+	for (i = 0; i < txns; i++)
+		fees += json_integer_value(json_object_get(json_array_get(txn_array, i), "fee"));
+	return fees;
+}
+
+/* Create coinbase only work on top of blockhash from its header and the
+ * current workbase, broadcasting it as clean work straight away so miners
+ * stop working on the stale block while the full template is fetched. Work
+ * is only derived when the new block is on the same difficulty and halving
+ * as the current workbase, and the full template follows immediately. */
+static bool empty_block_update(ckpool_t *ckp, sdata_t *sdata, const char *blockhash)
+{
+	json_t *empty_array = NULL;
+	bool new_block = false;
+	workbase_t *wb, *cwb;
+	uint32_t mediantime;
+	char nbit[12], bin[32], swap[32];
+	int height;
+	time_t now;
+
+	if (!generator_get_blockheader(ckp, blockhash, &height, nbit, &mediantime))
+		return false;
+	height++;
+	/* Possible retarget or subsidy halving on any network */
+	if (!(height % 2016) || !(height % 150)) {
+		LOGINFO("Not creating empty work at height %d", height);
+		return false;
+	}
+
+	wb = ckzalloc(sizeof(workbase_t));
+	ck_rlock(&sdata->workbase_lock);
+	cwb = sdata->current_workbase;
+	if (cwb && cwb->height + 1 == height && !strcmp(cwb->nbit, nbit) && !cwb->proxy) {
+		strcpy(wb->target, cwb->target);
+		wb->diff = cwb->diff;
+		wb->version = cwb->version;
+		strcpy(wb->bbversion, cwb->bbversion);
+		strcpy(wb->nbit, cwb->nbit);
+		wb->coinbasevalue = cwb->coinbasevalue;
+		if (cwb->json)
+			wb->coinbasevalue -= gbt_fees(cwb->json);
+		wb->insert_witness = cwb->insert_witness;
+		wb->flags = strdup(cwb->flags);
+		wb->height = height;
+	}
+	ck_runlock(&sdata->workbase_lock);
+	if (!wb->height) {
+		LOGINFO("Unable to derive empty work at height %d from current workbase", height);
+		free(wb);
+		return false;
+	}
+
+	hex2bin(bin, blockhash, 32);
+	swap_256(swap, bin);
+	__bin2hex(wb->prevhash, swap, 32);
+	now = time(NULL);
+	wb->curtime = MAX((uint32_t)now, mediantime + 1);
+	snprintf(wb->ntime, 9, "%08x", wb->curtime);
+	wb->ntime32 = wb->curtime;
+	wb->ckp = ckp;
+
+	empty_array = json_array();
+	/* With no transactions a local workbase leaves the merkle cache of
+	 * the last full one untouched */
+	wb_merkle_bin_txns(ckp, sdata, wb, empty_array, true);
+	if (wb->insert_witness)
+		gbt_witness_data(wb, empty_array);
+	json_decref(empty_array);
+
+	generate_coinbase(ckp, wb);
+	add_base(ckp, sdata, wb, &new_block);
+	if (ckp->btcsolo)
+		stratum_broadcast_updates(sdata, new_block);
+	else
+		stratum_broadcast_update(sdata, wb, new_block);
+	LOGNOTICE("Broadcast empty work on block %s", blockhash);
+	return true;
+}
+
 /* This function assumes it will only receive a valid json gbt base template
  * since checking should have been done earlier, and creates the base template
  * for generating work templates. This is a ckmsgq so all uses of this function
  * are serialised. */
-static void block_update(ckpool_t *ckp, int *prio)
+static void block_update(ckpool_t *ckp, base_update_t *update)
 {
-	bool new_block = false, ret = false;
+	bool new_block = false, ret = false, empty = false;
 	const char *witnessdata_check;
 	sdata_t *sdata = ckp->sdata;
 	json_t *txn_array;
 	txntable_t *txns;
+	int64_t start, built;
 	int retries = 0;
 	workbase_t *wb;
-
+	double elapsed;
+	tv_t now_tv;
+
+	if (ckp->emptywork && update->blockhash[0] &&
+	    strcmp(update->blockhash, sdata->lastswaphash) &&
+	    empty_block_update(ckp, sdata, update->blockhash)) {
+		empty = true;
+		tv_time(&now_tv);
+		elapsed = tvdiff(&now_tv, &update->queued);
+		sdata->empty_jobs++;
+		sdata->empty_last = elapsed;
+		if (elapsed > sdata->empty_max)
+			sdata->empty_max = elapsed;
+	}
 retry:
+	start = time_nanos();
 	wb = generator_getbase(ckp);
 	if (unlikely(!wb)) {
-		if (retries++ < 5 || *prio == GEN_PRIORITY) {
+		if (retries++ < 5 || update->prio == GEN_PRIORITY) {
 			LOGWARNING("Generator returned failure in update_base, retry #%d", retries);
 			goto retry;
 		}
@@ -1509,7 +2338,15 @@ retry:
 
 	generate_coinbase(ckp, wb);
 
+	/* Compact nodes only know txns by the short ids update_txns sends
+	 * them so they need those ahead of the workinfo */
+	if (txns && sdata->compact_nodes) {
+		update_txns(ckp, sdata, txns, true);
+		txns = NULL;
+	}
 	add_base(ckp, sdata, wb, &new_block);
+	built = time_nanos();
+	ckhist_add(&sdata->template_time, built - start);
 
 	if (new_block)
 		LOGNOTICE("Block hash changed to %s", sdata->lastswaphash);
@@ -1517,8 +2354,17 @@ retry:
 		stratum_broadcast_updates(sdata, new_block);
 	else
 		stratum_broadcast_update(sdata, wb, new_block);
+	ckhist_add(&sdata->broadcast_time, time_nanos() - built);
 	ret = true;
 	LOGINFO("Broadcast updated stratum base");
+	if (new_block || empty) {
+		tv_time(&now_tv);
+		elapsed = tvdiff(&now_tv, &update->queued);
+		sdata->full_jobs++;
+		sdata->full_last = elapsed;
+		if (elapsed > sdata->full_max)
+			sdata->full_max = elapsed;
+	}
 	/* Update transactions after stratum broadcast to not delay
 	 * propagation. */
 	if (likely(txns))
@@ -1538,7 +2384,7 @@ out:
 		LOGINFO("Broadcast ping due to failed stratum base update");
 		broadcast_ping(sdata);
 	}
-	free(prio);
+	free(update);
 }
 
 #define SSEND_PREPEND	0
@@ -1577,10 +2423,10 @@ static void downstream_json(sdata_t *sdata, const json_t *val, const int64_t cli
 		LOGINFO("Sending json to %d remote servers", messages);
 		switch (prio) {
 			case SSEND_PREPEND:
-				ssend_bulk_prepend(sdata, bulk_send, messages);
+				ssend_bulk_prepend(sdata, bulk_send);
 				break;
 			case SSEND_APPEND:
-				ssend_bulk_append(sdata, bulk_send, messages);
+				ssend_bulk_append(sdata, bulk_send);
 				break;
 		}
 	}
@@ -1644,8 +2490,7 @@ static bool rebuild_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 		ck_wlock(&sdata->txn_lock);
 		HASH_FIND_STR(sdata->txns, hash, txn);
 		if (likely(txn)) {
-			txn->refcount = REFCOUNT_REMOTE;
-			txn->seen = true;
+			__ref_txn(sdata, txn, REFCOUNT_REMOTE);
 			JSON_CPACK(txn_val, "{ss,ss}",
 				   "hash", hash, "data", txn->data);
 			json_array_append_new(txn_array, txn_val);
@@ -1676,8 +2521,7 @@ static bool rebuild_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 		} else {
 			free(data);
 		}
-		txn->refcount = REFCOUNT_REMOTE;
-		txn->seen = true;
+		__ref_txn(sdata, txn, REFCOUNT_REMOTE);
 		JSON_CPACK(txn_val, "{ss,ss}",
 			   "hash", hash, "data", txn->data);
 		json_array_append_new(txn_array, txn_val);
@@ -1687,9 +2531,9 @@ static bool rebuild_txns(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 	if (ret) {
 		wb->incomplete = false;
 		LOGINFO("Rebuilt txns into workbase with %d transactions", i);
-		/* These two structures are regenerated so free their ram */
+		/* The merkle array is regenerated so free it. The old txn
+		 * hashes stay in the arena till the workbase is cleared */
 		json_decref(wb->merkle_array);
-		dealloc(wb->txn_hashes);
 		txns = wb_merkle_bin_txns(ckp, sdata, wb, txn_array, false);
 		if (likely(txns))
 			update_txns(ckp, sdata, txns, false);
@@ -1810,10 +2654,16 @@ static void add_remote_base(ckpool_t *ckp, sdata_t *sdata, workbase_t *wb)
 
 	if (bulk_send) {
 		LOGINFO("Sending remote workinfo to %d other remote servers", messages);
-		ssend_bulk_append(sdata, bulk_send, messages);
+		ssend_bulk_append(sdata, bulk_send);
 	}
 }
 
+/* As json_strdup but allocated from the arena */
+static char *json_arena_strdup(arena_t *arena, json_t *val, const char *key)
+{
+	return arena_strdup(arena, json_string_value(json_object_get(val, key)) ? : "");
+}
+
 static void add_node_base(ckpool_t *ckp, json_t *val, bool trusted, int64_t client_id)
 {
 	workbase_t *wb = ckzalloc(sizeof(workbase_t));
@@ -1843,7 +2693,7 @@ static void add_node_base(ckpool_t *ckp, json_t *val, bool trusted, int64_t clie
 	json_strdup(&wb->flags, val, "flags");
 
 	json_intcpy(&wb->txns, val, "txns");
-	json_strdup(&wb->txn_hashes, val, "txn_hashes");
+	wb->txn_hashes = json_arena_strdup(&wb->arena, val, "txn_hashes");
 	if (!ckp->proxy) {
 		/* This is a workbase from a trusted remote */
 		wb->merkle_array = json_object_dup(val, "merklehash");
@@ -1856,13 +2706,13 @@ static void add_node_base(ckpool_t *ckp, json_t *val, bool trusted, int64_t clie
 			return;
 		}
 	}
-	json_strdup(&wb->coinb1, val, "coinb1");
+	wb->coinb1 = json_arena_strdup(&wb->arena, val, "coinb1");
 	json_intcpy(&wb->coinb1len, val, "coinb1len");
-	wb->coinb1bin = ckzalloc(wb->coinb1len);
+	wb->coinb1bin = arena_alloc(&wb->arena, wb->coinb1len);
 	hex2bin(wb->coinb1bin, wb->coinb1, wb->coinb1len);
-	json_strdup(&wb->coinb2, val, "coinb2");
+	wb->coinb2 = json_arena_strdup(&wb->arena, val, "coinb2");
 	json_intcpy(&wb->coinb2len, val, "coinb2len");
-	wb->coinb2bin = ckzalloc(wb->coinb2len);
+	wb->coinb2bin = arena_alloc(&wb->arena, wb->coinb2len);
 	hex2bin(wb->coinb2bin, wb->coinb2, wb->coinb2len);
 	json_intcpy(&wb->enonce1varlen, val, "enonce1varlen");
 	json_intcpy(&wb->enonce2varlen, val, "enonce2varlen");
@@ -1897,7 +2747,6 @@ share_diff(char *coinbase, const uchar *enonce1bin, const workbase_t *wb, const
 {
 	unsigned char merkle_root[32], merkle_sha[64];
 	uint32_t *data32, *swap32, benonce32;
-	uchar hash1[32];
 	char data[80];
 	int i;
 
@@ -1945,8 +2794,7 @@ share_diff(char *coinbase, const uchar *enonce1bin, const workbase_t *wb, const
 	data32 = (uint32_t *)data;
 	swap32 = (uint32_t *)swap;
 	flip_80(swap32, data32);
-	sha256(swap, 80, hash1);
-	sha256(hash1, 32, hash);
+	sha256d_80(swap, hash);
 
 	/* Calculate the diff of the share here */
 	return diff_from_target(hash);
@@ -2002,7 +2850,7 @@ static void send_nodes_block(sdata_t *sdata, const json_t *block_val, const int6
 
 	if (bulk_send) {
 		LOGNOTICE("Sending block to %d mining nodes", messages);
-		ssend_bulk_prepend(sdata, bulk_send, messages);
+		ssend_bulk_prepend(sdata, bulk_send);
 	}
 
 }
@@ -2030,8 +2878,9 @@ static void send_node_block(ckpool_t *ckp, sdata_t *sdata, const char *enonce1,
 	}
 }
 
-/* Process a block into a message for the generator to submit. Must hold
- * workbase readcount */
+/* Process a block into the header, transaction count and coinbase hex for
+ * the generator to submit ahead of the workbase's ready transactions. Must
+ * hold workbase readcount */
 static char *
 process_block(const workbase_t *wb, const char *coinbase, const int cblen,
 	      const uchar *data, const uchar *hash, uchar *flip32, char *blockhash)
@@ -2064,15 +2913,16 @@ process_block(const workbase_t *wb, const char *coinbase, const int cblen,
 	strcat(gbt_block, varint);
 	__bin2hex(hexcoinbase, coinbase, cblen);
 	strcat(gbt_block, hexcoinbase);
-	if (wb->txns)
-		realloc_strcat(&gbt_block, wb->txn_data);
 	return gbt_block;
 }
 
-/* Submit block data locally, absorbing and freeing gbt_block */
-static bool local_block_submit(ckpool_t *ckp, char *gbt_block, const uchar *flip32, int height)
+/* Submit block data locally, absorbing and freeing gbt_block. Must hold
+ * workbase readcount */
+static bool local_block_submit(ckpool_t *ckp, const workbase_t *wb, char *gbt_block,
+			       const uchar *flip32, const tv_t *solve_tv)
 {
-	bool ret = generator_submitblock(ckp, gbt_block);
+	bool ret = generator_submitblock(ckp, gbt_block, wb->txns ? wb->txnbuf : NULL, solve_tv);
+	int height = wb->height;
 	char heighthash[68] = {}, rhash[68] = {};
 	uchar swap256[32];
 
@@ -2163,6 +3013,7 @@ static void submit_node_block(ckpool_t *ckp, sdata_t *sdata, json_t *val)
 	int enonce1len, cblen;
 	workbase_t *wb = NULL;
 	json_t *bval;
+	tv_t solve_tv;
 	double diff;
 	ts_t ts_now;
 	int64_t id;
@@ -2198,6 +3049,7 @@ static void submit_node_block(ckpool_t *ckp, sdata_t *sdata, json_t *val)
 		LOGINFO("No version mask in node method block");
 	}
 
+	tv_time(&solve_tv);
 	LOGWARNING("Possible upstream block solve diff %lf !", diff);
 
 	ts_realtime(&ts_now);
@@ -2234,7 +3086,7 @@ static void submit_node_block(ckpool_t *ckp, sdata_t *sdata, json_t *val)
 
 	/* Now we have enough to assemble a block */
 	gbt_block = process_block(wb, coinbase, cblen, swap, hash, flip32, blockhash);
-	ret = local_block_submit(ckp, gbt_block, flip32, wb->height);
+	ret = local_block_submit(ckp, wb, gbt_block, flip32, &solve_tv);
 
 	JSON_CPACK(bval, "{si,ss,ss,sI,ss,ss,si,ss,sI,sf,ss,ss,ss,ss}",
 			 "height", wb->height,
@@ -2265,9 +3117,11 @@ out:
 	free(enonce1);
 }
 
-static void update_base(sdata_t *sdata, const int prio)
+/* Queue a base update, with the hash of the new block that triggered it if
+ * known */
+static void update_block_base(sdata_t *sdata, const int prio, const char *blockhash)
 {
-	int *uprio;
+	base_update_t *update;
 
 	/* All uses of block_update are serialised so if we have more
 	 * update_base calls waiting there is no point servicing them unless
@@ -2276,30 +3130,223 @@ static void update_base(sdata_t *sdata, const int prio)
 		/* Don't queue another routine update if one is already in
 		 * progress. */
 		if (cksem_trywait(&sdata->update_sem)) {
-			LOGINFO("Skipped lowprio update base");
+			LOGDEBUG("Skipped lowprio update base");
 			return;
 		}
 	} else
 		cksem_wait(&sdata->update_sem);
 
-	uprio = ckalloc(sizeof(int));
-	*uprio = prio;
-	ckmsgq_add(sdata->updateq, uprio);
+	update = ckzalloc(sizeof(base_update_t));
+	update->prio = prio;
+	tv_time(&update->queued);
+	if (blockhash)
+		strncpy(update->blockhash, blockhash, 64);
+	ckmsgq_add(sdata->updateq, update);
+}
+
+static void update_base(sdata_t *sdata, const int prio)
+{
+	update_block_base(sdata, prio, NULL);
+}
+
+static inline instance_shard_t *instance_shard(sdata_t *sdata, const int64_t id)
+{
+	return &sdata->instance_shards[(uint64_t)id % INSTANCE_SHARDS];
+}
+
+/* Total instances over all shards, only stable with instance_lock held */
+static int instance_count(sdata_t *sdata)
+{
+	int i, count = 0;
+
+	for (i = 0; i < INSTANCE_SHARDS; i++)
+		count += HASH_COUNT(sdata->instance_shards[i].instances);
+	return count;
+}
+
+/* Enter with instance_lock held. Tags a client as dropped and, if nothing
+ * holds a reference to it, removes it from its shard and returns true for the
+ * caller to drop it now. Otherwise the last reference drops it. Both are done
+ * under the one shard lock so ref_instance_by_id can't take a new reference
+ * to a client being dropped. */
+static bool __tag_dropped(sdata_t *sdata, stratum_instance_t *client)
+{
+	instance_shard_t *shard = instance_shard(sdata, client->id);
+	bool unused;
+
+	ck_wlock(&shard->lock);
+	client->dropped = true;
+	unused = !__atomic_load_n(&client->ref, __ATOMIC_SEQ_CST);
+	if (unused)
+		HASH_DEL(shard->instances, client);
+	ck_wunlock(&shard->lock);
+
+	return unused;
+}
+
+static void init_slab(objslab_t *objslab, const size_t size)
+{
+	objslab->size = (size + 63) & ~(size_t)63;
+}
+
+/* Enter with instance_lock held. Returns a zeroed cache line aligned object
+ * from the oldest slab with one free, storing which slab in from if set */
+static void *__slab_alloc(objslab_t *objslab, slab_t **from)
+{
+	slab_t *slab = objslab->partial;
+	char *ret;
+
+	if (!slab) {
+		slab = ckzalloc(sizeof(slab_t));
+		slab->objslab = objslab;
+		slab->id = objslab->ids++;
+		slab->objects = aligned_alloc(64, objslab->size * SLAB_OBJECTS);
+		if (unlikely(!slab->objects))
+			quit(1, "Failed to aligned_alloc slab of %d objects", SLAB_OBJECTS);
+		DL_APPEND(objslab->partial, slab);
+		objslab->count++;
+	}
+	if (slab->recycled) {
+		ret = slab->recycled;
+		slab->recycled = *(void **)ret;
+		*(void **)ret = NULL;
+	} else {
+		ret = slab->objects + objslab->size * slab->carved++;
+		memset(ret, 0, objslab->size);
+		objslab->generated++;
+	}
+	if (++slab->used == SLAB_OBJECTS)
+		DL_DELETE(objslab->partial, slab);
+	objslab->used++;
+	if (from)
+		*from = slab;
+	return ret;
+}
+
+/* Put a full slab that's just had an object freed back on the partial list
+ * in order of age. Only the few slabs with room are walked. */
+static void __slab_partial(objslab_t *objslab, slab_t *slab)
+{
+	slab_t *older;
+
+	DL_FOREACH(objslab->partial, older) {
+		if (older->id > slab->id) {
+			DL_PREPEND_ELEM(objslab->partial, older, slab);
+			return;
+		}
+	}
+	DL_APPEND(objslab->partial, slab);
+}
+
+/* Enter with instance_lock held. Returns an object to the slab it came from,
+ * freeing the slab once it's empty provided there would still be a whole
+ * slab's worth of free objects left in the others. */
+static void __slab_free(slab_t *slab, void *obj)
+{
+	objslab_t *objslab = slab->objslab;
+
+	memset(obj, 0, objslab->size);
+	*(void **)obj = slab->recycled;
+	slab->recycled = obj;
+	objslab->used--;
+	if (slab->used-- == SLAB_OBJECTS)
+		__slab_partial(objslab, slab);
+	if (slab->used)
+		return;
+	if (objslab->count * SLAB_OBJECTS - objslab->used < SLAB_OBJECTS * 2)
+		return;
+	DL_DELETE(objslab->partial, slab);
+	objslab->count--;
+	objslab->freed++;
+	free(slab->objects);
+	free(slab);
+}
+
+static int64_t slab_objects(const objslab_t *objslab)
+{
+	return objslab->used;
+}
+
+static int64_t slab_memsize(const objslab_t *objslab)
+{
+	return objslab->count * (SLAB_OBJECTS * objslab->size + sizeof(slab_t));
+}
+
+/* Returns a reference to the interned copy of the first len bytes of str,
+ * adding it if it isn't stored yet. */
+static char *intern_strn(sdata_t *sdata, const char *str, const size_t len)
+{
+	strintern_t *si;
+
+	mutex_lock(&sdata->intern_lock);
+	HASH_FIND(hh, sdata->interned, str, len, si);
+	if (si) {
+		si->refs++;
+		sdata->interned_saved += len + 1;
+	} else {
+		si = ckalloc(sizeof(strintern_t) + len + 1);
+		memcpy(si->str, str, len);
+		si->str[len] = '\0';
+		si->refs = 1;
+		HASH_ADD_KEYPTR(hh, sdata->interned, si->str, len, si);
+		sdata->interned_bytes += len + 1;
+	}
+	sdata->interned_refs++;
+	mutex_unlock(&sdata->intern_lock);
+
+	return si->str;
+}
+
+static char *intern_str(sdata_t *sdata, const char *str)
+{
+	return intern_strn(sdata, str, strlen(str));
+}
+
+/* Drop a reference to an interned string, freeing it with the last one */
+static void unintern_str(sdata_t *sdata, char *str)
+{
+	strintern_t *si;
+	size_t len;
+
+	if (!str)
+		return;
+	si = (strintern_t *)(str - offsetof(strintern_t, str));
+	len = si->hh.keylen + 1;
+
+	mutex_lock(&sdata->intern_lock);
+	sdata->interned_refs--;
+	if (--si->refs)
+		sdata->interned_saved -= len;
+	else {
+		HASH_DEL(sdata->interned, si);
+		sdata->interned_bytes -= len;
+		free(si);
+	}
+	mutex_unlock(&sdata->intern_lock);
+}
+
+/* Point *ptr at the interned copy of str, releasing what it pointed to */
+static void reintern_str(sdata_t *sdata, char **ptr, const char *str)
+{
+	char *old = *ptr;
+
+	*ptr = intern_str(sdata, str);
+	unintern_str(sdata, old);
 }
 
-/* Instead of removing the client instance, we add it to a list of recycled
- * clients allowing us to reuse it instead of callocing a new one */
+/* Instead of freeing the client instance, we return it to its slab allowing
+ * us to reuse it instead of callocing a new one */
 static void __kill_instance(sdata_t *sdata, stratum_instance_t *client)
 {
 	if (client->proxy) {
 		client->proxy->bound_clients--;
 		client->proxy->parent->combined_clients--;
 	}
-	free(client->workername);
-	free(client->password);
-	free(client->useragent);
-	memset(client, 0, sizeof(stratum_instance_t));
-	DL_APPEND2(sdata->recycled_instances, client, recycled_prev, recycled_next);
+	unintern_str(sdata, client->workername);
+	unintern_str(sdata, client->password);
+	unintern_str(sdata, client->useragent);
+	unintern_str(sdata, client->address);
+	__slab_free(client->slab, client);
 }
 
 /* Called with instance_lock held. Note stats.users is protected by
@@ -2310,6 +3357,7 @@ static void __inc_worker(sdata_t *sdata, user_instance_t *user, worker_instance_
 	if (!user->workers++)
 		sdata->stats.users++;
 	worker->instance_count++;
+	user->dirty = true;
 }
 
 static void __dec_worker(sdata_t *sdata, user_instance_t *user, worker_instance_t *worker)
@@ -2318,46 +3366,136 @@ static void __dec_worker(sdata_t *sdata, user_instance_t *user, worker_instance_
 	if (!--user->workers)
 		sdata->stats.users--;
 	worker->instance_count--;
+	user->dirty = true;
 }
 
-static void __disconnect_session(sdata_t *sdata, const stratum_instance_t *client)
+static void __del_session(sdata_t *sdata, session_t *session)
 {
-	time_t now_t = time(NULL);
+	HASH_DEL(sdata->disconnected_sessions, session);
+	HASH_DELETE(hh_addr, sdata->session_addrs, session);
+	DL_DELETE(sdata->session_wheel[session->added & (SESSION_WHEEL - 1)], session);
+	unintern_str(sdata, session->address);
+	dealloc(session);
+	sdata->stats.disconnected--;
+}
+
+/* Free sessions added over SESSION_EXPIRE seconds ago, visiting only the
+ * wheel slots of the seconds passed since the last call. Entered with
+ * session_lock held for writing. */
+static void __age_sessions(sdata_t *sdata, const time_t now_t)
+{
+	time_t expire = now_t - SESSION_EXPIRE, tick;
 	session_t *session, *tmp;
 
-	/* Opportunity to age old sessions */
-	HASH_ITER(hh, sdata->disconnected_sessions, session, tmp) {
-		if (now_t - session->added > 600) {
-			HASH_DEL(sdata->disconnected_sessions, session);
-			dealloc(session);
-			sdata->stats.disconnected--;
+	if (expire <= sdata->sessions_aged)
+		return;
+	tick = MAX(sdata->sessions_aged + 1, expire - SESSION_WHEEL + 1);
+	for (; tick <= expire; tick++) {
+		session_t **slot = &sdata->session_wheel[tick & (SESSION_WHEEL - 1)];
+
+		DL_FOREACH_SAFE(*slot, session, tmp) {
+			/* Slots are shared by seconds a wheel turn apart */
+			if (session->added <= expire)
+				__del_session(sdata, session);
 		}
 	}
+	sdata->sessions_aged = expire;
+}
+
+static void age_sessions(sdata_t *sdata)
+{
+	ck_wlock(&sdata->session_lock);
+	__age_sessions(sdata, time(NULL));
+	ck_wunlock(&sdata->session_lock);
+}
+
+/* Entered with the instance_lock held, session_lock always nests inside it */
+static void __disconnect_session(sdata_t *sdata, const stratum_instance_t *client)
+{
+	time_t now_t = time(NULL);
+	session_t *session;
 
 	if (!client->enonce1_64 || !client->user_instance || !client->authorised)
 		return;
+
+	ck_wlock(&sdata->session_lock);
+	/* Opportunity to age old sessions */
+	__age_sessions(sdata, now_t);
 	HASH_FIND_INT(sdata->disconnected_sessions, &client->session_id, session);
 	if (session)
-		return;
+		goto out_unlock;
 	session = ckalloc(sizeof(session_t));
 	session->enonce1_64 = client->enonce1_64;
 	session->session_id = client->session_id;
 	session->client_id = client->id;
 	session->userid = client->user_id;
 	session->added = now_t;
-	strcpy(session->address, client->address);
+	session->address = intern_str(sdata, client->address);
 	HASH_ADD_INT(sdata->disconnected_sessions, session_id, session);
+	HASH_ADD_KEYPTR(hh_addr, sdata->session_addrs, session->address,
+			strlen(session->address), session);
+	DL_APPEND(sdata->session_wheel[now_t & (SESSION_WHEEL - 1)], session);
 	sdata->stats.disconnected++;
 	sdata->disconnected_generated++;
+out_unlock:
+	ck_wunlock(&sdata->session_lock);
+}
+
+static session_t *__find_session(sdata_t *sdata, const int session_id, const char *address)
+{
+	session_t *session;
+
+	if (address)
+		HASH_FIND(hh_addr, sdata->session_addrs, address, strlen(address), session);
+	else
+		HASH_FIND_INT(sdata->disconnected_sessions, &session_id, session);
+	return session;
+}
+
+/* Find and remove a resumable session by id, or by address if address is
+ * set, copying what a resume needs into ret. Misses, the common case for new
+ * clients, only ever take the read lock. */
+static bool take_session(sdata_t *sdata, const int session_id, const char *address,
+			 session_t *ret)
+{
+	session_t *session;
+	bool found = false;
+
+	ck_rlock(&sdata->session_lock);
+	session = __find_session(sdata, session_id, address);
+	ck_runlock(&sdata->session_lock);
+	if (!session)
+		return false;
+
+	ck_wlock(&sdata->session_lock);
+	/* Look again as another client may have taken it since */
+	session = __find_session(sdata, session_id, address);
+	if (likely(session)) {
+		ret->enonce1_64 = session->enonce1_64;
+		ret->client_id = session->client_id;
+		ret->userid = session->userid;
+		__del_session(sdata, session);
+		found = true;
+	}
+	ck_wunlock(&sdata->session_lock);
+
+	return found;
 }
 
-/* Removes a client instance we know is on the stratum_instances list and from
- * the user client list if it's been placed on it */
+/* Removes a client instance __tag_dropped has taken off its instance shard
+ * from the node or remote server lists and the user client list if it's been
+ * placed on them */
 static void __del_client(sdata_t *sdata, stratum_instance_t *client)
 {
 	user_instance_t *user = client->user_instance;
 
-	HASH_DEL(sdata->stratum_instances, client);
+	if (unlikely(client->node)) {
+		DL_DELETE2(sdata->node_instances, client, node_prev, node_next);
+		if (client->compact)
+			sdata->compact_nodes--;
+	} else if (unlikely(client->trusted))
+		DL_DELETE2(sdata->remote_instances, client, remote_prev, remote_next);
+
 	if (user) {
 		DL_DELETE2(user->clients, client, user_prev, user_next );
 		__dec_worker(sdata, user, client->worker_instance);
@@ -2377,19 +3515,20 @@ static void drop_allclients(ckpool_t *ckp)
 {
 	stratum_instance_t *client, *tmp;
 	sdata_t *sdata = ckp->sdata;
-	int kills = 0;
+	int kills = 0, i;
 
 	ck_wlock(&sdata->instance_lock);
-	HASH_ITER(hh, sdata->stratum_instances, client, tmp) {
-		int64_t client_id = client->id;
+	for (i = 0; i < INSTANCE_SHARDS; i++) {
+		HASH_ITER(hh, sdata->instance_shards[i].instances, client, tmp) {
+			int64_t client_id = client->id;
 
-		if (!client->ref) {
-			__del_client(sdata, client);
-			__kill_instance(sdata, client);
-		} else
-			client->dropped = true;
-		kills++;
-		connector_drop_client(ckp, client_id);
+			if (__tag_dropped(sdata, client)) {
+				__del_client(sdata, client);
+				__kill_instance(sdata, client);
+			}
+			kills++;
+			connector_drop_client(ckp, client_id);
+		}
 	}
 	sdata->stats.users = sdata->stats.workers = 0;
 	ck_wunlock(&sdata->instance_lock);
@@ -2663,7 +3802,7 @@ static void generator_recruit(ckpool_t *ckp, const int proxyid, const int recrui
 static void reconnect_global_clients(sdata_t *sdata)
 {
 	stratum_instance_t *client, *tmpclient;
-	int reconnects = 0;
+	int reconnects = 0, i;
 	int64_t headroom;
 	proxy_t *proxy;
 
@@ -2672,23 +3811,25 @@ static void reconnect_global_clients(sdata_t *sdata)
 		return;
 
 	ck_rlock(&sdata->instance_lock);
-	HASH_ITER(hh, sdata->stratum_instances, client, tmpclient) {
-		if (client->dropped)
-			continue;
-		if (!client->authorised)
-			continue;
-		/* Is this client bound to a dead proxy? */
-		if (!client->reconnect) {
-			/* This client is bound to a user proxy */
-			if (client->proxy->userid)
+	for (i = 0; i < INSTANCE_SHARDS; i++) {
+		HASH_ITER(hh, sdata->instance_shards[i].instances, client, tmpclient) {
+			if (client->dropped)
+				continue;
+			if (!client->authorised)
 				continue;
-			if (client->proxyid == proxy->id)
+			/* Is this client bound to a dead proxy? */
+			if (!client->reconnect) {
+				/* This client is bound to a user proxy */
+				if (client->proxy->userid)
+					continue;
+				if (client->proxyid == proxy->id)
+					continue;
+			}
+			if (headroom-- < 1)
 				continue;
+			reconnects++;
+			reconnect_client(sdata, client);
 		}
-		if (headroom-- < 1)
-			continue;
-		reconnects++;
-		reconnect_client(sdata, client);
 	}
 	ck_runlock(&sdata->instance_lock);
 
@@ -2771,7 +3912,7 @@ static void check_proxy(sdata_t *sdata, proxy_t *proxy)
 static void dead_proxyid(sdata_t *sdata, const int id, const int subid, const bool replaced, const bool deleted)
 {
 	stratum_instance_t *client, *tmp;
-	int reconnects = 0, proxyid = 0;
+	int reconnects = 0, proxyid = 0, i;
 	int64_t headroom;
 	proxy_t *proxy;
 
@@ -2788,18 +3929,20 @@ static void dead_proxyid(sdata_t *sdata, const int id, const int subid, const bo
 		proxyid = proxy->id;
 
 	ck_rlock(&sdata->instance_lock);
-	HASH_ITER(hh, sdata->stratum_instances, client, tmp) {
-		if (client->proxyid != id || client->subproxyid != subid)
-			continue;
-		/* Clients could remain connected to a dead connection here
-		 * but should be picked up when we recruit enough slots after
-		 * another notify. */
-		if (headroom-- < 1) {
-			client->reconnect = true;
-			continue;
+	for (i = 0; i < INSTANCE_SHARDS; i++) {
+		HASH_ITER(hh, sdata->instance_shards[i].instances, client, tmp) {
+			if (client->proxyid != id || client->subproxyid != subid)
+				continue;
+			/* Clients could remain connected to a dead connection here
+			 * but should be picked up when we recruit enough slots after
+			 * another notify. */
+			if (headroom-- < 1) {
+				client->reconnect = true;
+				continue;
+			}
+			reconnects++;
+			reconnect_client(sdata, client);
 		}
-		reconnects++;
-		reconnect_client(sdata, client);
 	}
 	ck_runlock(&sdata->instance_lock);
 
@@ -2955,25 +4098,27 @@ static void check_userproxies(sdata_t *sdata, proxy_t *proxy, const int userid)
 {
 	int64_t headroom = best_userproxy_headroom(sdata, userid);
 	stratum_instance_t *client, *tmpclient;
-	int reconnects = 0;
+	int reconnects = 0, i;
 
 	ck_rlock(&sdata->instance_lock);
-	HASH_ITER(hh, sdata->stratum_instances, client, tmpclient) {
-		if (client->dropped)
-			continue;
-		if (!client->authorised)
-			continue;
-		if (client->user_id != userid)
-			continue;
-		/* Is the client already bound to a proxy of its own userid of
-		 * a higher priority than this one. */
-		if (client->proxy->userid == userid &&
-		    client->proxy->parent->priority <= proxy->parent->priority)
-			continue;
-		if (headroom-- < 1)
-			continue;
-		reconnects++;
-		reconnect_client(sdata, client);
+	for (i = 0; i < INSTANCE_SHARDS; i++) {
+		HASH_ITER(hh, sdata->instance_shards[i].instances, client, tmpclient) {
+			if (client->dropped)
+				continue;
+			if (!client->authorised)
+				continue;
+			if (client->user_id != userid)
+				continue;
+			/* Is the client already bound to a proxy of its own userid of
+			 * a higher priority than this one. */
+			if (client->proxy->userid == userid &&
+			    client->proxy->parent->priority <= proxy->parent->priority)
+				continue;
+			if (headroom-- < 1)
+				continue;
+			reconnects++;
+			reconnect_client(sdata, client);
+		}
 	}
 	ck_runlock(&sdata->instance_lock);
 
@@ -3024,14 +4169,14 @@ static void update_notify(ckpool_t *ckp, const char *cmd)
 	json_get_int64(&wb->id, val, "jobid");
 	json_strcpy(wb->prevhash, val, "prevhash");
 	json_intcpy(&wb->coinb1len, val, "coinb1len");
-	wb->coinb1bin = ckalloc(wb->coinb1len);
-	wb->coinb1 = ckalloc(wb->coinb1len * 2 + 1);
+	wb->coinb1bin = arena_alloc(&wb->arena, wb->coinb1len);
+	wb->coinb1 = arena_alloc(&wb->arena, wb->coinb1len * 2 + 1);
 	json_strcpy(wb->coinb1, val, "coinbase1");
 	hex2bin(wb->coinb1bin, wb->coinb1, wb->coinb1len);
 	wb->height = get_sernumber(wb->coinb1bin + 42);
-	json_strdup(&wb->coinb2, val, "coinbase2");
+	wb->coinb2 = json_arena_strdup(&wb->arena, val, "coinbase2");
 	wb->coinb2len = strlen(wb->coinb2) / 2;
-	wb->coinb2bin = ckalloc(wb->coinb2len);
+	wb->coinb2bin = arena_alloc(&wb->arena, wb->coinb2len);
 	hex2bin(wb->coinb2bin, wb->coinb2, wb->coinb2len);
 	wb->merkle_array = json_object_dup(val, "merklehash");
 	wb->merkles = json_array_size(wb->merkle_array);
@@ -3054,7 +4199,7 @@ static void update_notify(ckpool_t *ckp, const char *cmd)
 	header[224] = 0;
 	LOGDEBUG("Header: %s", header);
 	hex2bin(wb->headerbin, header, 112);
-	wb->txn_hashes = ckzalloc(1);
+	wb->txn_hashes = arena_alloc(&wb->arena, 1);
 
 	dsdata = proxy->sdata;
 
@@ -3091,7 +4236,7 @@ static void update_diff(ckpool_t *ckp, const char *cmd)
 	sdata_t *sdata = ckp->sdata, *dsdata;
 	stratum_instance_t *client, *tmp;
 	double old_diff, diff;
-	int id = 0, subid = 0;
+	int id = 0, subid = 0, i;
 	const char *buf;
 	proxy_t *proxy;
 	json_t *val;
@@ -3143,14 +4288,16 @@ static void update_diff(ckpool_t *ckp, const char *cmd)
 	/* If the diff has dropped, iterate over all the clients and check
 	 * they're at or below the new diff, and update it if not. */
 	ck_rlock(&sdata->instance_lock);
-	HASH_ITER(hh, sdata->stratum_instances, client, tmp) {
-		if (client->proxyid != id)
-			continue;
-		if (client->subproxyid != subid)
-			continue;
-		if (client->diff > diff) {
-			client->diff = diff;
-			stratum_send_diff(sdata, client);
+	for (i = 0; i < INSTANCE_SHARDS; i++) {
+		HASH_ITER(hh, sdata->instance_shards[i].instances, client, tmp) {
+			if (client->proxyid != id)
+				continue;
+			if (client->subproxyid != subid)
+				continue;
+			if (client->diff > diff) {
+				client->diff = diff;
+				stratum_send_diff(sdata, client);
+			}
 		}
 	}
 	ck_runlock(&sdata->instance_lock);
@@ -3170,18 +4317,10 @@ static void free_proxy(ckpool_t *ckp, proxy_t *proxy)
 {
 	sdata_t *dsdata = proxy->sdata;
 
-	/* Delete any shares in the proxy's hashtable. */
+	/* Delete the proxy's workbases along with their share tables. */
 	if (dsdata) {
-		share_t *share, *tmpshare;
 		workbase_t *wb, *tmpwb;
 
-		mutex_lock(&dsdata->share_lock);
-		HASH_ITER(hh, dsdata->shares, share, tmpshare) {
-			HASH_DEL(dsdata->shares, share);
-			dealloc(share);
-		}
-		mutex_unlock(&dsdata->share_lock);
-
 		/* Do we need to check readcount here if freeing the proxy? */
 		ck_wlock(&dsdata->workbase_lock);
 		HASH_ITER(hh, dsdata->workbases, wb, tmpwb) {
@@ -3248,29 +4387,31 @@ static void reap_proxies(ckpool_t *ckp, sdata_t *sdata)
 		LOGINFO("Stratifier discarded %d dead proxies", dead);
 }
 
-/* Enter with instance_lock held */
+/* Enter with instance_lock or the id's shard lock held */
 static stratum_instance_t *__instance_by_id(sdata_t *sdata, const int64_t id)
 {
 	stratum_instance_t *client;
 
-	HASH_FIND_I64(sdata->stratum_instances, &id, client);
+	HASH_FIND_I64(instance_shard(sdata, id)->instances, &id, client);
 	return client;
 }
 
 /* Increase the reference count of instance */
 static void __inc_instance_ref(stratum_instance_t *client)
 {
-	client->ref++;
+	__atomic_add_fetch(&client->ref, 1, __ATOMIC_SEQ_CST);
 }
 
 /* Find an __instance_by_id and increase its reference count allowing us to
  * use this instance outside of instance_lock without fear of it being
- * dereferenced. Does not return dropped clients still on the list. */
+ * dereferenced. Does not return dropped clients still on the list. Only
+ * takes the read lock of the client's shard. */
 static inline stratum_instance_t *ref_instance_by_id(sdata_t *sdata, const int64_t id)
 {
+	instance_shard_t *shard = instance_shard(sdata, id);
 	stratum_instance_t *client;
 
-	ck_wlock(&sdata->instance_lock);
+	ck_rlock(&shard->lock);
 	client = __instance_by_id(sdata, id);
 	if (client) {
 		if (unlikely(client->dropped))
@@ -3278,7 +4419,7 @@ static inline stratum_instance_t *ref_instance_by_id(sdata_t *sdata, const int64
 		else
 			__inc_instance_ref(client);
 	}
-	ck_wunlock(&sdata->instance_lock);
+	ck_runlock(&shard->lock);
 
 	return client;
 }
@@ -3287,11 +4428,6 @@ static void __drop_client(sdata_t *sdata, stratum_instance_t *client, bool lazil
 {
 	user_instance_t *user = client->user_instance;
 
-	if (unlikely(client->node))
-		DL_DELETE2(sdata->node_instances, client, node_prev, node_next);
-	else if (unlikely(client->trusted))
-		DL_DELETE2(sdata->remote_instances, client, remote_prev, remote_next);
-
 	if (client->workername) {
 		if (user) {
 			/* No message anywhere if throttled, too much flood and
@@ -3316,29 +4452,40 @@ static void __drop_client(sdata_t *sdata, stratum_instance_t *client, bool lazil
 
 static int __dec_instance_ref(stratum_instance_t *client)
 {
-	return --client->ref;
+	return __atomic_sub_fetch(&client->ref, 1, __ATOMIC_SEQ_CST);
 }
 
-/* Decrease the reference count of instance. */
+/* Decrease the reference count of instance, only taking instance_lock when
+ * the last reference of a dropped instance is released. */
 static void _dec_instance_ref(sdata_t *sdata, stratum_instance_t *client, const char *file,
 			      const char *func, const int line)
 {
+	const int64_t id = client->id;
+	instance_shard_t *shard = instance_shard(sdata, id);
 	char_entry_t *entries = NULL;
-	bool dropped = false;
+	bool dropped;
 	char *msg = NULL;
 	int ref;
 
-	ck_wlock(&sdata->instance_lock);
+	ck_rlock(&shard->lock);
 	ref = __dec_instance_ref(client);
+	dropped = client->dropped && !ref;
+	ck_runlock(&shard->lock);
+
 	/* See if there are any instances that were dropped that could not be
-	 * moved due to holding a reference and drop them now. */
-	if (unlikely(client->dropped && !ref)) {
-		dropped = true;
-		__drop_client(sdata, client, true, &msg);
-		if (msg)
-			add_msg_entry(&entries, &msg);
+	 * moved due to holding a reference and drop them now, checking again
+	 * under instance_lock that nothing else has referenced or dropped it
+	 * in the meantime. */
+	if (unlikely(dropped)) {
+		ck_wlock(&sdata->instance_lock);
+		if (__instance_by_id(sdata, id) == client && __tag_dropped(sdata, client)) {
+			__drop_client(sdata, client, true, &msg);
+			if (msg)
+				add_msg_entry(&entries, &msg);
+		} else
+			dropped = false;
+		ck_wunlock(&sdata->instance_lock);
 	}
-	ck_wunlock(&sdata->instance_lock);
 
 	if (entries)
 		notice_msg_entries(&entries);
@@ -3352,36 +4499,24 @@ static void _dec_instance_ref(sdata_t *sdata, stratum_instance_t *client, const
 
 #define dec_instance_ref(sdata, instance) _dec_instance_ref(sdata, instance, __FILE__, __func__, __LINE__)
 
-/* If we have a no longer used stratum instance in the recycled linked list,
- * use that, otherwise calloc a fresh one. */
-static stratum_instance_t *__recruit_stratum_instance(sdata_t *sdata)
-{
-	stratum_instance_t *client = sdata->recycled_instances;
-
-	if (client)
-		DL_DELETE2(sdata->recycled_instances, client, recycled_prev, recycled_next);
-	else {
-		client = ckzalloc(sizeof(stratum_instance_t));
-		sdata->stratum_generated++;
-	}
-	return client;
-}
-
 /* Enter with write instance_lock held, drops and grabs it again */
 static stratum_instance_t *__stratum_add_instance(ckpool_t *ckp, int64_t id, const char *address,
 						  int server)
 {
 	sdata_t *sdata = ckp->sdata;
 	stratum_instance_t *client;
+	instance_shard_t *shard;
 	int64_t pass_id;
+	slab_t *slab;
 
-	client = __recruit_stratum_instance(sdata);
+	client = __slab_alloc(&sdata->instance_slab, &slab);
+	client->slab = slab;
 	ck_wunlock(&sdata->instance_lock);
 
 	client->start_time = time(NULL);
 	client->id = id;
 	client->session_id = ++sdata->session_id;
-	strcpy(client->address, address);
+	client->address = intern_str(sdata, address);
 	/* Sanity check to not overflow lookup in ckp->serverurl[] */
 	if (server >= ckp->serverurls)
 		server = 0;
@@ -3421,32 +4556,22 @@ static stratum_instance_t *__stratum_add_instance(ckpool_t *ckp, int64_t id, con
 	}
 
 	ck_wlock(&sdata->instance_lock);
-	HASH_ADD_I64(sdata->stratum_instances, id, client);
+	shard = instance_shard(sdata, client->id);
+	ck_wlock(&shard->lock);
+	HASH_ADD_I64(shard->instances, id, client);
+	ck_wunlock(&shard->lock);
 	return client;
 }
 
 static uint64_t disconnected_sessionid_exists(sdata_t *sdata, const int session_id,
 					      const int64_t id)
 {
-	session_t *session;
-	int64_t old_id = 0;
-	uint64_t ret = 0;
-
-	ck_wlock(&sdata->instance_lock);
-	HASH_FIND_INT(sdata->disconnected_sessions, &session_id, session);
-	if (!session)
-		goto out_unlock;
-	HASH_DEL(sdata->disconnected_sessions, session);
-	sdata->stats.disconnected--;
-	ret = session->enonce1_64;
-	old_id = session->client_id;
-	dealloc(session);
-out_unlock:
-	ck_wunlock(&sdata->instance_lock);
+	session_t session;
 
-	if (ret)
-		LOGINFO("Reconnecting old instance %"PRId64" to instance %"PRId64, old_id, id);
-	return ret;
+	if (!take_session(sdata, session_id, NULL, &session))
+		return 0;
+	LOGINFO("Reconnecting old instance %"PRId64" to instance %"PRId64, session.client_id, id);
+	return session.enonce1_64;
 }
 
 static inline bool client_active(stratum_instance_t *client)
@@ -3470,16 +4595,37 @@ static void connector_test_client(ckpool_t *ckp, const int64_t id)
 	send_proc(ckp->connector, buf);
 }
 
+/* Queue a diff held back by add_submit in sharebudget mode to go out just
+ * ahead of the notify being sent to this client. */
+static void pending_diff(ckmsg_t **sends, stratum_instance_t *client)
+{
+	ckmsg_t *client_msg;
+	smsg_t *msg;
+
+	if (likely(!__atomic_exchange_n(&client->diff_pending, false, __ATOMIC_RELAXED)))
+		return;
+	msg = ckzalloc(sizeof(smsg_t));
+	ASPRINTF(&msg->buf, "{\"params\":[%"PRId64"],\"id\":null,\"method\":\"mining.set_difficulty\"}\n",
+		 client->diff);
+	msg->client_id = client->id;
+	client_msg = ckalloc(sizeof(ckmsg_t));
+	client_msg->data = msg;
+	DL_APPEND(*sends, client_msg);
+}
+
 /* For creating a list of sends without locking that can then be concatenated
  * to the stratum_sends list. Minimises locking and avoids taking recursive
- * locks. Sends only to sdata bound clients (everyone in ckpool) */
+ * locks. Sends only to sdata bound clients (everyone in ckpool). Local clients
+ * all share the one serialised copy of the message, with only subclients that
+ * need their own node.method getting a json copy each. */
 static void stratum_broadcast(sdata_t *sdata, json_t *val, const int msg_type)
 {
 	ckpool_t *ckp = sdata->ckp;
 	sdata_t *ckp_sdata = ckp->sdata;
 	stratum_instance_t *client, *tmp;
-	ckmsg_t *bulk_send = NULL;
-	int messages = 0;
+	int allocated = 0, size, i;
+	ckmsg_t *bulk_send = NULL, *diff_sends = NULL;
+	smsg_t *bmsg = NULL;
 
 	if (unlikely(!val)) {
 		LOGERR("Sent null json to stratum_broadcast");
@@ -3491,37 +4637,73 @@ static void stratum_broadcast(sdata_t *sdata, json_t *val, const int msg_type)
 		return;
 	}
 
-	ck_rlock(&ckp_sdata->instance_lock);
-	HASH_ITER(hh, ckp_sdata->stratum_instances, client, tmp) {
-		ckmsg_t *client_msg;
-		smsg_t *msg;
+	/* Serialise the message before any node.method is added below */
+	bmsg = ckzalloc(sizeof(smsg_t));
+	bmsg->ckbuf = create_ckbuf(json_dumps(val, JSON_EOL | JSON_COMPACT));
 
-		if (sdata != ckp_sdata && client->sdata != sdata)
-			continue;
+	/* Walk one shard at a time under its own lock only, never holding up
+	 * instance lookups in the other shards or anything needing
+	 * instance_lock */
+	for (i = 0; i < INSTANCE_SHARDS; i++) {
+		instance_shard_t *shard = &ckp_sdata->instance_shards[i];
+
+		ck_rlock(&shard->lock);
+		size = bmsg->clients + HASH_COUNT(shard->instances);
+		if (size > allocated) {
+			allocated = size * 2;
+			bmsg->client_ids = realloc(bmsg->client_ids, sizeof(int64_t) * allocated);
+			if (unlikely(!bmsg->client_ids))
+				quit(1, "Failed to realloc broadcast client_ids of size %d", allocated);
+		}
+		HASH_ITER(hh, shard->instances, client, tmp) {
+			ckmsg_t *client_msg;
+			smsg_t *msg;
 
-		if (!client_active(client) || remote_server(client))
-			continue;
+			if (sdata != ckp_sdata && client->sdata != sdata)
+				continue;
 
-		/* Only send messages to whitelisted clients */
-		if (msg_type == SM_MSG && !client->messages)
-			continue;
+			if (!client_active(client) || remote_server(client))
+				continue;
 
-		client_msg = ckalloc(sizeof(ckmsg_t));
-		msg = ckzalloc(sizeof(smsg_t));
-		if (subclient(client->id))
+			/* Only send messages to whitelisted clients */
+			if (msg_type == SM_MSG && !client->messages)
+				continue;
+
+			if (likely(!subclient(client->id))) {
+				if (msg_type == SM_UPDATE && ckp->sharebudget)
+					pending_diff(&diff_sends, client);
+				bmsg->client_ids[bmsg->clients++] = client->id;
+				continue;
+			}
+
+			client_msg = ckalloc(sizeof(ckmsg_t));
+			msg = ckzalloc(sizeof(smsg_t));
 			json_set_string(val, "node.method", stratum_msgs[msg_type]);
-		msg->json_msg = json_deep_copy(val);
-		msg->client_id = client->id;
-		client_msg->data = msg;
-		DL_APPEND(bulk_send, client_msg);
-		messages++;
+			msg->json_msg = json_deep_copy(val);
+			msg->client_id = client->id;
+			client_msg->data = msg;
+			DL_APPEND(bulk_send, client_msg);
+		}
+		ck_runlock(&shard->lock);
 	}
-	ck_runlock(&ckp_sdata->instance_lock);
 
 	json_decref(val);
 
+	if (likely(bmsg->clients)) {
+		ckmsg_t *client_msg = ckalloc(sizeof(ckmsg_t));
+
+		client_msg->data = bmsg;
+		DL_PREPEND(bulk_send, client_msg);
+	} else
+		free_smsg(bmsg);
+
+	/* Any held back diffs go first to apply to this notify */
+	if (diff_sends) {
+		DL_CONCAT(diff_sends, bulk_send);
+		bulk_send = diff_sends;
+	}
 	if (likely(bulk_send))
-		ssend_bulk_append(sdata, bulk_send, messages);
+		ssend_bulk_append(sdata, bulk_send);
 }
 
 static void stratum_add_send(sdata_t *sdata, json_t *val, const int64_t client_id,
@@ -3555,12 +4737,35 @@ static void stratum_add_send(sdata_t *sdata, json_t *val, const int64_t client_i
 	msg = ckzalloc(sizeof(smsg_t));
 	msg->json_msg = val;
 	msg->client_id = client_id;
-	if (likely(ckmsgq_add(sdata->ssends, msg)))
+	if (likely(ssend_add(sdata, msg)))
 		return;
 	json_decref(msg->json_msg);
 	free(msg);
 }
 
+/* Queue a message serialised by the caller to a local, non subclient client,
+ * bypassing json entirely. Takes ownership of buf. */
+static void stratum_add_sendbuf(sdata_t *sdata, char *buf, const int64_t client_id,
+				const int64_t stamp)
+{
+	smsg_t *msg;
+
+	if (sdata->ckp->node) {
+		free(buf);
+		return;
+	}
+	msg = ckzalloc(sizeof(smsg_t));
+	msg->buf = buf;
+	msg->client_id = client_id;
+	if (stamp) {
+		msg->stamp = stamp;
+		msg->queued = time_nanos();
+	}
+	if (likely(ssend_add(sdata, msg)))
+		return;
+	free_smsg(msg);
+}
+
 static void drop_client(ckpool_t *ckp, sdata_t *sdata, const int64_t id)
 {
 	char_entry_t *entries = NULL;
@@ -3575,12 +4780,11 @@ static void drop_client(ckpool_t *ckp, sdata_t *sdata, const int64_t id)
 		__disconnect_session(sdata, client);
 		/* If the client is still holding a reference, don't drop them
 		 * now but wait till the reference is dropped */
-		if (!client->ref) {
+		if (__tag_dropped(sdata, client)) {
 			__drop_client(sdata, client, false, &msg);
 			if (msg)
 				add_msg_entry(&entries, &msg);
-		} else
-			client->dropped = true;
+		}
 	}
 	ck_wunlock(&sdata->instance_lock);
 
@@ -3605,6 +4809,7 @@ static void request_reconnect(sdata_t *sdata, const char *cmd)
 	char *port = strdupa(cmd), *url = NULL;
 	stratum_instance_t *client, *tmp;
 	json_t *json_msg;
+	int i;
 
 	strsep(&port, ":");
 	if (port)
@@ -3620,8 +4825,10 @@ static void request_reconnect(sdata_t *sdata, const char *cmd)
 	/* Tag all existing clients as dropped now so they can be removed
 	 * lazily */
 	ck_wlock(&sdata->instance_lock);
-	HASH_ITER(hh, sdata->stratum_instances, client, tmp) {
-		client->dropped = true;
+	for (i = 0; i < INSTANCE_SHARDS; i++) {
+		HASH_ITER(hh, sdata->instance_shards[i].instances, client, tmp) {
+			client->dropped = true;
+		}
 	}
 	ck_wunlock(&sdata->instance_lock);
 }
@@ -3630,6 +4837,7 @@ static void reset_bestshares(sdata_t *sdata)
 {
 	user_instance_t *user, *tmpuser;
 	stratum_instance_t *client, *tmp;
+	int i;
 
 	/* Can do this unlocked since it's just zeroing the values */
 	sdata->stats.accounted_diff_shares =
@@ -3638,13 +4846,16 @@ static void reset_bestshares(sdata_t *sdata)
 	sdata->stats.best_diff = 0;
 
 	ck_rlock(&sdata->instance_lock);
-	HASH_ITER(hh, sdata->stratum_instances, client, tmp) {
-		client->best_diff = 0;
+	for (i = 0; i < INSTANCE_SHARDS; i++) {
+		HASH_ITER(hh, sdata->instance_shards[i].instances, client, tmp) {
+			client->best_diff = 0;
+		}
 	}
 	HASH_ITER(hh, sdata->user_instances, user, tmpuser) {
 		worker_instance_t *worker;
 
 		user->best_diff = 0;
+		user->dirty = true;
 		DL_FOREACH(user->worker_instances, worker) {
 			worker->best_diff = 0;
 		}
@@ -3669,25 +4880,80 @@ static user_instance_t *user_by_workername(sdata_t *sdata, const char *workernam
 
 static worker_instance_t *get_worker(sdata_t *sdata, user_instance_t *user, const char *workername);
 
+/* Longest the share path goes without decaying a hashmeter, in seconds */
+#define METER_INTERVAL 1
+
+/* Fold any diff accumulated since the last decay into the averages */
+static void decay_meter(hashmeter_t *meter, tv_t *now_t)
+{
+	double tdiff = sane_tdiff(now_t, &meter->last_decay), diff, zero = 0;
+
+	/* Decaying too frequently only loses precision, leave uadiff to
+	 * accumulate till next time */
+	if (tdiff < 0.05)
+		return;
+	copy_tv(&meter->last_decay, now_t);
+	__atomic_exchange(&meter->uadiff, &zero, &diff, __ATOMIC_RELAXED);
+	decay_time(&meter->dsps1, diff, tdiff, MIN1);
+	decay_time(&meter->dsps5, diff, tdiff, MIN5);
+	decay_time(&meter->dsps60, diff, tdiff, HOUR);
+	decay_time(&meter->dsps1440, diff, tdiff, DAY);
+	decay_time(&meter->dsps10080, diff, tdiff, WEEK);
+}
+
+/* Add diff from the share path, only evaluating the decay every
+ * METER_INTERVAL. The atomic add means shares from concurrent threads are
+ * never lost, while the rare racing decay is as harmless as it always was.
+ * There is no atomic add for doubles so it's a compare and swap loop. */
+static void meter_add(hashmeter_t *meter, const double diff, tv_t *now_t)
+{
+	double old, new;
+
+	__atomic_load(&meter->uadiff, &old, __ATOMIC_RELAXED);
+	do {
+		new = old + diff;
+	} while (!__atomic_compare_exchange(&meter->uadiff, &old, &new, true,
+					   __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	if (sane_tdiff(now_t, &meter->last_decay) >= METER_INTERVAL)
+		decay_meter(meter, now_t);
+}
+
+/* Copy of meter without modifying it, for readers. It's only decayed to now
+ * if it's been METER_INTERVAL since the last decay, so readers on the share
+ * path of an active client don't recalculate the averages every share. */
+static void meter_snapshot(hashmeter_t *snap, const hashmeter_t *meter, tv_t *now_t)
+{
+	memcpy(snap, meter, sizeof(hashmeter_t));
+	if (sane_tdiff(now_t, &snap->last_decay) < METER_INTERVAL)
+		return;
+	__atomic_load(&meter->uadiff, &snap->uadiff, __ATOMIC_RELAXED);
+	decay_meter(snap, now_t);
+}
+
 static json_t *worker_stats(const worker_instance_t *worker)
 {
+	hashmeter_t meter;
+	tv_t now;
 	char suffix1[16], suffix5[16], suffix60[16], suffix1440[16], suffix10080[16];
 	json_t *val;
 	double ghs;
 
-	ghs = worker->dsps1 * nonces;
+	tv_time(&now);
+	meter_snapshot(&meter, &worker->meter, &now);
+
+	ghs = meter.dsps1 * nonces;
 	suffix_string(ghs, suffix1, 16, 0);
 
-	ghs = worker->dsps5 * nonces;
+	ghs = meter.dsps5 * nonces;
 	suffix_string(ghs, suffix5, 16, 0);
 
-	ghs = worker->dsps60 * nonces;
+	ghs = meter.dsps60 * nonces;
 	suffix_string(ghs, suffix60, 16, 0);
 
-	ghs = worker->dsps1440 * nonces;
+	ghs = meter.dsps1440 * nonces;
 	suffix_string(ghs, suffix1440, 16, 0);
 
-	ghs = worker->dsps10080 * nonces;
+	ghs = meter.dsps10080 * nonces;
 	suffix_string(ghs, suffix10080, 16, 0);
 
 	JSON_CPACK(val, "{ss,ss,ss,ss,ss}",
@@ -3701,23 +4967,28 @@ static json_t *worker_stats(const worker_instance_t *worker)
 
 static json_t *user_stats(const user_instance_t *user)
 {
+	hashmeter_t meter;
+	tv_t now;
 	char suffix1[16], suffix5[16], suffix60[16], suffix1440[16], suffix10080[16];
 	json_t *val;
 	double ghs;
 
-	ghs = user->dsps1 * nonces;
+	tv_time(&now);
+	meter_snapshot(&meter, &user->meter, &now);
+
+	ghs = meter.dsps1 * nonces;
 	suffix_string(ghs, suffix1, 16, 0);
 
-	ghs = user->dsps5 * nonces;
+	ghs = meter.dsps5 * nonces;
 	suffix_string(ghs, suffix5, 16, 0);
 
-	ghs = user->dsps60 * nonces;
+	ghs = meter.dsps60 * nonces;
 	suffix_string(ghs, suffix60, 16, 0);
 
-	ghs = user->dsps1440 * nonces;
+	ghs = meter.dsps1440 * nonces;
 	suffix_string(ghs, suffix1440, 16, 0);
 
-	ghs = user->dsps10080 * nonces;
+	ghs = meter.dsps10080 * nonces;
 	suffix_string(ghs, suffix10080, 16, 0);
 
 	JSON_CPACK(val, "{ss,ss,ss,ss,ss,sI,sI}",
@@ -3847,37 +5118,145 @@ static void broadcast_ping(sdata_t *sdata)
 static void ckmsgq_stats(ckmsgq_t *ckmsgq, const int size, json_t **val)
 {
 	int64_t memsize, generated;
-	ckmsg_t *msg;
 	int objects;
 
-	mutex_lock(ckmsgq->lock);
-	DL_COUNT(ckmsgq->msgs, msg, objects);
-	generated = ckmsgq->messages;
-	mutex_unlock(ckmsgq->lock);
-
-	memsize = (sizeof(ckmsg_t) + size) * objects;
+	objects = ckmsgq_queued(ckmsgq);
+	generated = __atomic_load_n(&ckmsgq->messages, __ATOMIC_RELAXED);
+	memsize = sizeof(struct ckmsgq_slot) * CKMSGQ_SLOTS + size * objects;
 	JSON_CPACK(*val, "{si,si,sI}", "count", objects, "memory", memsize, "generated", generated);
 }
 
+/* As ckmsgq_stats for an array of queues, totalled, with the depth of each
+ * queue listed under shards */
+static void ckmsgqs_stats(ckmsgq_t *ckmsgqs, const int count, const int size, json_t **val)
+{
+	int64_t memsize = 0, generated = 0;
+	json_t *shards = json_array();
+	int i, objects = 0;
+
+	for (i = 0; i < count; i++) {
+		int queued = ckmsgq_queued(&ckmsgqs[i]);
+
+		objects += queued;
+		generated += __atomic_load_n(&ckmsgqs[i].messages, __ATOMIC_RELAXED);
+		memsize += sizeof(struct ckmsgq_slot) * CKMSGQ_SLOTS + size * queued;
+		json_array_append_new(shards, json_integer(queued));
+	}
+	JSON_CPACK(*val, "{si,si,sI,so}", "count", objects, "memory", memsize,
+		   "generated", generated, "shards", shards);
+}
+
+/* Per stage share latencies and lock waits in ns, emptying them if reset is
+ * set so the next call covers only the time since */
+json_t *stratifier_latency(void *data, const bool reset)
+{
+	json_t *val = json_object(), *subval = json_object();
+	sdata_t *sdata = data;
+
+	ckhist_set_json(val, "submitqueue", &sdata->submit_queue, reset);
+	ckhist_set_json(val, "submitparse", &sdata->submit_parse, reset);
+	ckhist_set_json(val, "sendqueue", &sdata->send_queue, reset);
+	ckhist_set_json(val, "recvprocess", &sdata->recv_process, reset);
+	ckhist_set_json(val, "template", &sdata->template_time, reset);
+	ckhist_set_json(val, "broadcast", &sdata->broadcast_time, reset);
+	ckhist_set_json(subval, "instance", &sdata->instance_wait, reset);
+	ckhist_set_json(subval, "workbase", &sdata->workbase_wait, reset);
+	ckhist_set_json(subval, "share", &sdata->share_wait, reset);
+	json_set_object(val, "lockwait", subval);
+	return val;
+}
+
+/* Label for each share result, indexed by share_err + 9 */
+static const char *share_results[] = {
+	"invalid_nonce2", "worker_mismatch", "no_nonce", "no_ntime", "no_nonce2",
+	"no_jobid", "no_username", "invalid_size", "not_array", "valid",
+	"invalid_jobid", "stale", "invalid_ntime", "duplicate", "high_hash",
+	"invalid_version_mask"
+};
+
+/* Append this stratifier's metrics, reading only counters and histograms
+ * that are kept up to date without needing any locks */
+void stratifier_metrics(ckpool_t *ckp, char **buf)
+{
+	sdata_t *sdata = ckp->sdata;
+	pool_stats_t *stats = &sdata->stats;
+	int i;
+
+	metrics_printf(buf, "# TYPE ckpool_shares_total counter\n");
+	for (i = 0; i <= SE_INVALID_VERSION_MASK + 9; i++) {
+		metrics_printf(buf, "ckpool_shares_total{result=\"%s\"} %"PRId64"\n", share_results[i],
+			       __atomic_load_n(&sdata->share_results[i], __ATOMIC_RELAXED));
+	}
+	metrics_printf(buf, "# TYPE ckpool_shares_per_second gauge\n"
+		       "ckpool_shares_per_second{interval=\"1m\"} %f\n"
+		       "ckpool_shares_per_second{interval=\"5m\"} %f\n"
+		       "ckpool_shares_per_second{interval=\"15m\"} %f\n"
+		       "ckpool_shares_per_second{interval=\"1h\"} %f\n",
+		       stats->sps1, stats->sps5, stats->sps15, stats->sps60);
+	metrics_printf(buf, "# TYPE ckpool_diff_shares_per_second gauge\n"
+		       "ckpool_diff_shares_per_second{interval=\"1m\"} %f\n"
+		       "ckpool_diff_shares_per_second{interval=\"5m\"} %f\n"
+		       "ckpool_diff_shares_per_second{interval=\"1h\"} %f\n",
+		       stats->dsps1, stats->dsps5, stats->dsps60);
+	metrics_printf(buf, "# TYPE ckpool_workers gauge\nckpool_workers %d\n"
+		       "# TYPE ckpool_users gauge\nckpool_users %d\n",
+		       stats->workers, stats->users);
+
+	metrics_printf(buf, "# TYPE ckpool_clean_jobs_total counter\n"
+		       "ckpool_clean_jobs_total{kind=\"empty\"} %"PRId64"\n"
+		       "ckpool_clean_jobs_total{kind=\"full\"} %"PRId64"\n",
+		       sdata->empty_jobs, sdata->full_jobs);
+	/* Seconds from a new block signal till clean work was sent */
+	metrics_printf(buf, "# TYPE ckpool_clean_job_seconds gauge\n"
+		       "ckpool_clean_job_seconds{kind=\"empty\"} %f\n"
+		       "ckpool_clean_job_seconds{kind=\"full\"} %f\n"
+		       "# TYPE ckpool_clean_job_max_seconds gauge\n"
+		       "ckpool_clean_job_max_seconds{kind=\"empty\"} %f\n"
+		       "ckpool_clean_job_max_seconds{kind=\"full\"} %f\n",
+		       sdata->empty_last, sdata->full_last, sdata->empty_max, sdata->full_max);
+	metrics_printf(buf, "# TYPE ckpool_template_seconds summary\n");
+	metrics_hist(buf, "ckpool_template_seconds", "", &sdata->template_time);
+	metrics_printf(buf, "# TYPE ckpool_broadcast_seconds summary\n");
+	metrics_hist(buf, "ckpool_broadcast_seconds", "", &sdata->broadcast_time);
+
+	metrics_printf(buf, "# TYPE ckpool_share_stage_seconds summary\n");
+	metrics_hist(buf, "ckpool_share_stage_seconds", "stage=\"submitqueue\"", &sdata->submit_queue);
+	metrics_hist(buf, "ckpool_share_stage_seconds", "stage=\"submitparse\"", &sdata->submit_parse);
+	metrics_hist(buf, "ckpool_share_stage_seconds", "stage=\"sendqueue\"", &sdata->send_queue);
+	metrics_hist(buf, "ckpool_share_stage_seconds", "stage=\"recvprocess\"", &sdata->recv_process);
+	metrics_printf(buf, "# TYPE ckpool_lock_wait_seconds summary\n");
+	metrics_hist(buf, "ckpool_lock_wait_seconds", "lock=\"instance\"", &sdata->instance_wait);
+	metrics_hist(buf, "ckpool_lock_wait_seconds", "lock=\"workbase\"", &sdata->workbase_wait);
+	metrics_hist(buf, "ckpool_lock_wait_seconds", "lock=\"share\"", &sdata->share_wait);
+}
+
 char *stratifier_stats(ckpool_t *ckp, void *data)
 {
 	json_t *val = json_object(), *subval;
-	int64_t memsize, generated;
+	int64_t memsize, generated, arena;
+	workbase_t *wb, *tmpwb;
 	sdata_t *sdata = data;
-	int objects;
+	int objects, i;
 	char *buf;
 
 	ck_rlock(&sdata->workbase_lock);
 	objects = HASH_COUNT(sdata->workbases);
-	memsize = SAFE_HASH_OVERHEAD(sdata->workbases) + sizeof(workbase_t) * objects;
+	arena = 0;
+	HASH_ITER(hh, sdata->workbases, wb, tmpwb)
+		arena += wb->arena.size;
+	memsize = SAFE_HASH_OVERHEAD(sdata->workbases) + sizeof(workbase_t) * objects + arena;
 	generated = sdata->workbases_generated;
-	JSON_CPACK(subval, "{si,si,sI}", "count", objects, "memory", memsize, "generated", generated);
+	JSON_CPACK(subval, "{si,sI,sI,sI}", "count", objects, "memory", memsize, "generated", generated,
+		   "arena", arena);
 	json_set_object(val, "workbases", subval);
 	objects = HASH_COUNT(sdata->remote_workbases);
-	memsize = SAFE_HASH_OVERHEAD(sdata->remote_workbases) + sizeof(workbase_t) * objects;
+	arena = 0;
+	HASH_ITER(hh, sdata->remote_workbases, wb, tmpwb)
+		arena += wb->arena.size;
+	memsize = SAFE_HASH_OVERHEAD(sdata->remote_workbases) + sizeof(workbase_t) * objects + arena;
 	ck_runlock(&sdata->workbase_lock);
 
-	JSON_CPACK(subval, "{si,si}", "count", objects, "memory", memsize);
+	JSON_CPACK(subval, "{si,sI,sI}", "count", objects, "memory", memsize, "arena", arena);
 	json_set_object(val, "remote_workbases", subval);
 
 	ck_rlock(&sdata->instance_lock);
@@ -3890,7 +5269,8 @@ char *stratifier_stats(ckpool_t *ckp, void *data)
 		HASH_ITER(hh, sdata->user_instances, user, tmpuser) {
 			subobjects = HASH_COUNT(user->userwbs);
 			objects += subobjects;
-			memsize += SAFE_HASH_OVERHEAD(user->userwbs) + sizeof(struct userwb) * subobjects;
+			/* The userwbs themselves are counted in workbase arenas */
+			memsize += SAFE_HASH_OVERHEAD(user->userwbs);
 		}
 		generated = sdata->userwbs_generated;
 		JSON_CPACK(subval, "{si,si,sI}", "count", objects, "memory", memsize, "generated", generated);
@@ -3898,30 +5278,70 @@ char *stratifier_stats(ckpool_t *ckp, void *data)
 	}
 
 	objects = HASH_COUNT(sdata->user_instances);
-	memsize = SAFE_HASH_OVERHEAD(sdata->user_instances) + sizeof(stratum_instance_t) * objects;
+	memsize = SAFE_HASH_OVERHEAD(sdata->user_instances) + sizeof(user_instance_t) * objects;
 	JSON_CPACK(subval, "{si,si}", "count", objects, "memory", memsize);
 	json_set_object(val, "users", subval);
 
-	objects = HASH_COUNT(sdata->stratum_instances);
-	memsize = SAFE_HASH_OVERHEAD(sdata->stratum_instances);
-	generated = sdata->stratum_generated;
-	JSON_CPACK(subval, "{si,si,sI}", "count", objects, "memory", memsize, "generated", generated);
+	objects = slab_objects(&sdata->worker_slab);
+	memsize = slab_memsize(&sdata->worker_slab);
+	JSON_CPACK(subval, "{si,si}", "count", objects, "memory", memsize);
+	json_set_object(val, "workers", subval);
+
+	objects = instance_count(sdata);
+	memsize = sizeof(instance_shard_t) * INSTANCE_SHARDS + slab_memsize(&sdata->instance_slab);
+	for (i = 0; i < INSTANCE_SHARDS; i++)
+		memsize += SAFE_HASH_OVERHEAD(sdata->instance_shards[i].instances);
+	generated = sdata->instance_slab.generated;
+	JSON_CPACK(subval, "{si,si,sI,sI,sI}", "count", objects, "memory", memsize, "generated", generated,
+		   "slabs", sdata->instance_slab.count, "slabsfreed", sdata->instance_slab.freed);
 	json_set_object(val, "clients", subval);
 
+	ck_rlock(&sdata->session_lock);
 	objects = sdata->stats.disconnected;
 	generated = sdata->disconnected_generated;
 	memsize = SAFE_HASH_OVERHEAD(sdata->disconnected_sessions);
+	if (sdata->session_addrs)
+		memsize += HASH_OVERHEAD(hh_addr, sdata->session_addrs);
 	memsize += sizeof(session_t) * sdata->stats.disconnected;
+	ck_runlock(&sdata->session_lock);
 	JSON_CPACK(subval, "{si,si,sI}", "count", objects, "memory", memsize, "generated", generated);
 	json_set_object(val, "disconnected", subval);
 	ck_runlock(&sdata->instance_lock);
 
+	mutex_lock(&sdata->intern_lock);
+	objects = HASH_COUNT(sdata->interned);
+	memsize = SAFE_HASH_OVERHEAD(sdata->interned) + sizeof(strintern_t) * objects +
+		  sdata->interned_bytes;
+	JSON_CPACK(subval, "{si,sI,sI,sI}", "count", objects, "memory", memsize,
+		   "refs", sdata->interned_refs, "saved", sdata->interned_saved);
+	mutex_unlock(&sdata->intern_lock);
+	json_set_object(val, "strings", subval);
+
 	mutex_lock(&sdata->share_lock);
 	generated = sdata->shares_generated;
-	objects = HASH_COUNT(sdata->shares);
-	memsize = SAFE_HASH_OVERHEAD(sdata->shares) + sizeof(share_t) * objects;
 	mutex_unlock(&sdata->share_lock);
 
+	objects = memsize = 0;
+	ck_rlock(&sdata->workbase_lock);
+	HASH_ITER(hh, sdata->workbases, wb, tmpwb) {
+		sharetable_t *sharetable = wb->sharetable;
+		int i;
+
+		if (!sharetable)
+			continue;
+		memsize += sizeof(sharetable_t);
+		for (i = 0; i < SHARE_STRIPES; i++) {
+			struct share_stripe *stripe = &sharetable->stripes[i];
+
+			mutex_lock(&stripe->lock);
+			objects += stripe->count;
+			memsize += stripe->size * 32;
+			generated += stripe->generated;
+			mutex_unlock(&stripe->lock);
+		}
+	}
+	ck_runlock(&sdata->workbase_lock);
+
 	JSON_CPACK(subval, "{si,si,sI}", "count", objects, "memory", memsize, "generated", generated);
 	json_set_object(val, "shares", subval);
 
@@ -3933,14 +5353,42 @@ char *stratifier_stats(ckpool_t *ckp, void *data)
 	json_set_object(val, "transactions", subval);
 	ck_runlock(&sdata->txn_lock);
 
-	ckmsgq_stats(sdata->ssends, sizeof(smsg_t), &subval);
+	if (ckp->sharebudget) {
+		JSON_CPACK(subval, "{sf,sf,sf}", "budget", ckp->sharebudget,
+			   "sps1", sdata->stats.sps1, "scale", sdata->diff_scale);
+		json_set_object(val, "sharebudget", subval);
+	}
+
+	/* Milliseconds from a new block signal till clean work was sent */
+	JSON_CPACK(subval, "{sI,sf,sf,sI,sf,sf}", "empty", sdata->empty_jobs,
+		   "emptyms", sdata->empty_last * 1000, "emptymaxms", sdata->empty_max * 1000,
+		   "full", sdata->full_jobs, "fullms", sdata->full_last * 1000,
+		   "fullmaxms", sdata->full_max * 1000);
+	json_set_object(val, "cleanjobs", subval);
+	json_set_object(val, "latency", stratifier_latency(sdata, false));
+
+	ckmsgqs_stats(sdata->ssends, sdata->sthreads, sizeof(smsg_t), &subval);
 	json_set_object(val, "ssends", subval);
 	/* Don't know exactly how big the string is so just count the pointer for now */
-	ckmsgq_stats(sdata->srecvs, sizeof(char *), &subval);
+	ckmsgqs_stats(sdata->srecvs, sdata->sthreads, sizeof(smsg_t), &subval);
 	json_set_object(val, "srecvs", subval);
+	ckmsgqs_stats(sdata->sshareq, sdata->sthreads, sizeof(stratum_submit_t), &subval);
+	json_set_object(val, "sshareq", subval);
+	ckmsgqs_stats(sdata->sauthq, sdata->sthreads, sizeof(json_params_t), &subval);
+	json_set_object(val, "sauthq", subval);
 	ckmsgq_stats(sdata->stxnq, sizeof(json_params_t), &subval);
 	json_set_object(val, "stxnq", subval);
 
+	if (ckp->logshares && sdata == ckp->sdata) {
+		mutex_lock(&sdata->sharelog_lock);
+		objects = sdata->sharelogs_queued;
+		memsize = sdata->sharelog_bytes + objects * sizeof(sharelog_t);
+		JSON_CPACK(subval, "{si,sI,sI,sI}", "count", objects, "memory", memsize,
+			   "generated", sdata->sharelogs_generated, "stalled", sdata->sharelogs_stalled);
+		mutex_unlock(&sdata->sharelog_lock);
+		json_set_object(val, "sharelog", subval);
+	}
+
 	buf = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER);
 	json_decref(val);
 	LOGNOTICE("Stratifier stats: %s", buf);
@@ -4002,12 +5450,17 @@ static void reconnect_client_id(sdata_t *sdata, const int64_t client_id)
 
 static json_t *userinfo(const user_instance_t *user)
 {
+	hashmeter_t meter;
+	tv_t now;
 	json_t *val;
 
+	tv_time(&now);
+	meter_snapshot(&meter, &user->meter, &now);
+
 	JSON_CPACK(val, "{ss,si,si,sf,sf,sf,sf,sf,sf,si}",
 		   "user", user->username, "id", user->id, "workers", user->workers,
-	    "bestdiff", user->best_diff, "dsps1", user->dsps1, "dsps5", user->dsps5,
-	    "dsps60", user->dsps60, "dsps1440", user->dsps1440, "dsps10080", user->dsps10080,
+	    "bestdiff", user->best_diff, "dsps1", meter.dsps1, "dsps5", meter.dsps5,
+	    "dsps60", meter.dsps60, "dsps1440", meter.dsps1440, "dsps10080", meter.dsps10080,
 	    "lastshare", user->last_share.tv_sec);
 	return val;
 }
@@ -4123,12 +5576,17 @@ out:
 
 static json_t *workerinfo(const user_instance_t *user, const worker_instance_t *worker)
 {
+	hashmeter_t meter;
+	tv_t now;
 	json_t *val;
 
+	tv_time(&now);
+	meter_snapshot(&meter, &worker->meter, &now);
+
 	JSON_CPACK(val, "{ss,ss,si,sf,sf,sf,sf,si,sf,si,sb}",
 		   "user", user->username, "worker", worker->workername, "id", user->id,
-	    "dsps1", worker->dsps1, "dsps5", worker->dsps5, "dsps60", worker->dsps60,
-	    "dsps1440", worker->dsps1440, "lastshare", worker->last_share.tv_sec,
+	    "dsps1", meter.dsps1, "dsps5", meter.dsps5, "dsps60", meter.dsps60,
+	    "dsps1440", meter.dsps1440, "lastshare", worker->last_share.tv_sec,
 	    "bestdiff", worker->best_diff, "mindiff", worker->mindiff, "idle", worker->idle);
 	return val;
 }
@@ -4205,19 +5663,24 @@ static void getusers(sdata_t *sdata, int *sockd)
 
 static json_t *clientinfo(const stratum_instance_t *client)
 {
+	hashmeter_t meter;
+	tv_t now;
 	json_t *val = json_object();
 
+	tv_time(&now);
+	meter_snapshot(&meter, &client->meter, &now);
+
 	/* Too many fields for a pack object, do each discretely to keep track */
 	json_set_int(val, "id", client->id);
 	json_set_string(val, "enonce1", client->enonce1);
 	json_set_string(val, "enonce1var", client->enonce1var);
 	json_set_int(val, "enonce1_64", client->enonce1_64);
 	json_set_double(val, "diff", client->diff);
-	json_set_double(val, "dsps1", client->dsps1);
-	json_set_double(val, "dsps5", client->dsps5);
-	json_set_double(val, "dsps60", client->dsps60);
-	json_set_double(val, "dsps1440", client->dsps1440);
-	json_set_double(val, "dsps10080", client->dsps10080);
+	json_set_double(val, "dsps1", meter.dsps1);
+	json_set_double(val, "dsps5", meter.dsps5);
+	json_set_double(val, "dsps60", meter.dsps60);
+	json_set_double(val, "dsps1440", meter.dsps1440);
+	json_set_double(val, "dsps10080", meter.dsps10080);
 	json_set_int(val, "lastshare", client->last_share.tv_sec);
 	json_set_int(val, "starttime", client->start_time);
 	json_set_string(val, "address", client->address);
@@ -4268,13 +5731,16 @@ out:
 static void getclients(sdata_t *sdata, int *sockd)
 {
 	json_t *val = NULL, *client_arr;
-	stratum_instance_t *client;
+	stratum_instance_t *client, *tmp;
+	int i;
 
 	client_arr = json_array();
 
 	ck_rlock(&sdata->instance_lock);
-	for (client = sdata->stratum_instances; client; client = client->hh.next) {
-		json_array_append_new(client_arr, clientinfo(client));
+	for (i = 0; i < INSTANCE_SHARDS; i++) {
+		HASH_ITER(hh, sdata->instance_shards[i].instances, client, tmp) {
+			json_array_append_new(client_arr, clientinfo(client));
+		}
 	}
 	ck_runlock(&sdata->instance_lock);
 
@@ -4521,11 +5987,8 @@ static void stratum_loop(ckpool_t *ckp, proc_instance_t *pi)
 	char *buf;
 
 retry:
-	if (umsg) {
-		Close(umsg->sockd);
-		free(umsg->buf);
-		dealloc(umsg);
-	}
+	put_unix_msg(umsg);
+	umsg = NULL;
 
 	do {
 		time_t end_t;
@@ -4553,7 +6016,7 @@ retry:
 
 		/* This is a message for a node */
 		if (likely(val))
-			ckmsgq_add(sdata->srecvs, val);
+			stratifier_add_recv(ckp, val);
 		goto retry;
 	}
 	if (cmdmatch(buf, "ping")) {
@@ -4634,6 +6097,9 @@ retry:
 	LOGDEBUG("Stratifier received request: %s", buf);
 	if (cmdmatch(buf, "update")) {
 		update_base(sdata, GEN_PRIORITY);
+	} else if (cmdmatch(buf, "mempool")) {
+		/* Template pushed with the same prevhash */
+		update_base(sdata, GEN_NORMAL);
 	} else if (cmdmatch(buf, "subscribe")) {
 		/* Proxifier has a new subscription */
 		update_subscribe(ckp, buf);
@@ -4694,13 +6160,18 @@ static void *blockupdate(void *arg)
 				break;
 			case GETBEST_SUCCESS:
 				if (strcmp(hash, sdata->lastswaphash)) {
-					update_base(sdata, GEN_PRIORITY);
+					update_block_base(sdata, GEN_PRIORITY, hash);
 					break;
 				}
 				[[fallthrough]];
 			case GETBEST_FAILED:
 			default:
-				cksleep_ms(ckp->blockpoll);
+				/* Longpoll pushes new blocks so polling is only a
+				 * fallback */
+				if (ckp->longpoll)
+					cksleep_ms(MAX(ckp->blockpoll, 1000));
+				else
+					cksleep_ms(ckp->blockpoll);
 		}
 	}
 	return NULL;
@@ -4863,49 +6334,23 @@ out:
 }
 
 static int userid_from_sessionid(sdata_t *sdata, const int session_id)
-{
-	session_t *session;
-	int ret = -1;
-
-	ck_wlock(&sdata->instance_lock);
-	HASH_FIND_INT(sdata->disconnected_sessions, &session_id, session);
-	if (!session)
-		goto out_unlock;
-	HASH_DEL(sdata->disconnected_sessions, session);
-	sdata->stats.disconnected--;
-	ret = session->userid;
-	dealloc(session);
-out_unlock:
-	ck_wunlock(&sdata->instance_lock);
-
-	if (ret != -1)
-		LOGINFO("Found old session id %d for userid %d", session_id, ret);
-	return ret;
-}
-
-static int userid_from_sessionip(sdata_t *sdata, const char *address)
-{
-	session_t *session, *tmp;
-	int ret = -1;
-
-	ck_wlock(&sdata->instance_lock);
-	HASH_ITER(hh, sdata->disconnected_sessions, session, tmp) {
-		if (!strcmp(session->address, address)) {
-			ret = session->userid;
-			break;
-		}
-	}
-	if (ret == -1)
-		goto out_unlock;
-	HASH_DEL(sdata->disconnected_sessions, session);
-	sdata->stats.disconnected--;
-	dealloc(session);
-out_unlock:
-	ck_wunlock(&sdata->instance_lock);
+{
+	session_t session;
 
-	if (ret != -1)
-		LOGINFO("Found old session address %s for userid %d", address, ret);
-	return ret;
+	if (!take_session(sdata, session_id, NULL, &session))
+		return -1;
+	LOGINFO("Found old session id %d for userid %d", session_id, session.userid);
+	return session.userid;
+}
+
+static int userid_from_sessionip(sdata_t *sdata, const char *address)
+{
+	session_t session;
+
+	if (!take_session(sdata, 0, address, &session))
+		return -1;
+	LOGINFO("Found old session address %s for userid %d", address, session.userid);
+	return session.userid;
 }
 
 /* Extranonce1 must be set here. Needs to be entered with client holding a ref
@@ -4940,10 +6385,7 @@ static json_t *parse_subscribe(stratum_instance_t *client, const int64_t client_
 		const char *buf;
 
 		buf = json_string_value(json_array_get(params_val, 0));
-		if (buf && strlen(buf))
-			client->useragent = strdup(buf);
-		else
-			client->useragent = ckzalloc(1); // Set to ""
+		reintern_str(ckp_sdata, &client->useragent, buf ? buf : "");
 		if (arr_size > 1) {
 			/* This would be the session id for reconnect, it will
 			 * not work for clients on a proxied connection. */
@@ -4962,7 +6404,7 @@ static json_t *parse_subscribe(stratum_instance_t *client, const int64_t client_
 			}
 		}
 	} else
-		client->useragent = ckzalloc(1);
+		reintern_str(ckp_sdata, &client->useragent, "");
 
 	/* Whitelist cgminer based clients to receive stratum messages */
 	if (strcasestr(client->useragent, "gminer"))
@@ -5058,69 +6500,219 @@ static double dsps_from_key(json_t *val, const char *key)
 	return ret;
 }
 
-static void decay_client(stratum_instance_t *client, double diff, tv_t *now_t)
-{
-	double tdiff = sane_tdiff(now_t, &client->last_decay);
 
-	/* If we're calling the hashmeter too frequently we'll just end up
-	 * racing and having inappropriate values, so store up diff and update
-	 * at most 20 times per second. Use an integer for uadiff to make the
-	 * update atomic */
-	if (tdiff < 0.05) {
-		client->uadiff += diff;
-		return;
-	}
-	copy_tv(&client->last_decay, now_t);
-	diff += client->uadiff;
-	client->uadiff = 0;
-	decay_time(&client->dsps1, diff, tdiff, MIN1);
-	decay_time(&client->dsps5, diff, tdiff, MIN5);
-	decay_time(&client->dsps60, diff, tdiff, HOUR);
-	decay_time(&client->dsps1440, diff, tdiff, DAY);
-	decay_time(&client->dsps10080, diff, tdiff, WEEK);
+static user_instance_t *get_create_user(sdata_t *sdata, const char *username, bool *new_user);
+static worker_instance_t *get_create_worker(sdata_t *sdata, user_instance_t *user,
+					    const char *workername, bool *new_worker);
+static user_instance_t *__create_user(sdata_t *sdata, const char *username);
+static worker_instance_t *__create_worker(sdata_t *sdata, user_instance_t *user,
+					  const char *workername);
+static worker_instance_t *__get_worker(user_instance_t *user, const char *workername);
+
+/* Binary snapshot of every user and worker's stats, written in one file by
+ * statsupdate each minute so startup can mmap it and bulk load all users
+ * instead of parsing one json file per user. Host endian since it is only
+ * ever read back by the pool that wrote it. Each record is followed by its
+ * name, NUL terminated and padded to 8 bytes, and each user record by its
+ * worker records. */
+#define SNAPSHOT_MAGIC		"CKSNAP1"
+#define SNAPSHOT_STALE		90 /* Seconds older than pool.status */
+
+typedef struct snapshot_header {
+	char magic[8];
+	int64_t written;
+	int64_t size;
+	int32_t users;
+	int32_t workers;
+} snapshot_header_t;
+
+typedef struct snapshot_stats {
+	double dsps1;
+	double dsps5;
+	double dsps60;
+	double dsps1440;
+	double dsps10080;
+	double best_diff;
+	int64_t best_ever;
+	int64_t shares;
+	int64_t last_share;
+	int32_t namelen; /* Including the NUL and padding */
+	int32_t count; /* Workers following a user record */
+	int64_t auth_time; /* Users only */
+} snapshot_stats_t;
+
+static void snapshot_to_meter(hashmeter_t *meter, const snapshot_stats_t *rec, const tv_t *now)
+{
+	copy_tv(&meter->last_decay, now);
+	meter->dsps1 = rec->dsps1;
+	meter->dsps5 = rec->dsps5;
+	meter->dsps60 = rec->dsps60;
+	meter->dsps1440 = rec->dsps1440;
+	meter->dsps10080 = rec->dsps10080;
 }
 
-static void decay_worker(worker_instance_t *worker, double diff, tv_t *now_t)
+/* Check every record fits in the mapping and every name is terminated before
+ * touching any users so a truncated file falls back cleanly to json. */
+static bool snapshot_valid(const char *map, const size_t size, const int64_t stale)
 {
-	double tdiff = sane_tdiff(now_t, &worker->last_decay);
+	const snapshot_header_t *hdr = (const snapshot_header_t *)map;
+	int users = 0, workers = 0, count;
+	const snapshot_stats_t *rec;
+	size_t ofs;
 
-	if (tdiff < 0.05) {
-		worker->uadiff += diff;
-		return;
+	if (size < sizeof(snapshot_header_t) || memcmp(hdr->magic, SNAPSHOT_MAGIC, 8)) {
+		LOGWARNING("Invalid user stats snapshot header");
+		return false;
+	}
+	if (hdr->size != (int64_t)size) {
+		LOGWARNING("User stats snapshot size %"PRId64" does not match file size %lu",
+			   hdr->size, (unsigned long)size);
+		return false;
+	}
+	if (hdr->written < stale) {
+		LOGNOTICE("User stats snapshot is stale, %"PRId64" seconds older than pool status",
+			  stale + SNAPSHOT_STALE - hdr->written);
+		return false;
+	}
+	for (ofs = sizeof(snapshot_header_t); ofs < size; ) {
+		if (size - ofs < sizeof(snapshot_stats_t))
+			goto out_bad;
+		rec = (const snapshot_stats_t *)(map + ofs);
+		if (rec->namelen < 8 || rec->namelen > 128 || rec->namelen & 7 ||
+		    size - ofs - sizeof(snapshot_stats_t) < (size_t)rec->namelen)
+			goto out_bad;
+		ofs += sizeof(snapshot_stats_t);
+		if (map[ofs + rec->namelen - 1])
+			goto out_bad;
+		ofs += rec->namelen;
+		users++;
+		for (count = rec->count; count > 0; count--) {
+			const snapshot_stats_t *wrec;
+
+			if (size - ofs < sizeof(snapshot_stats_t))
+				goto out_bad;
+			wrec = (const snapshot_stats_t *)(map + ofs);
+			if (wrec->namelen < 8 || wrec->namelen & 7 ||
+			    size - ofs - sizeof(snapshot_stats_t) < (size_t)wrec->namelen)
+				goto out_bad;
+			ofs += sizeof(snapshot_stats_t);
+			if (map[ofs + wrec->namelen - 1])
+				goto out_bad;
+			ofs += wrec->namelen;
+			workers++;
+		}
 	}
-	copy_tv(&worker->last_decay, now_t);
-	diff += worker->uadiff;
-	worker->uadiff = 0;
-	decay_time(&worker->dsps1, diff, tdiff, MIN1);
-	decay_time(&worker->dsps5, diff, tdiff, MIN5);
-	decay_time(&worker->dsps60, diff, tdiff, HOUR);
-	decay_time(&worker->dsps1440, diff, tdiff, DAY);
-	decay_time(&worker->dsps10080, diff, tdiff, WEEK);
+	if (users == hdr->users && workers == hdr->workers)
+		return true;
+out_bad:
+	LOGWARNING("Corrupt user stats snapshot at offset %lu", (unsigned long)ofs);
+	return false;
 }
 
-static void decay_user(user_instance_t *user, double diff, tv_t *now_t)
+/* Create all users and workers from the snapshot under one hold of the
+ * instance lock. Returns false if there is no usable snapshot so the caller
+ * falls back to the json files. */
+static bool read_stats_snapshot(ckpool_t *ckp, sdata_t *sdata, const int tvsec_diff)
 {
-	double tdiff = sane_tdiff(now_t, &user->last_decay);
+	int users = 0, workers = 0, fd;
+	size_t ofs, size;
+	struct stat st;
+	bool ret = false;
+	char *map, *s;
+	tv_t now;
 
-	if (tdiff < 0.05) {
-		user->uadiff += diff;
-		return;
+	ASPRINTF(&s, "%spool/users.snapshot", ckp->logdir);
+	fd = open(s, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		LOGINFO("No user stats snapshot %s", s);
+		goto out;
 	}
-	copy_tv(&user->last_decay, now_t);
-	diff += user->uadiff;
-	user->uadiff = 0;
-	decay_time(&user->dsps1, diff, tdiff, MIN1);
-	decay_time(&user->dsps5, diff, tdiff, MIN5);
-	decay_time(&user->dsps60, diff, tdiff, HOUR);
-	decay_time(&user->dsps1440, diff, tdiff, DAY);
-	decay_time(&user->dsps10080, diff, tdiff, WEEK);
-}
+	if (unlikely(fstat(fd, &st) || st.st_size < (off_t)sizeof(snapshot_header_t))) {
+		Close(fd);
+		LOGWARNING("Unable to use user stats snapshot %s", s);
+		goto out;
+	}
+	size = st.st_size;
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	Close(fd);
+	if (unlikely(map == MAP_FAILED)) {
+		LOGWARNING("Failed to mmap user stats snapshot %s", s);
+		goto out;
+	}
+	madvise(map, size, MADV_SEQUENTIAL);
 
-static user_instance_t *get_create_user(sdata_t *sdata, const char *username, bool *new_user);
-static worker_instance_t *get_create_worker(sdata_t *sdata, user_instance_t *user,
-					    const char *workername, bool *new_worker);
+	tv_time(&now);
+	if (!snapshot_valid(map, size, now.tv_sec - tvsec_diff - SNAPSHOT_STALE))
+		goto out_unmap;
+
+	ck_wlock(&sdata->instance_lock);
+	for (ofs = sizeof(snapshot_header_t); ofs < size; ) {
+		const snapshot_stats_t *rec = (const snapshot_stats_t *)(map + ofs);
+		const char *username = map + ofs + sizeof(snapshot_stats_t);
+		user_instance_t *user;
+		int count;
+
+		ofs += sizeof(snapshot_stats_t) + rec->namelen;
+		HASH_FIND_STR(sdata->user_instances, username, user);
+		if (unlikely(user)) {
+			LOGWARNING("Duplicate user in user stats snapshot %s", username);
+			for (count = rec->count; count > 0; count--) {
+				rec = (const snapshot_stats_t *)(map + ofs);
+				ofs += sizeof(snapshot_stats_t) + rec->namelen;
+			}
+			continue;
+		}
+		user = __create_user(sdata, username);
+		users++;
+		copy_tv(&user->last_share, &now);
+		snapshot_to_meter(&user->meter, rec, &now);
+		user->last_share.tv_sec = rec->last_share;
+		user->shares = rec->shares;
+		user->best_diff = rec->best_diff;
+		user->best_ever = rec->best_ever;
+		user->auth_time = rec->auth_time;
+		if (user->best_diff > user->best_ever)
+			user->best_ever = user->best_diff;
+		if (tvsec_diff > 60)
+			decay_meter(&user->meter, &now);
+
+		for (count = rec->count; count > 0; count--) {
+			const snapshot_stats_t *wrec = (const snapshot_stats_t *)(map + ofs);
+			const char *workername = map + ofs + sizeof(snapshot_stats_t);
+			worker_instance_t *worker;
+
+			ofs += sizeof(snapshot_stats_t) + wrec->namelen;
+			if (unlikely(!strstr(workername, username) || __get_worker(user, workername))) {
+				LOGWARNING("Invalid workername in user stats snapshot %s", workername);
+				continue;
+			}
+			worker = __create_worker(sdata, user, workername);
+			workers++;
+			snapshot_to_meter(&worker->meter, wrec, &now);
+			worker->last_share.tv_sec = wrec->last_share;
+			worker->shares = wrec->shares;
+			worker->best_diff = wrec->best_diff;
+			worker->best_ever = wrec->best_ever;
+			if (worker->best_diff > worker->best_ever)
+				worker->best_ever = worker->best_diff;
+			if (tvsec_diff > 60)
+				decay_meter(&worker->meter, &now);
+		}
+	}
+	ck_wunlock(&sdata->instance_lock);
+	ret = true;
+
+	if (likely(users))
+		LOGWARNING("Loaded %d users and %d workers from snapshot", users, workers);
+out_unmap:
+	munmap(map, size);
+out:
+	free(s);
+	return ret;
+}
 
-/* Load the statistics of and create all known users at startup */
+/* Load the statistics of and create all known users at startup, from the
+ * snapshot if there is a current one or else from each user's json file */
 static void read_userstats(ckpool_t *ckp, sdata_t *sdata, int tvsec_diff)
 {
 	char dnam[256], s[4096], *username, *buf;
@@ -5135,6 +6727,9 @@ static void read_userstats(ckpool_t *ckp, sdata_t *sdata, int tvsec_diff)
 	DIR *d;
 	int fd;
 
+	if (read_stats_snapshot(ckp, sdata, tvsec_diff))
+		return;
+
 	snprintf(dnam, 255, "%susers", ckp->logdir);
 	d = opendir(dnam);
 	if (!d) {
@@ -5194,12 +6789,12 @@ static void read_userstats(ckpool_t *ckp, sdata_t *sdata, int tvsec_diff)
 		dealloc(buf);
 
 		copy_tv(&user->last_share, &now);
-		copy_tv(&user->last_decay, &now);
-		user->dsps1 = dsps_from_key(val, "hashrate1m");
-		user->dsps5 = dsps_from_key(val, "hashrate5m");
-		user->dsps60 = dsps_from_key(val, "hashrate1hr");
-		user->dsps1440 = dsps_from_key(val, "hashrate1d");
-		user->dsps10080 = dsps_from_key(val, "hashrate7d");
+		copy_tv(&user->meter.last_decay, &now);
+		user->meter.dsps1 = dsps_from_key(val, "hashrate1m");
+		user->meter.dsps5 = dsps_from_key(val, "hashrate5m");
+		user->meter.dsps60 = dsps_from_key(val, "hashrate1hr");
+		user->meter.dsps1440 = dsps_from_key(val, "hashrate1d");
+		user->meter.dsps10080 = dsps_from_key(val, "hashrate7d");
 		json_get_int(&lastshare, val, "lastshare");
 		user->last_share.tv_sec = lastshare;
 		json_get_int64(&user->shares, val, "shares");
@@ -5210,10 +6805,10 @@ static void read_userstats(ckpool_t *ckp, sdata_t *sdata, int tvsec_diff)
 		if (user->best_diff > user->best_ever)
 			user->best_ever = user->best_diff;
 		LOGINFO("Successfully read user %s stats %f %f %f %f %f %f %ld %ld", user->username,
-			user->dsps1, user->dsps5, user->dsps60, user->dsps1440,
-			user->dsps10080, user->best_diff, user->best_ever, user->auth_time);
+			user->meter.dsps1, user->meter.dsps5, user->meter.dsps60, user->meter.dsps1440,
+			user->meter.dsps10080, user->best_diff, user->best_ever, user->auth_time);
 		if (tvsec_diff > 60)
-			decay_user(user, 0, &now);
+			decay_meter(&user->meter, &now);
 
 		worker_array = json_object_get(val, "worker");
 		json_array_foreach(worker_array, index, arr_val) {
@@ -5232,12 +6827,12 @@ static void read_userstats(ckpool_t *ckp, sdata_t *sdata, int tvsec_diff)
 				continue;
 			}
 			workers++;
-			copy_tv(&worker->last_decay, &now);
-			worker->dsps1 = dsps_from_key(arr_val, "hashrate1m");
-			worker->dsps5 = dsps_from_key(arr_val, "hashrate5m");
-			worker->dsps60 = dsps_from_key(arr_val, "hashrate1hr");
-			worker->dsps1440 = dsps_from_key(arr_val, "hashrate1d");
-			worker->dsps10080 = dsps_from_key(arr_val, "hashrate7d");
+			copy_tv(&worker->meter.last_decay, &now);
+			worker->meter.dsps1 = dsps_from_key(arr_val, "hashrate1m");
+			worker->meter.dsps5 = dsps_from_key(arr_val, "hashrate5m");
+			worker->meter.dsps60 = dsps_from_key(arr_val, "hashrate1hr");
+			worker->meter.dsps1440 = dsps_from_key(arr_val, "hashrate1d");
+			worker->meter.dsps10080 = dsps_from_key(arr_val, "hashrate7d");
 			json_get_int(&lastshare, arr_val, "lastshare");
 			worker->last_share.tv_sec = lastshare;
 			json_get_double(&worker->best_diff, arr_val, "bestshare");
@@ -5246,9 +6841,9 @@ static void read_userstats(ckpool_t *ckp, sdata_t *sdata, int tvsec_diff)
 				worker->best_ever = worker->best_diff;
 			json_get_int64(&worker->shares, arr_val, "shares");
 			LOGINFO("Successfully read worker %s stats %f %f %f %f %f %ld", worker->workername,
-				worker->dsps1, worker->dsps5, worker->dsps60, worker->dsps1440, worker->best_diff, worker->best_ever);
+				worker->meter.dsps1, worker->meter.dsps5, worker->meter.dsps60, worker->meter.dsps1440, worker->best_diff, worker->best_ever);
 			if (tvsec_diff > 60)
-				decay_worker(worker, 0, &now);
+				decay_meter(&worker->meter, &now);
 		}
 		json_decref(val);
 	}
@@ -5295,11 +6890,12 @@ static user_instance_t *get_user(sdata_t *sdata, const char *username)
 	return get_create_user(sdata, username, &dummy);
 }
 
-static worker_instance_t *__create_worker(user_instance_t *user, const char *workername)
+static worker_instance_t *__create_worker(sdata_t *sdata, user_instance_t *user,
+					  const char *workername)
 {
-	worker_instance_t *worker = ckzalloc(sizeof(worker_instance_t));
+	worker_instance_t *worker = __slab_alloc(&sdata->worker_slab, NULL);
 
-	worker->workername = strdup(workername);
+	worker->workername = intern_str(sdata, workername);
 	worker->user_instance = user;
 	DL_APPEND(user->worker_instances, worker);
 	worker->start_time = time(NULL);
@@ -5329,7 +6925,7 @@ static worker_instance_t *get_create_worker(sdata_t *sdata, user_instance_t *use
 	ck_wlock(&sdata->instance_lock);
 	worker = __get_worker(user, workername);
 	if (!worker) {
-		worker = __create_worker(user, workername);
+		worker = __create_worker(sdata, user, workername);
 		*new_worker = true;
 	}
 	ck_wunlock(&sdata->instance_lock);
@@ -5347,6 +6943,90 @@ static worker_instance_t *get_worker(sdata_t *sdata, user_instance_t *user, cons
 /* This simply strips off the first part of the workername and matches it to a
  * user or creates a new one. Needs to be entered with client holding a ref
  * count. */
+/* Check a username is an address on the pool's network, decoding it locally
+ * when we can and only asking bitcoind when that's enabled or the pool's own
+ * address couldn't be decoded, caching bitcoind's answers. */
+static bool check_address(ckpool_t *ckp, sdata_t *sdata, const char *address, bool *script,
+			  bool *segwit)
+{
+	addrcache_t *ac, *tmp;
+	time_t now;
+	bool ret;
+	int nets;
+
+	if (likely(ckp->addrnets)) {
+		nets = decode_address(address, script, segwit);
+		if (nets)
+			return nets & ckp->addrnets;
+		if (!ckp->rpcaddrcheck)
+			return false;
+	}
+
+	now = time(NULL);
+	ck_rlock(&sdata->addrcache_lock);
+	HASH_FIND_STR(sdata->addrcache, address, ac);
+	if (ac && !ac->valid && now - ac->added >= ADDRCACHE_INVALID)
+		ac = NULL;
+	if (ac) {
+		*script = ac->script;
+		*segwit = ac->segwit;
+		ret = ac->valid;
+	}
+	ck_runlock(&sdata->addrcache_lock);
+	if (ac)
+		return ret;
+
+	ret = generator_checkaddr(ckp, address, script, segwit);
+	ac = ckzalloc(sizeof(addrcache_t));
+	strcpy(ac->address, address);
+	ac->added = now;
+	ac->valid = ret;
+	ac->script = *script;
+	ac->segwit = *segwit;
+	ck_wlock(&sdata->addrcache_lock);
+	/* Replace any expired entry, or one added by another authoriser
+	 * checking the same address at the same time */
+	HASH_FIND_STR(sdata->addrcache, address, tmp);
+	if (tmp) {
+		HASH_DEL(sdata->addrcache, tmp);
+		free(tmp);
+	}
+	HASH_ADD_STR(sdata->addrcache, address, ac);
+	/* Entries are iterated in the order they were added */
+	while (HASH_COUNT(sdata->addrcache) > ADDRCACHE_MAX) {
+		tmp = sdata->addrcache;
+		HASH_DEL(sdata->addrcache, tmp);
+		free(tmp);
+	}
+	ck_wunlock(&sdata->addrcache_lock);
+	return ret;
+}
+
+/* Authorisers for other clients may be checking the same user, so only
+ * publish its address under the instance lock, completely, once. */
+static void set_user_address(ckpool_t *ckp, sdata_t *sdata, user_instance_t *user,
+			     const char *username)
+{
+	bool script = false, segwit = false;
+	char txnbin[48];
+	int txnlen;
+
+	/* Is this a btc address based username? */
+	if (!check_address(ckp, sdata, username, &script, &segwit))
+		return;
+	txnlen = address_to_txn(txnbin, username, script, segwit);
+
+	ck_wlock(&sdata->instance_lock);
+	if (!user->btcaddress) {
+		user->script = script;
+		user->segwit = segwit;
+		memcpy(user->txnbin, txnbin, txnlen);
+		user->txnlen = txnlen;
+		user->btcaddress = true;
+	}
+	ck_wunlock(&sdata->instance_lock);
+}
+
 static user_instance_t *generate_user(ckpool_t *ckp, stratum_instance_t *client,
 				      const char *workername)
 {
@@ -5376,13 +7056,8 @@ static user_instance_t *generate_user(ckpool_t *ckp, stratum_instance_t *client,
 	__inc_worker(sdata,user, worker);
 	ck_wunlock(&sdata->instance_lock);
 
-	if (!ckp->proxy && (new_user || !user->btcaddress)) {
-		/* Is this a btc address based username? */
-		if (generator_checkaddr(ckp, username, &user->script, &user->segwit)) {
-			user->btcaddress = true;
-			user->txnlen = address_to_txn(user->txnbin, username, user->script, user->segwit);
-		}
-	}
+	if (!ckp->proxy && (new_user || !user->btcaddress))
+		set_user_address(ckp, sdata, user, username);
 	if (new_user) {
 		LOGNOTICE("Added new user %s%s", username, user->btcaddress ?
 			  " as address based registration" : "");
@@ -5410,6 +7085,7 @@ static void client_auth(ckpool_t *ckp, stratum_instance_t *client, user_instance
 	if (ret) {
 		client->authorised = ret;
 		user->authorised = ret;
+		user->dirty = true;
 		if (ckp->proxy) {
 			LOGNOTICE("Authorised client %s to proxy %d:%d, worker %s as user %s",
 				  client->identity, client->proxyid, client->subproxyid,
@@ -5447,14 +7123,20 @@ static void client_auth(ckpool_t *ckp, stratum_instance_t *client, user_instance
 	client->authorising = false;
 }
 
-static json_t *__user_notify(const workbase_t *wb, const user_instance_t *user, const bool clean);
+static json_t *__user_notify(sdata_t *sdata, workbase_t *wb, user_instance_t *user, const bool clean);
 
+/* Needs to be entered with workbase readcount */
 static void update_solo_client(sdata_t *sdata, workbase_t *wb, const int64_t client_id,
 				 user_instance_t *user_instance)
 {
-	json_t *json_msg = __user_notify(wb, user_instance, true);
+	json_t *json_msg;
 
-	stratum_add_send(sdata, json_msg, client_id, SM_UPDATE);
+	ck_wlock(&sdata->instance_lock);
+	json_msg = __user_notify(sdata, wb, user_instance, true);
+	ck_wunlock(&sdata->instance_lock);
+
+	if (likely(json_msg))
+		stratum_add_send(sdata, json_msg, client_id, SM_UPDATE);
 }
 
 /* Needs to be entered with client holding a ref count. */
@@ -5505,11 +7187,12 @@ static json_t *parse_authorise(stratum_instance_t *client, const json_t *params_
 	client->start_time = now.tv_sec;
 	/* NOTE workername is NULL prior to this so should not be used in code
 	 * till after this point */
-	client->workername = strdup(buf);
+	reintern_str(ckp->sdata, &client->workername, buf);
+	unintern_str(ckp->sdata, client->password);
 	if (pass)
-		client->password = strndup(pass, 64);
+		client->password = intern_strn(ckp->sdata, pass, strnlen(pass, 64));
 	else
-		client->password = strdup("");
+		client->password = intern_str(ckp->sdata, "");
 	if (user->failed_authtime) {
 		time_t now_t = time(NULL);
 
@@ -5544,10 +7227,6 @@ out:
 		wb->readcount++;
 		ck_wunlock(&sdata->workbase_lock);
 
-		ck_wlock(&sdata->instance_lock);
-		__generate_userwb(sdata, wb, user);
-		ck_wunlock(&sdata->instance_lock);
-
 		update_solo_client(sdata, wb, client->id, user);
 
 		ck_wlock(&sdata->workbase_lock);
@@ -5564,6 +7243,14 @@ static void stratum_send_diff(sdata_t *sdata, const stratum_instance_t *client)
 {
 	json_t *json_msg;
 
+	if (likely(!subclient(client->id))) {
+		char *buf;
+
+		ASPRINTF(&buf, "{\"params\":[%"PRId64"],\"id\":null,\"method\":\"mining.set_difficulty\"}\n",
+			 client->diff);
+		stratum_add_sendbuf(sdata, buf, client->id, 0);
+		return;
+	}
 	JSON_CPACK(json_msg, "{s[I]soss}", "params", client->diff, "id", json_null(),
 			     "method", "mining.set_difficulty");
 	stratum_add_send(sdata, json_msg, client->id, SM_DIFF);
@@ -5592,24 +7279,51 @@ static double time_bias(const double tdiff, const double period)
 	return 1.0 - 1.0 / exp(dexp);
 }
 
+/* The share counters of the calling thread, created on first use */
+static uastats_t *thread_uastats(sdata_t *sdata)
+{
+	static __thread uastats_t *uastats;
+
+	if (unlikely(!uastats)) {
+		uastats = aligned_alloc(64, sizeof(uastats_t));
+		if (unlikely(!uastats))
+			quit(1, "Failed to aligned_alloc uastats");
+		memset(uastats, 0, sizeof(uastats_t));
+		mutex_lock(&sdata->uastats_lock);
+		LL_PREPEND(sdata->uastats, uastats);
+		mutex_unlock(&sdata->uastats_lock);
+	}
+	return uastats;
+}
+
+/* Counters are only written by their own thread so need no locked operation,
+ * just a store statsupdate can't see torn. */
+static inline void uastats_add(int64_t *counter, const int64_t val)
+{
+	__atomic_store_n(counter, *counter + val, __ATOMIC_RELAXED);
+}
+
 /* Needs to be entered with client holding a ref count. */
 static void add_submit(ckpool_t *ckp, stratum_instance_t *client, const double diff, const bool valid,
 		       const bool submit)
 {
 	sdata_t *ckp_sdata = ckp->sdata, *sdata = client->sdata;
 	worker_instance_t *worker = client->worker_instance;
-	double tdiff, bdiff, dsps, drr, network_diff, bias;
+	double tdiff, bdiff, dsps, drr, network_diff, bias, scale = 1;
+	hashmeter_t meter;
 	user_instance_t *user = client->user_instance;
 	int64_t next_blockid, optimal, mindiff;
+	uastats_t *uastats;
 	tv_t now_t;
 
-	mutex_lock(&ckp_sdata->uastats_lock);
+	uastats = thread_uastats(ckp_sdata);
 	if (valid) {
-		ckp_sdata->stats.unaccounted_shares++;
-		ckp_sdata->stats.unaccounted_diff_shares += diff;
+		uastats_add(&uastats->shares, 1);
+		uastats_add(&uastats->diff_shares, diff);
 	} else
-		ckp_sdata->stats.unaccounted_rejects += diff;
-	mutex_unlock(&ckp_sdata->uastats_lock);
+		uastats_add(&uastats->rejects, diff);
+
+	user->dirty = true;
 
 	/* Count only accepted and stale rejects in diff calculation. */
 	if (valid) {
@@ -5633,14 +7347,14 @@ static void add_submit(ckpool_t *ckp, stratum_instance_t *client, const double d
 		copy_tv(&client->ldc, &now_t);
 	}
 
-	decay_client(client, diff, &now_t);
+	meter_add(&client->meter, diff, &now_t);
 	copy_tv(&client->last_share, &now_t);
 
-	decay_worker(worker, diff, &now_t);
+	meter_add(&worker->meter, diff, &now_t);
 	copy_tv(&worker->last_share, &now_t);
 	worker->idle = false;
 
-	decay_user(user, diff, &now_t);
+	meter_add(&user->meter, diff, &now_t);
 	copy_tv(&user->last_share, &now_t);
 	client->idle = false;
 
@@ -5664,9 +7378,13 @@ static void add_submit(ckpool_t *ckp, stratum_instance_t *client, const double d
 		return;
 	}
 
-	/* Diff rate ratio */
-	dsps = client->dsps5 / bias;
-	drr = dsps / (double)client->diff;
+	/* Diff rate ratio, scaled up to aim for a lower share rate when the
+	 * pool is over its share budget. Not critical so read unlocked. */
+	if (ckp->sharebudget)
+		scale = ckp_sdata->diff_scale;
+	meter_snapshot(&meter, &client->meter, &now_t);
+	dsps = meter.dsps5 / bias;
+	drr = dsps * scale / (double)client->diff;
 
 	/* Optimal rate product is 0.3, allow some hysteresis. */
 	if (drr > 0.15 && drr < 0.4)
@@ -5681,9 +7399,9 @@ static void add_submit(ckpool_t *ckp, stratum_instance_t *client, const double d
 	if (mindiff) {
 		if (drr < 0.5)
 			return;
-		optimal = lround(dsps * 2.4);
+		optimal = lround(dsps * scale * 2.4);
 	} else
-		optimal = lround(dsps * 3.33);
+		optimal = lround(dsps * scale * 3.33);
 
 	/* Clamp to mindiff ~ network_diff */
 
@@ -5717,13 +7435,18 @@ static void add_submit(ckpool_t *ckp, stratum_instance_t *client, const double d
 	client->ssdc = 0;
 
 	LOGINFO("Client %s biased dsps %.2f dsps %.2f drr %.2f adjust diff from %"PRId64" to: %"PRId64" ",
-		client->identity, dsps, client->dsps5, drr, client->diff, optimal);
+		client->identity, dsps, meter.dsps5, drr, client->diff, optimal);
 
 	copy_tv(&client->ldc, &now_t);
 	client->diff_change_job_id = next_blockid;
 	client->old_diff = client->diff;
 	client->diff = optimal;
-	stratum_send_diff(sdata, client);
+	/* The new diff only applies from the next job anyway so in budget mode
+	 * hold it back to go out with the next notify */
+	if (ckp->sharebudget && !subclient(client->id))
+		__atomic_store_n(&client->diff_pending, true, __ATOMIC_RELAXED);
+	else
+		stratum_send_diff(sdata, client);
 }
 
 static void
@@ -5753,6 +7476,7 @@ test_blocksolve(const stratum_instance_t *client, const workbase_t *wb, const uc
 	double network_diff;
 	json_t *val = NULL;
 	uchar flip32[32];
+	tv_t solve_tv;
 	ts_t ts_now;
 	bool ret;
 
@@ -5761,6 +7485,7 @@ test_blocksolve(const stratum_instance_t *client, const workbase_t *wb, const uc
 	if (likely(diff < network_diff))
 		return;
 
+	tv_time(&solve_tv);
 	LOGWARNING("Possible %sblock solve diff %lf !", stale ? "stale share " : "", diff);
 	/* Can't submit a block in proxy mode without the transactions */
 	if (!ckp->node && wb->proxy)
@@ -5805,7 +7530,7 @@ test_blocksolve(const stratum_instance_t *client, const workbase_t *wb, const uc
 
 	/* Submit block locally after sending it to remote locations avoiding
 	 * the delay of local verification */
-	ret = local_block_submit(ckp, gbt_block, flip32, wb->height);
+	ret = local_block_submit(ckp, wb, gbt_block, flip32, &solve_tv);
 	if (ret)
 		block_solve(ckp, val);
 	else
@@ -5814,29 +7539,46 @@ test_blocksolve(const stratum_instance_t *client, const workbase_t *wb, const uc
 	json_decref(val);
 }
 
-/* Entered with instance_lock held */
-static inline uchar *__user_coinb2(const stratum_instance_t *client, const workbase_t *wb, int *cb2len)
+/* Copy the coinb2 for this client's user on wb into buf, returning its
+ * length. The user's coinbase is generated under write lock on the first
+ * share it submits on wb without a notify having needed it first. */
+static int user_coinb2(sdata_t *sdata, const stratum_instance_t *client, workbase_t *wb, uchar *buf)
 {
+	user_instance_t *user = client->user_instance;
 	struct userwb *userwb;
-	int64_t id;
+	int64_t id = wb->id;
+	int len = 0;
 
 	if (!client->ckp->btcsolo)
 		goto out_nouserwb;
 
-	id = wb->id;
-	HASH_FIND_I64(client->user_instance->userwbs, &id, userwb);
-	if (unlikely(!userwb))
-		goto out_nouserwb;
-	*cb2len = userwb->coinb2len;
-	return userwb->coinb2bin;
+	ck_rlock(&sdata->instance_lock);
+	HASH_FIND_I64(user->userwbs, &id, userwb);
+	if (likely(userwb)) {
+		len = userwb->coinb2len;
+		memcpy(buf, userwb->coinb2bin, len);
+	}
+	ck_runlock(&sdata->instance_lock);
+	if (likely(userwb))
+		return len;
+
+	ck_wlock(&sdata->instance_lock);
+	userwb = __get_userwb(sdata, wb, user);
+	if (likely(userwb)) {
+		len = userwb->coinb2len;
+		memcpy(buf, userwb->coinb2bin, len);
+	}
+	ck_wunlock(&sdata->instance_lock);
+	if (likely(userwb))
+		return len;
 
 out_nouserwb:
-	*cb2len = wb->coinb2len;
-	return wb->coinb2bin;
+	memcpy(buf, wb->coinb2bin, wb->coinb2len);
+	return wb->coinb2len;
 }
 
 /* Needs to be entered with workbase readcount and client holding a ref count. */
-static double submission_diff(sdata_t *sdata, const stratum_instance_t *client, const workbase_t *wb,
+static double submission_diff(sdata_t *sdata, const stratum_instance_t *client, workbase_t *wb,
 			      const char *nonce2, const uint32_t ntime32, uint32_t version_mask,
 			      const char *nonce, uchar *hash, const bool stale)
 {
@@ -5844,12 +7586,13 @@ static double submission_diff(sdata_t *sdata, const stratum_instance_t *client,
 	uint32_t *data32, *swap32, benonce32;
 	char *coinbase, data[80];
 	uchar swap[80], hash1[32];
-	int cblen, i, cb2len;
-	uchar *coinb2bin;
+	sha256_ctx ctx;
+	int cblen, i;
 	double ret;
 
-	/* Leave enough room for 25 byte generation address + length counter */
-	coinbase = alloca(wb->coinb1len + wb->enonce1constlen + wb->enonce1varlen + wb->enonce2varlen + wb->coinb2len + 26 + wb->coinb3len);
+	/* Leave enough room for the user's generation script + length counter */
+	coinbase = alloca(wb->coinb1len + wb->enonce1constlen + wb->enonce1varlen + wb->enonce2varlen +
+			  wb->coinb2len + 1 + sizeof(((user_instance_t *)0)->txnbin) + wb->coinb3len);
 	memcpy(coinbase, wb->coinb1bin, wb->coinb1len);
 	cblen = wb->coinb1len;
 	memcpy(coinbase + cblen, &client->enonce1bin, wb->enonce1constlen + wb->enonce1varlen);
@@ -5857,14 +7600,13 @@ static double submission_diff(sdata_t *sdata, const stratum_instance_t *client,
 	hex2bin(coinbase + cblen, nonce2, wb->enonce2varlen);
 	cblen += wb->enonce2varlen;
 
-	ck_rlock(&sdata->instance_lock);
-	coinb2bin = __user_coinb2(client, wb, &cb2len);
-	memcpy(coinbase + cblen, coinb2bin, cb2len);
-	ck_runlock(&sdata->instance_lock);
+	cblen += user_coinb2(sdata, client, wb, (uchar *)coinbase + cblen);
 
-	cblen += cb2len;
-
-	gen_hash((uchar *)coinbase, merkle_root, cblen);
+	/* Continue from the coinb1 midstate hashing only the variable tail */
+	memcpy(&ctx, &wb->coinb1ctx, sizeof(sha256_ctx));
+	sha256_update(&ctx, (uchar *)coinbase + wb->coinb1len, cblen - wb->coinb1len);
+	sha256_final(&ctx, hash1);
+	sha256(hash1, 32, merkle_root);
 	memcpy(merkle_sha, merkle_root, 32);
 	for (i = 0; i < wb->merkles; i++) {
 		memcpy(merkle_sha + 32, &wb->merklebin[i], 32);
@@ -5899,8 +7641,7 @@ static double submission_diff(sdata_t *sdata, const stratum_instance_t *client,
 	data32 = (uint32_t *)data;
 	swap32 = (uint32_t *)swap;
 	flip_80(swap32, data32);
-	sha256(swap, 80, hash1);
-	sha256(hash1, 32, hash);
+	sha256d_80(swap, hash);
 
 	/* Calculate the diff of the share here */
 	ret = diff_from_target(hash);
@@ -5911,26 +7652,66 @@ static double submission_diff(sdata_t *sdata, const stratum_instance_t *client,
 	return ret;
 }
 
-/* Optimised for the common case where shares are new */
-static bool new_share(sdata_t *sdata, const uchar *hash, const int64_t wb_id)
+/* Double the size of a stripe, rehashing everything already in it. Must be
+ * entered with the stripe lock held. */
+static void __grow_share_stripe(struct share_stripe *stripe)
+{
+	static const uchar empty[32] = {};
+	int64_t i, size = stripe->size << 1;
+	uchar (*hashes)[32];
+
+	hashes = ckzalloc(size * 32);
+	for (i = 0; i < stripe->size; i++) {
+		uint64_t slot;
+
+		if (!memcmp(stripe->hashes[i], empty, 32))
+			continue;
+		memcpy(&slot, stripe->hashes[i] + 4, 8);
+		for (slot &= size - 1; memcmp(hashes[slot], empty, 32); slot = (slot + 1) & (size - 1));
+		memcpy(hashes[slot], stripe->hashes[i], 32);
+	}
+	free(stripe->hashes);
+	stripe->hashes = hashes;
+	stripe->size = size;
+}
+
+/* Optimised for the common case where shares are new. Must be entered with
+ * a workbase readcount held. */
+static bool new_share(workbase_t *wb, const uchar *hash)
 {
-	share_t *share = ckzalloc(sizeof(share_t)), *match = NULL;
+	static const uchar empty[32] = {};
+	sharetable_t *sharetable = wb->sharetable;
+	struct share_stripe *stripe;
 	bool ret = true;
+	uint64_t slot;
 
-	memcpy(share->hash, hash, 32);
-	share->workbase_id = wb_id;
+	/* Shares against workbases from before a block change are not
+	 * tracked once their table is purged */
+	if (unlikely(!sharetable))
+		return ret;
 
-	mutex_lock(&sdata->share_lock);
-	sdata->shares_generated++;
-	HASH_FIND(hh, sdata->shares, hash, 32, match);
-	if (likely(!match))
-		HASH_ADD(hh, sdata->shares, hash, 32, share);
-	mutex_unlock(&sdata->share_lock);
+	stripe = &sharetable->stripes[hash[0] % SHARE_STRIPES];
+	memcpy(&slot, hash + 4, 8);
+
+	mutex_lock(&stripe->lock);
+	stripe->generated++;
+	if (unlikely(stripe->count * 2 >= stripe->size))
+		__grow_share_stripe(stripe);
+	for (slot &= stripe->size - 1; ; slot = (slot + 1) & (stripe->size - 1)) {
+		uchar *entry = stripe->hashes[slot];
 
-	if (unlikely(match)) {
-		dealloc(share);
-		ret = false;
+		if (!memcmp(entry, empty, 32)) {
+			memcpy(entry, hash, 32);
+			stripe->count++;
+			break;
+		}
+		if (unlikely(!memcmp(entry, hash, 32))) {
+			ret = false;
+			break;
+		}
 	}
+	mutex_unlock(&stripe->lock);
+
 	return ret;
 }
 
@@ -5958,6 +7739,7 @@ static void check_best_diff(sdata_t *sdata, user_instance_t *user,worker_instanc
 	char buf[512];
 	bool best_ever = false, best_worker = false, best_user = false;
 
+	user->dirty = true;
 	if (sdiff > user->best_ever) {
 		user->best_ever = sdiff;
 		best_ever = true;
@@ -5986,23 +7768,444 @@ static void check_best_diff(sdata_t *sdata, user_instance_t *user,worker_instanc
 	}
 	if (likely((!best_user && !best_worker) || !client))
 		return;
-	snprintf(buf, 511, "New best %sshare for %s: %lf", best_ever ? "ever " : "",
-		 best_user ? "user" : "worker", sdiff);
-	stratum_send_message(sdata, client, buf);
+	snprintf(buf, 511, "New best %sshare for %s: %lf", best_ever ? "ever " : "",
+		 best_user ? "user" : "worker", sdiff);
+	stratum_send_message(sdata, client, buf);
+}
+
+/* Maximum entries queued for the sharelog writer before share processing
+ * waits for it to catch up on a slow filesystem */
+#define SHARELOG_MAXQUEUED 1000000
+/* Flush the sharelog queue once this many bytes or ms have accumulated */
+#define SHARELOG_FLUSHSIZE 262144
+#define SHARELOG_FLUSHMS 100
+/* Maximum iovecs handed to one writev */
+#define SHARELOG_IOVS 256
+/* Close sharelog descriptors not written to in this many seconds */
+#define SHARELOG_FDIDLE 120
+/* Longest we wait at shutdown for queued sharelog entries to be written */
+#define SHARELOG_FLUSHSECS 10
+
+static void free_sharelog(sharelog_t *sharelog)
+{
+	int i;
+
+	for (i = 0; i < SHARELOG_STRINGS; i++)
+		free(sharelog->strings[i]);
+	free(sharelog->fname);
+	free(sharelog->buf);
+	free(sharelog);
+}
+
+static void queue_sharelog(sdata_t *sdata, sharelog_t *sharelog)
+{
+	bool signal;
+
+	mutex_lock(&sdata->sharelog_lock);
+	if (unlikely(sdata->sharelogs_queued >= SHARELOG_MAXQUEUED)) {
+		if (!(sdata->sharelogs_stalled++ % 1000))
+			LOGWARNING("Sharelog writer falling behind, %"PRId64" entries stalled",
+				   sdata->sharelogs_stalled);
+		while (sdata->sharelogs_queued >= SHARELOG_MAXQUEUED)
+			cond_wait(&sdata->sharelog_space, &sdata->sharelog_lock);
+	}
+	/* Only wake the writer on the first entry or once there's enough to
+	 * flush immediately, allowing entries to accumulate for one write */
+	signal = !sdata->sharelogs || (sdata->sharelog_bytes < SHARELOG_FLUSHSIZE &&
+		 sdata->sharelog_bytes + sharelog->len >= SHARELOG_FLUSHSIZE);
+	DL_APPEND(sdata->sharelogs, sharelog);
+	sdata->sharelogs_queued++;
+	sdata->sharelogs_generated++;
+	sdata->sharelog_bytes += sharelog->len;
+	if (signal)
+		pthread_cond_signal(&sdata->sharelog_cond);
+	mutex_unlock(&sdata->sharelog_lock);
+}
+
+/* Queue a heap allocated sharelog line for fname to the sharelog writer,
+ * which takes ownership of both. */
+static void add_sharelog(sdata_t *sdata, char *fname, char *buf)
+{
+	sharelog_t *sharelog = ckzalloc(sizeof(sharelog_t));
+
+	sharelog->fname = fname;
+	sharelog->buf = buf;
+	sharelog->len = strlen(buf);
+	queue_sharelog(sdata, sharelog);
+}
+
+/* Decode up to len bytes of hex from str into p, stopping at the end of the
+ * string or any invalid hex and returning the number of bytes decoded */
+static int sharelog_hex(uchar *p, const char *str, const int len)
+{
+	int i;
+
+	if (!str)
+		return 0;
+	for (i = 0; i < len && str[0] && str[1]; i++, str += 2) {
+		int nibble1 = hex2bin_tbl[(uchar)str[0]],
+		    nibble2 = hex2bin_tbl[(uchar)str[1]];
+
+		if (unlikely(nibble1 < 0 || nibble2 < 0))
+			break;
+		p[i] = (nibble1 << 4) | nibble2;
+	}
+	return i;
+}
+
+static char *sharelog_string(const json_t *val, const char *key)
+{
+	const char *str = json_string_value(json_object_get(val, key));
+
+	return strdup(str ? str : "");
+}
+
+/* Convert the json sharelog entry val into a binary record for fname and
+ * queue it. The string ids are filled in by the writer which owns the
+ * dictionary of each file. */
+static void add_binary_sharelog(sdata_t *sdata, char *fname, const json_t *val)
+{
+	sharelog_t *sharelog = ckzalloc(sizeof(sharelog_t));
+	sharelog_share_t *share;
+	const char *cdfield;
+	long sec, nsec;
+
+	share = ckzalloc(sizeof(sharelog_share_t));
+	share->type = SHARELOG_SHARE;
+	share->result = json_is_true(json_object_get(val, "result"));
+	share->errn = json_integer_value(json_object_get(val, "errn"));
+	share->workinfoid = json_integer_value(json_object_get(val, "workinfoid"));
+	share->clientid = json_integer_value(json_object_get(val, "clientid"));
+	cdfield = json_string_value(json_object_get(val, "createdate"));
+	if (cdfield && sscanf(cdfield, "%ld,%ld", &sec, &nsec) == 2) {
+		share->createsec = sec;
+		share->creatensec = nsec;
+	}
+	share->diff = json_real_value(json_object_get(val, "diff"));
+	share->sdiff = json_real_value(json_object_get(val, "sdiff"));
+	share->enonce1len = sharelog_hex(share->enonce1, json_string_value(json_object_get(val, "enonce1")),
+					 sizeof(share->enonce1));
+	share->nonce2len = sharelog_hex(share->nonce2, json_string_value(json_object_get(val, "nonce2")),
+					sizeof(share->nonce2));
+	sharelog_hex(share->nonce, json_string_value(json_object_get(val, "nonce")), 4);
+	sharelog_hex(share->ntime, json_string_value(json_object_get(val, "ntime")), 4);
+	sharelog_hex(share->hash, json_string_value(json_object_get(val, "hash")), 32);
+
+	sharelog->strings[SLS_WORKERNAME] = sharelog_string(val, "workername");
+	sharelog->strings[SLS_USERNAME] = sharelog_string(val, "username");
+	sharelog->strings[SLS_ADDRESS] = sharelog_string(val, "address");
+	sharelog->strings[SLS_AGENT] = sharelog_string(val, "agent");
+	sharelog->strings[SLS_CREATEINET] = sharelog_string(val, "createinet");
+	sharelog->fname = fname;
+	sharelog->buf = (char *)share;
+	sharelog->len = sizeof(sharelog_share_t);
+	sharelog->binary = true;
+	queue_sharelog(sdata, sharelog);
+}
+
+static sharelog_fd_t *sharelog_fd(sharelog_fd_t **sharelog_fds, const char *fname,
+				  const bool binary)
+{
+	sharelog_fd_t *sfd;
+	int fd;
+
+	HASH_FIND_STR(*sharelog_fds, fname, sfd);
+	if (likely(sfd))
+		return sfd;
+	fd = open(fname, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (unlikely(fd < 0)) {
+		LOGERR("Failed to open %s", fname);
+		return NULL;
+	}
+	/* New binary sharelogs start with the file header */
+	if (binary && !lseek(fd, 0, SEEK_END)) {
+		sharelog_hdr_t hdr;
+
+		memcpy(hdr.magic, SHARELOG_MAGIC, sizeof(hdr.magic));
+		hdr.version = SHARELOG_VERSION;
+		if (unlikely(write(fd, &hdr, sizeof(hdr)) != sizeof(hdr))) {
+			LOGERR("Failed to write header to %s", fname);
+			Close(fd);
+			return NULL;
+		}
+	}
+	sfd = ckzalloc(sizeof(sharelog_fd_t));
+	sfd->fname = strdup(fname);
+	sfd->fd = fd;
+	HASH_ADD_KEYPTR(hh, *sharelog_fds, sfd->fname, strlen(sfd->fname), sfd);
+	return sfd;
+}
+
+static void close_sharelog_fd(sharelog_fd_t **sharelog_fds, sharelog_fd_t *sfd)
+{
+	sharelog_strid_t *strid, *tmp;
+
+	HASH_DEL(*sharelog_fds, sfd);
+	HASH_ITER(hh, sfd->strids, strid, tmp) {
+		HASH_DEL(sfd->strids, strid);
+		free(strid->str);
+		free(strid);
+	}
+	Close(sfd->fd);
+	free(sfd->fname);
+	free(sfd);
+}
+
+/* Look up the ids of a binary sharelog's strings in this file's dictionary,
+ * prefixing the record with definitions of any strings not yet written to
+ * it. */
+static void render_binary_sharelog(sharelog_fd_t *sfd, sharelog_t *sharelog)
+{
+	sharelog_share_t *share = (sharelog_share_t *)sharelog->buf;
+	sharelog_strid_t *newids[SHARELOG_STRINGS];
+	int i, len = sharelog->len;
+	char *buf, *p;
+
+	for (i = 0; i < SHARELOG_STRINGS; i++) {
+		sharelog_strid_t *strid;
+
+		newids[i] = NULL;
+		HASH_FIND_STR(sfd->strids, sharelog->strings[i], strid);
+		if (!strid) {
+			strid = ckalloc(sizeof(sharelog_strid_t));
+			strid->str = sharelog->strings[i];
+			sharelog->strings[i] = NULL;
+			strid->id = sfd->strid++;
+			HASH_ADD_KEYPTR(hh, sfd->strids, strid->str, strlen(strid->str), strid);
+			newids[i] = strid;
+			len += sizeof(sharelog_str_t) + MIN(strlen(strid->str), (size_t)UINT16_MAX);
+		}
+		share->strings[i] = strid->id;
+	}
+	if (len == sharelog->len)
+		return;
+
+	p = buf = ckalloc(len);
+	for (i = 0; i < SHARELOG_STRINGS; i++) {
+		sharelog_str_t def;
+
+		if (!newids[i])
+			continue;
+		def.type = SHARELOG_STRING;
+		def.pad = 0;
+		def.len = MIN(strlen(newids[i]->str), (size_t)UINT16_MAX);
+		def.id = newids[i]->id;
+		memcpy(p, &def, sizeof(def));
+		p += sizeof(def);
+		memcpy(p, newids[i]->str, def.len);
+		p += def.len;
+	}
+	memcpy(p, sharelog->buf, sharelog->len);
+	free(sharelog->buf);
+	sharelog->buf = buf;
+	sharelog->len = len;
+}
+
+/* Write out all of iov, coping with partial writes */
+static void write_sharelog_iov(const sharelog_fd_t *sfd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt) {
+		ssize_t ret = writev(sfd->fd, iov, iovcnt);
+
+		if (unlikely(ret < 0)) {
+			if (errno == EINTR)
+				continue;
+			LOGERR("Failed to writev to %s", sfd->fname);
+			return;
+		}
+		while (iovcnt && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+}
+
+/* Writes sharelog entries in batches so that share processing never waits on
+ * the filesystem, keeping one open append descriptor per logfile and writing
+ * consecutive entries for the same file with a single writev. */
+static void *sharelog_writer(void *arg)
+{
+	sharelog_fd_t *sharelog_fds = NULL, *sfd, *tmpfd;
+	struct iovec iov[SHARELOG_IOVS];
+	ckpool_t *ckp = (ckpool_t *)arg;
+	sdata_t *sdata = ckp->sdata;
+	time_t last_check = 0;
+
+	rename_proc("ssharelog");
+
+	while (42) {
+		sharelog_t *sharelogs, *sharelog, *tmp;
+		const char *fname = NULL;
+		int iovcnt = 0;
+		ts_t timeout_ts;
+		time_t now_t;
+
+		mutex_lock(&sdata->sharelog_lock);
+		ts_realtime(&timeout_ts);
+		if (!sdata->sharelogs) {
+			timeout_ts.tv_sec++;
+			cond_timedwait(&sdata->sharelog_cond, &sdata->sharelog_lock, &timeout_ts);
+		}
+		if (sdata->sharelogs && sdata->sharelog_bytes < SHARELOG_FLUSHSIZE &&
+		    !sdata->sharelog_flush) {
+			const ts_t polltime = {0, SHARELOG_FLUSHMS * 1000000};
+
+			ts_realtime(&timeout_ts);
+			timeraddspec(&timeout_ts, &polltime);
+			cond_timedwait(&sdata->sharelog_cond, &sdata->sharelog_lock, &timeout_ts);
+		}
+		sharelogs = sdata->sharelogs;
+		sdata->sharelogs = NULL;
+		sdata->sharelogs_queued = 0;
+		sdata->sharelog_bytes = 0;
+		sdata->sharelog_writing = !!sharelogs;
+		pthread_cond_broadcast(&sdata->sharelog_space);
+		mutex_unlock(&sdata->sharelog_lock);
+
+		now_t = time(NULL);
+		sfd = NULL;
+		DL_FOREACH(sharelogs, sharelog) {
+			if (!fname || strcmp(fname, sharelog->fname) || iovcnt >= SHARELOG_IOVS) {
+				if (sfd && iovcnt)
+					write_sharelog_iov(sfd, iov, iovcnt);
+				iovcnt = 0;
+				fname = sharelog->fname;
+				sfd = sharelog_fd(&sharelog_fds, fname, sharelog->binary);
+				if (likely(sfd))
+					sfd->last_write = now_t;
+			}
+			if (unlikely(!sfd))
+				continue;
+			if (sharelog->binary)
+				render_binary_sharelog(sfd, sharelog);
+			iov[iovcnt].iov_base = sharelog->buf;
+			iov[iovcnt++].iov_len = sharelog->len;
+		}
+		if (sfd && iovcnt)
+			write_sharelog_iov(sfd, iov, iovcnt);
+
+		DL_FOREACH_SAFE(sharelogs, sharelog, tmp)
+			free_sharelog(sharelog);
+
+		if (sharelogs) {
+			mutex_lock(&sdata->sharelog_lock);
+			sdata->sharelog_writing = false;
+			pthread_cond_broadcast(&sdata->sharelog_space);
+			mutex_unlock(&sdata->sharelog_lock);
+		}
+
+		/* Close descriptors of logfiles from retired workbases */
+		if (now_t - last_check < 10)
+			continue;
+		last_check = now_t;
+		HASH_ITER(hh, sharelog_fds, sfd, tmpfd) {
+			if (now_t - sfd->last_write < SHARELOG_FDIDLE)
+				continue;
+			close_sharelog_fd(&sharelog_fds, sfd);
+		}
+	}
+	return NULL;
+}
+
+/* Have the sharelog writer write out everything still queued, waiting up to
+ * SHARELOG_FLUSHSECS for it before the process exits. */
+void stratifier_flush(ckpool_t *ckp)
+{
+	sdata_t *sdata = ckp->sdata;
+	ts_t timeout_ts;
+
+	if (!ckp->logshares || !sdata || !ckp->stratifier_ready)
+		return;
+	ts_realtime(&timeout_ts);
+	timeout_ts.tv_sec += SHARELOG_FLUSHSECS;
+	mutex_lock(&sdata->sharelog_lock);
+	sdata->sharelog_flush = true;
+	pthread_cond_signal(&sdata->sharelog_cond);
+	while (sdata->sharelogs || sdata->sharelog_writing) {
+		if (cond_timedwait(&sdata->sharelog_space, &sdata->sharelog_lock, &timeout_ts))
+			break;
+	}
+	if (sdata->sharelogs)
+		LOGWARNING("Sharelog writer failed to flush %d entries at shutdown",
+			   sdata->sharelogs_queued);
+	mutex_unlock(&sdata->sharelog_lock);
+}
+
+/* Add a share to the next sharebatch */
+static void add_remote_share(sdata_t *sdata, const char *workername, const double diff,
+			     const double sdiff)
+{
+	remote_share_t *rshare = ckalloc(sizeof(remote_share_t));
+
+	rshare->workername = strdup(workername);
+	rshare->diff = diff;
+	rshare->sdiff = sdiff;
+	mutex_lock(&sdata->remote_share_lock);
+	DL_APPEND(sdata->remote_shares, rshare);
+	mutex_unlock(&sdata->remote_share_lock);
 }
 
-#define JSON_ERR(err) json_string(SHARE_ERR(err))
+/* Upstream the shares gathered over each SHAREBATCH_MS in one message holding
+ * a column per field parse_remote_share takes, with an entry per share. */
+static void *sharebatcher(void *arg)
+{
+	ckpool_t *ckp = (ckpool_t *)arg;
+	sdata_t *sdata = ckp->sdata;
+	ts_t ts;
+
+	rename_proc("ssharebatch");
+	cksleep_prepare_r(&ts);
 
-/* Needs to be entered with client holding a ref count. */
-static json_t *parse_submit(stratum_instance_t *client, json_t *json_msg,
-			    const json_t *params_val, json_t **err_val)
+	while (42) {
+		json_t *val, *workernames, *diffs, *sdiffs;
+		remote_share_t *rshares, *rshare, *tmp;
+
+		cksleep_ms_r(&ts, SHAREBATCH_MS);
+
+		mutex_lock(&sdata->remote_share_lock);
+		rshares = sdata->remote_shares;
+		sdata->remote_shares = NULL;
+		mutex_unlock(&sdata->remote_share_lock);
+
+		if (!rshares)
+			continue;
+		workernames = json_array();
+		diffs = json_array();
+		sdiffs = json_array();
+		DL_FOREACH_SAFE(rshares, rshare, tmp) {
+			DL_DELETE(rshares, rshare);
+			json_array_append_new(workernames, json_string(rshare->workername));
+			json_array_append_new(diffs, json_real(rshare->diff));
+			json_array_append_new(sdiffs, json_real(rshare->sdiff));
+			free(rshare->workername);
+			free(rshare);
+		}
+		JSON_CPACK(val, "{so,so,so}", "workername", workernames, "diff", diffs,
+			   "sdiff", sdiffs);
+		upstream_json_msgtype(ckp, val, SM_SHAREBATCH);
+		json_decref(val);
+	}
+	return NULL;
+}
+
+/* Needs to be entered with client holding a ref count. Returns whether the
+ * share was accepted with the reason in errn if not. reject is set for shares
+ * on a valid job that were rejected, whose response carries a reject-reason
+ * instead of an error. */
+static bool parse_submit(stratum_instance_t *client, char **params, const int nparams,
+			 int *errn, bool *reject)
 {
 	bool share = false, result = false, invalid = true, submit = false, stale = false;
 	const char *workername, *job_id, *ntime, *version_mask;
 	double diff = client->diff, wdiff = 0, sdiff = -1;
 	char hexhash[68] = {}, sharehash[32], cdfield[64];
 	user_instance_t *user = client->user_instance;
-	char *fname = NULL, *s, *nonce, *nonce2;
+	char *fname = NULL, *nonce, *nonce2;
 	uint32_t ntime32, version_mask32 = 0;
 	sdata_t *sdata = client->sdata;
 	enum share_err err = SE_NONE;
@@ -6015,67 +8218,59 @@ static json_t *parse_submit(stratum_instance_t *client, json_t *json_msg,
 	json_t *val;
 	int64_t id;
 	ts_t now;
-	FILE *fp;
 
+	*errn = SE_NONE;
+	*reject = false;
 	ts_realtime(&now);
 	now_t = now.tv_sec;
 	sprintf(cdfield, "%lu,%lu", now.tv_sec, now.tv_nsec);
 
-	if (unlikely(!json_is_array(params_val))) {
+	if (unlikely(nparams < 0)) {
 		err = SE_NOT_ARRAY;
-		*err_val = JSON_ERR(err);
 		goto out;
 	}
-	if (unlikely(json_array_size(params_val) < 5)) {
+	if (unlikely(nparams < 5)) {
 		err = SE_INVALID_SIZE;
-		*err_val = JSON_ERR(err);
 		goto out;
 	}
-	workername = json_string_value(json_array_get(params_val, 0));
+	workername = params[0];
 	if (unlikely(!workername || !strlen(workername))) {
 		err = SE_NO_USERNAME;
-		*err_val = JSON_ERR(err);
 		goto out;
 	}
-	job_id = json_string_value(json_array_get(params_val, 1));
+	job_id = params[1];
 	if (unlikely(!job_id || !strlen(job_id))) {
 		err = SE_NO_JOBID;
-		*err_val = JSON_ERR(err);
 		goto out;
 	}
-	nonce2 = (char *)json_string_value(json_array_get(params_val, 2));
+	nonce2 = params[2];
 	if (unlikely(!nonce2 || !strlen(nonce2) || !validhex(nonce2))) {
 		err = SE_NO_NONCE2;
-		*err_val = JSON_ERR(err);
 		goto out;
 	}
-	ntime = json_string_value(json_array_get(params_val, 3));
+	ntime = params[3];
 	if (unlikely(!ntime || !strlen(ntime) || !validhex(ntime))) {
 		err = SE_NO_NTIME;
-		*err_val = JSON_ERR(err);
 		goto out;
 	}
-	nonce = (char *)json_string_value(json_array_get(params_val, 4));
+	nonce = params[4];
 	if (unlikely(!nonce || strlen(nonce) < 8 || !validhex(nonce))) {
 		err = SE_NO_NONCE;
-		*err_val = JSON_ERR(err);
 		goto out;
 	}
 
-	version_mask = json_string_value(json_array_get(params_val, 5));
+	version_mask = nparams > 5 ? params[5] : NULL;
 	if (version_mask && strlen(version_mask) && validhex(version_mask)) {
 		sscanf(version_mask, "%x", &version_mask32);
 		// check version mask
 		if (version_mask32 && ((~ckp->version_mask) & version_mask32) != 0) {
 			// means client changed some bits which server doesn't allow to change
 			err = SE_INVALID_VERSION_MASK;
-			*err_val = JSON_ERR(err);
 			goto out;
 		}
 	}
 	if (safecmp(workername, client->workername)) {
 		err = SE_WORKER_MISMATCH;
-		*err_val = JSON_ERR(err);
 		goto out;
 	}
 	sscanf(job_id, "%lx", &id);
@@ -6084,20 +8279,20 @@ static json_t *parse_submit(stratum_instance_t *client, json_t *json_msg,
 	share = true;
 
 	if (unlikely(!sdata->current_workbase))
-		return json_boolean(false);
+		return false;
 
 	wb = get_workbase(sdata, id);
 	if (unlikely(!wb)) {
 		id = sdata->current_workbase->id;
 		err = SE_INVALID_JOBID;
-		json_set_string(json_msg, "reject-reason", SHARE_ERR(err));
 		strncpy(idstring, job_id, 19);
-		ASPRINTF(&fname, "%s.sharelog", sdata->current_workbase->logdir);
-		goto out_nowb;
+		ASPRINTF(&fname, "%s.%s", sdata->current_workbase->logdir,
+			 ckp->binarysharelog ? SHARELOG_SUFFIX : "sharelog");
+		goto out_put;
 	}
 	wdiff = wb->diff;
 	strncpy(idstring, wb->idstring, 20);
-	ASPRINTF(&fname, "%s.sharelog", wb->logdir);
+	ASPRINTF(&fname, "%s.%s", wb->logdir, ckp->binarysharelog ? SHARELOG_SUFFIX : "sharelog");
 	/* Fix broken clients sending too many chars. Nonce2 is part of the
 	 * read only json so use a temporary variable and modify it. */
 	len = wb->enonce2varlen * 2;
@@ -6152,14 +8347,12 @@ static json_t *parse_submit(stratum_instance_t *client, json_t *json_msg,
 			}
 		}
 		err = SE_STALE;
-		json_set_string(json_msg, "reject-reason", SHARE_ERR(err));
 		goto out_submit;
 	}
 no_stale:
 	/* Ntime cannot be less, but allow forward ntime rolling up to max */
 	if (ntime32 < wb->ntime32 || ntime32 > wb->ntime32 + 7000) {
 		err = SE_NTIME_INVALID;
-		json_set_string(json_msg, "reject-reason", SHARE_ERR(err));
 		goto out_put;
 	}
 	invalid = false;
@@ -6172,8 +8365,7 @@ out_submit:
 		submit = true;
 	}
 out_put:
-	put_workbase(sdata, wb);
-out_nowb:
+	/* Any workbase readcount is held till after its share table is checked */
 
 	/* Accept shares of the old diff until the next update */
 	if (id < client->diff_change_job_id)
@@ -6183,13 +8375,12 @@ out_nowb:
 
 		suffix_string(wdiff, wdiffsuffix, 16, 0);
 		if (sdiff >= diff) {
-			if (new_share(sdata, hash, id)) {
+			if (new_share(wb, hash)) {
 				LOGINFO("Accepted client %s share diff %.1f/%.0f/%s: %s",
 					client->identity, sdiff, diff, wdiffsuffix, hexhash);
 				result = true;
 			} else {
 				err = SE_DUPE;
-				json_set_string(json_msg, "reject-reason", SHARE_ERR(err));
 				LOGINFO("Rejected client %s dupe diff %.1f/%.0f/%s: %s",
 					client->identity, sdiff, diff, wdiffsuffix, hexhash);
 				submit = false;
@@ -6198,7 +8389,6 @@ out_nowb:
 			err = SE_HIGH_DIFF;
 			LOGINFO("Rejected client %s high diff %.1f/%.0f/%s: %s",
 				client->identity, sdiff, diff, wdiffsuffix, hexhash);
-			json_set_string(json_msg, "reject-reason", SHARE_ERR(err));
 			submit = false;
 		}
 	}  else
@@ -6210,6 +8400,8 @@ out_nowb:
 		LOGINFO("Submitting share upstream: %s", hexhash);
 		submit_share(client, id, nonce2, ntime, nonce);
 	}
+	if (wb)
+		put_workbase(sdata, wb);
 
 	add_submit(ckp, client, diff, result, submit);
 
@@ -6228,8 +8420,8 @@ out_nowb:
 	json_set_double(val, "sdiff", sdiff);
 	json_set_string(val, "hash", hexhash);
 	json_set_bool(val, "result", result);
-	json_object_set(val, "reject-reason", json_object_get(json_msg, "reject-reason"));
-	json_object_set(val, "error", *err_val);
+	if (err)
+		json_set_string(val, "reject-reason", SHARE_ERR(err));
 	json_set_int(val, "errn", err);
 	json_set_string(val, "createdate", cdfield);
 	json_set_string(val, "createby", "code");
@@ -6241,20 +8433,18 @@ out_nowb:
         json_set_string(val, "agent", client->useragent);
 
 	if (ckp->logshares) {
-		fp = fopen(fname, "ae");
-		if (likely(fp)) {
-			s = json_dumps(val, JSON_EOL);
-			len = strlen(s);
-			len = fprintf(fp, "%s", s);
-			free(s);
-			fclose(fp);
-			if (unlikely(len < 0))
-				LOGERR("Failed to fwrite to %s", fname);
-		} else
-			LOGERR("Failed to fopen %s", fname);
+		if (ckp->binarysharelog)
+			add_binary_sharelog(ckp->sdata, fname, val);
+		else
+			add_sharelog(ckp->sdata, fname, json_dumps(val, JSON_EOL));
+		fname = NULL;
+	}
+	if (ckp->remote) {
+		if (ckp->upstream_sharebatch)
+			add_remote_share(ckp->sdata, client->workername, diff, sdiff);
+		else
+			upstream_json_msgtype(ckp, val, SM_SHARE);
 	}
-	if (ckp->remote)
-		upstream_json_msgtype(ckp, val, SM_SHARE);
 	json_decref(val);
 out:
 	if (!sdata->wbincomplete && ((!result && !submit) || !share)) {
@@ -6296,7 +8486,7 @@ out:
 			json_set_int(val, "workinfoid", sdata->current_workbase->id);
 			json_set_string(val, "workername", client->workername);
 			json_set_string(val, "username", user->username);
-			json_object_set(val, "error", *err_val);
+			json_set_string(val, "error", SHARE_ERR(err));
 			json_set_int(val, "errn", err);
 			json_set_string(val, "createdate", cdfield);
 			json_set_string(val, "createby", "code");
@@ -6307,7 +8497,9 @@ out:
 		LOGINFO("Invalid share from client %s: %s", client->identity, client->workername);
 	}
 	free(fname);
-	return json_boolean(result);
+	*errn = err;
+	*reject = share && err;
+	return result;
 }
 
 /* Must enter with workbase_lock held */
@@ -6363,19 +8555,10 @@ static void stratum_send_update(sdata_t *sdata, const int64_t client_id, const b
 	stratum_add_send(sdata, json_msg, client_id, SM_UPDATE);
 }
 
-/* Hold instance and workbase lock */
-static json_t *__user_notify(const workbase_t *wb, const user_instance_t *user, const bool clean)
+static json_t *userwb_notify(const workbase_t *wb, const struct userwb *userwb, const bool clean)
 {
-	int64_t id = wb->id;
-	struct userwb *userwb;
 	json_t *val;
 
-	HASH_FIND_I64(user->userwbs, &id, userwb);
-	if (unlikely(!userwb)) {
-		LOGINFO("Failed to find userwb in __user_notify!");
-		return NULL;
-	}
-
 	JSON_CPACK(val, "{s:[ssssosssb],s:o,s:s}",
 			"params",
 			wb->idstring,
@@ -6392,31 +8575,114 @@ static json_t *__user_notify(const workbase_t *wb, const user_instance_t *user,
 	return val;
 }
 
-/* Sends a stratum update with a unique coinb2 for every client. Avoid
- * recursive locking. */
+/* Hold instance write lock and a wb readcount */
+static json_t *__user_notify(sdata_t *sdata, workbase_t *wb, user_instance_t *user, const bool clean)
+{
+	struct userwb *userwb = __get_userwb(sdata, wb, user);
+
+	if (unlikely(!userwb)) {
+		LOGINFO("Failed to find userwb in __user_notify!");
+		return NULL;
+	}
+	return userwb_notify(wb, userwb, clean);
+}
+
+/* Return the serialised notify for this userwb, rendering it only the first
+ * time it's asked for. Hold instance write lock and a wb readcount. */
+static ckbuf_t *__userwb_notify_buf(const workbase_t *wb, struct userwb *userwb, const bool clean)
+{
+	ckbuf_t **notify = &userwb->notify[clean];
+
+	if (!*notify) {
+		json_t *val = userwb_notify(wb, userwb, clean);
+
+		*notify = create_ckbuf(json_dumps(val, JSON_EOL | JSON_COMPACT));
+		json_decref(val);
+	}
+	return *notify;
+}
+
+/* Sends a stratum update with a unique coinb2 for every user. All clients of
+ * the same user share one serialised notify, queued as a single broadcast
+ * message per user. Subclients needing node.method get their own json and are
+ * sent after dropping instance_lock to avoid recursive locking. */
 static void stratum_broadcast_updates(sdata_t *sdata, bool clean)
 {
-	stratum_instance_t *client, *tmp;
-	json_t *json_msg;
+	ckmsg_t *bulk_send = NULL, *subclient_sends = NULL, *diff_sends = NULL, *client_msg, *tmpmsg;
+	stratum_instance_t *client, *counted;
+	user_instance_t *user, *tmpuser;
+	ckpool_t *ckp = sdata->ckp;
+	workbase_t *wb;
+
+	if (ckp->node || unlikely(!sdata->current_workbase))
+		return;
+
+	ck_wlock(&sdata->workbase_lock);
+	wb = sdata->current_workbase;
+	wb->readcount++;
+	ck_wunlock(&sdata->workbase_lock);
 
 	ck_wlock(&sdata->instance_lock);
-	HASH_ITER(hh, sdata->stratum_instances, client, tmp) {
-		if (!client->user_instance)
+	HASH_ITER(hh, sdata->user_instances, user, tmpuser) {
+		struct userwb *userwb;
+		smsg_t *msg = NULL;
+		int clients;
+
+		if (!user->clients)
 			continue;
-		__inc_instance_ref(client);
-		ck_wunlock(&sdata->instance_lock);
+		userwb = __get_userwb(sdata, wb, user);
+		if (unlikely(!userwb)) {
+			LOGINFO("Failed to find userwb for user %s in stratum_broadcast_updates",
+				user->username);
+			continue;
+		}
+		DL_FOREACH2(user->clients, client, user_next) {
+			if (unlikely(subclient(client->id))) {
+				smsg_t *submsg = ckzalloc(sizeof(smsg_t));
+
+				submsg->json_msg = userwb_notify(wb, userwb, clean);
+				submsg->client_id = client->id;
+				client_msg = ckalloc(sizeof(ckmsg_t));
+				client_msg->data = submsg;
+				DL_APPEND(subclient_sends, client_msg);
+				continue;
+			}
+			if (!msg) {
+				msg = ckzalloc(sizeof(smsg_t));
+				msg->ckbuf = __userwb_notify_buf(wb, userwb, clean);
+				ckbuf_get(msg->ckbuf, 1);
+				DL_COUNT2(user->clients, counted, clients, user_next);
+				msg->client_ids = ckalloc(sizeof(int64_t) * clients);
+				client_msg = ckalloc(sizeof(ckmsg_t));
+				client_msg->data = msg;
+				DL_APPEND(bulk_send, client_msg);
+			}
+			if (ckp->sharebudget)
+				pending_diff(&diff_sends, client);
+			msg->client_ids[msg->clients++] = client->id;
+		}
+	}
+	ck_wunlock(&sdata->instance_lock);
 
-		ck_rlock(&sdata->workbase_lock);
-		json_msg = __user_notify(sdata->current_workbase, client->user_instance, clean);
-		ck_runlock(&sdata->workbase_lock);
+	ck_wlock(&sdata->workbase_lock);
+	wb->readcount--;
+	ck_wunlock(&sdata->workbase_lock);
 
-		if (likely(json_msg))
-			stratum_add_send(sdata, json_msg, client->id, SM_UPDATE);
+	if (diff_sends) {
+		DL_CONCAT(diff_sends, bulk_send);
+		bulk_send = diff_sends;
+	}
+	if (likely(bulk_send))
+		ssend_bulk_append(sdata, bulk_send);
 
-		ck_wlock(&sdata->instance_lock);
-		__dec_instance_ref(client);
+	DL_FOREACH_SAFE(subclient_sends, client_msg, tmpmsg) {
+		smsg_t *submsg = client_msg->data;
+
+		DL_DELETE(subclient_sends, client_msg);
+		stratum_add_send(sdata, submsg->json_msg, submsg->client_id, SM_UPDATE);
+		free(submsg);
+		free(client_msg);
 	}
-	ck_wunlock(&sdata->instance_lock);
 }
 
 static void send_json_err(sdata_t *sdata, const int64_t client_id, json_t *id_val, const char *err_msg)
@@ -6441,6 +8707,67 @@ static void update_client(const stratum_instance_t *client, const int64_t client
 	stratum_send_diff(sdata, client);
 }
 
+stratum_submit_t *create_submit(const int64_t client_id, const char *address, const int server,
+				const char *id, const int idlen, const char * const *param,
+				const int *paramlen, const int params)
+{
+	int i, len = idlen + 1, addrlen = address ? strlen(address) + 1 : 0;
+	stratum_submit_t *submit;
+	char *p;
+
+	for (i = 0; i < params; i++) {
+		if (param[i])
+			len += paramlen[i] + 1;
+	}
+	/* Zeroed so every string is already NUL terminated */
+	submit = ckzalloc(sizeof(stratum_submit_t) + len + addrlen);
+	submit->client_id = client_id;
+	submit->server = server;
+	submit->params = params;
+	p = submit->buf;
+	submit->id = p;
+	memcpy(p, id, idlen);
+	p += idlen + 1;
+	for (i = 0; i < params; i++) {
+		if (!param[i])
+			continue;
+		submit->param[i] = p;
+		memcpy(p, param[i], paramlen[i]);
+		p += paramlen[i] + 1;
+	}
+	if (address) {
+		submit->address = p;
+		memcpy(p, address, addrlen);
+	}
+	return submit;
+}
+
+/* Create a submit from the params and id of a share received as json */
+static stratum_submit_t *json_submit(const int64_t client_id, const json_t *params_val,
+				     const json_t *id_val)
+{
+	int paramlen[SUBMIT_PARAMS] = {}, params = -1, i;
+	const char *param[SUBMIT_PARAMS] = {};
+	stratum_submit_t *submit;
+	char *id = NULL;
+
+	if (json_is_array(params_val)) {
+		params = MIN(json_array_size(params_val), (size_t)SUBMIT_PARAMS);
+		for (i = 0; i < params; i++) {
+			param[i] = json_string_value(json_array_get(params_val, i));
+			if (param[i])
+				paramlen[i] = strlen(param[i]);
+		}
+	}
+	if (id_val)
+		id = json_dumps(id_val, JSON_ENCODE_ANY | JSON_COMPACT);
+	if (!id)
+		id = strdup("null");
+	submit = create_submit(client_id, NULL, 0, id, strlen(id), param, paramlen, params);
+	free(id);
+	return submit;
+}
+
 static json_params_t
 *create_json_params(const int64_t client_id, const json_t *method, const json_t *params,
 		    const json_t *id_val)
@@ -6497,14 +8824,58 @@ static void init_client(const stratum_instance_t *client, const int64_t client_i
 		stratum_send_update(sdata, client_id, true);
 }
 
+/* Start sending a node compact messages, sending it every txn with a short
+ * id. Any txn added to the table after this is sent to it by update_txns,
+ * which can't add any in between with txn_lock held throughout. */
+static void send_node_txndelta(sdata_t *sdata, stratum_instance_t *client)
+{
+	txndelta_t delta = {NULL, 0, 0};
+	stratum_instance_t *node;
+	txntable_t *txn, *tmp;
+	json_t *val;
+	smsg_t *msg;
+
+	ck_rlock(&sdata->txn_lock);
+	ck_wlock(&sdata->instance_lock);
+	DL_FOREACH2(sdata->node_instances, node, node_next) {
+		if (node == client) {
+			client->compact = true;
+			sdata->compact_nodes++;
+			break;
+		}
+	}
+	ck_wunlock(&sdata->instance_lock);
+
+	HASH_ITER(hh, sdata->txns, txn, tmp) {
+		if (txn->sid)
+			txndelta_add(&delta, txn);
+	}
+	ck_runlock(&sdata->txn_lock);
+
+	JSON_CPACK(val, "{ss}", "node.method", stratum_msgs[SM_TXNDELTA]);
+	json_set_uint32(val, "epoch", sdata->txn_epoch);
+	compact_payload(val, delta.buf, delta.len, client->zlib);
+	free(delta.buf);
+	msg = ckzalloc(sizeof(smsg_t));
+	msg->json_msg = val;
+	msg->client_id = client->id;
+	ssend_add(sdata, msg);
+	LOGNOTICE("Sending new compact node client %s all transactions", client->identity);
+}
+
 /* When a node first connects it has no transactions so we have to send all
  * current ones to it. */
-static void send_node_all_txns(sdata_t *sdata, const stratum_instance_t *client)
+static void send_node_all_txns(sdata_t *sdata, stratum_instance_t *client)
 {
 	json_t *txn_array, *val, *txn_val;
 	txntable_t *txn, *tmp;
 	smsg_t *msg;
 
+	if (client->node_protocol > 0 && !client->trusted) {
+		send_node_txndelta(sdata, client);
+		return;
+	}
+
 	txn_array = json_array();
 
 	ck_rlock(&sdata->txn_lock);
@@ -6524,7 +8895,7 @@ static void send_node_all_txns(sdata_t *sdata, const stratum_instance_t *client)
 	msg = ckzalloc(sizeof(smsg_t));
 	msg->json_msg = val;
 	msg->client_id = client->id;
-	ckmsgq_add(sdata->ssends, msg);
+	ssend_add(sdata, msg);
 	LOGNOTICE("Sending new node client %s all transactions", client->identity);
 }
 
@@ -6586,9 +8957,9 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 	 * most common messages will be shares so look for those first */
 	method = json_string_value(method_val);
 	if (likely(cmdmatch(method, "mining.submit") && client->authorised)) {
-		json_params_t *jp = create_json_params(client_id, method_val, params_val, id_val);
+		stratum_submit_t *submit = json_submit(client_id, params_val, id_val);
 
-		ckmsgq_add(sdata->sshareq, jp);
+		ckmsgq_add(ckmsgq_by_id(sdata->sshareq, client_id), submit);
 		return;
 	}
 
@@ -6651,6 +9022,12 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 			connector_drop_client(ckp, client_id);
 			drop_client(ckp, sdata, client_id);
 		} else {
+			json_t *node_val = json_array_get(params_val, 1);
+
+			/* Newer nodes offer to take compact messages */
+			client->node_protocol = MIN(json_integer_value(json_object_get(node_val, "compact")),
+						    NODE_PROTOCOL);
+			client->zlib = NODE_ZLIB && json_is_true(json_object_get(node_val, "zlib"));
 			snprintf(buf, 255, "passthrough=%"PRId64, client_id);
 			send_proc(ckp->connector, buf);
 			add_mining_node(ckp, sdata, client);
@@ -6691,7 +9068,7 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 			return;
 		}
 		jp = create_json_params(client_id, method_val, params_val, id_val);
-		ckmsgq_add(sdata->sauthq, jp);
+		add_sauth(ckp, jp);
 		return;
 	}
 
@@ -6746,12 +9123,6 @@ static void parse_method(ckpool_t *ckp, sdata_t *sdata, stratum_instance_t *clie
 	return;
 }
 
-static void free_smsg(smsg_t *msg)
-{
-	json_decref(msg->json_msg);
-	free(msg);
-}
-
 /* Even though we check the results locally in node mode, check the upstream
  * results in case of runs of invalids. */
 static void parse_share_result(ckpool_t *ckp, stratum_instance_t *client, json_t *val)
@@ -6844,30 +9215,30 @@ out:
 	return ret;
 }
 
+/* Write the username a remote workername belongs to into username, which
+ * must hold 128 bytes */
+static void remote_username(char *username, const char *workername)
+{
+	char *base_username = strdupa(workername), *name;
+
+	name = strsep(&base_username, "._");
+	if (!name || !strlen(name))
+		name = base_username;
+	snprintf(username, 128, "%s", name ? : "");
+}
+
 static user_instance_t *generate_remote_user(ckpool_t *ckp, const char *workername)
 {
-	char *base_username = strdupa(workername), *username;
 	sdata_t *sdata = ckp->sdata;
 	bool new_user = false;
 	user_instance_t *user;
-	int len;
-
-	username = strsep(&base_username, "._");
-	if (!username || !strlen(username))
-		username = base_username;
-	len = strlen(username);
-	if (unlikely(len > 127))
-		username[127] = '\0';
+	char username[128];
 
+	remote_username(username, workername);
 	user = get_create_user(sdata, username, &new_user);
 
-	if (!ckp->proxy && (new_user || !user->btcaddress)) {
-		/* Is this a btc address based username? */
-		if (generator_checkaddr(ckp, username, &user->script, &user->segwit)) {
-			user->btcaddress = true;
-			user->txnlen = address_to_txn(user->txnbin, username, user->script, user->segwit);
-		}
-	}
+	if (!ckp->proxy && (new_user || !user->btcaddress))
+		set_user_address(ckp, sdata, user, username);
 	if (new_user) {
 		LOGNOTICE("Added new remote user %s%s", username, user->btcaddress ?
 			  " as address based registration" : "");
@@ -6876,6 +9247,12 @@ static user_instance_t *generate_remote_user(ckpool_t *ckp, const char *workerna
 	return user;
 }
 
+/* Remote mindiff may be below 1 so any positive diff is a valid remote share */
+static bool valid_remote_diff(const double diff)
+{
+	return diff > 0;
+}
+
 static void parse_remote_share(ckpool_t *ckp, sdata_t *sdata, json_t *val, const char *buf)
 {
 	json_t *workername_val = json_object_get(val, "workername");
@@ -6883,6 +9260,7 @@ static void parse_remote_share(ckpool_t *ckp, sdata_t *sdata, json_t *val, const
 	const char *workername;
 	double diff, sdiff = 0;
 	user_instance_t *user;
+	uastats_t *uastats;
 	tv_t now_t;
 
 	workername = json_string_value(workername_val);
@@ -6890,7 +9268,7 @@ static void parse_remote_share(ckpool_t *ckp, sdata_t *sdata, json_t *val, const
 		LOGWARNING("Failed to get workername from remote message %s", buf);
 		return;
 	}
-	if (unlikely(!json_get_double(&diff, val, "diff") || diff < 1)) {
+	if (unlikely(!json_get_double(&diff, val, "diff") || !valid_remote_diff(diff))) {
 		LOGWARNING("Unable to parse valid diff from remote message %s", buf);
 		return;
 	}
@@ -6900,25 +9278,111 @@ static void parse_remote_share(ckpool_t *ckp, sdata_t *sdata, json_t *val, const
 	worker = get_worker(sdata, user, workername);
 	check_best_diff(sdata, user, worker, sdiff, NULL);
 
-	mutex_lock(&sdata->uastats_lock);
-	sdata->stats.unaccounted_shares++;
-	sdata->stats.unaccounted_diff_shares += diff;
-	mutex_unlock(&sdata->uastats_lock);
+	uastats = thread_uastats(sdata);
+	uastats_add(&uastats->shares, 1);
+	uastats_add(&uastats->diff_shares, diff);
 
 	worker->shares += diff;
 	user->shares += diff;
 	tv_time(&now_t);
 
-	decay_worker(worker, diff, &now_t);
+	meter_add(&worker->meter, diff, &now_t);
 	copy_tv(&worker->last_share, &now_t);
 	worker->idle = false;
 
-	decay_user(user, diff, &now_t);
+	meter_add(&user->meter, diff, &now_t);
 	copy_tv(&user->last_share, &now_t);
 
 	LOGINFO("Added %.0lf remote shares to worker %s", diff, workername);
 }
 
+/* As parse_remote_share for every share in a sharebatch, finding or creating
+ * all their users and workers under the one instance_lock. */
+static void parse_remote_sharebatch(ckpool_t *ckp, sdata_t *sdata, json_t *val, const char *buf)
+{
+	json_t *workernames = json_object_get(val, "workername");
+	json_t *diffs = json_object_get(val, "diff");
+	json_t *sdiffs = json_object_get(val, "sdiff");
+	worker_instance_t **workers;
+	int i, entries, added = 0;
+	user_instance_t **users;
+	uastats_t *uastats;
+	bool *new_users;
+	tv_t now_t;
+
+	entries = json_array_size(workernames);
+	if (unlikely(!entries || json_array_size(diffs) != entries ||
+		     json_array_size(sdiffs) != entries)) {
+		LOGWARNING("Mismatched columns in remote sharebatch %s", buf);
+		return;
+	}
+	users = ckzalloc(sizeof(user_instance_t *) * entries);
+	workers = ckalloc(sizeof(worker_instance_t *) * entries);
+	new_users = ckzalloc(sizeof(bool) * entries);
+
+	ck_wlock(&sdata->instance_lock);
+	for (i = 0; i < entries; i++) {
+		const char *workername = json_string_value(json_array_get(workernames, i));
+		user_instance_t *user;
+		char username[128];
+
+		if (unlikely(!workername))
+			continue;
+		remote_username(username, workername);
+		HASH_FIND_STR(sdata->user_instances, username, user);
+		if (unlikely(!user)) {
+			user = __create_user(sdata, username);
+			new_users[i] = true;
+		}
+		workers[i] = __get_worker(user, workername);
+		if (unlikely(!workers[i]))
+			workers[i] = __create_worker(sdata, user, workername);
+		users[i] = user;
+	}
+	ck_wunlock(&sdata->instance_lock);
+
+	uastats = thread_uastats(sdata);
+	tv_time(&now_t);
+	for (i = 0; i < entries; i++) {
+		double diff = json_number_value(json_array_get(diffs, i));
+		double sdiff = json_number_value(json_array_get(sdiffs, i));
+		worker_instance_t *worker = workers[i];
+		user_instance_t *user = users[i];
+
+		if (unlikely(!user || !valid_remote_diff(diff))) {
+			LOGWARNING("Invalid entry %d in remote sharebatch %s", i, buf);
+			continue;
+		}
+		if (!ckp->proxy && (new_users[i] || !user->btcaddress))
+			set_user_address(ckp, sdata, user, user->username);
+		if (new_users[i]) {
+			LOGNOTICE("Added new remote user %s%s", user->username, user->btcaddress ?
+				  " as address based registration" : "");
+		}
+		user->authorised = true;
+		check_best_diff(sdata, user, worker, sdiff, NULL);
+
+		uastats_add(&uastats->shares, 1);
+		uastats_add(&uastats->diff_shares, diff);
+
+		worker->shares += diff;
+		user->shares += diff;
+
+		meter_add(&worker->meter, diff, &now_t);
+		copy_tv(&worker->last_share, &now_t);
+		worker->idle = false;
+
+		meter_add(&user->meter, diff, &now_t);
+		copy_tv(&user->last_share, &now_t);
+		added++;
+	}
+	free(new_users);
+	free(workers);
+	free(users);
+
+	LOGINFO("Added batch of %d remote shares", added);
+}
+
 static void parse_remote_shareerr(ckpool_t *ckp, json_t *val, const char *buf)
 {
 	const char *workername;
@@ -6964,21 +9428,26 @@ static void send_auth_failure(sdata_t *sdata, stratum_instance_t *client)
 static stratum_instance_t *ref_instance_by_virtualid(sdata_t *sdata, int64_t *client_id)
 {
 	stratum_instance_t *client, *ret = NULL;
+	int i;
 
-	ck_wlock(&sdata->instance_lock);
-	for (client = sdata->stratum_instances; client; client = client->hh.next) {
-		if (likely(client->virtualid != *client_id))
-			continue;
-		if (likely(!client->dropped)) {
-			ret = client;
-			__inc_instance_ref(ret);
-			/* Replace the client_id with the correct one, allowing
-			 * us to send the response to the correct client */
-			*client_id = client->id;
+	ck_rlock(&sdata->instance_lock);
+	for (i = 0; i < INSTANCE_SHARDS; i++) {
+		for (client = sdata->instance_shards[i].instances; client; client = client->hh.next) {
+			if (likely(client->virtualid != *client_id))
+				continue;
+			if (likely(!client->dropped)) {
+				ret = client;
+				__inc_instance_ref(ret);
+				/* Replace the client_id with the correct one,
+				 * allowing us to send the response to the
+				 * correct client */
+				*client_id = client->id;
+			}
+			goto out_unlock;
 		}
-		break;
 	}
-	ck_wunlock(&sdata->instance_lock);
+out_unlock:
+	ck_runlock(&sdata->instance_lock);
 
 	return ret;
 }
@@ -7038,6 +9507,7 @@ static void parse_remote_auth(ckpool_t *ckp, sdata_t *sdata, json_t *val, stratu
 	stratum_instance_t *client;
 	json_params_t *jp;
 	int64_t client_id;
+	const char *buf;
 
 	if (ckp->btcsolo) {
 		LOGWARNING("Got remote auth request in btcsolo mode, ignoring!");
@@ -7059,12 +9529,14 @@ static void parse_remote_auth(ckpool_t *ckp, sdata_t *sdata, json_t *val, stratu
 	if (likely(!client))
 		client = __stratum_add_instance(ckp, client_id, remote->address, remote->server);
 	client->remote = true;
-	json_strdup(&client->useragent, val, "useragent");
+	if ((buf = json_string_value(json_object_get(val, "useragent"))))
+		reintern_str(sdata, &client->useragent, buf);
 	json_strcpy(client->enonce1, val, "enonce1");
-	json_strcpy(client->address, val, "address");
+	if ((buf = json_string_value(json_object_get(val, "address"))))
+		reintern_str(sdata, &client->address, buf);
 	ck_wunlock(&sdata->instance_lock);
 
-	ckmsgq_add(sdata->sauthq, jp);
+	add_sauth(ckp, jp);
 }
 
 /* Get the remote worker count once per minute from all the remote servers */
@@ -7086,6 +9558,7 @@ static void parse_remote_workers(sdata_t *sdata, const json_t *val, const char *
 		return;
 	}
 	user->remote_workers += workers;
+	user->dirty = true;
 	LOGDEBUG("Adding %d remote workers to user %s", workers, username);
 }
 
@@ -7127,7 +9600,9 @@ static void parse_remote_block(ckpool_t *ckp, sdata_t *sdata, json_t *val, const
 		uchar swap[80], hash[32], hash1[32], flip32[32];
 		char *coinbase = alloca(cblen), *gbt_block;
 		char blockhash[68];
+		tv_t solve_tv;
 
+		tv_time(&solve_tv);
 		LOGWARNING("Possible remote block solve diff %lf !", diff);
 		hex2bin(coinbase, coinbasehex, cblen);
 		hex2bin(swap, swaphex, 80);
@@ -7140,7 +9615,7 @@ static void parse_remote_block(ckpool_t *ckp, sdata_t *sdata, json_t *val, const
 		/* We rely on the remote server to give us the ID_BLOCK
 		 * responses, so only use this response to determine if we
 		 * should reset the best shares. */
-		if (local_block_submit(ckp, gbt_block, flip32, wb->height)) {
+		if (local_block_submit(ckp, wb, gbt_block, flip32, &solve_tv)) {
 			block_share_summary(sdata);
 			reset_bestshares(sdata);
 		}
@@ -7199,22 +9674,162 @@ static void add_node_txns(ckpool_t *ckp, sdata_t *sdata, const json_t *val)
 	for (i = 0; i < arr_size; i++) {
 		const char *hash, *data;
 
-		txn_val = json_array_get(txn_array, i);
-		data_val = json_object_get(txn_val, "data");
-		hash_val = json_object_get(txn_val, "hash");
-		data = json_string_value(data_val);
-		hash = json_string_value(hash_val);
-		if (unlikely(!data || !hash)) {
-			LOGERR("Failed to get hash/data in add_node_txns");
-			continue;
-		}
+		txn_val = json_array_get(txn_array, i);
+		data_val = json_object_get(txn_val, "data");
+		hash_val = json_object_get(txn_val, "hash");
+		data = json_string_value(data_val);
+		hash = json_string_value(hash_val);
+		if (unlikely(!data || !hash)) {
+			LOGERR("Failed to get hash/data in add_node_txns");
+			continue;
+		}
+
+		if (add_txn(ckp, sdata, &txns, hash, NULL, data, false, NULL))
+			added++;
+	}
+
+	if (added)
+		update_txns(ckp, sdata, txns, false);
+}
+
+/* Enter with txn_lock held. Map txn to the short id upstream knows it by,
+ * forgetting any other txn upstream has since given that short id. */
+static void __map_usid(sdata_t *sdata, txntable_t *txn, const uint32_t usid)
+{
+	txntable_t *old;
+
+	if (txn->usid == usid)
+		return;
+	if (txn->usid)
+		HASH_DELETE(uh, sdata->txn_usids, txn);
+	HASH_FIND(uh, sdata->txn_usids, &usid, sizeof(uint32_t), old);
+	if (old) {
+		HASH_DELETE(uh, sdata->txn_usids, old);
+		old->usid = 0;
+	}
+	txn->usid = usid;
+	HASH_ADD(uh, sdata->txn_usids, usid, sizeof(uint32_t), txn);
+}
+
+/* Enter with txn_lock held. Upstream short ids are only valid for the epoch
+ * they were sent with so forget them all if upstream has restarted. */
+static void __upstream_epoch(sdata_t *sdata, const uint32_t epoch)
+{
+	txntable_t *txn, *tmp;
+
+	if (likely(epoch == sdata->upstream_epoch))
+		return;
+	HASH_ITER(uh, sdata->txn_usids, txn, tmp) {
+		HASH_DELETE(uh, sdata->txn_usids, txn);
+		txn->usid = 0;
+	}
+	sdata->upstream_epoch = epoch;
+}
+
+/* Compact txns are keyed by txid so rebuild_txns finds them from the short
+ * ids of a workdelta without asking bitcoind. */
+static void add_node_txndelta(ckpool_t *ckp, sdata_t *sdata, json_t *val)
+{
+	const uchar *p, *next, *end, *txid, *data;
+	txntable_t *txns = NULL, *txn;
+	int added = 0, entries = 0;
+	uint32_t epoch = 0, sid, len;
+	uchar *payload;
+	char hash[68];
+	size_t plen;
+
+	json_uintcpy(&epoch, val, "epoch");
+	payload = compact_data(val, &plen);
+	if (unlikely(!payload)) {
+		LOGWARNING("Failed to decode txndelta from upstream");
+		return;
+	}
+	end = payload + plen;
+	for (p = payload; p < end; p = next) {
+		char *hex;
+
+		next = txndelta_next(p, end, &sid, &txid, &data, &len);
+		if (unlikely(!next)) {
+			LOGWARNING("Truncated txndelta from upstream after %d transactions", entries);
+			end = p;
+			break;
+		}
+		__bin2hex(hash, txid, 32);
+		hex = bin2hex(data, len);
+		if (add_txn(ckp, sdata, &txns, hash, NULL, hex, false, NULL))
+			added++;
+		free(hex);
+		entries++;
+	}
+	if (added)
+		update_txns(ckp, sdata, txns, false);
+
+	/* Map the short ids now every txn is in the table */
+	ck_wlock(&sdata->txn_lock);
+	__upstream_epoch(sdata, epoch);
+	for (p = payload; p < end; p = next) {
+		next = txndelta_next(p, end, &sid, &txid, &data, &len);
+		if (unlikely(!next))
+			break;
+		if (unlikely(!sid))
+			continue;
+		__bin2hex(hash, txid, 32);
+		HASH_FIND_STR(sdata->txns, hash, txn);
+		if (likely(txn))
+			__map_usid(sdata, txn, sid);
+	}
+	ck_wunlock(&sdata->txn_lock);
+	free(payload);
+
+	LOGINFO("Stratifier got txndelta of %d transactions, %d new", entries, added);
+}
+
+/* Turn the short ids of a workdelta back into the txn_hashes of a workinfo */
+static void add_node_workdelta(ckpool_t *ckp, sdata_t *sdata, json_t *val)
+{
+	int txns = 0, i, missing = 0;
+	uint32_t epoch = 0, sid;
+	char *hashes = NULL;
+	uchar *payload;
+	txntable_t *txn;
+	size_t plen;
+
+	json_uintcpy(&epoch, val, "epoch");
+	json_intcpy(&txns, val, "txns");
+	payload = compact_data(val, &plen);
+	if (unlikely(!payload || txns < 0 || plen != (size_t)txns * sizeof(uint32_t))) {
+		LOGWARNING("Failed to decode workdelta from upstream");
+		goto out;
+	}
+	hashes = ckalloc(txns * 65 + 1);
+	memset(hashes, 0x20, txns * 65); // Spaces
+	hashes[txns * 65] = '\0';
 
-		if (add_txn(ckp, sdata, &txns, hash, data, false))
-			added++;
+	ck_rlock(&sdata->txn_lock);
+	if (unlikely(epoch != sdata->upstream_epoch))
+		missing = txns;
+	for (i = 0; i < txns && !missing; i++) {
+		memcpy(&sid, payload + i * sizeof(uint32_t), sizeof(uint32_t));
+		sid = le32toh(sid);
+		HASH_FIND(uh, sdata->txn_usids, &sid, sizeof(uint32_t), txn);
+		if (unlikely(!txn))
+			missing = txns - i;
+		else
+			memcpy(hashes + i * 65, txn->hash, 64);
 	}
+	ck_runlock(&sdata->txn_lock);
 
-	if (added)
-		update_txns(ckp, sdata, txns, false);
+	if (unlikely(missing)) {
+		LOGWARNING("Dropping workdelta from upstream missing up to %d of %d transactions",
+			   missing, txns);
+		goto out;
+	}
+	json_object_del(val, "data");
+	json_set_string(val, "txn_hashes", hashes);
+	add_node_base(ckp, val, false, 0);
+out:
+	free(hashes);
+	free(payload);
 }
 
 void parse_remote_txns(ckpool_t *ckp, const json_t *val)
@@ -7305,7 +9920,9 @@ static void parse_trusted_msg(ckpool_t *ckp, sdata_t *sdata, json_t *val, stratu
 		goto out;
 	}
 
-	if (likely(!safecmp(method, stratum_msgs[SM_SHARE])))
+	if (likely(!safecmp(method, stratum_msgs[SM_SHAREBATCH])))
+		parse_remote_sharebatch(ckp, sdata, val, buf);
+	else if (!safecmp(method, stratum_msgs[SM_SHARE]))
 		parse_remote_share(ckp, sdata, val, buf);
 	else if (!safecmp(method, stratum_msgs[SM_TRANSACTIONS]))
 		add_node_txns(ckp, sdata, val);
@@ -7332,10 +9949,9 @@ out:
 /* Entered with client holding ref count */
 static void node_client_msg(ckpool_t *ckp, json_t *val, stratum_instance_t *client)
 {
-	json_t *params, *method, *res_val, *id_val, *err_val = NULL;
+	json_t *params, *res_val, *id_val, *err_val = NULL;
 	int msg_type = node_msg_type(val);
 	sdata_t *sdata = ckp->sdata;
-	json_params_t *jp;
 	char *buf = NULL;
 
 	if (msg_type < 0) {
@@ -7345,13 +9961,12 @@ static void node_client_msg(ckpool_t *ckp, json_t *val, stratum_instance_t *clie
 	}
 	LOGDEBUG("Got client %s node method %d:%s", client->identity, msg_type, stratum_msgs[msg_type]);
 	id_val = json_object_get(val, "id");
-	method = json_object_get(val, "method");
 	params = json_object_get(val, "params");
 	res_val = json_object_get(val, "result");
 	switch (msg_type) {
 		case SM_SHARE:
-			jp = create_json_params(client->id, method, params, id_val);
-			ckmsgq_add(sdata->sshareq, jp);
+			ckmsgq_add(ckmsgq_by_id(sdata->sshareq, client->id),
+				   json_submit(client->id, params, id_val));
 			break;
 		case SM_SHARERESULT:
 			parse_share_result(ckp, client, res_val);
@@ -7402,6 +10017,12 @@ static void parse_node_msg(ckpool_t *ckp, sdata_t *sdata, json_t *val)
 		case SM_WORKINFO:
 			add_node_base(ckp, val, false, 0);
 			break;
+		case SM_TXNDELTA:
+			add_node_txndelta(ckp, sdata, val);
+			break;
+		case SM_WORKDELTA:
+			add_node_workdelta(ckp, sdata, val);
+			break;
 		case SM_BLOCK:
 			submit_node_block(ckp, sdata, val);
 			break;
@@ -7465,22 +10086,47 @@ static void parse_instance_msg(ckpool_t *ckp, sdata_t *sdata, smsg_t *msg, strat
 	parse_method(ckp, sdata, client, client_id, id_val, method, params);
 }
 
-static void srecv_process(ckpool_t *ckp, json_t *val)
+/* Shares from authorised local clients go straight to the share processors.
+ * Anything else takes the full json path so clients not yet known,
+ * authorised, or about to be dropped are handled as before. */
+static bool direct_submit(sdata_t *sdata, const stratum_submit_t *submit)
+{
+	stratum_instance_t *client;
+	instance_shard_t *shard;
+	bool ret;
+
+	shard = instance_shard(sdata, submit->client_id);
+	ck_rlock(&shard->lock);
+	client = __instance_by_id(sdata, submit->client_id);
+	ret = client && client->authorised && !client->dropped && !client->trusted &&
+		client->reject < 3;
+	ck_runlock(&shard->lock);
+
+	return ret;
+}
+
+static void srecv_process(ckpool_t *ckp, smsg_t *msg)
 {
 	char address[INET6_ADDRSTRLEN], *buf = NULL;
 	bool noid = false, dropped = false;
+	int64_t start = time_nanos();
 	sdata_t *sdata = ckp->sdata;
 	stratum_instance_t *client;
-	smsg_t *msg;
+	json_t *val;
 	int server;
 
-	if (unlikely(!val)) {
-		LOGWARNING("srecv_process received NULL val!");
-		return;
+	if (msg->submit) {
+		/* Passed on from here to stay behind anything the client
+		 * sent before it */
+		if (likely(direct_submit(sdata, msg->submit))) {
+			ckmsgq_add(ckmsgq_by_id(sdata->sshareq, msg->client_id), msg->submit);
+			free(msg);
+			return;
+		}
+		msg->json_msg = submit_json(msg->submit);
+		dealloc(msg->submit);
 	}
 
-	msg = ckzalloc(sizeof(smsg_t));
-	msg->json_msg = val;
 	val = json_object_get(msg->json_msg, "client_id");
 	if (unlikely(!val)) {
 		if (ckp->node)
@@ -7546,22 +10192,100 @@ static void srecv_process(ckpool_t *ckp, json_t *val)
 out:
 	free_smsg(msg);
 	free(buf);
+	ckhist_add(&sdata->recv_process, time_nanos() - start);
 }
 
 void _stratifier_add_recv(ckpool_t *ckp, json_t *val, const char *file, const char *func, const int line)
 {
 	sdata_t *sdata;
+	smsg_t *msg;
 
 	if (unlikely(!val)) {
 		LOGWARNING("_stratifier_add_recv received NULL val from %s %s:%d", file, func, line);
 		return;
 	}
 	sdata = ckp->sdata;
-	ckmsgq_add(sdata->srecvs, val);
+	msg = ckzalloc(sizeof(smsg_t));
+	msg->json_msg = val;
+	json_get_int64(&msg->client_id, val, "client_id");
+	ckmsgq_add(ckmsgq_by_id(sdata->srecvs, msg->client_id), msg);
+}
+
+/* As stratifier_add_recv for a list of one client's messages, queued ahead of
+ * everything waiting if prio is set. Takes ownership of the list. */
+void stratifier_add_recvs(ckpool_t *ckp, ckmsg_t *msgs, const bool prio)
+{
+	sdata_t *sdata = ckp->sdata;
+	int64_t client_id = 0;
+	ckmsg_t *recv;
+
+	if (!msgs)
+		return;
+	json_get_int64(&client_id, msgs->data, "client_id");
+	DL_FOREACH(msgs, recv) {
+		smsg_t *msg = ckzalloc(sizeof(smsg_t));
+
+		msg->json_msg = recv->data;
+		msg->client_id = client_id;
+		recv->data = msg;
+	}
+	ckmsgq_addbulk(ckmsgq_by_id(sdata->srecvs, client_id), msgs, prio);
+}
+
+/* Recreate the json message the connector would have sent for a submit */
+json_t *submit_json(const stratum_submit_t *submit)
+{
+	json_t *val = json_object(), *params = json_array(), *id_val;
+	int i;
+
+	for (i = 0; i < submit->params; i++) {
+		if (submit->param[i])
+			json_array_append_new(params, json_string_nocheck(submit->param[i]));
+		else
+			json_array_append_new(params, json_null());
+	}
+	json_object_set_new_nocheck(val, "params", params);
+	id_val = json_loads(submit->id, JSON_DECODE_ANY, NULL);
+	json_object_set_new_nocheck(val, "id", id_val ? id_val : json_null());
+	json_object_set_new_nocheck(val, "method", json_string_nocheck("mining.submit"));
+	json_object_set_new_nocheck(val, "client_id", json_integer(submit->client_id));
+	if (submit->address)
+		json_object_set_new_nocheck(val, "address", json_string(submit->address));
+	json_object_set_new_nocheck(val, "server", json_integer(submit->server));
+	return val;
+}
+
+/* Queue a submit on its client's srecvs queue, keeping it in order with the
+ * client's other messages. Takes ownership of submit. */
+void stratifier_add_submit(ckpool_t *ckp, stratum_submit_t *submit)
+{
+	sdata_t *sdata = ckp->sdata;
+	smsg_t *msg;
+
+	msg = ckzalloc(sizeof(smsg_t));
+	msg->submit = submit;
+	msg->client_id = submit->client_id;
+	ckmsgq_add(ckmsgq_by_id(sdata->srecvs, submit->client_id), msg);
 }
 
 static void ssend_process(ckpool_t *ckp, smsg_t *msg)
 {
+	sdata_t *sdata = ckp->sdata;
+
+	if (msg->ckbuf) {
+		/* The connector takes its own references to the shared buffer */
+		connector_broadcast(ckp, msg->ckbuf, msg->client_ids, msg->clients);
+		free_smsg(msg);
+		return;
+	}
+	if (msg->buf) {
+		if (msg->stamp)
+			ckhist_add(&sdata->send_queue, time_nanos() - msg->queued);
+		/* The connector takes ownership of buf */
+		connector_send(ckp, msg->client_id, msg->buf, msg->stamp);
+		free(msg);
+		return;
+	}
 	if (unlikely(!msg->json_msg)) {
 		LOGERR("Sent null json msg to stratum_sender");
 		free(msg);
@@ -7592,14 +10316,56 @@ static void steal_json_id(json_t *val, json_params_t *jp)
 	jp->id_val = NULL;
 }
 
-static void sshare_process(ckpool_t *ckp, json_params_t *jp)
+/* How many queued shares a share processing thread takes per wakeup */
+#define SHARE_BATCH 16
+
+/* Respond to a share, serialising the response directly for local clients
+ * while subclients still get json for their node.method */
+static void stratum_send_share_result(sdata_t *sdata, const int64_t client_id, const char *id,
+				      const bool result, const int errn, const bool reject,
+				      const int64_t stamp)
 {
-	json_t *result_val, *json_msg, *err_val = NULL;
-	stratum_instance_t *client;
+	const char *res = result ? "true" : "false";
+	json_t *json_msg;
+
+	if (likely(!subclient(client_id))) {
+		char *buf;
+
+		if (!errn)
+			ASPRINTF(&buf, "{\"result\":%s,\"error\":null,\"id\":%s}\n", res, id);
+		else if (reject) {
+			ASPRINTF(&buf, "{\"reject-reason\":\"%s\",\"result\":%s,\"error\":null,\"id\":%s}\n",
+				 SHARE_ERR(errn), res, id);
+		} else {
+			ASPRINTF(&buf, "{\"result\":%s,\"error\":\"%s\",\"id\":%s}\n",
+				 res, SHARE_ERR(errn), id);
+		}
+		stratum_add_sendbuf(sdata, buf, client_id, stamp);
+		return;
+	}
+	json_msg = json_object();
+	if (reject)
+		json_set_string(json_msg, "reject-reason", SHARE_ERR(errn));
+	json_set_bool(json_msg, "result", result);
+	if (errn && !reject)
+		json_set_string(json_msg, "error", SHARE_ERR(errn));
+	else
+		json_object_set_new_nocheck(json_msg, "error", json_null());
+	json_object_set_new_nocheck(json_msg, "id", json_loads(id, JSON_DECODE_ANY, NULL));
+	stratum_add_send(sdata, json_msg, client_id, SM_SHARERESULT);
+}
+
+static void sshare_process(ckpool_t *ckp, stratum_submit_t *submit)
+{
+	int64_t client_id, start = time_nanos();
 	sdata_t *sdata = ckp->sdata;
-	int64_t client_id;
+	stratum_instance_t *client;
+	bool result, reject;
+	int errn;
 
-	client_id = jp->client_id;
+	client_id = submit->client_id;
+	if (submit->stamp)
+		ckhist_add(&sdata->submit_queue, start - submit->stamp);
 
 	client = ref_instance_by_id(sdata, client_id);
 	if (unlikely(!client)) {
@@ -7610,16 +10376,14 @@ static void sshare_process(ckpool_t *ckp, json_params_t *jp)
 		LOGDEBUG("Client %s no longer authorised to submit shares", client->identity);
 		goto out_decref;
 	}
-	json_msg = json_object();
-	result_val = parse_submit(client, json_msg, jp->params, &err_val);
-	json_object_set_new_nocheck(json_msg, "result", result_val);
-	json_object_set_new_nocheck(json_msg, "error", err_val ? err_val : json_null());
-	steal_json_id(json_msg, jp);
-	stratum_add_send(sdata, json_msg, client_id, SM_SHARERESULT);
+	result = parse_submit(client, submit->param, submit->params, &errn, &reject);
+	ckhist_add(&sdata->submit_parse, time_nanos() - start);
+	__atomic_add_fetch(&sdata->share_results[errn + 9], 1, __ATOMIC_RELAXED);
+	stratum_send_share_result(sdata, client_id, submit->id, result, errn, reject, submit->stamp);
 out_decref:
 	dec_instance_ref(sdata, client);
 out:
-	discard_json_params(jp);
+	free(submit);
 }
 
 /* As ref_instance_by_id but only returns clients not authorising or authorised,
@@ -7831,6 +10595,9 @@ out:
 	discard_json_params(jp);
 }
 
+/* How often to store the stats of idle users whose stats haven't changed */
+#define USER_IDLE_STORE 600
+
 static void add_log_entry(log_entry_t **entries, char **fname, char **buf)
 {
 	log_entry_t *entry = ckalloc(sizeof(log_entry_t));
@@ -7842,19 +10609,30 @@ static void add_log_entry(log_entry_t **entries, char **fname, char **buf)
 	DL_APPEND(*entries, entry);
 }
 
-static void dump_log_entries(log_entry_t **entries)
+/* Write out up to max entries, each to a temporary file renamed over the
+ * original so readers never see a partially written file. */
+static void dump_log_entries(log_entry_t **entries, int max)
 {
 	log_entry_t *entry, *tmpentry;
+	char *tmpname;
 	FILE *fp;
 
 	DL_FOREACH_SAFE(*entries, entry, tmpentry) {
+		if (max-- < 1)
+			break;
 		DL_DELETE(*entries, entry);
-		fp = fopen(entry->fname, "we");
+		ASPRINTF(&tmpname, "%s.tmp", entry->fname);
+		fp = fopen(tmpname, "we");
 		if (likely(fp)) {
-			fprintf(fp, "%s", entry->buf);
-			fclose(fp);
+			bool ret = fputs(entry->buf, fp) >= 0;
+
+			if (unlikely(fclose(fp) || !ret))
+				LOGERR("Failed to write %s in dump_log_entries", tmpname);
+			else if (unlikely(rename(tmpname, entry->fname)))
+				LOGERR("Failed to rename %s to %s in dump_log_entries", tmpname, entry->fname);
 		} else
-			LOGERR("Failed to fopen %s in dump_log_entries", entry->fname);
+			LOGERR("Failed to fopen %s in dump_log_entries", tmpname);
+		free(tmpname);
 		free(entry->fname);
 		free(entry->buf);
 		free(entry);
@@ -7871,6 +10649,40 @@ static void upstream_workers(ckpool_t *ckp, user_instance_t *user)
 }
 
 
+/* Walk all instances one shard lock at a time, dropping the reference of the
+ * last instance examined and grabbing one of the next, allowing it to be
+ * examined without holding any lock. */
+static stratum_instance_t *next_instance(sdata_t *sdata, stratum_instance_t *client)
+{
+	instance_shard_t *shard;
+	int i = 0;
+
+	if (client) {
+		shard = instance_shard(sdata, client->id);
+		i = shard - sdata->instance_shards;
+		ck_rlock(&shard->lock);
+		__dec_instance_ref(client);
+		client = client->hh.next;
+		if (likely(client))
+			__inc_instance_ref(client);
+		ck_runlock(&shard->lock);
+		if (client)
+			return client;
+		i++;
+	}
+	for (; i < INSTANCE_SHARDS; i++) {
+		shard = &sdata->instance_shards[i];
+		ck_rlock(&shard->lock);
+		client = shard->instances;
+		if (likely(client))
+			__inc_instance_ref(client);
+		ck_runlock(&shard->lock);
+		if (client)
+			break;
+	}
+	return client;
+}
+
 /* To iterate over all users, if user is initially NULL, this will return the first entry,
  * otherwise it will return the entry after user, and NULL if there are no more entries.
  * Allows us to grab and drop the lock on each iteration. */
@@ -7899,6 +10711,127 @@ static worker_instance_t *next_worker(sdata_t *sdata, user_instance_t *user, wor
 	return worker;
 }
 
+/* Move the vardiff scale towards keeping the pool share rate at the share
+ * budget once a minute, only halfway each time since clients take minutes to
+ * retarget. It never goes below the normal vardiff targets. */
+static void update_diff_scale(ckpool_t *ckp, sdata_t *sdata)
+{
+	double sps = sdata->stats.sps1, scale = sdata->diff_scale;
+
+	if (sps <= 0)
+		return;
+	scale *= sqrt(sps / ckp->sharebudget);
+	scale = MAX(scale, 1);
+	scale = MIN(scale, 1000000);
+	if (scale != sdata->diff_scale)
+		LOGINFO("Share rate %.1f for budget %.1f, vardiff scale %.3f", sps,
+			ckp->sharebudget, scale);
+	sdata->diff_scale = scale;
+}
+
+static void snapshot_append(char **buf, size_t *len, size_t *size, snapshot_stats_t *rec,
+			    const char *name)
+{
+	size_t need;
+
+	rec->namelen = (strlen(name) + 8) & ~7;
+	need = *len + sizeof(snapshot_stats_t) + rec->namelen;
+	if (unlikely(need > *size)) {
+		while (need > *size)
+			*size *= 2;
+		*buf = realloc(*buf, *size);
+		if (unlikely(!*buf))
+			quit(1, "Failed to realloc user stats snapshot of size %lu", (unsigned long)*size);
+	}
+	memcpy(*buf + *len, rec, sizeof(snapshot_stats_t));
+	*len += sizeof(snapshot_stats_t);
+	memset(*buf + *len, 0, rec->namelen);
+	strcpy(*buf + *len, name);
+	*len += rec->namelen;
+}
+
+static void meter_to_snapshot(snapshot_stats_t *rec, const hashmeter_t *meter)
+{
+	rec->dsps1 = meter->dsps1;
+	rec->dsps5 = meter->dsps5;
+	rec->dsps60 = meter->dsps60;
+	rec->dsps1440 = meter->dsps1440;
+	rec->dsps10080 = meter->dsps10080;
+}
+
+/* Write every user that has ever authorised, along with all its workers, to
+ * the stats snapshot, taking the instance lock once per user. */
+static void write_stats_snapshot(ckpool_t *ckp, sdata_t *sdata, const tv_t *now)
+{
+	size_t len = sizeof(snapshot_header_t), size = 65536;
+	char *buf = ckzalloc(size), *fname, *tmpname;
+	user_instance_t *user = NULL;
+	snapshot_header_t *hdr;
+	int users = 0, workers = 0;
+	FILE *fp;
+
+	while ((user = next_user(sdata, user)) != NULL) {
+		worker_instance_t *worker;
+		snapshot_stats_t rec;
+		size_t userofs;
+
+		if (!user->authorised && !user->auth_time)
+			continue;
+		memset(&rec, 0, sizeof(rec));
+		ck_rlock(&sdata->instance_lock);
+		meter_to_snapshot(&rec, &user->meter);
+		rec.best_diff = user->best_diff;
+		rec.best_ever = user->best_ever;
+		rec.shares = user->shares;
+		rec.last_share = user->last_share.tv_sec;
+		rec.auth_time = user->auth_time;
+		userofs = len;
+		snapshot_append(&buf, &len, &size, &rec, user->username);
+		users++;
+		DL_FOREACH(user->worker_instances, worker) {
+			snapshot_stats_t wrec;
+
+			memset(&wrec, 0, sizeof(wrec));
+			meter_to_snapshot(&wrec, &worker->meter);
+			wrec.best_diff = worker->best_diff;
+			wrec.best_ever = worker->best_ever;
+			wrec.shares = worker->shares;
+			wrec.last_share = worker->last_share.tv_sec;
+			snapshot_append(&buf, &len, &size, &wrec, worker->workername);
+			rec.count++;
+		}
+		ck_runlock(&sdata->instance_lock);
+		/* Buffer may have moved so store the worker count by offset */
+		((snapshot_stats_t *)(buf + userofs))->count = rec.count;
+		workers += rec.count;
+	}
+
+	hdr = (snapshot_header_t *)buf;
+	memcpy(hdr->magic, SNAPSHOT_MAGIC, 8);
+	hdr->written = now->tv_sec;
+	hdr->size = len;
+	hdr->users = users;
+	hdr->workers = workers;
+
+	ASPRINTF(&fname, "%spool/users.snapshot", ckp->logdir);
+	ASPRINTF(&tmpname, "%s.tmp", fname);
+	fp = fopen(tmpname, "we");
+	if (likely(fp)) {
+		bool ret = fwrite(buf, len, 1, fp) == 1;
+
+		if (unlikely(fclose(fp) || !ret))
+			LOGERR("Failed to write %s", tmpname);
+		else if (unlikely(rename(tmpname, fname)))
+			LOGERR("Failed to rename %s to %s", tmpname, fname);
+		else
+			LOGDEBUG("Wrote user stats snapshot of %d users %d workers", users, workers);
+	} else
+		LOGERR("Failed to fopen %s", tmpname);
+	free(tmpname);
+	free(fname);
+	free(buf);
+}
+
 static void *statsupdate(void *arg)
 {
 	ckpool_t *ckp = (ckpool_t *)arg;
@@ -7918,6 +10851,7 @@ static void *statsupdate(void *arg)
 		char suffix1[16], suffix5[16], suffix15[16], suffix60[16], cdfield[64];
 		char suffix360[16], suffix1440[16], suffix10080[16];
 		int remote_users = 0, remote_workers = 0, idle_workers = 0;
+		int log_count = 0, log_batch;
 		log_entry_t *log_entries = NULL;
 		char_entry_t *char_list = NULL;
 		stratum_instance_t *client;
@@ -7932,14 +10866,9 @@ static void *statsupdate(void *arg)
 		tv_time(&now);
 		timersub(&now, &stats->start_time, &diff);
 
-		ck_wlock(&sdata->instance_lock);
-		/* Grab the first entry */
-		client = sdata->stratum_instances;
-		if (likely(client))
-			__inc_instance_ref(client);
-		ck_wunlock(&sdata->instance_lock);
+		client = NULL;
 
-		while (client) {
+		while ((client = next_instance(sdata, client)) != NULL) {
 			tv_time(&now);
 			/* Look for clients that may have been dropped which the
 			 * stratifier has not been informed about and ask the
@@ -7960,7 +10889,7 @@ static void *statsupdate(void *arg)
 				/* Decay times per connected instance */
 				if (per_tdiff > 60) {
 					/* No shares for over a minute, decay to 0 */
-					decay_client(client, 0, &now);
+					decay_meter(&client->meter, &now);
 					idle_workers++;
 					if (per_tdiff > 600)
 						client->idle = true;
@@ -7968,25 +10897,18 @@ static void *statsupdate(void *arg)
 					connector_test_client(ckp, client->id);
 				}
 			}
-
-			ck_wlock(&sdata->instance_lock);
-			/* Drop the reference of the last entry we examined,
-			 * then grab the next client. */
-			__dec_instance_ref(client);
-			client = client->hh.next;
-			/* Grab a reference to this client allowing us to examine
-			 * it without holding the lock */
-			if (likely(client))
-				__inc_instance_ref(client);
-			ck_wunlock(&sdata->instance_lock);
 		}
 
+		/* Expire sessions even when no clients are disconnecting */
+		age_sessions(sdata);
+
 		user = NULL;
 
 		while ((user = next_user(sdata, user)) != NULL) {
+			json_t *user_array = NULL;
 			worker_instance_t *worker;
-			json_t *user_array;
-			bool idle = false;
+			bool idle = false, store;
+			int workers;
 
 			if (!user->authorised)
 				continue;
@@ -8001,23 +10923,48 @@ static void *statsupdate(void *arg)
 					LOGDEBUG("Skipping user %s", user->username);
 					continue;
 				}
-				decay_user(user, 0, &now);
 				idle = true;
 			}
+			decay_meter(&user->meter, &now);
+
+			workers = user->workers + user->remote_workers;
+			if (user->remote_workers) {
+				remote_workers += user->remote_workers;
+				/* Reset the remote_workers count once per minute */
+				user->remote_workers = 0;
+				/* We check this unlocked but transiently
+				 * wrong is harmless */
+				if (!user->workers)
+					remote_users++;
+			}
+			/* Upstream resets remote worker counts every minute
+			 * so only needs those of users still with workers */
+			if (ckp->remote && user->workers)
+				upstream_workers(ckp, user);
+
+			/* Only store users whose stats have changed, and idle
+			 * users every USER_IDLE_STORE seconds while their
+			 * hashrates decay, but still log and decay every user
+			 * and worker. */
+			store = user->dirty || now.tv_sec - user->last_stored >= USER_IDLE_STORE;
+			if (store) {
+				user->dirty = false;
+				user->last_stored = now.tv_sec;
+			}
 
-			ghs = user->dsps1440 * nonces;
+			ghs = user->meter.dsps1440 * nonces;
 			suffix_string(ghs, suffix1440, 16, 0);
 
-			ghs = user->dsps1 * nonces;
+			ghs = user->meter.dsps1 * nonces;
 			suffix_string(ghs, suffix1, 16, 0);
 
-			ghs = user->dsps5 * nonces;
+			ghs = user->meter.dsps5 * nonces;
 			suffix_string(ghs, suffix5, 16, 0);
 
-			ghs = user->dsps60 * nonces;
+			ghs = user->meter.dsps60 * nonces;
 			suffix_string(ghs, suffix60, 16, 0);
 
-			ghs = user->dsps10080 * nonces;
+			ghs = user->meter.dsps10080 * nonces;
 			suffix_string(ghs, suffix10080, 16, 0);
 
 			JSON_CPACK(val, "{ss,ss,ss,ss,ss,si,si,sI,sf,sI, sI}",
@@ -8027,29 +10974,20 @@ static void *statsupdate(void *arg)
 					"hashrate1d", suffix1440,
 					"hashrate7d", suffix10080,
 				        "lastshare", user->last_share.tv_sec,
-					"workers", user->workers + user->remote_workers,
+					"workers", workers,
 					"shares", user->shares,
 					"bestshare", user->best_diff,
 					"bestever", user->best_ever,
 					"authorised", user->auth_time);
 
-			if (user->remote_workers) {
-				remote_workers += user->remote_workers;
-				/* Reset the remote_workers count once per minute */
-				user->remote_workers = 0;
-				/* We check this unlocked but transiently
-				 * wrong is harmless */
-				if (!user->workers)
-					remote_users++;
-			}
-
 			if (!idle) {
 				s = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER | JSON_COMPACT);
 				ASPRINTF(&sp, "User %s:%s", user->username, s);
 				dealloc(s);
 				add_msg_entry(&char_list, &sp);
 			}
-			user_array = json_array();
+			if (store)
+				user_array = json_array();
 			worker = NULL;
 
 			/* Decay times per worker */
@@ -8063,23 +11001,25 @@ static void *statsupdate(void *arg)
 						LOGDEBUG("Skipping worker %s", worker->workername);
 						continue;
 					}
-					decay_worker(worker, 0, &now);
 					worker->idle = true;
 				}
+				decay_meter(&worker->meter, &now);
+				if (!store)
+					continue;
 
-				ghs = worker->dsps1440 * nonces;
+				ghs = worker->meter.dsps1440 * nonces;
 				suffix_string(ghs, suffix1440, 16, 0);
 
-				ghs = worker->dsps1 * nonces;
+				ghs = worker->meter.dsps1 * nonces;
 				suffix_string(ghs, suffix1, 16, 0);
 
-				ghs = worker->dsps5 * nonces;
+				ghs = worker->meter.dsps5 * nonces;
 				suffix_string(ghs, suffix5, 16, 0);
 
-				ghs = worker->dsps60 * nonces;
+				ghs = worker->meter.dsps60 * nonces;
 				suffix_string(ghs, suffix60, 16, 0);
 
-				ghs = worker->dsps10080 * nonces;
+				ghs = worker->meter.dsps10080 * nonces;
 				suffix_string(ghs, suffix10080, 16, 0);
 
 				LOGDEBUG("Storing worker %s", worker->workername);
@@ -8098,14 +11038,17 @@ static void *statsupdate(void *arg)
 				json_array_append_new(user_array, wval);
 			}
 
+			if (!store) {
+				json_decref(val);
+				continue;
+			}
 			json_object_set_new_nocheck(val, "worker", user_array);
 			ASPRINTF(&fname, "%s/users/%s", ckp->logdir, user->username);
 			s = json_dumps(val, JSON_NO_UTF8 | JSON_PRESERVE_ORDER | JSON_EOL |
 				JSON_REAL_PRECISION(16) | JSON_INDENT(1));
 			add_log_entry(&log_entries, &fname, &s);
+			log_count++;
 			json_decref(val);
-			if (ckp->remote)
-				upstream_workers(ckp, user);
 		}
 
 		if (remote_workers) {
@@ -8115,8 +11058,10 @@ static void *statsupdate(void *arg)
 			mutex_unlock(&sdata->stats_lock);
 		}
 
-		/* Dump log entries out of instance_lock */
-		dump_log_entries(&log_entries);
+		write_stats_snapshot(ckp, sdata, &now);
+
+		/* Spread writing the user files over the update interval */
+		log_batch = (log_count + 31) / 32;
 		notice_msg_entries(&char_list);
 
 		ghs1 = stats->dsps1 * nonces;
@@ -8261,7 +11206,10 @@ static void *statsupdate(void *arg)
 			int64_t unaccounted_shares,
 				unaccounted_diff_shares,
 				unaccounted_rejects;
+			uastats_t *uastats;
 
+			/* Write the next batch of user files */
+			dump_log_entries(&log_entries, log_batch);
 			ts_to_tv(&diff, &stats->last_update);
 			cksleep_ms_r(&stats->last_update, 1875);
 			cksleep_prepare_r(&stats->last_update);
@@ -8270,13 +11218,20 @@ static void *statsupdate(void *arg)
 			 * stats update */
 			per_tdiff = tvdiff(&now, &diff);
 
+			unaccounted_shares = unaccounted_diff_shares = unaccounted_rejects = 0;
 			mutex_lock(&sdata->uastats_lock);
-			unaccounted_shares = stats->unaccounted_shares;
-			unaccounted_diff_shares = stats->unaccounted_diff_shares;
-			unaccounted_rejects = stats->unaccounted_rejects;
-			stats->unaccounted_shares =
-			stats->unaccounted_diff_shares =
-			stats->unaccounted_rejects = 0;
+			LL_FOREACH(sdata->uastats, uastats) {
+				int64_t shares = __atomic_load_n(&uastats->shares, __ATOMIC_RELAXED),
+					diff_shares = __atomic_load_n(&uastats->diff_shares, __ATOMIC_RELAXED),
+					rejects = __atomic_load_n(&uastats->rejects, __ATOMIC_RELAXED);
+
+				unaccounted_shares += shares - uastats->accounted_shares;
+				unaccounted_diff_shares += diff_shares - uastats->accounted_diff_shares;
+				unaccounted_rejects += rejects - uastats->accounted_rejects;
+				uastats->accounted_shares = shares;
+				uastats->accounted_diff_shares = diff_shares;
+				uastats->accounted_rejects = rejects;
+			}
 			mutex_unlock(&sdata->uastats_lock);
 
 			mutex_lock(&sdata->stats_lock);
@@ -8304,6 +11259,9 @@ static void *statsupdate(void *arg)
 		mutex_lock(&sdata->stats_lock);
 		stats->remote_workers = stats->remote_users = 0;
 		mutex_unlock(&sdata->stats_lock);
+
+		if (ckp->sharebudget)
+			update_diff_scale(ckp, sdata);
 	}
 
 	return NULL;
@@ -8455,7 +11413,10 @@ static void *zmqnotify(void *arg)
 	notify = zmq_socket(context, ZMQ_SUB);
 	if (!notify)
 		quit(1, "zmq_socket failed with errno %d", errno);
-	rc = zmq_setsockopt(notify, ZMQ_SUBSCRIBE, "hashblock", 0);
+	if (ckp->zmqsequence)
+		rc = zmq_setsockopt(notify, ZMQ_SUBSCRIBE, "sequence", 0);
+	else
+		rc = zmq_setsockopt(notify, ZMQ_SUBSCRIBE, "hashblock", 0);
 	if (rc < 0)
 		quit(1, "zmq_setsockopt failed with errno %d", errno);
 	rc = zmq_connect(notify, ckp->zmqblock);
@@ -8468,6 +11429,7 @@ static void *zmqnotify(void *arg)
 
 		do {
 			char hexhash[68] = {};
+			const uchar *data;
 			int size;
 
 			zmq_msg_init(&message);
@@ -8484,14 +11446,38 @@ static void *zmqnotify(void *arg)
 				case 9:
 					LOGDEBUG("ZMQ hashblock message");
 					break;
+				case 8:
+					LOGDEBUG("ZMQ sequence message");
+					break;
 				case 4:
 					LOGDEBUG("ZMQ sequence number");
 					break;
 				case 32:
-					update_base(sdata, GEN_PRIORITY);
 					__bin2hex(hexhash, zmq_msg_data(&message), 32);
+					update_block_base(sdata, GEN_PRIORITY, hexhash);
 					LOGNOTICE("ZMQ block hash %s", hexhash);
 					break;
+				case 33:
+				case 41:
+					/* Sequence topic hash followed by a label of
+					 * (C)onnected or (D)isconnected block, or
+					 * mempool (A)dded or (R)emoved transaction and
+					 * its mempool sequence */
+					data = zmq_msg_data(&message);
+					__bin2hex(hexhash, data, 32);
+					if (data[32] == 'C') {
+						update_block_base(sdata, GEN_PRIORITY, hexhash);
+						LOGNOTICE("ZMQ block connected %s", hexhash);
+					} else if (data[32] == 'D') {
+						update_base(sdata, GEN_PRIORITY);
+						LOGNOTICE("ZMQ block disconnected %s", hexhash);
+					} else if (data[32] == 'A') {
+						/* Coalesce mempool changes into at most one
+						 * template update per mempool_refresh */
+						if (time(NULL) - sdata->update_time >= ckp->mempool_refresh)
+							update_base(sdata, GEN_NORMAL);
+					}
+					break;
 				default:
 					LOGWARNING("ZMQ message size error, size = %d!", size);
 					break;
@@ -8512,9 +11498,10 @@ static void *zmqnotify(void *arg)
 
 void *stratifier(void *arg)
 {
-	pthread_t pth_blockupdate, pth_statsupdate, pth_throbber, pth_zmqnotify;
+	pthread_t pth_blockupdate, pth_statsupdate, pth_throbber, pth_zmqnotify, pth_sharelog;
+	pthread_t pth_sharebatcher;
 	proc_instance_t *pi = (proc_instance_t *)arg;
-	int threads, tvsec_diff = 0;
+	int threads, i, tvsec_diff = 0;
 	ckpool_t *ckp = pi->ckp;
 	int64_t randomiser;
 	sdata_t *sdata;
@@ -8533,6 +11520,8 @@ void *stratifier(void *arg)
 		cksleep_ms(10);
 
 	if (!ckp->proxy) {
+		bool script = false, segwit = false;
+
 		if (!generator_checkaddr(ckp, ckp->btcaddress, &ckp->script, &ckp->segwit)) {
 			LOGEMERG("Fatal: btcaddress invalid according to bitcoind");
 			goto out;
@@ -8542,6 +11531,12 @@ void *stratifier(void *arg)
 		hex2bin(scriptsig_header_bin, scriptsig_header, 41);
 		sdata->txnlen = address_to_txn(sdata->txnbin, ckp->btcaddress, ckp->script, ckp->segwit);
 
+		/* User addresses are decoded locally if we can tell which
+		 * network the pool address is for */
+		ckp->addrnets = decode_address(ckp->btcaddress, &script, &segwit);
+		if (!ckp->addrnets)
+			LOGWARNING("Unable to decode btcaddress locally, checking user addresses with bitcoind");
+
 		/* Find a valid donation address if possible */
 		if (generator_checkaddr(ckp, ckp->donaddress, &ckp->donscript, &ckp->donsegwit)) {
 			ckp->donvalid = true;
@@ -8563,7 +11558,7 @@ void *stratifier(void *arg)
 
 	randomiser = time(NULL);
 	sdata->enonce1_64 = htole64(randomiser);
-	sdata->session_id = randomiser;
+	sdata->session_id = sdata->txn_epoch = randomiser;
 	/* Set the initial id to time as high bits so as to not send the same
 	 * id on restarts */
 	randomiser <<= 32;
@@ -8571,16 +11566,39 @@ void *stratifier(void *arg)
 		sdata->blockchange_id = sdata->workbase_id = randomiser;
 
 	cklock_init(&sdata->instance_lock);
+	sdata->instance_lock.wait = &sdata->instance_wait;
+	cklock_init(&sdata->session_lock);
+	for (i = 0; i < INSTANCE_SHARDS; i++)
+		cklock_init(&sdata->instance_shards[i].lock);
+	init_slab(&sdata->instance_slab, sizeof(stratum_instance_t));
+	init_slab(&sdata->worker_slab, sizeof(worker_instance_t));
+	mutex_init(&sdata->intern_lock);
 	cksem_init(&sdata->update_sem);
 	cksem_post(&sdata->update_sem);
+	sdata->diff_scale = 1;
 
 	/* Create half as many share processing and receiving threads as there
 	 * are CPUs */
 	threads = sysconf(_SC_NPROCESSORS_ONLN) / 2 ? : 1;
+	sdata->sthreads = threads;
+	if (ckp->logshares) {
+		mutex_init(&sdata->sharelog_lock);
+		cond_init(&sdata->sharelog_cond);
+		cond_init(&sdata->sharelog_space);
+		create_pthread(&pth_sharelog, sharelog_writer, ckp);
+	}
+	if (ckp->remote) {
+		mutex_init(&sdata->remote_share_lock);
+		create_pthread(&pth_sharebatcher, sharebatcher, ckp);
+	}
 	sdata->updateq = create_ckmsgq(ckp, "updater", &block_update);
 	sdata->sshareq = create_ckmsgqs(ckp, "sprocessor", &sshare_process, threads);
+	/* Drain shares in small batches to not take the queue lock per share */
+	for (i = 0; i < threads; i++)
+		sdata->sshareq[i].batch = SHARE_BATCH;
 	sdata->ssends = create_ckmsgqs(ckp, "ssender", &ssend_process, threads);
-	sdata->sauthq = create_ckmsgq(ckp, "authoriser", &sauth_process);
+	sdata->sauthq = create_ckmsgqs(ckp, "authoriser", &sauth_process, threads);
+	cklock_init(&sdata->addrcache_lock);
 	sdata->stxnq = create_ckmsgq(ckp, "stxnq", &send_transactions);
 	sdata->srecvs = create_ckmsgqs(ckp, "sreceiver", &srecv_process, threads);
 	create_pthread(&pth_throbber, throbber, ckp);
@@ -8592,6 +11610,7 @@ void *stratifier(void *arg)
 
 	cklock_init(&sdata->txn_lock);
 	cklock_init(&sdata->workbase_lock);
+	sdata->workbase_lock.wait = &sdata->workbase_wait;
 	if (!ckp->proxy)
 		create_pthread(&pth_blockupdate, blockupdate, ckp);
 	else {
@@ -8604,6 +11623,7 @@ void *stratifier(void *arg)
 		create_pthread(&pth_statsupdate, statsupdate, ckp);
 
 	mutex_init(&sdata->share_lock);
+	sdata->share_lock.wait = &sdata->share_wait;
 	if (!ckp->proxy)
 		create_pthread(&pth_zmqnotify, zmqnotify, ckp);
 
@@ -8617,3 +11637,225 @@ out:
 	exit(1);
 	return NULL;
 }
+
+#ifdef CKBENCH
+/* The share and broadcast hot paths driven by ckbench against a workbase
+ * built from a gbt fixture, with an sdata set up as in stratifier() but
+ * without bitcoind, the connector or any real clients. */
+
+static void bench_ssend(ckpool_t *ckp, smsg_t *msg)
+{
+	/* There's no connector so only the fan-out itself is measured */
+	free_smsg(msg);
+}
+
+static sdata_t *bench_sdata(ckpool_t *ckp)
+{
+	sdata_t *sdata = ckzalloc(sizeof(sdata_t));
+	int i;
+
+	ckp->sdata = sdata;
+	sdata->ckp = ckp;
+	hex2bin(scriptsig_header_bin, scriptsig_header, 41);
+	sdata->txnlen = address_to_txn(sdata->txnbin, ckp->btcaddress, ckp->script, ckp->segwit);
+	sdata->enonce1_64 = htole64(time(NULL));
+	sdata->blockchange_id = sdata->workbase_id = (int64_t)time(NULL) << 32;
+
+	cklock_init(&sdata->instance_lock);
+	cklock_init(&sdata->session_lock);
+	for (i = 0; i < INSTANCE_SHARDS; i++)
+		cklock_init(&sdata->instance_shards[i].lock);
+	init_slab(&sdata->instance_slab, sizeof(stratum_instance_t));
+	init_slab(&sdata->worker_slab, sizeof(worker_instance_t));
+	mutex_init(&sdata->intern_lock);
+	sdata->diff_scale = 1;
+	sdata->ssends = create_ckmsgq(ckp, "ssender", &bench_ssend);
+	sdata->stats.network_diff = ~0ULL;
+	cklock_init(&sdata->txn_lock);
+	cklock_init(&sdata->workbase_lock);
+	mutex_init(&sdata->stats_lock);
+	mutex_init(&sdata->uastats_lock);
+	mutex_init(&sdata->share_lock);
+	return sdata;
+}
+
+/* Build and add a workbase the way block_update does */
+static workbase_t *bench_workbase(ckpool_t *ckp, sdata_t *sdata, const json_t *gbt)
+{
+	workbase_t *wb = ckzalloc(sizeof(workbase_t));
+	bool new_block = false;
+	json_t *txn_array;
+	txntable_t *txns;
+
+	if (unlikely(!decode_gbtbase(json_deep_copy(gbt), wb)))
+		quit(1, "Failed to decode gbt fixture");
+	wb->ckp = ckp;
+	txn_array = json_object_get(wb->json, "transactions");
+	txns = wb_merkle_bin_txns(ckp, sdata, wb, txn_array, true);
+	if (json_object_get(wb->json, "default_witness_commitment"))
+		gbt_witness_data(wb, txn_array);
+	generate_coinbase(ckp, wb);
+	add_base(ckp, sdata, wb, &new_block);
+	/* Never let a lucky share try to submit a block to nowhere */
+	wb->network_diff = ~0ULL;
+	if (likely(txns))
+		update_txns(ckp, sdata, txns, true);
+	return wb;
+}
+
+static stratum_instance_t *bench_client(ckpool_t *ckp, sdata_t *sdata, const int64_t id)
+{
+	stratum_instance_t *client;
+
+	ck_wlock(&sdata->instance_lock);
+	client = __stratum_add_instance(ckp, id, "127.0.0.1", 0);
+	ck_wunlock(&sdata->instance_lock);
+
+	client->enonce1_64 = htole64(id);
+	memcpy(client->enonce1bin, &client->enonce1_64, sizeof(client->enonce1_64));
+	__bin2hex(client->enonce1, client->enonce1bin, ckp->nonce1length);
+	client->authorised = true;
+	return client;
+}
+
+static void bench_submission_diff(sdata_t *sdata, const stratum_instance_t *client,
+				  workbase_t *wb, const int64_t ops)
+{
+	char nonce2[20], nonce[12], params[64];
+	bench_t bench;
+	uchar hash[32];
+	int64_t i;
+
+	snprintf(params, 64, "merkles=%d", wb->merkles);
+	bench_start(&bench, "submission_diff", params, ops);
+	for (i = 0; i < ops; i++) {
+		int64_t begin;
+
+		__bin2hex(nonce2, &i, wb->enonce2varlen);
+		sprintf(nonce, "%08x", (uint32_t)i);
+		begin = bench_ns();
+		submission_diff(sdata, client, wb, nonce2, wb->ntime32, 0, nonce, hash, false);
+		bench_sample(&bench, begin, 1);
+	}
+	bench_end(&bench);
+}
+
+static void bench_new_share(workbase_t *wb, const int64_t ops)
+{
+	bench_t bench;
+	uchar hash[32];
+	int64_t i;
+
+	bench_start(&bench, "new_share", "", ops);
+	for (i = 0; i < ops; i++) {
+		int64_t begin;
+
+		/* Spread the shares over the stripes like real hashes */
+		gen_hash((uchar *)&i, hash, sizeof(i));
+		begin = bench_ns();
+		new_share(wb, hash);
+		bench_sample(&bench, begin, 1);
+	}
+	bench_end(&bench);
+}
+
+/* Fan a notify out to 1k, 10k then 100k authorised clients */
+static void bench_broadcast(ckpool_t *ckp, sdata_t *sdata, const workbase_t *wb,
+			    const int64_t ops)
+{
+	int64_t clients = 1, fanout, i;
+
+	for (fanout = 1000; fanout <= 100000; fanout *= 10) {
+		int64_t iterations = MAX(ops / fanout, 10);
+		char params[64];
+		bench_t bench;
+
+		while (clients < fanout)
+			bench_client(ckp, sdata, ++clients);
+		snprintf(params, 64, "clients=%"PRId64, fanout);
+		bench_start(&bench, "stratum_broadcast", params, iterations);
+		for (i = 0; i < iterations; i++) {
+			int64_t begin = bench_ns();
+
+			stratum_broadcast_update(sdata, wb, false);
+			bench_sample(&bench, begin, 1);
+		}
+		bench_end(&bench);
+		/* Let the sender drain before the next fan-out */
+		while (!ckmsgq_empty(sdata->ssends))
+			cksleep_ms(1);
+	}
+}
+
+/* Rebuild the merkle tree from the fixture's transactions with and without
+ * the previous tree cached, then add the transactions each rebuild found to
+ * the transaction table */
+static void bench_txns(ckpool_t *ckp, sdata_t *sdata, const json_t *gbt, const int64_t ops)
+{
+	json_t *txn_array = json_object_get(json_object_get(gbt, "result"), "transactions");
+	merkle_cache_t *mc = &sdata->merkle_cache;
+	int txns = json_array_size(txn_array);
+	txntable_t **txntables;
+	int64_t iterations, i;
+	workbase_t **wbs;
+	char params[64];
+	bench_t bench;
+	int cached;
+
+	iterations = MAX(ops / MAX(txns, 1), 10);
+	wbs = ckalloc(sizeof(workbase_t *) * iterations);
+	txntables = ckalloc(sizeof(txntable_t *) * iterations);
+	for (cached = 0; cached < 2; cached++) {
+		snprintf(params, 64, "txns=%d,cached=%s", txns, cached ? "true" : "false");
+		bench_start(&bench, "wb_merkle_bin_txns", params, iterations);
+		for (i = 0; i < iterations; i++) {
+			int64_t begin;
+
+			wbs[i] = ckzalloc(sizeof(workbase_t));
+			if (!cached)
+				memset(mc->size, 0, sizeof(mc->size));
+			begin = bench_ns();
+			txntables[i] = wb_merkle_bin_txns(ckp, sdata, wbs[i], txn_array, true);
+			bench_sample(&bench, begin, 1);
+		}
+		bench_end(&bench);
+
+		/* The table holds the same transactions after each pass */
+		snprintf(params, 64, "txns=%d", txns);
+		if (!cached)
+			bench_start(&bench, "update_txns", params, iterations);
+		for (i = 0; i < iterations; i++) {
+			int64_t begin = bench_ns();
+
+			update_txns(ckp, sdata, txntables[i], true);
+			if (!cached)
+				bench_sample(&bench, begin, 1);
+			clear_workbase(ckp, wbs[i]);
+		}
+		if (!cached)
+			bench_end(&bench);
+	}
+	free(txntables);
+	free(wbs);
+}
+
+void stratifier_bench(ckpool_t *ckp, const json_t *gbt, const int64_t ops)
+{
+	stratum_instance_t *client;
+	sdata_t *sdata;
+	workbase_t *wb;
+
+	sdata = bench_sdata(ckp);
+	wb = bench_workbase(ckp, sdata, gbt);
+	client = bench_client(ckp, sdata, 1);
+
+	if (bench_enabled("submission_diff"))
+		bench_submission_diff(sdata, client, wb, ops);
+	if (bench_enabled("new_share"))
+		bench_new_share(wb, ops);
+	if (bench_enabled("stratum_broadcast"))
+		bench_broadcast(ckp, sdata, wb, ops);
+	if (bench_enabled("wb_merkle_bin_txns") || bench_enabled("update_txns"))
+		bench_txns(ckp, sdata, gbt, ops);
+}
+#endif /* CKBENCH */
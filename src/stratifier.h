@@ -10,6 +10,8 @@
 #ifndef STRATIFIER_H
 #define STRATIFIER_H
 
+#include "sha2.h"
+
 /* Generic structure for both workbase in stratifier and gbtbase in generator */
 struct genwork {
 	/* Hash table data */
@@ -48,8 +50,9 @@ struct genwork {
 	int height;
 	char *flags;
 	int txns;
-	char *txn_data;
+	ckbuf_t *txnbuf; // Transactions hex tail of the block, shared with submissions
 	char *txn_hashes;
+	uint32_t *sids; // Little endian short ids of txns for compact nodes
 	char witnessdata[80]; //null-terminated ascii
 	bool insert_witness;
 	int merkles;
@@ -61,6 +64,7 @@ struct genwork {
 	char *coinb1; // coinbase1
 	uchar *coinb1bin;
 	int coinb1len; // length of above
+	sha256_ctx coinb1ctx; // sha256 midstate of coinb1bin shared by all shares
 
 	char enonce1const[32]; // extranonce1 section that is constant
 	uchar enonce1constbin[16];
@@ -85,9 +89,37 @@ struct genwork {
 
 	bool incomplete; /* This is a remote workinfo without all the txn data */
 
+	struct sharetable *sharetable; /* Duplicate share detection, NULL once retired */
+
 	json_t *json; /* getblocktemplate json */
+
+	/* Per user coinbases in btcsolo mode, only generated for users that
+	 * need them. Protected by the stratifier instance lock. */
+	struct userwb *userwbs;
+
+	/* Holds the txn data, hashes, coinbases, logdir and every userwb of
+	 * this workbase, all released together when it is cleared */
+	arena_t arena;
 };
 
+/* Maximum params in a mining.submit including the optional version mask */
+#define SUBMIT_PARAMS 6
+
+/* A mining.submit handed from the connector to the stratifier without
+ * building a json tree. The id is kept as its raw json text to be echoed back
+ * in the response and any params that were not strings are NULL. All the
+ * strings are stored in buf. */
+typedef struct stratum_submit {
+	int64_t client_id;
+	int64_t stamp; /* time_nanos() when the connector read it, or 0 */
+	int server;
+	int params; /* -1 if params was not an array */
+	char *address;
+	char *id;
+	char *param[SUBMIT_PARAMS];
+	char buf[];
+} stratum_submit_t;
+
 void parse_remote_txns(ckpool_t *ckp, const json_t *val);
 #define parse_upstream_txns(ckp, val) parse_remote_txns(ckp, val)
 void parse_upstream_auth(ckpool_t *ckp, json_t *val);
@@ -95,8 +127,17 @@ void parse_upstream_workinfo(ckpool_t *ckp, json_t *val);
 void parse_upstream_block(ckpool_t *ckp, json_t *val);
 void parse_upstream_reqtxns(ckpool_t *ckp, json_t *val);
 char *stratifier_stats(ckpool_t *ckp, void *data);
+json_t *stratifier_latency(void *data, const bool reset);
+void stratifier_metrics(ckpool_t *ckp, char **buf);
 void _stratifier_add_recv(ckpool_t *ckp, json_t *val, const char *file, const char *func, const int line);
 #define stratifier_add_recv(ckp, val) _stratifier_add_recv(ckp, val, __FILE__, __func__, __LINE__)
+void stratifier_add_recvs(ckpool_t *ckp, ckmsg_t *msgs, const bool prio);
+stratum_submit_t *create_submit(const int64_t client_id, const char *address, const int server,
+				const char *id, const int idlen, const char * const *param,
+				const int *paramlen, const int params);
+json_t *submit_json(const stratum_submit_t *submit);
+void stratifier_add_submit(ckpool_t *ckp, stratum_submit_t *submit);
+void stratifier_flush(ckpool_t *ckp);
 void *stratifier(void *arg);
 
 #endif /* STRATIFIER_H */